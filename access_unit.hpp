@@ -0,0 +1,115 @@
+#pragma once
+
+#include "gst/gst.h"
+#include "gst/gstbuffer.h"
+#include "gst/gstsample.h"
+#include "h26x.hpp"
+#include "types.hpp"
+#include <utility>
+
+/**
+ * @brief Move-only handle to one encoded H.264 access unit (Annex B byte
+ * stream, one picture per buffer) as it left the parser. Like Frame, it owns
+ * one reference to the GstSample and keeps the buffer mapped for reading, so
+ * the bitstream is read in place.
+ */
+class AccessUnit {
+  public:
+    AccessUnit() = default;
+    AccessUnit(const AccessUnit &) = delete;
+    AccessUnit &operator=(const AccessUnit &) = delete;
+
+    /**
+     * @brief Takes ownership of @p sample (the caller's reference is
+     * transferred to the access unit).
+     */
+    explicit AccessUnit(GstSample *sample) : sample_(sample) { Map(); }
+
+    AccessUnit(AccessUnit &&rhs) noexcept
+        : sample_(std::exchange(rhs.sample_, nullptr)),
+          is_mapped_(std::exchange(rhs.is_mapped_, false)), map_(rhs.map_) {}
+
+    AccessUnit &operator=(AccessUnit &&rhs) noexcept {
+        if (this != &rhs) {
+            Release();
+            sample_ = std::exchange(rhs.sample_, nullptr);
+            is_mapped_ = std::exchange(rhs.is_mapped_, false);
+            map_ = rhs.map_;
+        }
+        return *this;
+    }
+
+    ~AccessUnit() { Release(); }
+
+    bool IsValid() const { return is_mapped_; }
+
+    explicit operator bool() const { return IsValid(); }
+
+    const u8 *Data() const { return is_mapped_ ? map_.data : nullptr; }
+
+    size_t Size() const { return is_mapped_ ? map_.size : 0; }
+
+    /**
+     * @brief Whether the parser flagged the unit as a keyframe (a random
+     * access point, not necessarily an IDR picture)
+     */
+    bool IsKeyframe() const {
+        return is_mapped_ &&
+               !GST_BUFFER_FLAG_IS_SET(Buffer(), GST_BUFFER_FLAG_DELTA_UNIT);
+    }
+
+    /**
+     * @brief Whether the unit holds an IDR picture, where a decoder can
+     * start without any earlier unit. Parses the NAL unit headers.
+     */
+    bool IsIdr() const {
+        h26x::StreamFormat format;
+        format.codec = h26x::Codec::H264;
+        return is_mapped_ && h26x::Inspect(format, Data(), Size()).idr;
+    }
+
+    /**
+     * @brief Presentation timestamp in nanoseconds, GST_CLOCK_TIME_NONE if the
+     * buffer carries none.
+     */
+    GstClockTime Pts() const {
+        return is_mapped_ ? GST_BUFFER_PTS(Buffer()) : GST_CLOCK_TIME_NONE;
+    }
+
+    /**
+     * @brief Decoding timestamp in nanoseconds, GST_CLOCK_TIME_NONE if the
+     * buffer carries none.
+     */
+    GstClockTime Dts() const {
+        return is_mapped_ ? GST_BUFFER_DTS(Buffer()) : GST_CLOCK_TIME_NONE;
+    }
+
+    GstSample *Sample() const { return sample_; }
+
+    GstBuffer *Buffer() const {
+        return sample_ ? gst_sample_get_buffer(sample_) : nullptr;
+    }
+
+  private:
+    GstSample *sample_ = nullptr;
+    bool is_mapped_ = false;
+    GstMapInfo map_{};
+
+    void Map() {
+        GstBuffer *buffer = Buffer();
+        if (buffer && gst_buffer_map(buffer, &map_, GST_MAP_READ)) {
+            is_mapped_ = true;
+        }
+    }
+
+    void Release() {
+        if (is_mapped_) {
+            gst_buffer_unmap(gst_sample_get_buffer(sample_), &map_);
+            is_mapped_ = false;
+        }
+        if (sample_) {
+            gst_sample_unref(sample_);
+            sample_ = nullptr;
+        }
+    }
+};
@@ -14,18 +14,125 @@ static inline cxxopts::ParseResult ParseArgs(int argc, char **argv) {
         cxxopts::value<u32>())(
         "s,stream_count",
         "The number of concurrent streams to run, make sure there are atleast "
-        "as many active rtsp servers running locally on different ports. The "
-        "port numbers must start from 8554 and increment by 1 for each "
-        "additional server.",
+        "as many active rtsp streams served locally. They are read from "
+        "--rtsp_port on, --mounts_per_port streams per port.",
         cxxopts::value<u32>())("r,refresh_rate",
                                "Number of (resource usage) "
                                "samples to collect per second.",
                                cxxopts::value<u32>()->default_value("1"))(
+        "samplers",
+        "Comma-separated resource samplers to run on every tick, in column "
+        "order: cpu, memory, threads, gpu. gpu is skipped when NVML is not "
+        "installed.",
+        cxxopts::value<vec<std::string>>()->default_value(
+            "cpu,memory,threads,gpu"))(
         "l,log_file", "Path to log file, for all log levels.",
         cxxopts::value<std::string>()->default_value("./log"))(
         "m,metrics_csv",
         "Path to csv file where usage metrics should be saved.",
-        cxxopts::value<std::string>()->default_value("./metrics.csv"));
+        cxxopts::value<std::string>()->default_value("./metrics.csv"))(
+        "metrics_format",
+        "Format of the usage metrics and stream counter files, written "
+        "while running: csv, or binary (fixed-record columnar, convert with "
+        "scripts/metrics_to_csv.py). Binary files are written to the csv "
+        "paths with a .bin extension instead of .csv.",
+        cxxopts::value<std::string>()->default_value("csv"))(
+        "shared_pipeline",
+        "Host all streams as branches of a single GstPipeline instead of one "
+        "pipeline per stream.",
+        cxxopts::value<bool>()->default_value("false"))(
+        "readers_per_stream",
+        "Readers of every stream. Readers of the same stream share one "
+        "pipeline, decoding each frame once for all of them.",
+        cxxopts::value<u32>()->default_value("1"))(
+        "rtsp_port", "Port of the first rtsp server.",
+        cxxopts::value<u32>()->default_value("8554"))(
+        "rtsp_path",
+        "Mount path of the streams, followed by the mount number when a port "
+        "serves several (rtsp_server -m).",
+        cxxopts::value<std::string>()->default_value("/stream"))(
+        "mounts_per_port",
+        "Streams read from each port before moving on to the next one "
+        "(rtsp_server -c).",
+        cxxopts::value<u32>()->default_value("1"))(
+        "format",
+        "Pixel format frames are delivered in, e.g. RGB, BGR, GRAY8, NV12, "
+        "I420, or \"native\" to skip videoconvert and keep the decoder's "
+        "NV12/I420 output.",
+        cxxopts::value<std::string>()->default_value("RGB"))(
+        "width", "Output frame width, 0 keeps the source width.",
+        cxxopts::value<u32>()->default_value("0"))(
+        "height", "Output frame height, 0 keeps the source height.",
+        cxxopts::value<u32>()->default_value("0"))(
+        "keep_aspect",
+        "Pad with borders instead of stretching when scaling changes the "
+        "aspect ratio.",
+        cxxopts::value<bool>()->default_value("false"))(
+        "t,threads",
+        "Number of consumer threads processing frames of all streams, 0 for "
+        "one per hardware thread.",
+        cxxopts::value<u32>()->default_value("0"))(
+        "decoder_threads",
+        "max-threads of every stream's video decoder: a count (0 lets the "
+        "decoder use all cores), \"auto\" to split the cores over the "
+        "streams, or \"default\" to leave the decoder default.",
+        cxxopts::value<std::string>()->default_value("auto"))(
+        "convert_threads",
+        "n-threads of every stream's videoscale and videoconvert: a count (0 "
+        "for all cores), \"auto\" or \"default\".",
+        cxxopts::value<std::string>()->default_value("auto"))(
+        "stream_stats_csv",
+        "Path to csv file where per-stream frame/drop counters should be "
+        "saved.",
+        cxxopts::value<std::string>()->default_value("./stream_stats.csv"))(
+        "decode_skip",
+        "Skip decoding frames the fps limit would drop: none, nonref (drop "
+        "non-reference frames before the decoder), keyframe (decode "
+        "keyframes only) or auto (pick from the fps limit, source frame "
+        "rate and keyframe interval).",
+        cxxopts::value<std::string>()->default_value("auto"))(
+        "stall_timeout_ms",
+        "Restart a stream's pipeline when it delivers no frame for this "
+        "many milliseconds, 0 to disable the watchdog.",
+        cxxopts::value<u32>()->default_value("3000"))(
+        "max_reconnects",
+        "Pipeline restarts per stall before a stream is closed, 0 for no "
+        "limit.",
+        cxxopts::value<u32>()->default_value("5"))(
+        "pre_event_bytes",
+        "Keep up to this many bytes of each stream's compressed video, whole "
+        "GOPs, to save the time before an event; 0 to keep none.",
+        cxxopts::value<u64>()->default_value("0"))(
+        "pre_event_dir",
+        "Directory to save every stream's pre-event buffer to as an MP4 "
+        "file once reading is done, empty to not save.",
+        cxxopts::value<std::string>()->default_value(""))(
+        "shm_export",
+        "Export every stream's frames to a POSIX shared-memory ring "
+        "(/gst_stream_<id>) that other processes can map and read.",
+        cxxopts::value<bool>()->default_value("false"))(
+        "shm_slots", "Frames kept in each shared-memory ring.",
+        cxxopts::value<u32>()->default_value("8"))(
+        "batch_max_wait_ms",
+        "Read the streams' frames as batches of one frame per stream, "
+        "emitting an incomplete batch after waiting this many milliseconds; "
+        "0 to read every stream on its own.",
+        cxxopts::value<u32>()->default_value("0"))(
+        "batch_pts_tolerance_ms",
+        "Largest distance between the timestamps of two frames of a batch.",
+        cxxopts::value<u32>()->default_value("15"))(
+        "startup_csv",
+        "Path to csv file where per-stream startup times (connect, caps, "
+        "first frame) should be saved.",
+        cxxopts::value<std::string>()->default_value("./startup.csv"))(
+        "latency_csv",
+        "Path to csv file where per-stream latency percentiles should be "
+        "saved.",
+        cxxopts::value<std::string>()->default_value("./latency.csv"))(
+        "latency_report_interval",
+        "Log per-stream latency percentiles every N seconds while running, 0 "
+        "to only report at the end.",
+        cxxopts::value<u32>()->default_value("0"));
     cxxopts::ParseResult result = options.parse(argc, argv);
     if (!result.count("frame_count") || !result.count("stream_count")) {
         std::cout << options.help();
@@ -33,3 +140,60 @@ static inline cxxopts::ParseResult ParseArgs(int argc, char **argv) {
     }
     return result;
 }
+
+static inline cxxopts::ParseResult ParseBenchmarkArgs(int argc, char **argv) {
+    cxxopts::Options options(
+        "Gst stream handler benchmarks",
+        "Runs every combination of the swept settings against local sources "
+        "and writes one JSON record per run.");
+    options.add_options()(
+        "source",
+        "Where streams come from: rtsp (an RTSP server started by the "
+        "benchmark, paced in real time) or file (--media decoded as fast as "
+        "possible).",
+        cxxopts::value<std::string>()->default_value("rtsp"))(
+        "media",
+        "H.264 MP4 file to serve or decode. Without it the RTSP server "
+        "encodes a videotestsrc pattern.",
+        cxxopts::value<std::string>()->default_value(""))(
+        "source_resolution",
+        "Resolution of the videotestsrc pattern, WIDTHxHEIGHT.",
+        cxxopts::value<std::string>()->default_value("1280x720"))(
+        "source_fps", "Frame rate of the videotestsrc pattern.",
+        cxxopts::value<u32>()->default_value("30"))(
+        "port", "Port of the RTSP server.",
+        cxxopts::value<u32>()->default_value("8654"))(
+        "stream_counts", "Numbers of concurrent streams to sweep.",
+        cxxopts::value<vec<u32>>()->default_value("1,4,16"))(
+        "formats", "Output formats to sweep (see --format of stream_handler).",
+        cxxopts::value<vec<std::string>>()->default_value("RGB,native"))(
+        "resolutions",
+        "Output resolutions to sweep, WIDTHxHEIGHT; 0x0 keeps the source "
+        "size.",
+        cxxopts::value<vec<std::string>>()->default_value("0x0"))(
+        "fps_limits", "Per-stream fps limits to sweep.",
+        cxxopts::value<vec<u32>>()->default_value("30"))(
+        "decoder_threads",
+        "Decoder max-threads values to sweep: auto, default or a count.",
+        cxxopts::value<vec<std::string>>()->default_value("auto"))(
+        "convert_threads",
+        "videoscale/videoconvert n-threads values to sweep: auto, default or "
+        "a count.",
+        cxxopts::value<vec<std::string>>()->default_value("auto"))(
+        "threads",
+        "Consumer threads processing frames, 0 for one per hardware thread.",
+        cxxopts::value<u32>()->default_value("0"))(
+        "frames", "Frames each stream reads per run.",
+        cxxopts::value<u32>()->default_value("300"))(
+        "output", "Path of the JSON results file.",
+        cxxopts::value<std::string>()->default_value("./benchmarks.json"))(
+        "l,log_file", "Path to log file, for all log levels.",
+        cxxopts::value<std::string>()->default_value("./benchmarks.log"))(
+        "h,help", "Print usage.");
+    cxxopts::ParseResult result = options.parse(argc, argv);
+    if (result.count("help")) {
+        std::cout << options.help();
+        std::exit(0);
+    }
+    return result;
+}
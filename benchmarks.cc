@@ -0,0 +1,427 @@
+#include "argparse.hpp"
+#include "executor.hpp"
+#include "histogram.hpp"
+#include "logging.hpp"
+#include "memory_sampler.hpp"
+#include "stream_handler.hpp"
+#include "stream_reader.hpp"
+#include "types.hpp"
+#include "utils.hpp"
+#include <arpa/inet.h>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cxxopts.hpp>
+#include <fstream>
+#include <future>
+#include <glog/log_severity.h>
+#include <gst/rtsp-server/rtsp-server.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+/**
+ * @brief One combination of the swept settings
+ */
+struct BenchConfig {
+    u32 stream_count;
+    OutputSpec output;
+    u32 fps_limit;
+    std::string decoder_threads;
+    std::string convert_threads;
+};
+
+struct BenchResult {
+    BenchConfig config;
+    /**
+     * @brief Thread counts the "auto"/"default" settings resolved to
+     */
+    i32 decoder_threads = ThreadingOptions::ELEMENT_DEFAULT;
+    i32 convert_threads = ThreadingOptions::ELEMENT_DEFAULT;
+    u32 streams_opened = 0;
+    u64 frames = 0;
+    double startup_ms = 0;
+    /**
+     * @brief From all streams being open to the last one finishing
+     */
+    double wall_ms = 0;
+    double fps = 0;
+    /**
+     * @brief Time frames waited between the appsink and the consumer, over
+     * all streams
+     */
+    u64 latency_p50_us = 0;
+    u64 latency_p99_us = 0;
+    u64 frame_gap_p99_us = 0;
+    double cpu_ms_per_frame = 0;
+    /**
+     * @brief Growth of the resident set while the streams were open,
+     * divided by the open streams
+     */
+    double rss_kib_per_stream = 0;
+};
+
+/**
+ * @brief Serves @p launch at rtsp://127.0.0.1:<port>/stream until killed.
+ * The media is shared, so all clients are fed by one pipeline and the
+ * server's cost does not grow with the stream count. Runs in a child
+ * process, so its CPU time is not counted against the streams.
+ */
+[[noreturn]] void RunRtspServer(u32 port, const std::string &launch) {
+    gst_init(nullptr, nullptr);
+    GMainLoop *loop = g_main_loop_new(nullptr, FALSE);
+    GstRTSPServer *server = gst_rtsp_server_new();
+    const std::string service = std::to_string(port);
+    g_object_set(server, "service", service.c_str(), NULL);
+
+    GstRTSPMountPoints *mounts = gst_rtsp_server_get_mount_points(server);
+    GstRTSPMediaFactory *factory = gst_rtsp_media_factory_new();
+    gst_rtsp_media_factory_set_launch(factory, launch.c_str());
+    gst_rtsp_media_factory_set_shared(factory, TRUE);
+    gst_rtsp_mount_points_add_factory(mounts, "/stream", factory);
+    g_object_unref(mounts);
+
+    if (gst_rtsp_server_attach(server, nullptr) == 0) {
+        g_printerr("Unable to listen on port %u\n", port);
+        std::_Exit(1);
+    }
+    g_main_loop_run(loop);
+    std::_Exit(0);
+}
+
+bool ParseResolution(const std::string &value, u32 &width, u32 &height) {
+    return std::sscanf(value.c_str(), "%ux%u", &width, &height) == 2;
+}
+
+/**
+ * @returns The server's launch line: --media payloaded as-is, or an encoded
+ * videotestsrc pattern; empty if the options are invalid
+ */
+std::string RtspLaunch(const cxxopts::ParseResult &args) {
+    const std::string media = args["media"].as<std::string>();
+    if (!media.empty()) {
+        return "( filesrc location=\"" + media +
+               "\" ! qtdemux ! h264parse ! rtph264pay name=pay0 pt=96 "
+               "config-interval=-1 )";
+    }
+    u32 width = 0, height = 0;
+    if (!ParseResolution(args["source_resolution"].as<std::string>(), width,
+                         height)) {
+        return "";
+    }
+    const std::string fps = std::to_string(args["source_fps"].as<u32>());
+    // One key frame per second, so clients joining the shared media start
+    // decoding quickly
+    return "( videotestsrc is-live=true pattern=ball ! video/x-raw,width=" +
+           std::to_string(width) + ",height=" + std::to_string(height) +
+           ",framerate=" + fps +
+           "/1 ! x264enc tune=zerolatency speed-preset=ultrafast key-int-max=" +
+           fps + " ! rtph264pay name=pay0 pt=96 config-interval=-1 )";
+}
+
+/**
+ * @brief Waits until something accepts TCP connections on @p port
+ */
+bool WaitForPort(u32 port, std::chrono::milliseconds timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    while (std::chrono::steady_clock::now() < deadline) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        bool connected =
+            fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address),
+                               sizeof(address)) == 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (connected) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return false;
+}
+
+double ProcessCpuMs() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0 +
+           usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+}
+
+/**
+ * @brief Opens config.stream_count streams of @p uri at once, reads
+ * @p frame_count frames from each and closes them again
+ */
+BenchResult Run(const BenchConfig &config, const std::string &uri,
+                u32 frame_count, u32 consumer_threads) {
+    BenchResult result;
+    result.config = config;
+
+    StreamOptions options;
+    options.fps_limit = config.fps_limit;
+    options.output = config.output;
+    const ThreadingOptions auto_threading =
+        ThreadingOptions::Auto(config.stream_count);
+    ThreadingOptions::ParseCount(config.decoder_threads,
+                                 auto_threading.decoder_threads,
+                                 options.threading.decoder_threads);
+    ThreadingOptions::ParseCount(config.convert_threads,
+                                 auto_threading.convert_threads,
+                                 options.threading.convert_threads);
+    result.decoder_threads = options.threading.decoder_threads;
+    result.convert_threads = options.threading.convert_threads;
+
+    MemorySampler memory;
+    const u64 base_rss_kib = memory.Read().rss_kib;
+    u64 peak_rss_kib = base_rss_kib;
+
+    // Declared before the readers so it outlives their drain tasks
+    WorkStealingExecutor executor(consumer_threads);
+    vec<up<StreamReader>> readers;
+    vec<fut<u32>> tasks;
+    for (u32 id = 0; id < config.stream_count; ++id) {
+        readers.push_back(std::make_unique<StreamReader>(id, uri, frame_count,
+                                                         options, executor));
+        tasks.push_back(readers.back()->Result());
+    }
+
+    const auto startup_begin = std::chrono::steady_clock::now();
+    for (const up<StreamReader> &reader : readers) {
+        reader->Start(nullptr, nullptr);
+    }
+    for (bool all_done = false; !all_done;) {
+        all_done = true;
+        for (const up<StreamReader> &reader : readers) {
+            all_done &= reader->Poll();
+        }
+        if (!all_done) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    const auto begin = std::chrono::steady_clock::now();
+    result.startup_ms =
+        std::chrono::duration<double, std::milli>(begin - startup_begin)
+            .count();
+
+    const double cpu_begin_ms = ProcessCpuMs();
+    for (fut<u32> &task : tasks) {
+        while (task.wait_for(std::chrono::milliseconds(100)) !=
+               std::future_status::ready) {
+            peak_rss_kib = std::max(peak_rss_kib, memory.Read().rss_kib);
+        }
+        result.frames += task.get();
+    }
+    const double cpu_ms = ProcessCpuMs() - cpu_begin_ms;
+    result.wall_ms = std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - begin)
+                         .count();
+
+    LatencyHistogram latency, frame_gap;
+    for (const up<StreamReader> &reader : readers) {
+        if (const StreamHandler *stream_handler = reader->Handler()) {
+            ++result.streams_opened;
+            latency.Merge(stream_handler->QueueResidencyUs());
+            frame_gap.Merge(stream_handler->InterFrameGapUs());
+        }
+    }
+    readers.clear();
+
+    result.fps =
+        result.wall_ms > 0 ? 1000.0 * result.frames / result.wall_ms : 0.0;
+    result.latency_p50_us = latency.Percentile(0.5);
+    result.latency_p99_us = latency.Percentile(0.99);
+    result.frame_gap_p99_us = frame_gap.Percentile(0.99);
+    result.cpu_ms_per_frame = result.frames ? cpu_ms / result.frames : 0.0;
+    result.rss_kib_per_stream =
+        static_cast<double>(peak_rss_kib - base_rss_kib) /
+        std::max(1u, result.streams_opened);
+    return result;
+}
+
+std::string JsonString(const std::string &value) {
+    std::string quoted = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+/**
+ * @brief Writes all results so far, so a sweep cut short keeps them
+ */
+void SaveResultsJson(const std::string &path, const vec<BenchResult> &results) {
+    std::ofstream out(path);
+    if (!out) {
+        ERROR << "Unable to open " << path;
+        return;
+    }
+    out << "[\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult &r = results[i];
+        const BenchConfig &c = r.config;
+        out << "  {\"streams\": " << c.stream_count
+            << ", \"format\": " << JsonString(c.output.format)
+            << ", \"width\": " << c.output.width
+            << ", \"height\": " << c.output.height
+            << ", \"fps_limit\": " << c.fps_limit
+            << ", \"decoder_threads\": " << r.decoder_threads
+            << ", \"convert_threads\": " << r.convert_threads
+            << ", \"streams_opened\": " << r.streams_opened
+            << ", \"frames\": " << r.frames
+            << ", \"startup_ms\": " << r.startup_ms
+            << ", \"wall_ms\": " << r.wall_ms << ", \"fps\": " << r.fps
+            << ", \"fps_per_stream\": "
+            << (r.streams_opened ? r.fps / r.streams_opened : 0.0)
+            << ", \"latency_p50_us\": " << r.latency_p50_us
+            << ", \"latency_p99_us\": " << r.latency_p99_us
+            << ", \"frame_gap_p99_us\": " << r.frame_gap_p99_us
+            << ", \"cpu_ms_per_frame\": " << r.cpu_ms_per_frame
+            << ", \"rss_kib_per_stream\": " << r.rss_kib_per_stream << "}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+void InitLogging(const char *argv0, const std::string &log_file) {
+    google::InitGoogleLogging(argv0);
+    FLAGS_minloglevel = 0;
+    fLB::FLAGS_alsologtostderr = true;
+    for (auto severity : {google::GLOG_INFO, google::GLOG_WARNING,
+                          google::GLOG_ERROR, google::GLOG_FATAL}) {
+        google::SetLogDestination(severity, log_file.c_str());
+    }
+}
+
+int main(i32 argc, char **argv) {
+    cxxopts::ParseResult args = ParseBenchmarkArgs(argc, argv);
+
+    // The server is forked before this process starts any thread
+    const std::string source = args["source"].as<std::string>();
+    const std::string media = args["media"].as<std::string>();
+    const u32 port = args["port"].as<u32>();
+    std::string uri;
+    pid_t server = -1;
+    if (source == "rtsp") {
+        const std::string launch = RtspLaunch(args);
+        if (launch.empty()) {
+            std::cerr << "Invalid --source_resolution\n";
+            return 1;
+        }
+        server = fork();
+        if (server == 0) {
+            RunRtspServer(port, launch);
+        }
+        uri = "rtsp://127.0.0.1:" + std::to_string(port) + "/stream";
+    } else if (source == "file" && !media.empty()) {
+        char *path = realpath(media.c_str(), nullptr);
+        if (!path) {
+            std::cerr << media << " not found\n";
+            return 1;
+        }
+        uri = std::string("file://") + path;
+        std::free(path);
+    } else {
+        std::cerr << "--source must be rtsp, or file with --media\n";
+        return 1;
+    }
+
+    InitLogging(argv[0], args["log_file"].as<std::string>());
+    utils::IncreaseFileDescriptorLimit();
+    auto stop_server = [server]() {
+        if (server > 0) {
+            kill(server, SIGTERM);
+            waitpid(server, nullptr, 0);
+        }
+    };
+    if (server > 0 && !WaitForPort(port, std::chrono::seconds(10))) {
+        ERROR << "The RTSP server did not start on port " << port;
+        stop_server();
+        return 1;
+    }
+    if (!StreamHandler::InitGStreamer()) {
+        stop_server();
+        return 1;
+    }
+
+    // Every combination, stream count outermost
+    vec<BenchConfig> configs;
+    for (u32 stream_count : args["stream_counts"].as<vec<u32>>()) {
+        for (const std::string &format :
+             args["formats"].as<vec<std::string>>()) {
+            for (const std::string &resolution :
+                 args["resolutions"].as<vec<std::string>>()) {
+                for (u32 fps_limit : args["fps_limits"].as<vec<u32>>()) {
+                    for (const std::string &decoder_threads :
+                         args["decoder_threads"].as<vec<std::string>>()) {
+                        for (const std::string &convert_threads :
+                             args["convert_threads"].as<vec<std::string>>()) {
+                            BenchConfig config{stream_count,
+                                               {},
+                                               fps_limit,
+                                               decoder_threads,
+                                               convert_threads};
+                            config.output.format = format;
+                            configs.push_back(config);
+                            if (!ParseResolution(
+                                    resolution, configs.back().output.width,
+                                    configs.back().output.height)) {
+                                ERROR << "Invalid resolution " << resolution;
+                                stop_server();
+                                return 1;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    for (const BenchConfig &config : configs) {
+        i32 threads;
+        if (!config.output.IsValid()) {
+            ERROR << "Unknown output format " << config.output.format;
+            stop_server();
+            return 1;
+        }
+        if (!ThreadingOptions::ParseCount(config.decoder_threads, 0, threads) ||
+            !ThreadingOptions::ParseCount(config.convert_threads, 0, threads)) {
+            ERROR << "Thread counts must be \"auto\", \"default\" or a number";
+            stop_server();
+            return 1;
+        }
+    }
+
+    const std::string output = args["output"].as<std::string>();
+    vec<BenchResult> results;
+    for (size_t i = 0; i < configs.size(); ++i) {
+        const BenchConfig &config = configs[i];
+        INFO << "Run " << i + 1 << "/" << configs.size() << ": "
+             << config.stream_count << " streams, " << config.output.format
+             << " " << config.output.width << "x" << config.output.height
+             << ", fps limit " << config.fps_limit << ", decoder threads "
+             << config.decoder_threads << ", convert threads "
+             << config.convert_threads;
+        results.push_back(Run(config, uri, args["frames"].as<u32>(),
+                              args["threads"].as<u32>()));
+        const BenchResult &r = results.back();
+        INFO << "Run " << i + 1 << ": " << r.streams_opened << "/"
+             << config.stream_count << " streams, FPS = " << r.fps
+             << ", p99 latency = " << r.latency_p99_us
+             << "us, CPU per frame = " << r.cpu_ms_per_frame
+             << " ms, RSS per stream = " << r.rss_kib_per_stream << " KiB";
+        SaveResultsJson(output, results);
+    }
+    INFO << "Wrote " << results.size() << " results to " << output;
+
+    stop_server();
+    return 0;
+}
@@ -0,0 +1,286 @@
+#pragma once
+
+#include "gst/app/gstappsrc.h"
+#include "gst/gst.h"
+#include "gst/gstbuffer.h"
+#include "gst/gstbus.h"
+#include "gst/gstcaps.h"
+#include "gst/gstmessage.h"
+#include "gst/gstparse.h"
+#include "h26x.hpp"
+#include "logging.hpp"
+#include "types.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+/**
+ * @brief How long ClipWriter::Write() waits for the muxer to finish a file
+ * before giving up on it; writing a pre-event buffer takes milliseconds
+ */
+constexpr std::chrono::seconds CLIP_WRITE_TIMEOUT(10);
+
+/**
+ * @brief Encoded video ready to be written out: the caps the buffers were
+ * parsed with and one reference to each buffer, in decoding order, starting
+ * at a keyframe
+ */
+struct Clip {
+    GstCaps *caps = nullptr;
+    vec<GstBuffer *> buffers;
+
+    Clip() = default;
+    Clip(const Clip &) = delete;
+    Clip &operator=(const Clip &) = delete;
+
+    Clip(Clip &&rhs) noexcept
+        : caps(std::exchange(rhs.caps, nullptr)),
+          buffers(std::move(rhs.buffers)) {}
+
+    Clip &operator=(Clip &&rhs) noexcept {
+        if (this != &rhs) {
+            Release();
+            caps = std::exchange(rhs.caps, nullptr);
+            buffers = std::move(rhs.buffers);
+        }
+        return *this;
+    }
+
+    ~Clip() { Release(); }
+
+    bool Empty() const { return buffers.empty(); }
+
+  private:
+    void Release() {
+        for (GstBuffer *buffer : buffers) {
+            gst_buffer_unref(buffer);
+        }
+        buffers.clear();
+        if (caps) {
+            gst_caps_unref(caps);
+            caps = nullptr;
+        }
+    }
+};
+
+/**
+ * @brief Outcome of writing one Clip
+ */
+struct ClipResult {
+    std::string path;
+    bool ok = false;
+    u64 buffers = 0;
+    u64 bytes = 0;
+    /**
+     * @brief Stream time covered by the clip
+     */
+    double duration_ms = 0;
+    /**
+     * @brief Time from the write being queued to the file being complete
+     */
+    double flush_ms = 0;
+};
+
+using ClipCallback = std::function<void(const ClipResult &)>;
+
+/**
+ * @brief Writes clips of H.264/H.265 access units to MP4 files without
+ * re-encoding (appsrc ! parser ! mp4mux ! filesink), one at a time on a
+ * background thread, so saving never blocks a streaming thread.
+ */
+class ClipWriter {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    ClipWriter() : stop_(false) {
+        thread_ = std::thread([this]() { Run(); });
+    }
+
+    ClipWriter(const ClipWriter &) = delete;
+
+    ~ClipWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+
+    /**
+     * @brief The writer shared by all streams of the process
+     */
+    static ClipWriter &Instance() {
+        static ClipWriter writer;
+        return writer;
+    }
+
+    /**
+     * @brief Queues @p clip to be written to @p path; @p on_done is called
+     * on the writer thread once the file is complete or writing failed.
+     */
+    void Submit(Clip clip, const std::string &path,
+                ClipCallback on_done = nullptr) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jobs_.push_back(
+                Job{std::move(clip), path, std::move(on_done), Clock::now()});
+        }
+        cv_.notify_one();
+    }
+
+    /**
+     * @brief Writes @p clip on the calling thread. A file not complete
+     * within CLIP_WRITE_TIMEOUT is aborted and removed.
+     */
+    static ClipResult Write(const Clip &clip, const std::string &path) {
+        ClipResult result;
+        result.path = path;
+        if (clip.Empty() || !clip.caps) {
+            return result;
+        }
+        const char *parser = ParserFor(clip.caps);
+        if (!parser) {
+            ERROR << "Unable to write " << path << ": unsupported codec";
+            return result;
+        }
+        const std::string description =
+            std::string("appsrc name=src format=time ! ") + parser +
+            " ! mp4mux ! filesink location=\"" + path + "\"";
+        GError *error = nullptr;
+        GstElement *pipeline = gst_parse_launch(description.c_str(), &error);
+        if (error) {
+            ERROR << "Unable to write " << path << ": " << error->message;
+            g_clear_error(&error);
+        }
+        if (!pipeline) {
+            return result;
+        }
+        GstElement *src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+        gst_app_src_set_caps(GST_APP_SRC(src), clip.caps);
+        gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+        // The file starts at time zero whatever the stream time was
+        const GstClockTime base = GST_BUFFER_DTS_OR_PTS(clip.buffers.front());
+        GstClockTime end = base;
+        for (GstBuffer *buffer : clip.buffers) {
+            // Shallow copy: new metadata, same memory
+            GstBuffer *copy = gst_buffer_copy(buffer);
+            GST_BUFFER_PTS(copy) = Rebase(GST_BUFFER_PTS(buffer), base);
+            GST_BUFFER_DTS(copy) = Rebase(GST_BUFFER_DTS(buffer), base);
+            const GstClockTime ts = GST_BUFFER_DTS_OR_PTS(buffer);
+            if (GST_CLOCK_TIME_IS_VALID(ts)) {
+                end = std::max(end, ts);
+            }
+            result.bytes += gst_buffer_get_size(buffer);
+            ++result.buffers;
+            if (gst_app_src_push_buffer(GST_APP_SRC(src), copy) !=
+                GST_FLOW_OK) {
+                break;
+            }
+        }
+        gst_app_src_end_of_stream(GST_APP_SRC(src));
+        gst_object_unref(src);
+
+        GstBus *bus = gst_element_get_bus(pipeline);
+        GstMessage *message = gst_bus_timed_pop_filtered(
+            bus,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                CLIP_WRITE_TIMEOUT)
+                .count(),
+            static_cast<GstMessageType>(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+        if (!message) {
+            ERROR << "Unable to write " << path << ": not complete after "
+                  << CLIP_WRITE_TIMEOUT.count() << " s";
+        } else if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR) {
+            GError *write_error = nullptr;
+            gst_message_parse_error(message, &write_error, nullptr);
+            ERROR << "Unable to write " << path << ": " << write_error->message;
+            g_clear_error(&write_error);
+        } else {
+            result.ok = true;
+        }
+        if (message) {
+            gst_message_unref(message);
+        }
+        gst_object_unref(bus);
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        gst_object_unref(pipeline);
+        if (!result.ok) {
+            // Without the moov box written at EOS the file is unplayable
+            std::remove(path.c_str());
+        }
+
+        result.duration_ms =
+            GST_CLOCK_TIME_IS_VALID(base) ? (end - base) / 1e6 : 0.0;
+        return result;
+    }
+
+  private:
+    struct Job {
+        Clip clip;
+        std::string path;
+        ClipCallback on_done;
+        Clock::time_point queued;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_;
+    std::deque<Job> jobs_;
+    std::thread thread_;
+
+    void Run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+            if (jobs_.empty()) {
+                // Stopping; queued clips are still written first
+                return;
+            }
+            Job job = std::move(jobs_.front());
+            jobs_.pop_front();
+            lock.unlock();
+
+            ClipResult result = Write(job.clip, job.path);
+            result.flush_ms = std::chrono::duration<double, std::milli>(
+                                  Clock::now() - job.queued)
+                                  .count();
+            if (result.ok) {
+                INFO << "Wrote " << result.path << ": " << result.buffers
+                     << " access units, " << result.bytes << " bytes, "
+                     << result.duration_ms << " ms of video in "
+                     << result.flush_ms << " ms";
+            }
+            if (job.on_done) {
+                job.on_done(result);
+            }
+            lock.lock();
+        }
+    }
+
+    static GstClockTime Rebase(GstClockTime ts, GstClockTime base) {
+        if (!GST_CLOCK_TIME_IS_VALID(ts) || !GST_CLOCK_TIME_IS_VALID(base)) {
+            return ts;
+        }
+        return ts > base ? ts - base : 0;
+    }
+
+    static const char *ParserFor(const GstCaps *caps) {
+        switch (h26x::StreamFormat::FromCaps(caps).codec) {
+        case h26x::Codec::H264:
+            return "h264parse";
+        case h26x::Codec::H265:
+            return "h265parse";
+        default:
+            return nullptr;
+        }
+    }
+};
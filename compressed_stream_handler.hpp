@@ -0,0 +1,380 @@
+#pragma once
+
+#include "access_unit.hpp"
+#include "frame.hpp"
+#include "gst/app/gstappsink.h"
+#include "gst/gst.h"
+#include "gst/gstbus.h"
+#include "gst/gstcaps.h"
+#include "gst/gstmessage.h"
+#include "gst/gstpad.h"
+#include "gst/gstparse.h"
+#include "gst/gststructure.h"
+#include "logging.hpp"
+#include "on_demand_decoder.hpp"
+#include "stream_handler.hpp"
+#include "stream_stats.hpp"
+#include "types.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
+/**
+ * @brief Access units the compressed stream buffers for a slow consumer
+ * before the oldest are dropped (about 4 s at 30 fps)
+ */
+constexpr u32 DEFAULT_AU_QUEUE_SIZE = 120;
+
+/**
+ * @brief Receives a stream without decoding it: the pipeline ends after
+ * depayloading and parsing and hands out H.264 access units (AccessUnit) with
+ * their keyframe flags and timestamps. Costs a fraction of a StreamHandler,
+ * which decodes, scales and converts every frame, so it suits streams that
+ * are only recorded or watched "just in case".
+ *
+ * When a stream needs to be analysed, AttachDecoder() starts an
+ * OnDemandDecoder and PullFrame() hands out decoded frames from the next IDR
+ * picture on; DetachDecoder() goes back to compressed passthrough.
+ *
+ * The parser repeats SPS/PPS in front of every IDR picture, so a decoder can
+ * start at any IDR. Only H.264 sources are supported; other codecs fail to
+ * link and close the stream.
+ */
+class CompressedStreamHandler {
+  public:
+    CompressedStreamHandler() = delete;
+    CompressedStreamHandler(const CompressedStreamHandler &) = delete;
+
+    /**
+     * @brief Starts the pipeline and returns without waiting for the stream
+     * to connect; see WaitUntilReady().
+     */
+    CompressedStreamHandler(int id, const std::string &stream_uri,
+                            u32 queue_size = DEFAULT_AU_QUEUE_SIZE)
+        : id_(id), stream_uri_(stream_uri), is_stream_open_(true) {
+        if (!StreamHandler::InitGStreamer()) {
+            is_stream_open_ = false;
+        }
+        CreateNewPipeline(queue_size);
+        ConnectProbes();
+        Play();
+    }
+
+    ~CompressedStreamHandler() {
+        // The decoder holds references to our buffers, not the other way
+        // round; it can go first
+        decoder_.reset();
+        is_stream_open_ = false;
+        if (pipeline_) {
+            gst_element_set_state(pipeline_, GST_STATE_NULL);
+            gst_element_get_state(pipeline_, NULL, NULL, GST_CLOCK_TIME_NONE);
+            gst_object_unref(pipeline_);
+            pipeline_ = nullptr;
+        }
+        if (appsink_) {
+            gst_object_unref(appsink_);
+            appsink_ = nullptr;
+        }
+    }
+
+    bool IsStreamOpen() const { return is_stream_open_; }
+
+    int GetId() const { return id_; }
+
+    /**
+     * @brief Whether the parsed caps are negotiated, i.e. the stream size is
+     * known
+     */
+    bool IsReady() const { return ready_; }
+
+    /**
+     * @brief Blocks until the stream is ready, has failed, or @p timeout
+     * passed.
+     * @returns Whether the stream is open and ready
+     */
+    bool WaitUntilReady(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(ready_mutex_);
+        ready_cv_.wait_for(lock, timeout,
+                           [this]() { return ready_ || !is_stream_open_; });
+        return is_stream_open_ && ready_;
+    }
+
+    size_t GetStreamWidth() const { return stream_width_; }
+
+    size_t GetStreamHeight() const { return stream_height_; }
+
+    /**
+     * @brief Waits up to @p timeout for the next access unit. The returned
+     * unit references the parser output in place; it is invalid if none came
+     * in time or the stream is closed.
+     *
+     * While a decoder is attached, use PullFrame() instead.
+     */
+    AccessUnit
+    PullAccessUnit(std::chrono::milliseconds timeout = DEFAULT_PULL_TIMEOUT) {
+        if (!is_stream_open_) {
+            return AccessUnit();
+        }
+        GstSample *sample = gst_app_sink_try_pull_sample(
+            GST_APP_SINK(appsink_),
+            std::chrono::duration_cast<std::chrono::nanoseconds>(timeout)
+                .count());
+        if (!sample) {
+            if (gst_app_sink_is_eos(GST_APP_SINK(appsink_))) {
+                ERROR << "[CompressedStreamHandler][PullAccessUnit] End of "
+                         "stream -- Closing the stream";
+                is_stream_open_ = false;
+            }
+            return AccessUnit();
+        }
+        AccessUnit unit(sample);
+        access_units_.Add();
+        bytes_delivered_.Add(unit.Size());
+        if (unit.IsKeyframe()) {
+            keyframes_.Add();
+        }
+        return unit;
+    }
+
+    /**
+     * @brief Starts decoding; frames are available through PullFrame() from
+     * the next IDR picture on. Replaces a decoder that is already attached.
+     * @returns Whether the decoder pipeline started
+     */
+    bool AttachDecoder(const OutputSpec &output,
+                       const ThreadingOptions &threading = {}) {
+        DetachDecoder();
+        decoder_ = std::make_unique<OnDemandDecoder>(id_, output, threading);
+        dropped_at_attach_ = frames_dropped_queue_.Load();
+        if (!decoder_->IsOpen()) {
+            decoder_.reset();
+            return false;
+        }
+        INFO << "Stream [" << id_ << "]: Decoder attached, " << output.format
+             << " frames from the next IDR picture";
+        return true;
+    }
+
+    /**
+     * @brief Stops decoding and releases the decoder pipeline
+     */
+    void DetachDecoder() {
+        if (decoder_) {
+            INFO << "Stream [" << id_ << "]: Decoder detached after "
+                 << decoder_->FramesDecoded() << " frames";
+            units_skipped_decode_.Add(decoder_->UnitsSkipped());
+            frames_decoded_.Add(decoder_->FramesDecoded());
+            decoder_.reset();
+        }
+    }
+
+    bool HasDecoder() const { return decoder_ != nullptr; }
+
+    /**
+     * @brief Decoder attached only. Pulls access units into the decoder
+     * until it outputs a frame or @p timeout passes.
+     * @returns The next decoded frame, invalid on timeout, if no decoder is
+     * attached or the stream or decoder closed
+     */
+    Frame PullFrame(std::chrono::milliseconds timeout = DEFAULT_PULL_TIMEOUT) {
+        if (!decoder_) {
+            return Frame();
+        }
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (decoder_->IsOpen()) {
+            Frame frame = decoder_->TryPullFrame();
+            if (frame) {
+                frames_delivered_.Add();
+                return frame;
+            }
+            const auto remaining =
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now());
+            if (remaining.count() <= 0) {
+                break;
+            }
+            AccessUnit unit = PullAccessUnit(remaining);
+            if (!unit) {
+                break;
+            }
+            // Units dropped by the leaky queue may be referenced by the ones
+            // that follow; start over at the next IDR picture
+            const u64 dropped = frames_dropped_queue_.Load();
+            if (dropped != dropped_at_attach_) {
+                dropped_at_attach_ = dropped;
+                decoder_->Resync();
+            }
+            decoder_->Decode(unit);
+        }
+        return Frame();
+    }
+
+    /**
+     * @brief Cheap, lock-free copy of the stream's counters. access_units
+     * and bytes_delivered count the compressed units handed out (including
+     * those fed to the decoder), frames_decoded and frames_delivered the
+     * decoded frames, frames_skipped_decode the units a decoder skipped
+     * while waiting for an IDR picture. The counters of an attached decoder
+     * are only included once it is detached.
+     */
+    StreamStats Snapshot() const {
+        StreamStats stats;
+        stats.stream_id = id_;
+        stats.access_units = access_units_.Load();
+        stats.frames_skipped_decode = units_skipped_decode_.Load();
+        stats.frames_decoded = frames_decoded_.Load();
+        stats.frames_dropped_queue = frames_dropped_queue_.Load();
+        stats.frames_delivered = frames_delivered_.Load();
+        stats.bytes_delivered = bytes_delivered_.Load();
+        return stats;
+    }
+
+    /**
+     * @brief Keyframes among the access units handed out
+     */
+    u64 Keyframes() const { return keyframes_.Load(); }
+
+  private:
+    int id_;
+    std::string stream_uri_;
+    atm<bool> is_stream_open_;
+
+    atm<bool> ready_{false};
+    atm<int> stream_width_{0};
+    atm<int> stream_height_{0};
+    std::mutex ready_mutex_;
+    std::condition_variable ready_cv_;
+
+    GstElement *pipeline_ = nullptr;
+    GstElement *appsink_ = nullptr;
+
+    up<OnDemandDecoder> decoder_;
+    /**
+     * @brief frames_dropped_queue_ when the decoder last (re)synced
+     */
+    u64 dropped_at_attach_ = 0;
+
+    PaddedCounter access_units_;
+    PaddedCounter keyframes_;
+    PaddedCounter bytes_delivered_;
+    PaddedCounter frames_dropped_queue_;
+    PaddedCounter units_skipped_decode_;
+    PaddedCounter frames_decoded_;
+    PaddedCounter frames_delivered_;
+
+    void CreateNewPipeline(u32 queue_size) {
+        GError *error = nullptr;
+        // uridecodebin stops autoplugging at the first pad matching its caps,
+        // i.e. right after the depayloader or demuxer; the parser then
+        // converts to AU-aligned byte-stream and repeats SPS/PPS at each IDR
+        const std::string pipeline_description =
+            "uridecodebin name=decode caps=video/x-h264 uri=" + stream_uri_ +
+            " ! h264parse config-interval=-1 ! " + H264_AU_CAPS +
+            " ! queue name=queue max-size-buffers=" +
+            std::to_string(queue_size) +
+            " max-size-bytes=0 max-size-time=0 leaky=downstream" +
+            " ! appsink sync=false name=sink";
+        pipeline_ = gst_parse_launch(pipeline_description.c_str(), &error);
+        if (error) {
+            ERROR << error->message;
+            g_clear_error(&error);
+            is_stream_open_ = false;
+        }
+        if (!pipeline_) {
+            ERROR << "Unable to create gstreamer pipeline";
+            is_stream_open_ = false;
+            return;
+        }
+        appsink_ = gst_bin_get_by_name(GST_BIN(pipeline_), "sink");
+        if (!appsink_) {
+            ERROR << "Unable to get app sink";
+            is_stream_open_ = false;
+        }
+    }
+
+    void ConnectProbes() {
+        if (!pipeline_ || !appsink_) {
+            return;
+        }
+        GstElement *queue = gst_bin_get_by_name(GST_BIN(pipeline_), "queue");
+        if (queue) {
+            g_signal_connect(
+                queue, "overrun",
+                G_CALLBACK(&CompressedStreamHandler::OnQueueOverrun), this);
+            gst_object_unref(queue);
+        }
+
+        GstPad *pad = gst_element_get_static_pad(appsink_, "sink");
+        g_signal_connect(pad, "notify::caps",
+                         G_CALLBACK(&CompressedStreamHandler::OnCapsChanged),
+                         this);
+        gst_object_unref(pad);
+
+        GstBus *bus = gst_element_get_bus(pipeline_);
+        gst_bus_set_sync_handler(bus, &CompressedStreamHandler::OnBusMessage,
+                                 this, nullptr);
+        gst_object_unref(bus);
+    }
+
+    void Play() {
+        if (!pipeline_) {
+            return;
+        }
+        if (gst_element_set_state(pipeline_, GST_STATE_PLAYING) ==
+            GST_STATE_CHANGE_FAILURE) {
+            ERROR << "Unable to start playing";
+            is_stream_open_ = false;
+        }
+    }
+
+    void NotifyReadyWaiters() {
+        { std::lock_guard<std::mutex> lock(ready_mutex_); }
+        ready_cv_.notify_all();
+    }
+
+    static void OnQueueOverrun(GstElement *, gpointer user_data) {
+        static_cast<CompressedStreamHandler *>(user_data)
+            ->frames_dropped_queue_.Add();
+    }
+
+    static void OnCapsChanged(GstPad *pad, GParamSpec *, gpointer user_data) {
+        auto *self = static_cast<CompressedStreamHandler *>(user_data);
+        GstCaps *caps = gst_pad_get_current_caps(pad);
+        if (!caps) {
+            return;
+        }
+        gint width = 0, height = 0;
+        if (gst_caps_get_size(caps) > 0) {
+            const GstStructure *structure = gst_caps_get_structure(caps, 0);
+            gst_structure_get_int(structure, "width", &width);
+            gst_structure_get_int(structure, "height", &height);
+        }
+        gst_caps_unref(caps);
+
+        self->stream_width_ = width;
+        self->stream_height_ = height;
+        if (!self->ready_.exchange(true)) {
+            INFO << "Stream [" << self->id_ << "]: Ready, compressed " << width
+                 << "x" << height;
+            self->NotifyReadyWaiters();
+        }
+    }
+
+    static GstBusSyncReply OnBusMessage(GstBus *, GstMessage *message,
+                                        gpointer user_data) {
+        auto *self = static_cast<CompressedStreamHandler *>(user_data);
+        if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR) {
+            GError *error = nullptr;
+            gchar *debug = nullptr;
+            gst_message_parse_error(message, &error, &debug);
+            ERROR << "Stream [" << self->id_ << "]: " << error->message
+                  << " -- Closing the stream";
+            self->is_stream_open_ = false;
+            self->NotifyReadyWaiters();
+            g_clear_error(&error);
+            g_free(debug);
+        }
+        return GST_BUS_DROP;
+    }
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "hart_sampler.hpp"
+#include "logging.hpp"
+#include "sampler.hpp"
+#include "types.hpp"
+#include <fstream>
+#include <set>
+#include <sys/resource.h>
+
+/**
+ * @brief CPU time of the process and usage of every hardware thread
+ */
+class CpuSampler : public Sampler {
+
+  public:
+    CpuSampler(const CpuSampler &) = delete;
+    CpuSampler(CpuSampler &&) = delete;
+    CpuSampler() : hart_sampler_() {}
+
+    const char *Name() const override { return "cpu"; }
+
+    vec<std::string> Columns() const override {
+        vec<std::string> columns = {"cpu_user_ms", "cpu_sys_ms"};
+        for (u32 c = 0; c < core_count_; ++c) {
+            columns.push_back("cpu" + std::to_string(c) + "_usage");
+        }
+        return columns;
+    }
+
+    /**
+     * @brief Cores that came online after construction are left out
+     */
+    void Sample(double *row) override {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        *row++ = usage.ru_utime.tv_sec * 1000 + usage.ru_utime.tv_usec / 1000;
+        *row++ = usage.ru_stime.tv_sec * 1000 + usage.ru_stime.tv_usec / 1000;
+        const HartSampler::Metrics &cores = hart_sampler_.Sample();
+        for (u32 c = 0; c < core_count_; ++c) {
+            *row++ = c < cores.size() ? cores[c].usage : 0.0;
+        }
+    }
+
+    u32 CpuCount() const { return hart_sampler_.CpuCount(); }
+
+    void LogMetadata() const override {
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::string line;
+        std::set<std::string> seen;
+        while (std::getline(cpuinfo, line)) {
+            if (line.find("model name") != std::string::npos ||
+                line.find("cpu cores") != std::string::npos ||
+                line.find("cache size") != std::string::npos) {
+                if (seen.insert(line).second) {
+                    INFO << line;
+                }
+            }
+        }
+    }
+
+  private:
+    HartSampler hart_sampler_;
+    /**
+     * @brief Hardware threads listed in /proc/stat when constructed
+     */
+    u32 core_count_ = hart_sampler_.CoreCount();
+};
@@ -0,0 +1,293 @@
+#pragma once
+
+#include "gst/gst.h"
+#include "gst/gstbuffer.h"
+#include "gst/gstcaps.h"
+#include "gst/gstevent.h"
+#include "gst/gstpad.h"
+#include "h26x.hpp"
+#include "logging.hpp"
+#include "stream_stats.hpp"
+#include "types.hpp"
+#include <algorithm>
+#include <atomic>
+#include <string>
+
+/**
+ * @brief How much decode work a rate-limited stream may skip.
+ * - None: decode everything, videorate drops the excess afterwards.
+ * - NonReference: drop access units no other picture references (typically
+ *   B-frames) before they reach the decoder.
+ * - KeyframeOnly: drop every delta unit and decode keyframes only.
+ * - Auto: pick one of the above from the fps limit, the source frame rate
+ *   and the keyframe interval.
+ */
+enum class DecodeSkipMode { None, NonReference, KeyframeOnly, Auto };
+
+inline const char *DecodeSkipModeName(DecodeSkipMode mode) {
+    switch (mode) {
+    case DecodeSkipMode::NonReference:
+        return "nonref";
+    case DecodeSkipMode::KeyframeOnly:
+        return "keyframe";
+    case DecodeSkipMode::Auto:
+        return "auto";
+    default:
+        return "none";
+    }
+}
+
+inline bool ParseDecodeSkipMode(const std::string &name, DecodeSkipMode &mode) {
+    for (DecodeSkipMode candidate :
+         {DecodeSkipMode::None, DecodeSkipMode::NonReference,
+          DecodeSkipMode::KeyframeOnly, DecodeSkipMode::Auto}) {
+        if (name == DecodeSkipModeName(candidate)) {
+            mode = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Drops encoded access units in front of a video decoder so frames
+ * the fps limit would throw away are never decoded. Installed as a probe on
+ * the decoder's sink pad; all state except the counters and the active mode
+ * is only touched by the streaming thread feeding the decoder.
+ */
+class DecodeSkipper {
+  public:
+    DecodeSkipper() = delete;
+    DecodeSkipper(const DecodeSkipper &) = delete;
+
+    DecodeSkipper(i32 stream_id, DecodeSkipMode mode, int fps_limit)
+        : stream_id_(stream_id), mode_(mode), fps_limit_(fps_limit),
+          active_(mode == DecodeSkipMode::Auto ? DecodeSkipMode::None : mode) {}
+
+    /**
+     * @brief Starts filtering the input of @p decoder
+     */
+    void Attach(GstElement *decoder) {
+        if (mode_ == DecodeSkipMode::None) {
+            return;
+        }
+        GstPad *pad = gst_element_get_static_pad(decoder, "sink");
+        if (!pad) {
+            return;
+        }
+        gst_pad_add_probe(
+            pad,
+            static_cast<GstPadProbeType>(GST_PAD_PROBE_TYPE_BUFFER |
+                                         GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+            &DecodeSkipper::OnProbe, this, nullptr);
+        gst_object_unref(pad);
+    }
+
+    /**
+     * @brief The mode in effect; for Auto, what it currently resolved to
+     */
+    DecodeSkipMode ActiveMode() const { return active_; }
+
+    /**
+     * @brief Access units that reached the decoder's sink pad
+     */
+    u64 AccessUnits() const { return access_units_.Load(); }
+
+    /**
+     * @brief Access units dropped before decoding
+     */
+    u64 Skipped() const { return skipped_.Load(); }
+
+    /**
+     * @brief Follows a change of the stream's fps limit; Auto re-resolves
+     * with the next access unit and switches at the next keyframe
+     */
+    void SetFpsLimit(int fps_limit) { fps_limit_ = fps_limit; }
+
+    /**
+     * @brief Accounts for one access unit reaching the decoder and returns
+     * the mode that applies to it. Auto switches modes on keyframes only:
+     * changing what is dropped in the middle of a GOP would leave the
+     * decoder with pictures whose references it never got, corrupting every
+     * frame up to the next keyframe.
+     * @param ts DTS, or PTS if there is none, of the access unit
+     */
+    DecodeSkipMode ModeFor(bool keyframe, GstClockTime ts) {
+        MeasureRate(ts);
+        if (keyframe) {
+            if (seen_keyframe_) {
+                keyframe_interval_ = since_keyframe_;
+            }
+            seen_keyframe_ = true;
+            since_keyframe_ = 0;
+        }
+        ++since_keyframe_;
+
+        if (mode_ != DecodeSkipMode::Auto) {
+            return mode_;
+        }
+        pending_ = Resolve();
+        if (keyframe && pending_ != active_.load(std::memory_order_relaxed)) {
+            active_ = pending_;
+            INFO << "Stream [" << stream_id_
+                 << "]: Decode skipping = " << DecodeSkipModeName(pending_)
+                 << " (source " << SourceFps() << " fps, keyframe every "
+                 << keyframe_interval_ << " frames, limit " << fps_limit_.load()
+                 << " fps)";
+        }
+        return active_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    i32 stream_id_;
+    DecodeSkipMode mode_;
+    atm<int> fps_limit_;
+    atm<DecodeSkipMode> active_;
+    /**
+     * @brief What Auto last resolved to, applied to active_ at the next
+     * keyframe
+     */
+    DecodeSkipMode pending_ = DecodeSkipMode::None;
+    PaddedCounter access_units_;
+    PaddedCounter skipped_;
+
+    h26x::StreamFormat format_;
+    /**
+     * @brief Frame rate from the caps, 0 if they do not say (common for RTP)
+     */
+    double caps_fps_ = 0;
+    /**
+     * @brief Frame rate measured from timestamps over windows of about a
+     * second, robust against B-frame reordering
+     */
+    double measured_fps_ = 0;
+    GstClockTime window_start_ = GST_CLOCK_TIME_NONE;
+    GstClockTime window_end_ = 0;
+    u32 window_frames_ = 0;
+    /**
+     * @brief Access units from the previous keyframe to the one before it, 0
+     * until two keyframes were seen
+     */
+    u64 keyframe_interval_ = 0;
+    u64 since_keyframe_ = 0;
+    bool seen_keyframe_ = false;
+    u32 max_temporal_id_ = 0;
+
+    static GstPadProbeReturn OnProbe(GstPad *, GstPadProbeInfo *info,
+                                     gpointer user_data) {
+        auto *self = static_cast<DecodeSkipper *>(user_data);
+        if (GST_PAD_PROBE_INFO_TYPE(info) &
+            GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+            GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+            if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+                GstCaps *caps = nullptr;
+                gst_event_parse_caps(event, &caps);
+                self->OnCaps(caps);
+            }
+            return GST_PAD_PROBE_OK;
+        }
+        GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+        return buffer && self->ShouldDrop(buffer) ? GST_PAD_PROBE_DROP
+                                                  : GST_PAD_PROBE_OK;
+    }
+
+    void OnCaps(const GstCaps *caps) {
+        format_ = h26x::StreamFormat::FromCaps(caps);
+        gint fps_n = 0, fps_d = 1;
+        const GstStructure *structure = caps && gst_caps_get_size(caps)
+                                            ? gst_caps_get_structure(caps, 0)
+                                            : nullptr;
+        caps_fps_ = structure &&
+                            gst_structure_get_fraction(structure, "framerate",
+                                                       &fps_n, &fps_d) &&
+                            fps_d > 0
+                        ? static_cast<double>(fps_n) / fps_d
+                        : 0.0;
+    }
+
+    void MeasureRate(GstClockTime ts) {
+        if (!GST_CLOCK_TIME_IS_VALID(ts)) {
+            return;
+        }
+        if (!GST_CLOCK_TIME_IS_VALID(window_start_) || ts < window_start_) {
+            window_start_ = ts;
+            window_end_ = ts;
+            window_frames_ = 0;
+            return;
+        }
+        ++window_frames_;
+        window_end_ = std::max(window_end_, ts);
+        if (window_end_ - window_start_ >= GST_SECOND) {
+            measured_fps_ = window_frames_ * static_cast<double>(GST_SECOND) /
+                            (window_end_ - window_start_);
+            window_start_ = window_end_;
+            window_frames_ = 0;
+        }
+    }
+
+    double SourceFps() const {
+        return caps_fps_ > 0 ? caps_fps_ : measured_fps_;
+    }
+
+    DecodeSkipMode Resolve() const {
+        const double source_fps = SourceFps();
+        const int fps_limit = fps_limit_.load(std::memory_order_relaxed);
+        if (fps_limit <= 0 || source_fps <= 0 || fps_limit >= source_fps) {
+            return DecodeSkipMode::None;
+        }
+        if (keyframe_interval_ > 0 &&
+            source_fps / keyframe_interval_ >= fps_limit) {
+            return DecodeSkipMode::KeyframeOnly;
+        }
+        // Non-reference pictures are usually at most every other frame
+        if (2 * fps_limit <= source_fps && format_.IsKnown()) {
+            return DecodeSkipMode::NonReference;
+        }
+        return DecodeSkipMode::None;
+    }
+
+    bool ShouldDrop(GstBuffer *buffer) {
+        access_units_.Add();
+        const bool keyframe =
+            !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+        // Codec headers never carry a picture
+        if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER)) {
+            return false;
+        }
+
+        bool drop = false;
+        switch (ModeFor(keyframe, GST_BUFFER_DTS_OR_PTS(buffer))) {
+        case DecodeSkipMode::KeyframeOnly:
+            drop = !keyframe;
+            break;
+        case DecodeSkipMode::NonReference:
+            drop = IsDroppableNonReference(buffer);
+            break;
+        default:
+            break;
+        }
+        if (drop) {
+            skipped_.Add();
+        }
+        return drop;
+    }
+
+    bool IsDroppableNonReference(GstBuffer *buffer) {
+        if (!format_.IsKnown()) {
+            return false;
+        }
+        GstMapInfo map;
+        if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+            return false;
+        }
+        const h26x::AccessUnitInfo info =
+            h26x::Inspect(format_, map.data, map.size);
+        gst_buffer_unmap(buffer, &map);
+
+        // An H.265 sub-layer non-reference picture may still be referenced
+        // by higher sub-layers; only pictures of the highest one are safe
+        max_temporal_id_ = std::max(max_temporal_id_, info.temporal_id);
+        return info.has_vcl && info.non_reference && !info.idr &&
+               info.temporal_id >= max_temporal_id_;
+    }
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include "types.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <pthread.h>
+#include <string>
+#include <thread>
+
+/**
+ * @brief Fixed-size thread pool with one task deque per worker. A worker pops
+ * its own deque LIFO (cache-warm) and, when empty, steals FIFO from the other
+ * workers before going to sleep.
+ */
+class WorkStealingExecutor {
+  public:
+    using Task = std::function<void()>;
+
+    WorkStealingExecutor() = delete;
+    WorkStealingExecutor(const WorkStealingExecutor &) = delete;
+    WorkStealingExecutor(WorkStealingExecutor &&) = delete;
+
+    /**
+     * @param thread_count Number of workers, 0 means one per hardware thread
+     */
+    explicit WorkStealingExecutor(u32 thread_count)
+        : queues_(ResolveThreadCount(thread_count)) {
+        for (u32 i = 0; i < queues_.size(); ++i) {
+            workers_.emplace_back([this, i]() { WorkerLoop(i); });
+        }
+    }
+
+    /**
+     * @brief Runs the tasks that are already queued, then joins the workers
+     */
+    ~WorkStealingExecutor() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (std::thread &worker : workers_) {
+            worker.join();
+        }
+    }
+
+    u32 ThreadCount() const { return workers_.size(); }
+
+    /**
+     * @brief Queues @p task. Called from a worker it goes to that worker's own
+     * deque, otherwise the target worker is picked round-robin.
+     */
+    void Submit(Task task) {
+        u32 index = current_worker_ != nullptr && current_worker_->owner == this
+                        ? current_worker_->index
+                        : next_queue_.fetch_add(1, std::memory_order_relaxed) %
+                              queues_.size();
+        // Counted before it is visible so pending_ never underflows.
+        // Sequentially consistent, pairs with the sleeping_/pending_ check in
+        // WorkerLoop so a wake-up cannot be lost.
+        pending_.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> lock(queues_[index].mutex);
+            queues_[index].tasks.push_back(std::move(task));
+        }
+        if (sleeping_.load() > 0) {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            wake_.notify_one();
+        }
+    }
+
+    static u32 ResolveThreadCount(u32 thread_count) {
+        return thread_count ? thread_count
+                            : std::max(1u, std::thread::hardware_concurrency());
+    }
+
+  private:
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    struct WorkerIdentity {
+        const WorkStealingExecutor *owner;
+        u32 index;
+    };
+
+    static inline thread_local const WorkerIdentity *current_worker_ = nullptr;
+
+    vec<Queue> queues_;
+    vec<std::thread> workers_;
+    atm<u32> next_queue_{0};
+    atm<u64> pending_{0};
+    atm<u32> sleeping_{0};
+
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    bool stop_ = false;
+
+    bool PopOwn(u32 index, Task &task) {
+        Queue &queue = queues_[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool Steal(u32 thief, Task &task) {
+        for (u32 offset = 1; offset < queues_.size(); ++offset) {
+            Queue &queue = queues_[(thief + offset) % queues_.size()];
+            std::unique_lock<std::mutex> lock(queue.mutex, std::try_to_lock);
+            if (!lock.owns_lock() || queue.tasks.empty()) {
+                continue;
+            }
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void WorkerLoop(u32 index) {
+        const WorkerIdentity identity{this, index};
+        current_worker_ = &identity;
+        // Lets ThreadCpuSampler count workers as consumers
+        pthread_setname_np(pthread_self(),
+                           ("consumer" + std::to_string(index)).c_str());
+
+        Task task;
+        while (true) {
+            if (PopOwn(index, task) || Steal(index, task)) {
+                pending_.fetch_sub(1);
+                task();
+                task = nullptr;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            if (pending_.load() > 0) {
+                // Work is being queued, or a try_lock missed it; retry
+                continue;
+            }
+            if (stop_) {
+                break;
+            }
+            sleeping_.fetch_add(1);
+            wake_.wait(lock, [this]() { return stop_ || pending_.load() > 0; });
+            sleeping_.fetch_sub(1);
+        }
+
+        current_worker_ = nullptr;
+    }
+};
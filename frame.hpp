@@ -0,0 +1,285 @@
+#pragma once
+
+#include "gst/gst.h"
+#include "gst/gstbuffer.h"
+#include "gst/gstsample.h"
+#include "gst/video/video-frame.h"
+#include "gst/video/video-info.h"
+#include "logging.hpp"
+#include "types.hpp"
+#include "yuv_to_rgb.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+/**
+ * @brief Frames handed out by a stream that are still held by consumers,
+ * with the bytes of decoder memory they keep from being reused
+ */
+struct FrameAccount {
+    atm<i64> frames{0};
+    atm<i64> bytes{0};
+};
+
+/**
+ * @brief Move-only handle to a decoded frame that lives in a GstBuffer. The
+ * handle owns one reference to the GstSample and keeps the buffer mapped for
+ * reading until it is destroyed, so the pixels can be read in place without
+ * copying them out of the decoder's memory.
+ */
+class Frame {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    Frame() = default;
+    Frame(const Frame &) = delete;
+    Frame &operator=(const Frame &) = delete;
+
+    /**
+     * @brief Takes ownership of @p sample (the caller's reference is
+     * transferred to the frame).
+     */
+    explicit Frame(GstSample *sample) : sample_(sample) { Map(); }
+
+    /**
+     * @param arrival When the sample reached the appsink
+     */
+    Frame(GstSample *sample, Clock::time_point arrival)
+        : sample_(sample), arrival_(arrival) {
+        Map();
+    }
+
+    Frame(Frame &&rhs) noexcept
+        : sample_(std::exchange(rhs.sample_, nullptr)), arrival_(rhs.arrival_),
+          is_mapped_(std::exchange(rhs.is_mapped_, false)),
+          video_frame_(rhs.video_frame_), account_(std::move(rhs.account_)) {}
+
+    Frame &operator=(Frame &&rhs) noexcept {
+        if (this != &rhs) {
+            Release();
+            sample_ = std::exchange(rhs.sample_, nullptr);
+            arrival_ = rhs.arrival_;
+            is_mapped_ = std::exchange(rhs.is_mapped_, false);
+            video_frame_ = rhs.video_frame_;
+            account_ = std::move(rhs.account_);
+        }
+        return *this;
+    }
+
+    ~Frame() { Release(); }
+
+    bool IsValid() const { return is_mapped_; }
+
+    explicit operator bool() const { return IsValid(); }
+
+    u32 Width() const { return GST_VIDEO_FRAME_WIDTH(&video_frame_); }
+
+    u32 Height() const { return GST_VIDEO_FRAME_HEIGHT(&video_frame_); }
+
+    GstVideoFormat Format() const {
+        return GST_VIDEO_FRAME_FORMAT(&video_frame_);
+    }
+
+    u32 PlaneCount() const { return GST_VIDEO_FRAME_N_PLANES(&video_frame_); }
+
+    const u8 *PlaneData(u32 plane) const {
+        return static_cast<const u8 *>(
+            GST_VIDEO_FRAME_PLANE_DATA(&video_frame_, plane));
+    }
+
+    /**
+     * @brief Bytes per row of @p plane, including any row padding.
+     */
+    u32 PlaneStride(u32 plane) const {
+        return GST_VIDEO_FRAME_PLANE_STRIDE(&video_frame_, plane);
+    }
+
+    /**
+     * @brief Number of rows of @p plane (e.g. half the height for the
+     * chroma plane of NV12)
+     */
+    u32 PlaneRows(u32 plane) const {
+        for (u32 c = 0; c < GST_VIDEO_FRAME_N_COMPONENTS(&video_frame_); ++c) {
+            if (static_cast<u32>(
+                    GST_VIDEO_FRAME_COMP_PLANE(&video_frame_, c)) == plane) {
+                return GST_VIDEO_FRAME_COMP_HEIGHT(&video_frame_, c);
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * @brief Total size in bytes of the mapped buffer (all planes, including
+     * padding).
+     */
+    size_t Size() const { return is_mapped_ ? video_frame_.map[0].size : 0; }
+
+    /**
+     * @brief Presentation timestamp in nanoseconds, GST_CLOCK_TIME_NONE if the
+     * buffer carries none.
+     */
+    GstClockTime Pts() const {
+        return is_mapped_ ? GST_BUFFER_PTS(video_frame_.buffer)
+                          : GST_CLOCK_TIME_NONE;
+    }
+
+    GstSample *Sample() const { return sample_; }
+
+    /**
+     * @brief Counts the frame in @p account until it is released
+     */
+    void Track(sp<FrameAccount> account) {
+        if (!is_mapped_ || account_) {
+            return;
+        }
+        account->frames.fetch_add(1, std::memory_order_relaxed);
+        account->bytes.fetch_add(Size(), std::memory_order_relaxed);
+        account_ = std::move(account);
+    }
+
+    /**
+     * @brief When the sample reached the appsink; only known for frames
+     * delivered in push mode
+     */
+    Clock::time_point ArrivalTime() const { return arrival_; }
+
+    bool HasArrivalTime() const { return arrival_ != Clock::time_point(); }
+
+    const GstVideoInfo &Info() const { return video_frame_.info; }
+
+    /**
+     * @brief Size in bytes of the frame laid out with the default strides of
+     * its format (what CopyTo writes)
+     */
+    size_t PackedSize() const {
+        GstVideoInfo info;
+        if (!is_mapped_ ||
+            !gst_video_info_set_format(&info, Format(), Width(), Height())) {
+            return 0;
+        }
+        return GST_VIDEO_INFO_SIZE(&info);
+    }
+
+    /**
+     * @brief Copies the pixels into @p dst using the default strides of the
+     * format, dropping any row padding of the source buffer.
+     * @returns false if the frame is invalid or @p dst_size is too small
+     */
+    bool CopyTo(u8 *dst, size_t dst_size) const {
+        GstVideoInfo info;
+        if (!is_mapped_ ||
+            !gst_video_info_set_format(&info, Format(), Width(), Height())) {
+            return false;
+        }
+        if (dst_size < GST_VIDEO_INFO_SIZE(&info)) {
+            return false;
+        }
+
+        GstBuffer *buffer = gst_buffer_new_wrapped_full(
+            static_cast<GstMemoryFlags>(0), dst, dst_size, 0,
+            GST_VIDEO_INFO_SIZE(&info), nullptr, nullptr);
+        GstVideoFrame dst_frame;
+        bool copied = false;
+        if (gst_video_frame_map(&dst_frame, &info, buffer, GST_MAP_WRITE)) {
+            copied = gst_video_frame_copy(&dst_frame, &video_frame_);
+            gst_video_frame_unmap(&dst_frame);
+        }
+        gst_buffer_unref(buffer);
+        return copied;
+    }
+
+    /**
+     * @brief Writes the frame as packed RGB into @p dst. NV12 and I420 are
+     * converted with the SIMD kernels using the frame's colorimetry, RGB is
+     * copied row by row.
+     * @param dst_stride Bytes per row of @p dst, at least 3 * Width()
+     * @returns false if the frame is invalid or in any other format
+     */
+    bool ToRgb(u8 *dst, u32 dst_stride,
+               yuv::Kernel kernel = yuv::BestKernel()) const {
+        if (!is_mapped_ || dst_stride < 3 * Width()) {
+            return false;
+        }
+
+        switch (Format()) {
+        case GST_VIDEO_FORMAT_RGB:
+            for (u32 row = 0; row < Height(); ++row) {
+                std::memcpy(dst + row * dst_stride,
+                            PlaneData(0) + row * PlaneStride(0), 3 * Width());
+            }
+            return true;
+        case GST_VIDEO_FORMAT_NV12:
+            yuv::ToRgb(yuv::Image::Nv12(PlaneData(0), PlaneStride(0),
+                                        PlaneData(1), PlaneStride(1), Width(),
+                                        Height()),
+                       YuvCoefficients(), dst, dst_stride, kernel);
+            return true;
+        case GST_VIDEO_FORMAT_I420:
+            yuv::ToRgb(yuv::Image::I420(PlaneData(0), PlaneStride(0),
+                                        PlaneData(1), PlaneStride(1),
+                                        PlaneData(2), PlaneStride(2), Width(),
+                                        Height()),
+                       YuvCoefficients(), dst, dst_stride, kernel);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+  private:
+    GstSample *sample_ = nullptr;
+    Clock::time_point arrival_;
+    bool is_mapped_ = false;
+    GstVideoFrame video_frame_{};
+    sp<FrameAccount> account_;
+
+    void Map() {
+        if (!sample_) {
+            return;
+        }
+
+        GstCaps *caps = gst_sample_get_caps(sample_);
+        GstBuffer *buffer = gst_sample_get_buffer(sample_);
+        GstVideoInfo info;
+        if (!caps || !buffer || !gst_video_info_from_caps(&info, caps)) {
+            ERROR << "[Frame] Sample has no buffer or parsable video caps";
+            return;
+        }
+
+        is_mapped_ =
+            gst_video_frame_map(&video_frame_, &info, buffer, GST_MAP_READ);
+        if (!is_mapped_) {
+            ERROR << "[Frame] Unable to map buffer";
+        }
+    }
+
+    /**
+     * @brief YCbCr matrix and range from the caps colorimetry, BT.601 limited
+     * range if the caps do not say
+     */
+    yuv::Coefficients YuvCoefficients() const {
+        const GstVideoColorimetry &colorimetry = Info().colorimetry;
+        gdouble kr = 0.299, kb = 0.114;
+        gst_video_color_matrix_get_Kr_Kb(colorimetry.matrix, &kr, &kb);
+        return yuv::Coefficients::Make(
+            kr, kb, colorimetry.range == GST_VIDEO_COLOR_RANGE_0_255);
+    }
+
+    void Release() {
+        if (account_) {
+            account_->frames.fetch_sub(1, std::memory_order_relaxed);
+            account_->bytes.fetch_sub(Size(), std::memory_order_relaxed);
+            account_.reset();
+        }
+        if (is_mapped_) {
+            gst_video_frame_unmap(&video_frame_);
+            is_mapped_ = false;
+        }
+        if (sample_) {
+            gst_sample_unref(sample_);
+            sample_ = nullptr;
+        }
+    }
+};
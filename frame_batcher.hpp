@@ -0,0 +1,455 @@
+#pragma once
+
+#include "frame.hpp"
+#include "logging.hpp"
+#include "stream_handler.hpp"
+#include "types.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+
+constexpr size_t BATCH_ALIGNMENT = 64;
+
+/**
+ * @brief One frame per stream packed into a single contiguous buffer. Slot i
+ * belongs to the i-th stream added to the FrameBatcher and starts at a
+ * BATCH_ALIGNMENT boundary. Slot::pts is the clock time the frame was due
+ * (see FrameBatcher).
+ */
+class Batch {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Slot {
+        i32 stream_id = -1;
+        bool filled = false;
+        GstClockTime pts = GST_CLOCK_TIME_NONE;
+        Clock::time_point arrival;
+        u32 width = 0;
+        u32 height = 0;
+    };
+
+    Batch() = default;
+    Batch(const Batch &) = delete;
+    Batch(Batch &&) = default;
+    Batch &operator=(Batch &&) = default;
+
+    const u8 *Data() const { return data_.get(); }
+
+    const u8 *SlotData(u32 index) const {
+        return data_.get() + index * slot_stride_;
+    }
+
+    size_t SlotStride() const { return slot_stride_; }
+
+    const vec<Slot> &Slots() const { return slots_; }
+
+    u32 FilledCount() const { return filled_count_; }
+
+    double FillRatio() const {
+        return slots_.empty()
+                   ? 0.0
+                   : static_cast<double>(filled_count_) / slots_.size();
+    }
+
+    /**
+     * @brief Time between the first frame arriving and the batch being
+     * emitted, i.e. the latency the batcher added to that frame
+     */
+    double AddedLatencyMs() const {
+        return std::chrono::duration<double, std::milli>(emitted_ -
+                                                         first_arrival_)
+            .count();
+    }
+
+    /**
+     * @brief Spread of the buffer PTS over the filled slots, in ms
+     */
+    double PtsSkewMs() const {
+        GstClockTime lo = GST_CLOCK_TIME_NONE, hi = 0;
+        for (const Slot &slot : slots_) {
+            if (slot.filled && GST_CLOCK_TIME_IS_VALID(slot.pts)) {
+                lo = std::min(lo, slot.pts);
+                hi = std::max(hi, slot.pts);
+            }
+        }
+        return GST_CLOCK_TIME_IS_VALID(lo)
+                   ? static_cast<double>(hi - lo) / GST_MSECOND
+                   : 0.0;
+    }
+
+  private:
+    friend class FrameBatcher;
+
+    /**
+     * @brief Earliest timestamp of the filled slots
+     */
+    GstClockTime OldestTime() const {
+        GstClockTime oldest = GST_CLOCK_TIME_NONE;
+        for (const Slot &slot : slots_) {
+            if (slot.filled && GST_CLOCK_TIME_IS_VALID(slot.pts)) {
+                oldest = std::min(oldest, slot.pts);
+            }
+        }
+        return oldest;
+    }
+
+    struct FreeDeleter {
+        void operator()(u8 *p) const { std::free(p); }
+    };
+
+    std::unique_ptr<u8, FreeDeleter> data_;
+    size_t slot_stride_ = 0;
+    vec<Slot> slots_;
+    u32 filled_count_ = 0;
+    Clock::time_point first_arrival_;
+    Clock::time_point emitted_;
+
+    void Reset(u32 slot_count, size_t slot_bytes) {
+        size_t stride = (slot_bytes + BATCH_ALIGNMENT - 1) / BATCH_ALIGNMENT *
+                        BATCH_ALIGNMENT;
+        if (!data_ || stride != slot_stride_ || slot_count != slots_.size()) {
+            data_.reset(static_cast<u8 *>(
+                std::aligned_alloc(BATCH_ALIGNMENT, stride * slot_count)));
+            slot_stride_ = stride;
+        }
+        slots_.assign(slot_count, Slot());
+        filled_count_ = 0;
+    }
+};
+
+constexpr u32 DEFAULT_BATCH_PTS_TOLERANCE_MS = 15;
+/**
+ * @brief Frames popped from a stream and waiting for a batch they align
+ * with; the oldest are dropped beyond this
+ */
+constexpr size_t MAX_PENDING_FRAMES = 4;
+
+/**
+ * @brief Collects one frame per stream of N push-mode streams into a Batch,
+ * aligned by timestamp: the frames of a batch are the ones closest to a
+ * common target time, within a tolerance window. A batch is emitted as soon
+ * as every stream contributed a frame, or when max_wait has passed since the
+ * first of its frames arrived, whichever comes first.
+ *
+ * Timestamps are PTS plus the base time of the stream's pipeline, i.e. the
+ * clock time each frame was due. All pipelines use the system clock, so
+ * they compare across streams whether or not they share a pipeline.
+ *
+ * Frames are popped from the streams as they arrive and kept until a batch
+ * takes them or they fall behind the batches being emitted; slots are only
+ * filled when a batch is emitted, so growing the slots loses no frame.
+ *
+ * Streams must be opened with the callback from FrameReadyCallback() so the
+ * batcher wakes up on new frames instead of spinning.
+ */
+class FrameBatcher {
+  public:
+    using Clock = Batch::Clock;
+
+    struct Stats {
+        u64 batches = 0;
+        u64 frames = 0;
+        /**
+         * @brief Frames no batch aligned with, or beyond MAX_PENDING_FRAMES
+         */
+        u64 frames_dropped = 0;
+        double fill_ratio_sum = 0.0;
+        double added_latency_ms_sum = 0.0;
+        double added_latency_ms_max = 0.0;
+        double pts_skew_ms_max = 0.0;
+
+        double MeanFillRatio() const {
+            return batches ? fill_ratio_sum / batches : 0.0;
+        }
+
+        double MeanAddedLatencyMs() const {
+            return batches ? added_latency_ms_sum / batches : 0.0;
+        }
+    };
+
+    FrameBatcher() = delete;
+    FrameBatcher(const FrameBatcher &) = delete;
+
+    explicit FrameBatcher(
+        std::chrono::milliseconds max_wait,
+        std::chrono::milliseconds pts_tolerance =
+            std::chrono::milliseconds(DEFAULT_BATCH_PTS_TOLERANCE_MS))
+        : max_wait_(max_wait),
+          pts_tolerance_(static_cast<GstClockTime>(pts_tolerance.count()) *
+                         GST_MSECOND),
+          slot_bytes_(0) {}
+
+    /**
+     * @brief Pass as StreamOptions::on_frame_ready of every batched stream
+     */
+    std::function<void()> FrameReadyCallback() {
+        return [this]() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                frame_ready_ = true;
+            }
+            frame_ready_cv_.notify_one();
+        };
+    }
+
+    /**
+     * @brief Adds a push-mode stream. All streams must be added before the
+     * first call to Next().
+     */
+    void AddStream(StreamHandler *stream) {
+        streams_.push_back(stream);
+        pending_.emplace_back();
+        // Grown on demand if a stream renegotiates to larger frames
+        slot_bytes_ = std::max(slot_bytes_, stream->GetFrameSize());
+    }
+
+    u32 StreamCount() const { return streams_.size(); }
+
+    /**
+     * @brief Blocks until the next batch is complete or its deadline passed.
+     * Reuses the buffer of @p batch when the layout did not change.
+     * @returns false if every stream is closed and no frame is left
+     */
+    bool Next(Batch &batch) {
+        if (streams_.empty()) {
+            return false;
+        }
+        vec<vec<GstClockTime>> times(streams_.size());
+        vec<i32> chosen;
+        while (true) {
+            bool any_open = Collect();
+            for (u32 i = 0; i < streams_.size(); ++i) {
+                times[i].clear();
+                for (const Pending &pending : pending_[i]) {
+                    times[i].push_back(pending.time);
+                }
+            }
+            GstClockTime target = GST_CLOCK_TIME_NONE;
+            chosen = AlignByPts(times, pts_tolerance_, target);
+
+            u32 filled = 0;
+            bool has_deadline = false;
+            Clock::time_point first_arrival;
+            for (u32 i = 0; i < streams_.size(); ++i) {
+                if (chosen[i] < 0) {
+                    continue;
+                }
+                ++filled;
+                Clock::time_point arrival = pending_[i][chosen[i]].arrival;
+                if (!has_deadline || arrival < first_arrival) {
+                    has_deadline = true;
+                    first_arrival = arrival;
+                }
+            }
+            batch.first_arrival_ = first_arrival;
+
+            if (filled == streams_.size()) {
+                break;
+            }
+            if (!any_open) {
+                if (filled == 0) {
+                    return false;
+                }
+                break;
+            }
+            const Clock::time_point deadline = first_arrival + max_wait_;
+            if (has_deadline && Clock::now() >= deadline) {
+                break;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (has_deadline) {
+                frame_ready_cv_.wait_until(lock, deadline,
+                                           [this]() { return frame_ready_; });
+            } else {
+                // Bounded so closed streams are noticed
+                frame_ready_cv_.wait_for(lock, max_wait_,
+                                         [this]() { return frame_ready_; });
+            }
+            frame_ready_ = false;
+        }
+
+        Emit(batch, chosen);
+        batch.emitted_ = Clock::now();
+        Record(batch);
+        return true;
+    }
+
+    const Stats &GetStats() const { return stats_; }
+
+    /**
+     * @brief Picks at most one frame per stream around a common target time.
+     * @p times holds the timestamps of every stream's pending frames, oldest
+     * first. The target is the newest time every stream with frames has
+     * reached, i.e. the oldest of the streams' newest frames, so no stream
+     * waits for a time it already passed. Frames without a timestamp match
+     * any target; a stream whose newest frame has none contributes that one.
+     * @param target Set to the target time, GST_CLOCK_TIME_NONE if no stream
+     * has a timestamped frame
+     * @returns Per stream, the index of its frame closest to the target and
+     * at most @p tolerance away from it, or -1
+     */
+    static vec<i32> AlignByPts(const vec<vec<GstClockTime>> &times,
+                               GstClockTime tolerance, GstClockTime &target) {
+        target = GST_CLOCK_TIME_NONE;
+        for (const vec<GstClockTime> &stream : times) {
+            if (!stream.empty() && GST_CLOCK_TIME_IS_VALID(stream.back())) {
+                target = GST_CLOCK_TIME_IS_VALID(target)
+                             ? std::min(target, stream.back())
+                             : stream.back();
+            }
+        }
+
+        vec<i32> chosen(times.size(), -1);
+        for (size_t i = 0; i < times.size(); ++i) {
+            const vec<GstClockTime> &stream = times[i];
+            if (stream.empty()) {
+                continue;
+            }
+            if (!GST_CLOCK_TIME_IS_VALID(stream.back()) ||
+                !GST_CLOCK_TIME_IS_VALID(target)) {
+                chosen[i] = stream.size() - 1;
+                continue;
+            }
+            GstClockTime best = tolerance;
+            for (size_t f = 0; f < stream.size(); ++f) {
+                if (!GST_CLOCK_TIME_IS_VALID(stream[f])) {
+                    continue;
+                }
+                GstClockTime distance = stream[f] > target ? stream[f] - target
+                                                           : target - stream[f];
+                if (distance <= best) {
+                    best = distance;
+                    chosen[i] = f;
+                }
+            }
+        }
+        return chosen;
+    }
+
+  private:
+    struct Pending {
+        Frame frame;
+        /**
+         * @brief Clock time the frame was due, GST_CLOCK_TIME_NONE without
+         * a PTS
+         */
+        GstClockTime time;
+        Clock::time_point arrival;
+    };
+
+    std::chrono::milliseconds max_wait_;
+    GstClockTime pts_tolerance_;
+    vec<StreamHandler *> streams_;
+    vec<std::deque<Pending>> pending_;
+    size_t slot_bytes_;
+    Stats stats_;
+
+    std::mutex mutex_;
+    std::condition_variable frame_ready_cv_;
+    bool frame_ready_ = false;
+
+    /**
+     * @brief Moves the frames queued in the streams to pending_
+     * @returns Whether any stream is still open
+     */
+    bool Collect() {
+        bool any_open = false;
+        for (u32 i = 0; i < streams_.size(); ++i) {
+            StreamHandler *stream = streams_[i];
+            any_open |= stream->IsStreamOpen();
+            for (Frame frame = stream->TryPop(); frame;
+                 frame = stream->TryPop()) {
+                const GstClockTime pts = frame.Pts();
+                Pending pending;
+                pending.time = GST_CLOCK_TIME_IS_VALID(pts)
+                                   ? pts + stream->GetBaseTime()
+                                   : GST_CLOCK_TIME_NONE;
+                pending.arrival =
+                    frame.HasArrivalTime() ? frame.ArrivalTime() : Clock::now();
+                pending.frame = std::move(frame);
+                pending_[i].push_back(std::move(pending));
+                if (pending_[i].size() > MAX_PENDING_FRAMES) {
+                    pending_[i].pop_front();
+                    ++stats_.frames_dropped;
+                }
+            }
+        }
+        return any_open;
+    }
+
+    /**
+     * @brief Lays out @p batch for the chosen frames and fills it. The
+     * chosen frames and the older ones of every stream leave pending_,
+     * newer ones stay for the next batch.
+     */
+    void Emit(Batch &batch, const vec<i32> &chosen) {
+        for (u32 i = 0; i < streams_.size(); ++i) {
+            if (chosen[i] >= 0) {
+                slot_bytes_ = std::max(
+                    slot_bytes_, pending_[i][chosen[i]].frame.PackedSize());
+            }
+        }
+        const size_t stride = batch.slot_stride_;
+        batch.Reset(streams_.size(), slot_bytes_);
+        if (stride && batch.slot_stride_ != stride) {
+            WARNING << "[FrameBatcher] Growing batch slots to "
+                    << batch.slot_stride_ << " bytes";
+        }
+
+        for (u32 i = 0; i < streams_.size(); ++i) {
+            std::deque<Pending> &pending = pending_[i];
+            if (chosen[i] >= 0) {
+                Fill(batch, i, streams_[i]->GetId(), pending[chosen[i]]);
+                stats_.frames_dropped += chosen[i];
+                pending.erase(pending.begin(), pending.begin() + chosen[i] + 1);
+                continue;
+            }
+            // Frames too old for this batch cannot align with a later one
+            const GstClockTime oldest = batch.OldestTime();
+            while (!pending.empty() && GST_CLOCK_TIME_IS_VALID(oldest) &&
+                   GST_CLOCK_TIME_IS_VALID(pending.front().time) &&
+                   pending.front().time + pts_tolerance_ < oldest) {
+                pending.pop_front();
+                ++stats_.frames_dropped;
+            }
+        }
+    }
+
+    void Fill(Batch &batch, u32 index, i32 stream_id, const Pending &pending) {
+        Batch::Slot &slot = batch.slots_[index];
+        u8 *dst = batch.data_.get() + index * batch.slot_stride_;
+        if (!pending.frame.CopyTo(dst, batch.slot_stride_)) {
+            return;
+        }
+        if (!slot.filled) {
+            ++batch.filled_count_;
+        }
+        slot.stream_id = stream_id;
+        slot.filled = true;
+        slot.pts = pending.time;
+        slot.arrival = pending.arrival;
+        slot.width = pending.frame.Width();
+        slot.height = pending.frame.Height();
+    }
+
+    void Record(const Batch &batch) {
+        ++stats_.batches;
+        stats_.frames += batch.filled_count_;
+        stats_.fill_ratio_sum += batch.FillRatio();
+        double latency = batch.AddedLatencyMs();
+        stats_.added_latency_ms_sum += latency;
+        stats_.added_latency_ms_max =
+            std::max(stats_.added_latency_ms_max, latency);
+        stats_.pts_skew_ms_max =
+            std::max(stats_.pts_skew_ms_max, batch.PtsSkewMs());
+        DEBUG << "[FrameBatcher] Batch " << stats_.batches
+              << ": fill ratio = " << batch.FillRatio()
+              << ", added latency = " << latency
+              << " ms, pts skew = " << batch.PtsSkewMs() << " ms";
+    }
+};
@@ -1,11 +1,137 @@
 #pragma once
 
+#include "logging.hpp"
+#include "sampler.hpp"
 #include "types.hpp"
-#include <glog/logging.h>
-#include <nvml.h>
-#include <utility>
+#include <dlfcn.h>
+#include <string>
+
+/**
+ * @brief The subset of the NVML API the GpuSampler uses, declared here so
+ * that neither the NVML headers nor the library are needed to build; the
+ * library is loaded at runtime when present. Layouts and values match
+ * nvml.h.
+ */
+namespace nvml {
+
+using Return = int;
+constexpr Return SUCCESS = 0;
+
+struct DeviceSt;
+using Device = DeviceSt *;
+
+struct Utilization {
+    unsigned int gpu;
+    unsigned int memory;
+};
+
+struct Memory {
+    unsigned long long total;
+    unsigned long long free;
+    unsigned long long used;
+};
+
+enum ClockType : int {
+    CLOCK_GRAPHICS = 0,
+    CLOCK_SM = 1,
+    CLOCK_MEM = 2,
+    CLOCK_VIDEO = 3,
+};
+
+constexpr int TEMPERATURE_GPU = 0;
+
+/**
+ * @brief Entry points of libnvidia-ml, resolved with dlsym
+ */
+struct Library {
+    void *handle = nullptr;
+
+    Return (*Init)();
+    Return (*Shutdown)();
+    const char *(*ErrorString)(Return);
+    Return (*DeviceGetCount)(unsigned int *);
+    Return (*DeviceGetHandleByIndex)(unsigned int, Device *);
+    Return (*DeviceGetName)(Device, char *, unsigned int);
+    Return (*DeviceGetMemoryInfo)(Device, Memory *);
+    Return (*DeviceGetPowerManagementLimit)(Device, unsigned int *);
+    Return (*DeviceGetMaxClockInfo)(Device, ClockType, unsigned int *);
+    Return (*DeviceGetClockInfo)(Device, ClockType, unsigned int *);
+    Return (*DeviceGetTemperature)(Device, int, unsigned int *);
+    Return (*DeviceGetPowerUsage)(Device, unsigned int *);
+    Return (*DeviceGetUtilizationRates)(Device, Utilization *);
+    Return (*DeviceGetEncoderUtilization)(Device, unsigned int *,
+                                          unsigned int *);
+    Return (*DeviceGetDecoderUtilization)(Device, unsigned int *,
+                                          unsigned int *);
+
+    Library() = default;
+    Library(const Library &) = delete;
+
+    ~Library() {
+        if (handle) {
+            dlclose(handle);
+        }
+    }
+
+    /**
+     * @returns The library, or nullptr if it is not installed or lacks an
+     * entry point
+     */
+    static up<Library> Load() {
+        auto library = std::make_unique<Library>();
+        library->handle = dlopen("libnvidia-ml.so.1", RTLD_NOW | RTLD_LOCAL);
+        if (!library->handle) {
+            INFO << "NVML not available: " << dlerror();
+            return nullptr;
+        }
+        // nvml.h maps nvmlInit and friends to their _v2 versions
+        bool resolved =
+            library->Resolve(library->Init, "nvmlInit_v2") &&
+            library->Resolve(library->Shutdown, "nvmlShutdown") &&
+            library->Resolve(library->ErrorString, "nvmlErrorString") &&
+            library->Resolve(library->DeviceGetCount,
+                             "nvmlDeviceGetCount_v2") &&
+            library->Resolve(library->DeviceGetHandleByIndex,
+                             "nvmlDeviceGetHandleByIndex_v2") &&
+            library->Resolve(library->DeviceGetName, "nvmlDeviceGetName") &&
+            library->Resolve(library->DeviceGetMemoryInfo,
+                             "nvmlDeviceGetMemoryInfo") &&
+            library->Resolve(library->DeviceGetPowerManagementLimit,
+                             "nvmlDeviceGetPowerManagementLimit") &&
+            library->Resolve(library->DeviceGetMaxClockInfo,
+                             "nvmlDeviceGetMaxClockInfo") &&
+            library->Resolve(library->DeviceGetClockInfo,
+                             "nvmlDeviceGetClockInfo") &&
+            library->Resolve(library->DeviceGetTemperature,
+                             "nvmlDeviceGetTemperature") &&
+            library->Resolve(library->DeviceGetPowerUsage,
+                             "nvmlDeviceGetPowerUsage") &&
+            library->Resolve(library->DeviceGetUtilizationRates,
+                             "nvmlDeviceGetUtilizationRates") &&
+            library->Resolve(library->DeviceGetEncoderUtilization,
+                             "nvmlDeviceGetEncoderUtilization") &&
+            library->Resolve(library->DeviceGetDecoderUtilization,
+                             "nvmlDeviceGetDecoderUtilization");
+        return resolved ? std::move(library) : nullptr;
+    }
 
-class GpuSampler {
+  private:
+    template <typename F> bool Resolve(F &function, const char *name) {
+        function = reinterpret_cast<F>(dlsym(handle, name));
+        if (!function) {
+            ERROR << "NVML lacks " << name;
+        }
+        return function != nullptr;
+    }
+};
+
+} // namespace nvml
+
+/**
+ * @brief Utilization, clocks, power and temperature of every NVIDIA GPU,
+ * through NVML loaded at runtime
+ */
+class GpuSampler : public Sampler {
 
   public:
     struct Metric {
@@ -44,106 +170,108 @@ class GpuSampler {
         u32 mem_max_clock_;
     };
 
-    using Metrics = vec<Metric>;
+    static constexpr const char *COLUMNS[] = {
+        "util",          "mem",           "enc_util",       "dec_util",
+        "temp",          "power",         "gpu_clock",      "mem_clock",
+        "sm_clock",      "vid_clock",     "gpu_clock_util", "mem_clock_util",
+        "sm_clock_util", "vid_clock_util"};
+
+    /**
+     * @returns The sampler, or nullptr if NVML is not installed, fails to
+     * initialize or finds no GPU
+     */
+    static up<GpuSampler> Create() {
+        up<nvml::Library> nvml = nvml::Library::Load();
+        if (!nvml) {
+            return nullptr;
+        }
+        nvml::Return result = nvml->Init();
+        if (result != nvml::SUCCESS) {
+            ERROR << "Failed to initialize NVML: " << nvml->ErrorString(result);
+            return nullptr;
+        }
+        up<GpuSampler> sampler(new GpuSampler(std::move(nvml)));
+        return sampler->devices_.empty() ? nullptr : std::move(sampler);
+    }
 
-    GpuSampler() { Init(); }
     GpuSampler(const GpuSampler &) = delete;
-    GpuSampler(GpuSampler &&rhs) {
-        std::swap(device_count_, rhs.device_count_);
-        std::swap(devices_, rhs.devices_);
-        std::swap(metadata_, rhs.metadata_);
+
+    ~GpuSampler() override {
+        nvml::Return result = nvml_->Shutdown();
+        if (result != nvml::SUCCESS) {
+            ERROR << "Failed to shutdown NVML: " << nvml_->ErrorString(result);
+        }
     }
 
-    ~GpuSampler() { Shutdown(); }
+    const char *Name() const override { return "gpu"; }
 
-    u32 DeviceCount() const { return device_count_; }
+    vec<std::string> Columns() const override {
+        vec<std::string> columns;
+        for (u32 g = 0; g < DeviceCount(); ++g) {
+            for (const char *metric : COLUMNS) {
+                columns.push_back("gpu" + std::to_string(g) + "_" + metric);
+            }
+        }
+        return columns;
+    }
 
-    const Metadata &GetDeviceMetadataByIndex(u32 index) const {
-        return metadata_[index];
+    void Sample(double *row) override {
+        for (u32 i = 0; i < DeviceCount(); ++i) {
+            const Metric g = SampleDevice(i);
+            for (u32 value :
+                 {g.gpu_, g.memory_, g.encoder_utilization_,
+                  g.decoder_utilization_, g.temperature_, g.power_,
+                  g.graphics_clocks_, g.mem_clocks_, g.sm_clocks_,
+                  g.vid_clocks_, g.graphics_clock_util_, g.mem_clock_util_,
+                  g.sm_clock_util_, g.vid_clock_util_}) {
+                *row++ = value;
+            }
+        }
     }
 
-    Metrics Sample() const {
-        Metrics metrics;
-
-        for (u32 i = 0; i < device_count_; ++i) {
-            Metric metric;
-            nvmlUtilization_t utilization;
-            u32 ignore;
-
-            // Temperature & Power
-            nvmlDeviceGetTemperature(devices_[i], NVML_TEMPERATURE_GPU,
-                                     &metric.temperature_);
-            nvmlDeviceGetPowerUsage(devices_[i], &metric.power_);
-
-            // SM compute & VRAM utilization
-            nvmlDeviceGetUtilizationRates(devices_[i], &utilization);
-            metric.gpu_ = utilization.gpu;
-            metric.memory_ = utilization.memory;
-
-            // Video Encoder & Decoder utilization
-            nvmlDeviceGetEncoderUtilization(
-                devices_[i], &metric.encoder_utilization_, &ignore);
-            nvmlDeviceGetDecoderUtilization(
-                devices_[i], &metric.decoder_utilization_, &ignore);
-
-            // clock frequencies
-            nvmlDeviceGetClockInfo(devices_[i], NVML_CLOCK_GRAPHICS,
-                                   &metric.graphics_clocks_);
-            nvmlDeviceGetClockInfo(devices_[i], NVML_CLOCK_MEM,
-                                   &metric.mem_clocks_);
-            nvmlDeviceGetClockInfo(devices_[i], NVML_CLOCK_VIDEO,
-                                   &metric.vid_clocks_);
-            nvmlDeviceGetClockInfo(devices_[i], NVML_CLOCK_SM,
-                                   &metric.sm_clocks_);
-
-            // clock utilization
-            metric.sm_clock_util_ =
-                metric.sm_clocks_ / metadata_[i].sm_max_clock_;
-            metric.mem_clock_util_ =
-                metric.mem_clocks_ / metadata_[i].mem_max_clock_;
-            metric.vid_clock_util_ =
-                metric.vid_clocks_ / metadata_[i].vid_max_clock_;
-            metric.graphics_clock_util_ =
-                metric.graphics_clocks_ / metadata_[i].graphics_max_clock_;
-
-            metrics.push_back(metric);
+    void LogMetadata() const override {
+        for (u32 id = 0; id < DeviceCount(); ++id) {
+            const Metadata &meta = metadata_[id];
+            INFO << "GPU " << id << ": " << meta.name_
+                 << ", Memory: " << meta.memory_total_ << " MB"
+                 << ", Power Limit: " << meta.power_limit_ << " mW"
+                 << ", Max GPU Clock: " << meta.graphics_max_clock_ << " MHz"
+                 << ", Max SM Clock: " << meta.sm_max_clock_ << " MHz"
+                 << ", Max Video Clock: " << meta.vid_max_clock_ << " MHz"
+                 << ", Max Mem Clock: " << meta.mem_max_clock_ << " MHz";
         }
+    }
+
+    u32 DeviceCount() const { return devices_.size(); }
 
-        return metrics;
+    const Metadata &GetDeviceMetadataByIndex(u32 index) const {
+        return metadata_[index];
     }
 
   private:
-    u32 device_count_;
-    vec<nvmlDevice_t> devices_;
+    up<nvml::Library> nvml_;
+    vec<nvml::Device> devices_;
     vec<Metadata> metadata_;
 
-    void Init() {
-        nvmlReturn_t result;
-
-        // Initialize nvml
-        result = nvmlInit();
-        if (result != NVML_SUCCESS) {
-            LOG(ERROR) << "Failed to initialize NVML: "
-                       << nvmlErrorString(result) << "\n";
-            return Shutdown();
-        }
-
-        // Get GPU count
-        result = nvmlDeviceGetCount(&device_count_);
-        if (result != NVML_SUCCESS) {
-            printf("Failed to query device count: %s\n",
-                   nvmlErrorString(result));
-            return Shutdown();
+    explicit GpuSampler(up<nvml::Library> nvml) : nvml_(std::move(nvml)) {
+        unsigned int device_count = 0;
+        nvml::Return result = nvml_->DeviceGetCount(&device_count);
+        if (result != nvml::SUCCESS) {
+            ERROR << "Failed to query device count: "
+                  << nvml_->ErrorString(result);
+            return;
         }
 
         // Get handles and metadata for all devices
-        for (u32 i = 0; i < device_count_; ++i) {
-            nvmlDevice_t device;
-            result = nvmlDeviceGetHandleByIndex(i, &device);
-            if (result != NVML_SUCCESS) {
-                printf("Failed to get handle for device %i: %s\n", i,
-                       nvmlErrorString(result));
-                return Shutdown();
+        for (u32 i = 0; i < device_count; ++i) {
+            nvml::Device device;
+            result = nvml_->DeviceGetHandleByIndex(i, &device);
+            if (result != nvml::SUCCESS) {
+                ERROR << "Failed to get handle for device " << i << ": "
+                      << nvml_->ErrorString(result);
+                devices_.clear();
+                metadata_.clear();
+                return;
             }
 
             devices_.push_back(device);
@@ -151,32 +279,73 @@ class GpuSampler {
         }
     }
 
-    Metadata GetDeviceMetadata(nvmlDevice_t device) {
+    Metric SampleDevice(u32 i) const {
+        Metric metric{};
+        const nvml::Device device = devices_[i];
+        nvml::Utilization utilization{};
+        u32 ignore;
+
+        // Temperature & Power
+        nvml_->DeviceGetTemperature(device, nvml::TEMPERATURE_GPU,
+                                    &metric.temperature_);
+        nvml_->DeviceGetPowerUsage(device, &metric.power_);
+
+        // SM compute & VRAM utilization
+        nvml_->DeviceGetUtilizationRates(device, &utilization);
+        metric.gpu_ = utilization.gpu;
+        metric.memory_ = utilization.memory;
+
+        // Video Encoder & Decoder utilization
+        nvml_->DeviceGetEncoderUtilization(device, &metric.encoder_utilization_,
+                                           &ignore);
+        nvml_->DeviceGetDecoderUtilization(device, &metric.decoder_utilization_,
+                                           &ignore);
+
+        // clock frequencies
+        nvml_->DeviceGetClockInfo(device, nvml::CLOCK_GRAPHICS,
+                                  &metric.graphics_clocks_);
+        nvml_->DeviceGetClockInfo(device, nvml::CLOCK_MEM, &metric.mem_clocks_);
+        nvml_->DeviceGetClockInfo(device, nvml::CLOCK_VIDEO,
+                                  &metric.vid_clocks_);
+        nvml_->DeviceGetClockInfo(device, nvml::CLOCK_SM, &metric.sm_clocks_);
+
+        // clock utilization, in percent of the maximum clock
+        const Metadata &meta = metadata_[i];
+        metric.sm_clock_util_ = Percent(metric.sm_clocks_, meta.sm_max_clock_);
+        metric.mem_clock_util_ =
+            Percent(metric.mem_clocks_, meta.mem_max_clock_);
+        metric.vid_clock_util_ =
+            Percent(metric.vid_clocks_, meta.vid_max_clock_);
+        metric.graphics_clock_util_ =
+            Percent(metric.graphics_clocks_, meta.graphics_max_clock_);
+        return metric;
+    }
+
+    static u32 Percent(u32 value, u32 max) {
+        return max ? static_cast<u64>(value) * 100 / max : 0;
+    }
+
+    Metadata GetDeviceMetadata(nvml::Device device) const {
         Metadata meta{};
-        char name_buf[64];
-        nvmlDeviceGetName(device, name_buf, sizeof(name_buf));
+        char name_buf[64] = {};
+        nvml_->DeviceGetName(device, name_buf, sizeof(name_buf));
         meta.name_ = name_buf;
 
-        nvmlMemory_t mem;
-        nvmlDeviceGetMemoryInfo(device, &mem);
+        nvml::Memory mem{};
+        nvml_->DeviceGetMemoryInfo(device, &mem);
         meta.memory_total_ = mem.total / 1024 / 1024;
 
-        nvmlDeviceGetPowerManagementLimit(device, &meta.power_limit_);
+        nvml_->DeviceGetPowerManagementLimit(device, &meta.power_limit_);
 
-        nvmlDeviceGetMaxClockInfo(device, NVML_CLOCK_GRAPHICS,
-                                  &meta.graphics_max_clock_);
-        nvmlDeviceGetMaxClockInfo(device, NVML_CLOCK_MEM, &meta.mem_max_clock_);
-        nvmlDeviceGetMaxClockInfo(device, NVML_CLOCK_VIDEO,
-                                  &meta.vid_max_clock_);
-        nvmlDeviceGetMaxClockInfo(device, NVML_CLOCK_SM, &meta.sm_max_clock_);
+        nvml_->DeviceGetMaxClockInfo(device, nvml::CLOCK_GRAPHICS,
+                                     &meta.graphics_max_clock_);
+        nvml_->DeviceGetMaxClockInfo(device, nvml::CLOCK_MEM,
+                                     &meta.mem_max_clock_);
+        nvml_->DeviceGetMaxClockInfo(device, nvml::CLOCK_VIDEO,
+                                     &meta.vid_max_clock_);
+        nvml_->DeviceGetMaxClockInfo(device, nvml::CLOCK_SM,
+                                     &meta.sm_max_clock_);
 
         return meta;
     }
-
-    void Shutdown() {
-        nvmlReturn_t result = nvmlShutdown();
-        if (result != NVML_SUCCESS) {
-            printf("Failed to shutdown NVML: %s\n", nvmlErrorString(result));
-        }
-    }
 };
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "gst/gst.h"
+#include "gst/gstcaps.h"
+#include "gst/gststructure.h"
+#include "types.hpp"
+#include <cstring>
+
+/**
+ * @brief Minimal H.264/H.265 access unit inspection: enough to tell
+ * keyframes and non-reference pictures apart without decoding. Works on the
+ * parsed, AU-aligned buffers that reach a decoder.
+ */
+namespace h26x {
+
+enum class Codec { Unknown, H264, H265 };
+
+/**
+ * @brief How access units of a stream are laid out, from its caps
+ */
+struct StreamFormat {
+    Codec codec = Codec::Unknown;
+    /**
+     * @brief Size of the big-endian length before every NAL unit (avc/hvc1
+     * stream formats), 0 for Annex B start codes (byte-stream)
+     */
+    u32 nal_length_size = 0;
+
+    bool IsKnown() const { return codec != Codec::Unknown; }
+
+    static StreamFormat FromCaps(const GstCaps *caps) {
+        StreamFormat format;
+        if (!caps || gst_caps_get_size(caps) == 0) {
+            return format;
+        }
+        const GstStructure *structure = gst_caps_get_structure(caps, 0);
+        if (gst_structure_has_name(structure, "video/x-h264")) {
+            format.codec = Codec::H264;
+        } else if (gst_structure_has_name(structure, "video/x-h265")) {
+            format.codec = Codec::H265;
+        } else {
+            return format;
+        }
+
+        const gchar *stream_format =
+            gst_structure_get_string(structure, "stream-format");
+        if (!stream_format || strcmp(stream_format, "byte-stream") == 0) {
+            return format;
+        }
+        // avcC: lengthSizeMinusOne in byte 4, hvcC: in byte 21
+        const GValue *value = gst_structure_get_value(structure, "codec_data");
+        GstBuffer *codec_data = value ? gst_value_get_buffer(value) : nullptr;
+        const gsize offset = format.codec == Codec::H264 ? 4 : 21;
+        u8 length_size_minus_one = 3;
+        if (codec_data && gst_buffer_get_size(codec_data) > offset) {
+            gst_buffer_extract(codec_data, offset, &length_size_minus_one, 1);
+        }
+        format.nal_length_size = (length_size_minus_one & 3) + 1;
+        return format;
+    }
+};
+
+/**
+ * @brief Calls @p fn(nal, size) for every NAL unit of an access unit, @p nal
+ * pointing at the NAL header.
+ * @returns false if the length prefixes run past the end of the buffer
+ */
+template <typename Fn>
+bool ForEachNal(const u8 *data, size_t size, u32 nal_length_size, Fn &&fn) {
+    if (nal_length_size > 0) {
+        size_t pos = 0;
+        while (pos + nal_length_size <= size) {
+            size_t length = 0;
+            for (u32 i = 0; i < nal_length_size; ++i) {
+                length = (length << 8) | data[pos + i];
+            }
+            pos += nal_length_size;
+            if (length > size - pos) {
+                return false;
+            }
+            fn(data + pos, length);
+            pos += length;
+        }
+        return pos == size;
+    }
+
+    // Annex B: NAL units follow 00 00 01 (or 00 00 00 01) start codes
+    auto NextStartCode = [data, size](size_t from) {
+        for (size_t i = from; i + 3 <= size; ++i) {
+            if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+                return i;
+            }
+        }
+        return size;
+    };
+    size_t start = NextStartCode(0);
+    while (start < size) {
+        const size_t nal = start + 3;
+        size_t next = NextStartCode(nal);
+        size_t end = next;
+        // Trailing zero bytes belong to the next (4-byte) start code
+        while (end > nal && data[end - 1] == 0) {
+            --end;
+        }
+        fn(data + nal, end - nal);
+        start = next;
+    }
+    return true;
+}
+
+/**
+ * @brief What the VCL (slice) NAL units of an access unit say about the
+ * picture
+ */
+struct AccessUnitInfo {
+    bool has_vcl = false;
+    /**
+     * @brief No other picture references this one: H.264 nal_ref_idc == 0,
+     * H.265 sub-layer non-reference NAL unit types (TRAIL_N, TSA_N, ...)
+     */
+    bool non_reference = true;
+    bool idr = false;
+    /**
+     * @brief H.265 TemporalId, always 0 for H.264
+     */
+    u32 temporal_id = 0;
+};
+
+inline AccessUnitInfo Inspect(const StreamFormat &format, const u8 *data,
+                              size_t size) {
+    AccessUnitInfo info;
+    ForEachNal(data, size, format.nal_length_size,
+               [&format, &info](const u8 *nal, size_t nal_size) {
+                   if (nal_size == 0) {
+                       return;
+                   }
+                   if (format.codec == Codec::H264) {
+                       const u32 type = nal[0] & 0x1F;
+                       if (type < 1 || type > 5) {
+                           return;
+                       }
+                       info.has_vcl = true;
+                       info.non_reference &= ((nal[0] >> 5) & 3) == 0;
+                       info.idr |= type == 5;
+                   } else if (format.codec == Codec::H265 && nal_size >= 2) {
+                       const u32 type = (nal[0] >> 1) & 0x3F;
+                       if (type > 31) {
+                           return;
+                       }
+                       info.has_vcl = true;
+                       info.non_reference &= type <= 14 && type % 2 == 0;
+                       // IDR_W_RADL, IDR_N_LP
+                       info.idr |= type == 19 || type == 20;
+                       const u32 temporal_id_plus1 = nal[1] & 7;
+                       if (temporal_id_plus1 > 0) {
+                           info.temporal_id = temporal_id_plus1 - 1;
+                       }
+                   }
+               });
+    if (!info.has_vcl) {
+        info.non_reference = false;
+    }
+    return info;
+}
+
+} // namespace h26x
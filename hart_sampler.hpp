@@ -1,8 +1,9 @@
 #pragma once
 
+#include "proc_file.hpp"
 #include "types.hpp"
-#include <fstream>
-#include <sstream>
+#include <string_view>
+#include <thread>
 
 /**
  * @brief Implementation class for sampling usage of a single hardware thread
@@ -28,53 +29,78 @@ class HartSampler {
     HartSampler(const HartSampler &) = delete;
     HartSampler(HartSampler &&) = delete;
     HartSampler()
-        : cpu_count_(std::thread::hardware_concurrency()),
-          last_sample_(ReadCpuStats()) {}
+        : cpu_count_(std::thread::hardware_concurrency()), stat_("/proc/stat") {
+        ParseCpuStats(stat_.Read(), last_sample_);
+        current_ = last_sample_;
+    }
 
-    Metrics Sample() const {
-        Metrics current = ReadCpuStats();
-        vec<double> usages = ComputeCoreUsage(last_sample_, current);
-        for (size_t i = 0; i < usages.size(); ++i) {
-            current[i].usage = usages[i];
-        }
-        last_sample_ = std::move(current);
+    /**
+     * @brief Reads /proc/stat through the descriptor kept open and computes
+     * the usage of every hardware thread since the previous call. Does not
+     * allocate once the core count is known.
+     * @returns The sample, valid until the next call
+     */
+    const Metrics &Sample() const {
+        ParseCpuStats(stat_.Read(), current_);
+        ComputeCoreUsage(last_sample_, current_);
+        std::swap(last_sample_, current_);
         return last_sample_;
     }
 
     u32 CpuCount() const { return cpu_count_; }
 
-  private:
-    u32 cpu_count_;
-    mutable Metrics last_sample_;
+    u32 CoreCount() const { return last_sample_.size(); }
 
-    vec<double> ComputeCoreUsage(const vec<Metric> &a,
-                                 const vec<Metric> &b) const {
-        vec<double> usage;
-        for (size_t i = 0; i < a.size(); ++i) {
-            u64 total_diff = b[i].Total() - a[i].Total();
-            u64 active_diff = b[i].Active() - a[i].Active();
-            double percent =
-                total_diff == 0 ? 0.0 : 100.0 * active_diff / total_diff;
-            usage.push_back(percent);
+    /**
+     * @brief Parses the per-core "cpuN" lines of /proc/stat into @p cores,
+     * reusing its elements
+     */
+    static void ParseCpuStats(std::string_view text, Metrics &cores) {
+        size_t count = 0;
+        while (!text.empty()) {
+            std::string_view line = proc::NextLine(text);
+            // cpu0, cpu1... but not the aggregate "cpu " line
+            if (line.size() < 4 || line.substr(0, 3) != "cpu" ||
+                line[3] == ' ') {
+                continue;
+            }
+            if (count == cores.size()) {
+                cores.emplace_back();
+            }
+            Metric &snap = cores[count++];
+            snap.id.assign(proc::NextToken(line));
+            snap.user = proc::NextU64(line);
+            snap.nice = proc::NextU64(line);
+            snap.system = proc::NextU64(line);
+            snap.idle = proc::NextU64(line);
+            snap.iowait = proc::NextU64(line);
+            snap.irq = proc::NextU64(line);
+            snap.softirq = proc::NextU64(line);
+            snap.steal = proc::NextU64(line);
         }
-        return usage;
+        cores.resize(count);
     }
 
-    Metrics ReadCpuStats() const {
-        std::ifstream stat("/proc/stat");
-        std::string line;
-        vec<Metric> cores;
-
-        while (std::getline(stat, line)) {
-            if (line.rfind("cpu", 0) == 0 && line[3] != ' ') { // cpu0, cpu1...
-                std::istringstream ss(line);
-                Metric snap;
-                ss >> snap.id >> snap.user >> snap.nice >> snap.system >>
-                    snap.idle >> snap.iowait >> snap.irq >> snap.softirq >>
-                    snap.steal;
-                cores.push_back(snap);
+    /**
+     * @brief Sets the usage of every core of @p b, in percent, from the
+     * ticks elapsed since @p a
+     */
+    static void ComputeCoreUsage(const Metrics &a, Metrics &b) {
+        for (size_t i = 0; i < b.size(); ++i) {
+            if (i >= a.size()) {
+                b[i].usage = 0.0;
+                continue;
             }
+            u64 total_diff = b[i].Total() - a[i].Total();
+            u64 active_diff = b[i].Active() - a[i].Active();
+            b[i].usage =
+                total_diff == 0 ? 0.0 : 100.0 * active_diff / total_diff;
         }
-        return cores;
     }
+
+  private:
+    u32 cpu_count_;
+    mutable ProcFile stat_;
+    mutable Metrics last_sample_;
+    mutable Metrics current_;
 };
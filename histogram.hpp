@@ -0,0 +1,117 @@
+#pragma once
+
+#include "types.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+/**
+ * @brief Fixed-memory, log-bucketed (HDR-style) histogram of non-negative
+ * integer values, e.g. latencies in microseconds.
+ *
+ * Values below 2^SUB_BUCKET_BITS are counted exactly; every higher power of
+ * two range [2^m, 2^(m+1)) is split into 2^SUB_BUCKET_BITS linear
+ * sub-buckets, bounding the relative error to about 3%. The BUCKET_COUNT = 896
+ * counters take 7 KiB per histogram. Record() is a single relaxed atomic
+ * increment, so any number of threads may record while others read
+ * percentiles.
+ */
+class LatencyHistogram {
+  public:
+    static constexpr u32 SUB_BUCKET_BITS = 5;
+    static constexpr u32 SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+    /**
+     * @brief Values at or above 2^(MAX_EXPONENT + 1) are clamped into the
+     * last bucket (~36 minutes in microseconds)
+     */
+    static constexpr u32 MAX_EXPONENT = 31;
+    static constexpr u32 BUCKET_COUNT =
+        SUB_BUCKETS + (MAX_EXPONENT - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    LatencyHistogram() = default;
+    LatencyHistogram(const LatencyHistogram &) = delete;
+
+    void Record(u64 value) {
+        buckets_[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+
+        u64 max = max_.load(std::memory_order_relaxed);
+        while (value > max && !max_.compare_exchange_weak(
+                                  max, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    /**
+     * @brief Adds the counts of @p other, e.g. for percentiles over several
+     * streams
+     */
+    void Merge(const LatencyHistogram &other) {
+        for (u32 i = 0; i < BUCKET_COUNT; ++i) {
+            buckets_[i].fetch_add(
+                other.buckets_[i].load(std::memory_order_relaxed),
+                std::memory_order_relaxed);
+        }
+        count_.fetch_add(other.Count(), std::memory_order_relaxed);
+        u64 max = max_.load(std::memory_order_relaxed);
+        const u64 other_max = other.Max();
+        while (other_max > max &&
+               !max_.compare_exchange_weak(max, other_max,
+                                           std::memory_order_relaxed)) {
+        }
+    }
+
+    u64 Count() const { return count_.load(std::memory_order_relaxed); }
+
+    u64 Max() const { return max_.load(std::memory_order_relaxed); }
+
+    /**
+     * @param quantile In [0, 1], e.g. 0.999 for p99.9
+     * @returns The midpoint of the bucket holding the quantile, 0 if empty
+     */
+    u64 Percentile(double quantile) const {
+        u64 total = Count();
+        if (total == 0) {
+            return 0;
+        }
+        u64 target = std::max<u64>(1, std::ceil(quantile * total));
+        u64 seen = 0;
+        for (u32 i = 0; i < BUCKET_COUNT; ++i) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                return std::min(BucketMidpoint(i), Max());
+            }
+        }
+        return Max();
+    }
+
+  private:
+    arr<atm<u64>, BUCKET_COUNT> buckets_{};
+    atm<u64> count_{0};
+    atm<u64> max_{0};
+
+    static u32 BucketIndex(u64 value) {
+        if (value < SUB_BUCKETS) {
+            return value;
+        }
+        u32 exponent = 63 - __builtin_clzll(value);
+        if (exponent > MAX_EXPONENT) {
+            return BUCKET_COUNT - 1;
+        }
+        u32 shift = exponent - SUB_BUCKET_BITS;
+        u32 sub_bucket = (value >> shift) - SUB_BUCKETS;
+        return SUB_BUCKETS + (exponent - SUB_BUCKET_BITS) * SUB_BUCKETS +
+               sub_bucket;
+    }
+
+    static u64 BucketMidpoint(u32 index) {
+        if (index < SUB_BUCKETS) {
+            return index;
+        }
+        u32 group = (index - SUB_BUCKETS) / SUB_BUCKETS;
+        u32 sub_bucket = (index - SUB_BUCKETS) % SUB_BUCKETS;
+        u32 shift = group;
+        u64 lower = static_cast<u64>(SUB_BUCKETS + sub_bucket) << shift;
+        u64 width = 1ull << shift;
+        return lower + width / 2;
+    }
+};
@@ -1,10 +1,17 @@
 #include "argparse.hpp"
+#include "executor.hpp"
+#include "frame_batcher.hpp"
 #include "iostream"
 #include "logging.hpp"
+#include "multi_stream_pipeline.hpp"
 #include "resource_monitor.hpp"
 #include "stream_handler.hpp"
+#include "stream_reader.hpp"
+#include "stream_registry.hpp"
+#include "stream_watchdog.hpp"
 #include "types.hpp"
 #include "utils.hpp"
+#include <algorithm>
 #include <chrono>
 #include <cstdlib>
 #include <cxxopts.hpp>
@@ -13,55 +20,94 @@
 #include <thread>
 
 /**
- * @returns The number of frames read
+ * @brief The streams the readers opened, once each however many readers
+ * share a stream
  */
-u32 ReadNFrames(up<StreamHandler> stream_handler, u32 frame_count) {
-    u32 read_count = 0;
-    size_t width = stream_handler->GetStreamWidth(),
-           height = stream_handler->GetStreamHeight();
-
-    for (u32 i = 0; i < frame_count && stream_handler->IsStreamOpen(); ++i) {
-        vec<u8> bytes = stream_handler->PullSample();
-        if (bytes.size() == width * height * 3) {
-            ++read_count;
-        } else {
-            INFO << "Stream [" << stream_handler->GetId() << "]: Read "
-                 << bytes.size() << "/" << width * height * 3 << " bytes";
+vec<const StreamHandler *> OpenStreams(const vec<up<StreamReader>> &readers) {
+    vec<const StreamHandler *> streams;
+    for (const up<StreamReader> &reader : readers) {
+        const StreamHandler *stream_handler = reader->Handler();
+        if (stream_handler && std::find(streams.begin(), streams.end(),
+                                        stream_handler) == streams.end()) {
+            streams.push_back(stream_handler);
         }
     }
-    return read_count;
+    return streams;
 }
 
-void OpenAndReadStream(i32 id, u32 frame_count) {
-    std::string stream_uri =
-        "rtsp://127.0.0.1:" + std::to_string(8554 + id) + "/stream";
-    up<StreamHandler> stream_handler =
-        StreamHandler::OpenStream(id, stream_uri);
-    if (stream_handler == nullptr) {
-        ERROR << "Stream [" << id << "]: Failed to open stream";
-    } else {
-        INFO << "Stream [" << id << "]: Opened stream, uri = " << stream_uri
-             << ", stream size = " << stream_handler->GetStreamWidth() << "x"
-             << stream_handler->GetStreamHeight();
-
-        auto [elapsed, read_count] = utils::TimedResult(
-            ReadNFrames, std::move(stream_handler), frame_count);
-
-        double fps = read_count / elapsed;
-        INFO << "Stream [" << id << "]: Read " << read_count << "/"
-             << frame_count << " in " << elapsed << "s, FPS = " << fps;
+vec<utils::StreamLatency>
+CollectLatencies(const vec<up<StreamReader>> &readers) {
+    vec<utils::StreamLatency> latencies;
+    for (const StreamHandler *stream_handler : OpenStreams(readers)) {
+        latencies.push_back({stream_handler->GetId(),
+                             &stream_handler->InterFrameGapUs(),
+                             &stream_handler->QueueResidencyUs()});
     }
+    return latencies;
 }
 
-auto StartResourceMonitor(const ResourceMonitor &resource_monitor,
+vec<StartupTimes> CollectStartupTimes(const vec<up<StreamReader>> &readers) {
+    vec<StartupTimes> times;
+    for (const up<StreamReader> &reader : readers) {
+        times.push_back(reader->GetStartupTimes());
+    }
+    return times;
+}
+
+/**
+ * @brief Reads batches until every stream read its frames or no stream has
+ * any left, counting each batched frame to its reader
+ */
+void ReadBatches(FrameBatcher &batcher, const vec<up<StreamReader>> &readers) {
+    Batch batch;
+    bool all_done = false;
+    while (!all_done && batcher.Next(batch)) {
+        for (const Batch::Slot &slot : batch.Slots()) {
+            if (slot.filled) {
+                readers[slot.stream_id]->AddBatchedFrame();
+            }
+        }
+        all_done = std::all_of(
+            readers.begin(), readers.end(),
+            [](const up<StreamReader> &reader) { return reader->IsDone(); });
+    }
+    for (const up<StreamReader> &reader : readers) {
+        reader->StopBatching();
+    }
+}
+
+/**
+ * @brief Saves the pre-event buffer of every open stream to
+ * @p directory/pre_event_<id>.mp4 and waits until all files are written
+ */
+void SavePreEventClips(const vec<up<StreamReader>> &readers,
+                       const std::string &directory) {
+    if (directory.empty()) {
+        return;
+    }
+    vec<fut<ClipResult>> saves;
+    for (const StreamHandler *stream_handler : OpenStreams(readers)) {
+        auto done = std::make_shared<std::promise<ClipResult>>();
+        fut<ClipResult> saved = done->get_future();
+        const std::string path = directory + "/pre_event_" +
+                                 std::to_string(stream_handler->GetId()) +
+                                 ".mp4";
+        if (stream_handler->SavePreEvent(path,
+                                         [done](const ClipResult &result) {
+                                             done->set_value(result);
+                                         })) {
+            saves.push_back(std::move(saved));
+        }
+    }
+    for (fut<ClipResult> &saved : saves) {
+        saved.wait();
+    }
+}
+
+auto StartResourceMonitor(ResourceMonitor &resource_monitor,
                           const atm<bool> &stop) {
     return std::async(std::launch::async, [&stop, &resource_monitor]() {
-        // Log GPU metadata
-        for (u32 i = 0; i < resource_monitor.GpuDeviceCount(); ++i) {
-            const auto &meta = resource_monitor.GetGpuMetadata(i);
-            utils::LogGpuMetadata(i, meta);
-        }
-        resource_monitor.LogCpuRamMetadata();
+        resource_monitor.LogMetadata();
         return resource_monitor.Run(stop);
     });
 }
@@ -91,30 +137,237 @@ int main(i32 argc, char **argv) {
 
     u32 frame_count = args["frame_count"].as<u32>(),
         stream_count = args["stream_count"].as<u32>();
-    vec<fut<void>> tasks;
+    vec<fut<u32>> tasks;
     atm<bool> stop = false;
 
-    ResourceMonitor resource_monitor(2);
-    auto metrics = StartResourceMonitor(resource_monitor, stop);
+    up<MultiStreamPipeline> shared_pipeline;
+    if (args["shared_pipeline"].as<bool>()) {
+        shared_pipeline = std::make_unique<MultiStreamPipeline>();
+    }
+
+    OutputSpec output;
+    output.format = args["format"].as<std::string>();
+    output.width = args["width"].as<u32>();
+    output.height = args["height"].as<u32>();
+    output.keep_aspect = args["keep_aspect"].as<bool>();
+    if (!output.IsValid()) {
+        ERROR << "Unknown output format " << output.format;
+        return 1;
+    }
+
+    StreamOptions options;
+    options.output = output;
+    options.pre_event_bytes = args["pre_event_bytes"].as<u64>();
+    if (!ParseDecodeSkipMode(args["decode_skip"].as<std::string>(),
+                             options.decode_skip)) {
+        ERROR << "Unknown decode skip mode "
+              << args["decode_skip"].as<std::string>();
+        return 1;
+    }
+    const ThreadingOptions auto_threading =
+        ThreadingOptions::Auto(stream_count);
+    if (!ThreadingOptions::ParseCount(args["decoder_threads"].as<std::string>(),
+                                      auto_threading.decoder_threads,
+                                      options.threading.decoder_threads) ||
+        !ThreadingOptions::ParseCount(args["convert_threads"].as<std::string>(),
+                                      auto_threading.convert_threads,
+                                      options.threading.convert_threads)) {
+        ERROR << "Thread counts must be \"auto\", \"default\" or a number";
+        return 1;
+    }
+    INFO << "Element threads: decoder max-threads = "
+         << ThreadingOptions::DescribeCount(options.threading.decoder_threads)
+         << ", videoscale/videoconvert n-threads = "
+         << ThreadingOptions::DescribeCount(options.threading.convert_threads)
+         << " (auto: " << auto_threading.decoder_threads << "/"
+         << auto_threading.convert_threads << " for " << stream_count
+         << " streams on " << std::thread::hardware_concurrency()
+         << " hardware threads)";
+
+    // Declared before the readers so it outlives the streams it watches
+    up<StreamWatchdog> watchdog;
+    if (args["stall_timeout_ms"].as<u32>() > 0) {
+        WatchdogOptions watchdog_options;
+        watchdog_options.stall_timeout =
+            std::chrono::milliseconds(args["stall_timeout_ms"].as<u32>());
+        watchdog_options.max_reconnects = args["max_reconnects"].as<u32>();
+        watchdog = std::make_unique<StreamWatchdog>(watchdog_options);
+    }
 
-    // Start N concurrent streams
-    INFO << "Starting " << stream_count << " concurrent streams";
-    for (u32 id = 0; id < stream_count; ++id) {
-        fut<void> f =
-            std::async(std::launch::async, OpenAndReadStream, id, frame_count);
-        tasks.push_back(std::move(f));
+    // Declared before the readers so it outlives the streams it batches
+    up<FrameBatcher> batcher;
+    if (args["batch_max_wait_ms"].as<u32>() > 0) {
+        batcher = std::make_unique<FrameBatcher>(
+            std::chrono::milliseconds(args["batch_max_wait_ms"].as<u32>()),
+            std::chrono::milliseconds(
+                args["batch_pts_tolerance_ms"].as<u32>()));
+    }
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    // Readers of the same stream share its pipeline through the registry
+    const u32 readers_per_stream =
+        std::max(1u, args["readers_per_stream"].as<u32>());
+    if (readers_per_stream > 1 && (shared_pipeline || batcher)) {
+        ERROR << "readers_per_stream cannot be combined with shared_pipeline "
+                 "or batching";
+        return 1;
     }
+    StreamRegistry registry;
+    const u32 rtsp_port = args["rtsp_port"].as<u32>();
+    const std::string rtsp_path = args["rtsp_path"].as<std::string>();
+    const u32 mounts_per_port = std::max(1u, args["mounts_per_port"].as<u32>());
 
-    // Wait for all tasks to complete
-    for (u32 i = 0; i < stream_count; ++i) {
-        tasks[i].get();
+    WorkStealingExecutor executor(args["threads"].as<u32>());
+    const u32 shm_slots =
+        args["shm_export"].as<bool>() ? args["shm_slots"].as<u32>() : 0;
+    vec<up<StreamReader>> readers;
+    for (u32 id = 0; id < stream_count * readers_per_stream; ++id) {
+        const std::string uri = utils::StreamUri(
+            id / readers_per_stream, rtsp_port, rtsp_path, mounts_per_port);
+        readers.push_back(std::make_unique<StreamReader>(
+            id, uri, frame_count, options, executor, shm_slots));
+        if (batcher) {
+            readers.back()->BatchWith(batcher.get());
+        }
+        if (readers_per_stream > 1) {
+            readers.back()->ShareVia(&registry);
+        }
+        tasks.push_back(readers.back()->Result());
+    }
+
+    // readers is not modified while the monitor runs
+    MetricsFormat metrics_format;
+    if (!ParseMetricsFormat(args["metrics_format"].as<std::string>(),
+                            metrics_format)) {
+        ERROR << "Unknown metrics format "
+              << args["metrics_format"].as<std::string>();
+        return 1;
+    }
+    const vec<std::string> samplers = args["samplers"].as<vec<std::string>>();
+    for (const std::string &sampler : samplers) {
+        if (!ResourceMonitor::BuiltinSamplers().Has(sampler)) {
+            ERROR << "Unknown sampler " << sampler;
+            return 1;
+        }
     }
+    ResourceMonitor resource_monitor(args["refresh_rate"].as<u32>(), samplers);
+    // Samples are written while running; the sinks outlive the monitor
+    MetricsSink usage_sink(
+        MetricsPath(args["metrics_csv"].as<std::string>(), metrics_format),
+        resource_monitor.UsageColumns(), metrics_format);
+    MetricsSink stream_sink(
+        MetricsPath(args["stream_stats_csv"].as<std::string>(), metrics_format),
+        ResourceMonitor::StreamColumns(), metrics_format);
+    resource_monitor.SetSinks(&usage_sink, &stream_sink);
+    resource_monitor.SetStreamStatsProvider([&readers]() {
+        vec<StreamStats> stats;
+        for (const up<StreamReader> &reader : readers) {
+            if (reader->Handler()) {
+                stats.push_back(reader->Snapshot());
+            }
+        }
+        return stats;
+    });
+    auto metrics = StartResourceMonitor(resource_monitor, stop);
 
-    // Stop resource monitor
+    // Start all N streams at once and wait for them together, so opening
+    // takes as long as the slowest stream rather than the sum of all.
+    // Frames are processed on the executor.
+    INFO << "Starting " << stream_count << " concurrent streams"
+         << (shared_pipeline ? " in a shared pipeline" : "") << ", "
+         << readers_per_stream << " reader(s) each, on "
+         << executor.ThreadCount() << " consumer threads";
+    auto startup_begin = std::chrono::steady_clock::now();
+    for (const up<StreamReader> &reader : readers) {
+        reader->Start(shared_pipeline.get(), watchdog.get());
+    }
+    for (bool all_done = false; !all_done;) {
+        all_done = true;
+        for (const up<StreamReader> &reader : readers) {
+            all_done &= reader->Poll();
+        }
+        if (!all_done) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    utils::LogStartupSummary(
+        CollectStartupTimes(readers),
+        std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - startup_begin)
+            .count());
+    // Streams are only added to the batcher while opening
+    fut<void> batching;
+    if (batcher) {
+        batching = std::async(std::launch::async, [&batcher, &readers]() {
+            ReadBatches(*batcher, readers);
+        });
+    }
+
+    // Wait for all tasks to complete, tracking peak thread count and RSS
+    u64 peak_threads = 0, peak_rss_kib = 0, total_frames = 0;
+    const std::chrono::seconds latency_report_interval(
+        args["latency_report_interval"].as<u32>());
+    auto last_latency_report = std::chrono::steady_clock::now();
+    for (u32 i = 0; i < tasks.size(); ++i) {
+        while (tasks[i].wait_for(std::chrono::milliseconds(100)) !=
+               std::future_status::ready) {
+            peak_threads =
+                std::max(peak_threads, utils::ReadProcSelfStatus("Threads"));
+            peak_rss_kib =
+                std::max(peak_rss_kib, utils::ReadProcSelfStatus("VmRSS"));
+
+            auto now = std::chrono::steady_clock::now();
+            if (latency_report_interval.count() > 0 &&
+                now - last_latency_report >= latency_report_interval) {
+                last_latency_report = now;
+                for (const auto &latency : CollectLatencies(readers)) {
+                    utils::LogLatencyPercentiles(latency);
+                }
+            }
+        }
+        total_frames += tasks[i].get();
+    }
+    if (batching.valid()) {
+        batching.get();
+        utils::LogBatchStats(batcher->GetStats());
+    }
+    if (readers_per_stream > 1) {
+        utils::LogRegistryStats(registry.GetStats());
+    }
+
+    // Stop resource monitor before the streams it samples go away
     stop.store(true);
-    utils::SaveResourceUsageMetricsCsv(args, resource_monitor, metrics.get());
+    metrics.get();
+    usage_sink.Close();
+    stream_sink.Close();
+    utils::LogMonitorStats(resource_monitor);
+    utils::LogMetricsSink(usage_sink);
+    utils::LogMetricsSink(stream_sink);
+
+    vec<utils::StreamLatency> latencies = CollectLatencies(readers);
+    for (const auto &latency : latencies) {
+        utils::LogLatencyPercentiles(latency);
+    }
+    utils::SaveLatencyPercentilesCsv(args, latencies);
+    utils::SaveStartupTimesCsv(args, CollectStartupTimes(readers));
+    for (const StreamHandler *stream_handler : OpenStreams(readers)) {
+        StreamStats stats = stream_handler->Snapshot();
+        utils::LogDecodeStats(stats, stream_handler->GetDecodeSkipMode());
+        utils::LogRecoveryStats(stats);
+        utils::LogPreEventStats(stats);
+    }
+    SavePreEventClips(readers, args["pre_event_dir"].as<std::string>());
+    readers.clear();
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu_ms =
+        usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0 +
+        usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+    INFO << "Summary: streams = " << stream_count
+         << ", shared_pipeline = " << (shared_pipeline != nullptr)
+         << ", frames = " << total_frames << ", peak_threads = " << peak_threads
+         << ", peak_rss_kib = " << peak_rss_kib << ", cpu_ms_per_frame = "
+         << (total_frames ? cpu_ms / total_frames : 0.0);
 
     return 0;
 }
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "logging.hpp"
+#include "proc_file.hpp"
+#include "sampler.hpp"
+#include "types.hpp"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/**
+ * @brief Current memory of the process. /proc/self/statm is read on every
+ * sample; /proc/self/smaps_rollup walks every mapping, so it costs far more
+ * with a large RSS and is read at most once per SMAPS_INTERVAL, the values
+ * in between being the last ones read.
+ */
+class MemorySampler : public Sampler {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr std::chrono::milliseconds SMAPS_INTERVAL{1000};
+
+    struct Metrics {
+        /**
+         * @brief Resident set now, and the part of it not backed by files or
+         * shared memory (heap, stacks, decoder buffers)
+         */
+        u64 rss_kib = 0;
+        u64 anon_kib = 0;
+        /**
+         * @brief Proportional set size: shared pages split among the
+         * processes mapping them (smaps_rollup, 0 if unavailable)
+         */
+        u64 pss_kib = 0;
+        u64 pss_anon_kib = 0;
+        u64 swap_kib = 0;
+    };
+
+    MemorySampler(const MemorySampler &) = delete;
+    MemorySampler()
+        : page_kib_(sysconf(_SC_PAGESIZE) / 1024), statm_("/proc/self/statm"),
+          smaps_("/proc/self/smaps_rollup") {}
+
+    const char *Name() const override { return "memory"; }
+
+    vec<std::string> Columns() const override {
+        return {"rss_kib",      "anon_kib", "pss_kib",
+                "pss_anon_kib", "swap_kib", "peak_rss_kib"};
+    }
+
+    void Sample(double *row) override {
+        const Metrics &memory = Read();
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        for (u64 value : {memory.rss_kib, memory.anon_kib, memory.pss_kib,
+                          memory.pss_anon_kib, memory.swap_kib,
+                          static_cast<u64>(usage.ru_maxrss)}) {
+            *row++ = static_cast<double>(value);
+        }
+    }
+
+    /**
+     * @returns The sample, valid until the next call
+     */
+    const Metrics &Read() {
+        // size resident shared text lib data dt, in pages
+        std::string_view statm = statm_.Read();
+        proc::NextU64(statm);
+        const u64 resident = proc::NextU64(statm);
+        const u64 shared = proc::NextU64(statm);
+        last_sample_.rss_kib = resident * page_kib_;
+        last_sample_.anon_kib =
+            (resident - std::min(shared, resident)) * page_kib_;
+
+        const Clock::time_point now = Clock::now();
+        if (smaps_.IsOpen() && now - last_smaps_ >= SMAPS_INTERVAL) {
+            last_smaps_ = now;
+            std::string_view smaps = smaps_.Read();
+            last_sample_.pss_kib = proc::FindU64(smaps, "Pss");
+            last_sample_.pss_anon_kib = proc::FindU64(smaps, "Pss_Anon");
+            last_sample_.swap_kib = proc::FindU64(smaps, "Swap");
+        }
+        return last_sample_;
+    }
+
+    void LogMetadata() const override {
+        std::ifstream meminfo("/proc/meminfo");
+        std::string line;
+        while (std::getline(meminfo, line)) {
+            if (line.find("MemTotal") != std::string::npos ||
+                line.find("MemFree") != std::string::npos ||
+                line.find("MemAvailable") != std::string::npos) {
+                INFO << line;
+            }
+        }
+    }
+
+  private:
+    u64 page_kib_;
+    ProcFile statm_;
+    ProcFile smaps_;
+    Clock::time_point last_smaps_{};
+    Metrics last_sample_{};
+};
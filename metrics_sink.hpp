@@ -0,0 +1,288 @@
+#pragma once
+
+#include "logging.hpp"
+#include "spsc_ring.hpp"
+#include "types.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+constexpr u32 DEFAULT_METRICS_RING_ROWS = 4096;
+constexpr u32 DEFAULT_METRICS_FLUSH_MS = 1000;
+
+/**
+ * @brief On-disk format of a MetricsSink
+ */
+enum class MetricsFormat {
+    /**
+     * @brief One line per row, header line with the column names
+     */
+    Csv,
+    /**
+     * @brief Fixed-record binary: a header with the schema, then blocks of
+     * rows stored column by column.
+     *
+     *   char[8] "GSMETRIC", u32 version, u32 column_count,
+     *   column_count x (u16 name_length, char[name_length] name)
+     *   blocks: u32 row_count, column_count x f64[row_count]
+     *
+     * Values are little-endian. A block cut short by a crash is incomplete
+     * and is ignored by scripts/metrics_to_csv.py.
+     */
+    Binary,
+};
+
+constexpr char METRICS_BINARY_MAGIC[8] = {'G', 'S', 'M', 'E',
+                                          'T', 'R', 'I', 'C'};
+constexpr u32 METRICS_BINARY_VERSION = 1;
+
+inline bool ParseMetricsFormat(const std::string &name, MetricsFormat &format) {
+    if (name == "csv") {
+        format = MetricsFormat::Csv;
+    } else if (name == "binary") {
+        format = MetricsFormat::Binary;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @returns @p path with the extension of @p format: a binary file's ".csv"
+ * extension becomes ".bin" (".bin" is appended to any other name), so a
+ * binary file never ends up behind a csv name
+ */
+inline std::string MetricsPath(const std::string &path, MetricsFormat format) {
+    if (format != MetricsFormat::Binary) {
+        return path;
+    }
+    const std::string csv = ".csv";
+    if (path.size() >= csv.size() &&
+        path.compare(path.size() - csv.size(), csv.size(), csv) == 0) {
+        return path.substr(0, path.size() - csv.size()) + ".bin";
+    }
+    return path + ".bin";
+}
+
+/**
+ * @brief Streams rows of numbers with a fixed schema to a file. The
+ * producer (the sampling thread) fills rows in place in a fixed-size ring
+ * and never blocks, allocates or touches the file; a background thread
+ * drains the ring every flush interval and flushes the file, so memory
+ * stays bounded however long the run is and at most one interval of rows
+ * is lost on a crash. When the ring is full, new rows are dropped and
+ * counted.
+ */
+class MetricsSink {
+  public:
+    MetricsSink() = delete;
+    MetricsSink(const MetricsSink &) = delete;
+
+    MetricsSink(const std::string &path, const vec<std::string> &columns,
+                MetricsFormat format = MetricsFormat::Csv,
+                u32 ring_rows = DEFAULT_METRICS_RING_ROWS,
+                std::chrono::milliseconds flush_interval =
+                    std::chrono::milliseconds(DEFAULT_METRICS_FLUSH_MS))
+        : path_(path), columns_(columns), format_(format),
+          ring_rows_(ring_rows), flush_interval_(flush_interval),
+          rows_(static_cast<size_t>(ring_rows) * columns.size()),
+          scratch_(rows_.size()),
+          out_(path, format == MetricsFormat::Binary
+                         ? std::ios::out | std::ios::binary
+                         : std::ios::out) {
+        if (!out_) {
+            ERROR << "Unable to open " << path_;
+            return;
+        }
+        WriteHeader();
+        writer_ = std::thread([this]() { Run(); });
+        open_ = true;
+    }
+
+    ~MetricsSink() { Close(); }
+
+    bool IsOpen() const { return open_.load(std::memory_order_relaxed); }
+
+    const vec<std::string> &Columns() const { return columns_; }
+
+    /**
+     * @returns Storage for the next row (Columns().size() values), nullptr
+     * if the ring is full or the sink is closed; publish it with
+     * CommitRow(). Producer thread only.
+     */
+    double *BeginRow() {
+        const u64 head = head_.load(std::memory_order_relaxed);
+        if (!IsOpen() ||
+            head - tail_.load(std::memory_order_acquire) >= ring_rows_) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        return &rows_[(head % ring_rows_) * columns_.size()];
+    }
+
+    void CommitRow() {
+        head_.store(head_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+    }
+
+    /**
+     * @brief Writes the rows still queued and closes the file
+     */
+    void Close() {
+        open_ = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        if (writer_.joinable()) {
+            writer_.join();
+            out_.close();
+        }
+    }
+
+    u64 RowsWritten() const { return written_.load(); }
+
+    u64 RowsDropped() const { return dropped_.load(); }
+
+    /**
+     * @brief Memory held by the ring and the writer's staging buffer
+     */
+    u64 MemoryBytes() const {
+        return (rows_.size() + scratch_.size()) * sizeof(double);
+    }
+
+    const std::string &Path() const { return path_; }
+
+  private:
+    std::string path_;
+    vec<std::string> columns_;
+    MetricsFormat format_;
+    u64 ring_rows_;
+    std::chrono::milliseconds flush_interval_;
+    vec<double> rows_;
+    /**
+     * @brief Rows being written, column by column (binary only)
+     */
+    vec<double> scratch_;
+    std::ofstream out_;
+
+    alignas(CACHE_LINE_SIZE) atm<u64> head_{0};
+    alignas(CACHE_LINE_SIZE) atm<u64> tail_{0};
+    atm<u64> written_{0};
+    atm<u64> dropped_{0};
+    atm<bool> open_{false};
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::thread writer_;
+
+    void Run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait_for(lock, flush_interval_, [this]() { return stop_; });
+            const bool stopping = stop_;
+            lock.unlock();
+            Drain();
+            if (stopping) {
+                return;
+            }
+            lock.lock();
+        }
+    }
+
+    void Drain() {
+        const u64 tail = tail_.load(std::memory_order_relaxed);
+        const u64 head = head_.load(std::memory_order_acquire);
+        if (head == tail) {
+            return;
+        }
+        // The ring wraps at most once between tail and head
+        const u64 first = tail % ring_rows_;
+        const u64 count = head - tail;
+        const u64 contiguous = std::min(count, ring_rows_ - first);
+        if (format_ == MetricsFormat::Csv) {
+            WriteCsv(first, contiguous);
+            WriteCsv(0, count - contiguous);
+        } else {
+            WriteBinaryBlock(first, contiguous, count);
+        }
+        out_.flush();
+        written_.fetch_add(count, std::memory_order_relaxed);
+        tail_.store(head, std::memory_order_release);
+    }
+
+    void WriteHeader() {
+        if (format_ == MetricsFormat::Csv) {
+            for (size_t c = 0; c < columns_.size(); ++c) {
+                out_ << (c ? "," : "") << columns_[c];
+            }
+            out_ << "\n";
+        } else {
+            const u32 column_count = columns_.size();
+            out_.write(METRICS_BINARY_MAGIC, sizeof(METRICS_BINARY_MAGIC));
+            Put(METRICS_BINARY_VERSION);
+            Put(column_count);
+            for (const std::string &column : columns_) {
+                const u16 length = column.size();
+                Put(length);
+                out_.write(column.data(), length);
+            }
+        }
+        out_.flush();
+    }
+
+    void WriteCsv(u64 first, u64 count) {
+        char number[32];
+        for (u64 r = first; r < first + count; ++r) {
+            const double *row = &rows_[r * columns_.size()];
+            for (size_t c = 0; c < columns_.size(); ++c) {
+                const double value = row[c];
+                // Counters print as integers, ratios with 10 digits
+                if (value == std::floor(value) && std::fabs(value) < 9e15) {
+                    std::snprintf(number, sizeof(number), "%lld",
+                                  static_cast<long long>(value));
+                } else {
+                    std::snprintf(number, sizeof(number), "%.10g", value);
+                }
+                if (c) {
+                    out_.put(',');
+                }
+                out_ << number;
+            }
+            out_.put('\n');
+        }
+    }
+
+    /**
+     * @brief Writes @p count rows starting at ring row @p first, of which
+     * @p contiguous precede the wrap, as one column-major block
+     */
+    void WriteBinaryBlock(u64 first, u64 contiguous, u64 count) {
+        const size_t columns = columns_.size();
+        for (u64 i = 0; i < count; ++i) {
+            const u64 r = i < contiguous ? first + i : i - contiguous;
+            const double *row = &rows_[r * columns];
+            for (size_t c = 0; c < columns; ++c) {
+                scratch_[c * count + i] = row[c];
+            }
+        }
+        const u32 row_count = count;
+        Put(row_count);
+        out_.write(reinterpret_cast<const char *>(scratch_.data()),
+                   count * columns * sizeof(double));
+    }
+
+    template <typename T> void Put(T value) {
+        out_.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+};
@@ -0,0 +1,720 @@
+#include "clip_writer.hpp"
+#include "compressed_stream_handler.hpp"
+#include "frame.hpp"
+#include "gst/gst.h"
+#include "hart_sampler.hpp"
+#include "histogram.hpp"
+#include "metrics_sink.hpp"
+#include "pre_event_buffer.hpp"
+#include "shm_frame_exporter.hpp"
+#include "stream_handler.hpp"
+#include "types.hpp"
+#include "video_reference.hpp"
+#include "yuv_to_rgb.hpp"
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#include <future>
+#include <new>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <thread>
+
+namespace {
+
+/**
+ * @brief operator new calls by all threads. GLib and GStreamer allocate with
+ * g_malloc, which is not counted.
+ */
+atm<u64> allocations{0};
+
+} // namespace
+
+void *operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+
+/**
+ * @brief Reports the operator new calls made from construction to Report()
+ * as the allocs_per_iter counter
+ */
+class AllocationCounter {
+  public:
+    AllocationCounter() : start_(allocations.load()) {}
+
+    void Report(benchmark::State &state) const {
+        state.counters["allocs_per_iter"] =
+            benchmark::Counter(static_cast<double>(allocations.load() - start_),
+                               benchmark::Counter::kAvgIterations);
+    }
+
+  private:
+    u64 start_;
+};
+
+void ResolutionArgs(benchmark::internal::Benchmark *b) {
+    b->Args({1280, 720})->Args({1920, 1080})->Args({3840, 2160});
+}
+
+const char *YUV_FORMATS[] = {"NV12", "I420"};
+
+/**
+ * @brief {width, height, YUV_FORMATS index} for the videoconvert baseline
+ */
+void YuvArgs(benchmark::internal::Benchmark *b) {
+    for (i64 format = 0; format < 2; ++format) {
+        b->Args({1280, 720, format})
+            ->Args({1920, 1080, format})
+            ->Args({3840, 2160, format});
+    }
+}
+
+/**
+ * @brief YuvArgs plus the yuv::Kernel to run
+ */
+void YuvKernelArgs(benchmark::internal::Benchmark *b) {
+    for (i64 kernel : {static_cast<i64>(yuv::Kernel::Scalar),
+                       static_cast<i64>(yuv::Kernel::Sse41),
+                       static_cast<i64>(yuv::Kernel::Avx2)}) {
+        for (i64 format = 0; format < 2; ++format) {
+            b->Args({1280, 720, format, kernel})
+                ->Args({1920, 1080, format, kernel})
+                ->Args({3840, 2160, format, kernel});
+        }
+    }
+}
+
+/**
+ * @brief /proc/stat as the kernel formats it for @p cores hardware threads;
+ * @p tick advances every counter, so two calls give a usage to compute
+ */
+std::string SyntheticProcStat(u32 cores, u64 tick) {
+    std::string text = "cpu  " + std::to_string(1000000 * tick) +
+                       " 2000 500000 90000000 30000 0 7000 0 0 0\n";
+    for (u32 i = 0; i < cores; ++i) {
+        const u64 busy = (i % 7 + 1) * 1000 * tick;
+        text += "cpu" + std::to_string(i) + " " + std::to_string(busy) +
+                " 13 " + std::to_string(busy / 3) + " " +
+                std::to_string(3000000 + 800 * tick) + " 1024 0 351 0 0 0\n";
+    }
+    text += "intr 1234567890 9 0 0 0 0 0 0 0 1 0 0 0 0 0 0 0\n"
+            "ctxt 9876543210\n"
+            "btime 1700000000\n"
+            "processes 1234567\n"
+            "procs_running 3\n"
+            "procs_blocked 0\n"
+            "softirq 123456789 0 23456 0 3456 0 0 456 7890 0 12345\n";
+    return text;
+}
+
+void CoreCountArgs(benchmark::internal::Benchmark *b) {
+    b->Arg(8)->Arg(64)->Arg(256);
+}
+
+const char *METRICS_FORMATS[] = {"csv", "binary"};
+
+/**
+ * @brief Columns of a monitor row with many cores and streams
+ */
+constexpr u32 METRICS_COLUMNS = 64;
+
+/**
+ * @brief {rows written per iteration, METRICS_FORMATS index}
+ */
+void MetricsSinkArgs(benchmark::internal::Benchmark *b) {
+    for (i64 format = 0; format < 2; ++format) {
+        b->Args({256, format})->Args({4096, format});
+    }
+}
+
+constexpr u32 H264_CLIP_FRAMES = 300;
+
+/**
+ * @brief Encodes a 720p, 30 fps H.264 clip with a keyframe every second
+ * once per run, so the pipeline benchmarks read the same input a camera
+ * would send.
+ * @returns The file URI, empty if the clip could not be encoded (e.g. no
+ * x264enc)
+ */
+const std::string &H264ClipUri() {
+    static const std::string uri = []() -> std::string {
+        const std::string path = "/tmp/micro_benchmarks_720p.mkv";
+        const std::string description =
+            "videotestsrc pattern=ball num-buffers=" +
+            std::to_string(H264_CLIP_FRAMES) +
+            " ! video/x-raw,width=1280,height=720,framerate=30/1"
+            " ! x264enc key-int-max=30 bframes=0 speed-preset=ultrafast"
+            " ! h264parse ! matroskamux ! filesink location=" +
+            path;
+        GstElement *pipeline = gst_parse_launch(description.c_str(), nullptr);
+        if (!pipeline) {
+            return "";
+        }
+        gst_element_set_state(pipeline, GST_STATE_PLAYING);
+        GstBus *bus = gst_element_get_bus(pipeline);
+        GstMessage *message = gst_bus_timed_pop_filtered(
+            bus, GST_CLOCK_TIME_NONE,
+            static_cast<GstMessageType>(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+        const bool encoded =
+            message && GST_MESSAGE_TYPE(message) == GST_MESSAGE_EOS;
+        if (message) {
+            gst_message_unref(message);
+        }
+        gst_object_unref(bus);
+        gst_element_set_state(pipeline, GST_STATE_NULL);
+        gst_object_unref(pipeline);
+        return encoded ? "file://" + path : "";
+    }();
+    return uri;
+}
+
+/**
+ * @brief User plus system CPU time of the whole process (all streaming
+ * threads), in milliseconds
+ */
+double ProcessCpuMs() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0 +
+           usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+}
+
+/**
+ * @brief CPU time per source frame of every stream, and cores kept busy
+ */
+void SetPipelineCounters(benchmark::State &state, double cpu_ms, double wall_ms,
+                         u32 streams) {
+    const double source_frames =
+        static_cast<double>(state.iterations()) * streams * H264_CLIP_FRAMES;
+    state.counters["cpu_ms_per_frame"] = cpu_ms / source_frames;
+    state.counters["cpu_cores"] = wall_ms > 0 ? cpu_ms / wall_ms : 0.0;
+}
+
+/**
+ * @brief The access units of the H.264 clip as a stream hands them out,
+ * read once per run; empty if the clip could not be encoded
+ */
+const vec<GstSample *> &H264ClipAccessUnits() {
+    static const vec<GstSample *> units = []() {
+        vec<GstSample *> samples;
+        const std::string &uri = H264ClipUri();
+        if (uri.empty()) {
+            return samples;
+        }
+        CompressedStreamHandler stream(0, uri);
+        while (stream.IsStreamOpen()) {
+            AccessUnit unit = stream.PullAccessUnit();
+            if (unit) {
+                samples.push_back(gst_sample_ref(unit.Sample()));
+            }
+        }
+        return samples;
+    }();
+    return units;
+}
+
+/**
+ * @brief A PreEventBuffer of @p byte_budget fed the whole clip
+ */
+up<PreEventBuffer> FilledPreEventBuffer(u64 byte_budget) {
+    const vec<GstSample *> &units = H264ClipAccessUnits();
+    auto buffer = std::make_unique<PreEventBuffer>(byte_budget);
+    if (units.empty()) {
+        return buffer;
+    }
+    buffer->SetCaps(gst_sample_get_caps(units.front()));
+    for (GstSample *sample : units) {
+        buffer->Push(gst_sample_get_buffer(sample));
+    }
+    return buffer;
+}
+
+} // namespace
+
+/**
+ * @brief The pre-Frame PullSample path: map the buffer and copy it into a
+ * freshly allocated vector.
+ */
+static void BM_PullSampleCopy(benchmark::State &state) {
+    GstSample *sample = MakeSample("RGB", state.range(0), state.range(1));
+    GstBuffer *buffer = gst_sample_get_buffer(sample);
+    size_t size = gst_buffer_get_size(buffer);
+
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        GstMapInfo map;
+        gst_buffer_map(buffer, &map, GST_MAP_READ);
+        vec<u8> bytes;
+        bytes.assign(map.data, map.data + map.size);
+        gst_buffer_unmap(buffer, &map);
+        benchmark::DoNotOptimize(bytes.data());
+        benchmark::ClobberMemory();
+    }
+    allocations.Report(state);
+
+    state.SetBytesProcessed(state.iterations() * size);
+    state.counters["copied_bytes"] = benchmark::Counter(
+        static_cast<double>(state.iterations() * size),
+        benchmark::Counter::kIsRate, benchmark::Counter::kIs1024);
+    gst_sample_unref(sample);
+}
+BENCHMARK(BM_PullSampleCopy)->Apply(ResolutionArgs);
+
+/**
+ * @brief The Frame path: take a reference and map the buffer in place.
+ */
+static void BM_PullSampleFrame(benchmark::State &state) {
+    GstSample *sample = MakeSample("RGB", state.range(0), state.range(1));
+    size_t size = gst_buffer_get_size(gst_sample_get_buffer(sample));
+
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        Frame frame(gst_sample_ref(sample));
+        benchmark::DoNotOptimize(frame.PlaneData(0));
+        benchmark::ClobberMemory();
+    }
+    allocations.Report(state);
+
+    state.SetBytesProcessed(state.iterations() * size);
+    state.counters["copied_bytes"] = benchmark::Counter(
+        0, benchmark::Counter::kIsRate, benchmark::Counter::kIs1024);
+    gst_sample_unref(sample);
+}
+BENCHMARK(BM_PullSampleFrame)->Apply(ResolutionArgs);
+
+/**
+ * @brief HartSampler's /proc/stat parse for range(0) hardware threads,
+ * reusing the metrics of the previous sample like Sample() does
+ */
+static void BM_HartParseCpuStats(benchmark::State &state) {
+    const std::string text = SyntheticProcStat(state.range(0), 1);
+    HartSampler::Metrics cores;
+    HartSampler::ParseCpuStats(text, cores);
+
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        HartSampler::ParseCpuStats(text, cores);
+        benchmark::DoNotOptimize(cores.data());
+        benchmark::ClobberMemory();
+    }
+    allocations.Report(state);
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_HartParseCpuStats)->Apply(CoreCountArgs);
+
+/**
+ * @brief HartSampler's per-core usage between two samples of range(0)
+ * hardware threads
+ */
+static void BM_HartComputeCoreUsage(benchmark::State &state) {
+    HartSampler::Metrics previous, current;
+    HartSampler::ParseCpuStats(SyntheticProcStat(state.range(0), 1), previous);
+    HartSampler::ParseCpuStats(SyntheticProcStat(state.range(0), 2), current);
+
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        HartSampler::ComputeCoreUsage(previous, current);
+        benchmark::DoNotOptimize(current.data());
+        benchmark::ClobberMemory();
+    }
+    allocations.Report(state);
+
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    state.SetBytesProcessed(state.iterations() * 2 * state.range(0) *
+                            sizeof(HartSampler::Metric));
+}
+BENCHMARK(BM_HartComputeCoreUsage)->Apply(CoreCountArgs);
+
+/**
+ * @brief The resource metrics writer: range(0) rows of METRICS_COLUMNS
+ * values committed to a MetricsSink and written out in one drain when it
+ * closes, including opening the file and starting the writer thread.
+ */
+static void BM_MetricsSinkWrite(benchmark::State &state) {
+    const u32 rows = state.range(0);
+    MetricsFormat format;
+    ParseMetricsFormat(METRICS_FORMATS[state.range(1)], format);
+    const std::string path = "/tmp/micro_benchmarks_metrics";
+    vec<std::string> columns;
+    for (u32 c = 0; c < METRICS_COLUMNS; ++c) {
+        columns.push_back("column" + std::to_string(c));
+    }
+
+    u64 file_bytes = 0;
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        // Drained only by Close(), so the rows are written in one go
+        MetricsSink sink(path, columns, format, rows, std::chrono::hours(1));
+        for (u32 r = 0; r < rows; ++r) {
+            double *row = sink.BeginRow();
+            if (!row) {
+                break;
+            }
+            // Counters and ratios, like a monitor row
+            for (u32 c = 0; c < METRICS_COLUMNS; ++c) {
+                row[c] = c % 2 ? 1000.0 * r + c : (r % 100) / 3.0 + c;
+            }
+            sink.CommitRow();
+        }
+        sink.Close();
+        if (sink.RowsWritten() != rows) {
+            state.SkipWithError("Unable to write the metrics file");
+            return;
+        }
+        struct stat file;
+        file_bytes = stat(path.c_str(), &file) == 0 ? file.st_size : 0;
+    }
+    allocations.Report(state);
+
+    state.SetLabel(METRICS_FORMATS[state.range(1)]);
+    state.SetItemsProcessed(state.iterations() * rows);
+    state.SetBytesProcessed(state.iterations() * file_bytes);
+}
+BENCHMARK(BM_MetricsSinkWrite)->Apply(MetricsSinkArgs);
+
+/**
+ * @brief Building a stream's pipeline from its description, as
+ * StreamHandler::CreateNewPipeline does: a pipeline of its own (range(0)
+ * 0) or a branch bin for a shared pipeline (1). Elements are created but
+ * the stream is not opened.
+ */
+static void BM_PipelineConstruction(benchmark::State &state) {
+    const bool branch = state.range(0);
+    const std::string description = StreamHandler::PipelineDescription(
+        "file:///dev/null", OutputSpec(), 30, ThreadingOptions());
+
+    AllocationCounter allocations;
+    for (auto _ : state) {
+        GError *error = nullptr;
+        GstElement *pipeline =
+            branch ? gst_parse_bin_from_description(description.c_str(), FALSE,
+                                                    &error)
+                   : gst_parse_launch(description.c_str(), &error);
+        if (error || !pipeline) {
+            g_clear_error(&error);
+            state.SkipWithError("Unable to parse the pipeline description");
+            return;
+        }
+        gst_object_ref_sink(pipeline);
+        gst_object_unref(pipeline);
+    }
+    allocations.Report(state);
+
+    state.SetLabel(branch ? "branch" : "pipeline");
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PipelineConstruction)->Arg(0)->Arg(1);
+
+/**
+ * @brief Baseline for lazy conversion: what videoconvert spends per frame to
+ * turn decoder output into RGB.
+ */
+static void BM_YuvToRgbVideoconvert(benchmark::State &state) {
+    GstSample *sample =
+        MakeSample(YUV_FORMATS[state.range(2)], state.range(0), state.range(1));
+    Frame frame(sample);
+    RgbConverter converter(frame.Info());
+
+    for (auto _ : state) {
+        converter.Convert(frame);
+        benchmark::ClobberMemory();
+    }
+
+    state.SetLabel(YUV_FORMATS[state.range(2)]);
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * converter.out_info.size);
+}
+BENCHMARK(BM_YuvToRgbVideoconvert)->Apply(YuvArgs);
+
+/**
+ * @brief Frame::ToRgb with one of the yuv kernels. The YuvToRgb unit tests
+ * check the output against videoconvert's.
+ */
+static void BM_YuvToRgbKernel(benchmark::State &state) {
+    const auto kernel = static_cast<yuv::Kernel>(state.range(3));
+    if (!yuv::IsSupported(kernel)) {
+        state.SkipWithError("Kernel not supported on this CPU");
+        return;
+    }
+    GstSample *sample =
+        MakeSample(YUV_FORMATS[state.range(2)], state.range(0), state.range(1));
+    Frame frame(sample);
+
+    const u32 stride = 3 * frame.Width();
+    vec<u8> rgb(static_cast<size_t>(stride) * frame.Height());
+    for (auto _ : state) {
+        frame.ToRgb(rgb.data(), stride, kernel);
+        benchmark::DoNotOptimize(rgb.data());
+        benchmark::ClobberMemory();
+    }
+
+    state.SetLabel(std::string(YUV_FORMATS[state.range(2)]) + "/" +
+                   yuv::KernelName(kernel));
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * rgb.size());
+}
+BENCHMARK(BM_YuvToRgbKernel)->Apply(YuvKernelArgs);
+
+/**
+ * @brief Baseline for compressed passthrough: range(0) StreamHandlers
+ * decoding and converting every frame of the clip to RGB, as fast as they
+ * can.
+ */
+static void BM_StreamAlwaysDecode(benchmark::State &state) {
+    const std::string &uri = H264ClipUri();
+    if (uri.empty()) {
+        state.SkipWithError("Unable to encode the H.264 clip");
+        return;
+    }
+    const u32 streams = state.range(0);
+    StreamOptions options;
+    options.fps_limit = 1000;
+    options.decode_skip = DecodeSkipMode::None;
+
+    double cpu_ms = 0, wall_ms = 0;
+    for (auto _ : state) {
+        const double cpu_start = ProcessCpuMs();
+        const auto start = std::chrono::steady_clock::now();
+        vec<up<StreamHandler>> handlers;
+        for (u32 id = 0; id < streams; ++id) {
+            handlers.push_back(
+                std::make_unique<StreamHandler>(id, uri, options));
+        }
+        for (bool open = true; open;) {
+            open = false;
+            for (const up<StreamHandler> &handler : handlers) {
+                if (handler->IsStreamOpen()) {
+                    open = true;
+                    Frame frame =
+                        handler->PullSample(std::chrono::milliseconds(10));
+                    benchmark::DoNotOptimize(frame.PlaneData(0));
+                }
+            }
+        }
+        handlers.clear();
+        wall_ms += std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+        cpu_ms += ProcessCpuMs() - cpu_start;
+    }
+    SetPipelineCounters(state, cpu_ms, wall_ms, streams);
+}
+BENCHMARK(BM_StreamAlwaysDecode)
+    ->Arg(24)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+/**
+ * @brief range(0) CompressedStreamHandlers handing out access units, of
+ * which the first range(1) have a decoder attached producing RGB frames.
+ */
+static void BM_StreamCompressed(benchmark::State &state) {
+    const std::string &uri = H264ClipUri();
+    if (uri.empty()) {
+        state.SkipWithError("Unable to encode the H.264 clip");
+        return;
+    }
+    const u32 streams = state.range(0);
+    const u32 decoding = state.range(1);
+    OutputSpec output;
+
+    double cpu_ms = 0, wall_ms = 0;
+    for (auto _ : state) {
+        const double cpu_start = ProcessCpuMs();
+        const auto start = std::chrono::steady_clock::now();
+        vec<up<CompressedStreamHandler>> handlers;
+        for (u32 id = 0; id < streams; ++id) {
+            handlers.push_back(
+                std::make_unique<CompressedStreamHandler>(id, uri));
+            if (id < decoding) {
+                handlers.back()->AttachDecoder(output);
+            }
+        }
+        for (bool open = true; open;) {
+            open = false;
+            for (const up<CompressedStreamHandler> &handler : handlers) {
+                if (!handler->IsStreamOpen()) {
+                    continue;
+                }
+                open = true;
+                if (handler->HasDecoder()) {
+                    Frame frame =
+                        handler->PullFrame(std::chrono::milliseconds(10));
+                    benchmark::DoNotOptimize(frame.PlaneData(0));
+                } else {
+                    AccessUnit unit =
+                        handler->PullAccessUnit(std::chrono::milliseconds(10));
+                    benchmark::DoNotOptimize(unit.Data());
+                }
+            }
+        }
+        handlers.clear();
+        wall_ms += std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+        cpu_ms += ProcessCpuMs() - cpu_start;
+    }
+    state.SetLabel(std::to_string(decoding) + "/" + std::to_string(streams) +
+                   " decoding");
+    SetPipelineCounters(state, cpu_ms, wall_ms, streams);
+}
+BENCHMARK(BM_StreamCompressed)
+    ->Args({24, 0})
+    ->Args({24, 3})
+    ->Args({24, 24})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+/**
+ * @brief Live-path cost of the pre-event buffer: one Push() per access unit
+ * on the streaming thread, with range(0) MiB of budget so GOPs are evicted
+ * continuously.
+ */
+static void BM_PreEventPush(benchmark::State &state) {
+    const vec<GstSample *> &units = H264ClipAccessUnits();
+    if (units.empty()) {
+        state.SkipWithError("Unable to encode the H.264 clip");
+        return;
+    }
+    PreEventBuffer buffer(static_cast<u64>(state.range(0)) << 20);
+    buffer.SetCaps(gst_sample_get_caps(units.front()));
+
+    size_t i = 0;
+    for (auto _ : state) {
+        buffer.Push(gst_sample_get_buffer(units[i]));
+        i = i + 1 < units.size() ? i + 1 : 0;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+    state.counters["bytes_per_stream"] = buffer.Bytes();
+}
+BENCHMARK(BM_PreEventPush)->Arg(1)->Arg(4)->Arg(16);
+
+/**
+ * @brief Saving a pre-event buffer of range(0) MiB holding the clip: time
+ * from the trigger to the MP4 being complete on the ClipWriter thread, and
+ * the memory kept per stream compared with the same frames as RGB.
+ */
+static void BM_PreEventFlush(benchmark::State &state) {
+    up<PreEventBuffer> buffer =
+        FilledPreEventBuffer(static_cast<u64>(state.range(0)) << 20);
+    if (buffer->GopCount() == 0) {
+        state.SkipWithError("Unable to encode the H.264 clip");
+        return;
+    }
+    const std::string path = "/tmp/micro_benchmarks_pre_event.mp4";
+
+    ClipResult result;
+    for (auto _ : state) {
+        std::promise<ClipResult> done;
+        buffer->Save(
+            path, [&done](const ClipResult &saved) { done.set_value(saved); });
+        result = done.get_future().get();
+        if (!result.ok) {
+            state.SkipWithError("Unable to write the MP4 file");
+            return;
+        }
+    }
+
+    state.counters["bytes_per_stream"] = buffer->Bytes();
+    state.counters["video_ms"] = buffer->DurationMs();
+    state.counters["rgb_bytes_same_frames"] =
+        static_cast<double>(result.buffers) * 1280 * 720 * 3;
+    state.counters["flush_ms"] = result.flush_ms;
+}
+BENCHMARK(BM_PreEventFlush)
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(16)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+/**
+ * @brief Shared-memory export of range(0)xrange(1) NV12 frames: one writer
+ * publishing as fast as it can, SHM_READERS reader threads each mapping the
+ * ring by name like a separate process would, reading in place. Reports
+ * reads and frames lost per reader and the publish-to-read latency.
+ */
+static void BM_ShmRing(benchmark::State &state) {
+    constexpr u32 SHM_READERS = 4;
+    const std::string name = "/micro_benchmarks_shm_ring";
+    Frame frame(MakeSample("NV12", state.range(0), state.range(1)));
+    ShmFrameExporter exporter(name);
+    // Creates the ring
+    exporter.Export(frame);
+
+    LatencyHistogram latency_ns;
+    atm<bool> stop(false);
+    atm<u64> reads(0), lost(0), torn(0);
+    vec<std::thread> readers;
+    for (u32 r = 0; r < SHM_READERS; ++r) {
+        readers.emplace_back([&]() {
+            up<shm::Reader> reader = shm::Reader::Open(name);
+            if (!reader) {
+                return;
+            }
+            u64 read = 0, checksum = 0;
+            shm::FrameView view;
+            while (!stop.load(std::memory_order_relaxed)) {
+                if (!reader->TryNext(view)) {
+                    continue;
+                }
+                latency_ns.Record(shm::MonotonicNs() - view.publish_ns);
+                for (u32 p = 0; p < view.plane_count; ++p) {
+                    checksum += view.data[p][0];
+                }
+                if (reader->IsValid(view)) {
+                    ++read;
+                } else {
+                    torn.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            benchmark::DoNotOptimize(checksum);
+            reads.fetch_add(read, std::memory_order_relaxed);
+            lost.fetch_add(reader->Lost(), std::memory_order_relaxed);
+        });
+    }
+
+    for (auto _ : state) {
+        exporter.Export(frame);
+    }
+    stop = true;
+    for (std::thread &reader : readers) {
+        reader.join();
+    }
+
+    const size_t size = frame.Size();
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * size);
+    const double published = static_cast<double>(exporter.Published());
+    state.counters["read_ratio"] = reads / (published * SHM_READERS);
+    state.counters["lost_per_reader"] = static_cast<double>(lost) / SHM_READERS;
+    state.counters["torn"] = torn.load();
+    state.counters["p50_us"] = latency_ns.Percentile(0.5) / 1e3;
+    state.counters["p99_us"] = latency_ns.Percentile(0.99) / 1e3;
+}
+BENCHMARK(BM_ShmRing)->Apply(ResolutionArgs)->UseRealTime();
+
+int main(int argc, char **argv) {
+    gst_init(&argc, &argv);
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
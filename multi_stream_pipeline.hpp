@@ -0,0 +1,219 @@
+#pragma once
+
+#include "gst/gst.h"
+#include "gst/gstbus.h"
+#include "gst/gstmessage.h"
+#include "gst/gstpipeline.h"
+#include "logging.hpp"
+#include "stream_handler.hpp"
+#include "stream_threads.hpp"
+#include "types.hpp"
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * @brief A single GstPipeline hosting one uridecodebin -> videoconvert ->
+ * appsink branch per stream, with one clock and one bus watch for all of
+ * them. Each branch is handed out as a regular StreamHandler.
+ *
+ * The MultiStreamPipeline must outlive every StreamHandler it created.
+ */
+class MultiStreamPipeline {
+  public:
+    MultiStreamPipeline(const MultiStreamPipeline &) = delete;
+    MultiStreamPipeline(MultiStreamPipeline &&) = delete;
+
+    MultiStreamPipeline()
+        : pipeline_(nullptr), context_(nullptr), loop_(nullptr) {
+        if (!StreamHandler::InitGStreamer()) {
+            return;
+        }
+
+        pipeline_ = gst_pipeline_new("multi-stream");
+        if (!pipeline_) {
+            ERROR << "Unable to create shared gstreamer pipeline";
+            return;
+        }
+
+        // Bus messages of all branches are dispatched on one thread
+        context_ = g_main_context_new();
+        loop_ = g_main_loop_new(context_, FALSE);
+        GstBus *bus = gst_element_get_bus(pipeline_);
+        GSource *watch = gst_bus_create_watch(bus);
+        g_source_set_callback(watch, G_SOURCE_FUNC(OnBusMessage), this,
+                              nullptr);
+        g_source_attach(watch, context_);
+        g_source_unref(watch);
+        // Streaming threads are named on the thread posting stream-status
+        gst_bus_set_sync_handler(bus, &MultiStreamPipeline::OnSyncMessage,
+                                 nullptr, nullptr);
+        gst_object_unref(bus);
+        bus_thread_ = std::thread([this]() { g_main_loop_run(loop_); });
+
+        if (gst_element_set_state(pipeline_, GST_STATE_PLAYING) ==
+            GST_STATE_CHANGE_FAILURE) {
+            ERROR << "Unable to start the shared pipeline";
+        }
+    }
+
+    ~MultiStreamPipeline() {
+        if (pipeline_) {
+            gst_element_set_state(pipeline_, GST_STATE_NULL);
+            gst_element_get_state(pipeline_, NULL, NULL, GST_CLOCK_TIME_NONE);
+        }
+        if (loop_) {
+            g_main_loop_quit(loop_);
+        }
+        if (bus_thread_.joinable()) {
+            bus_thread_.join();
+        }
+        if (loop_) {
+            g_main_loop_unref(loop_);
+        }
+        if (context_) {
+            g_main_context_unref(context_);
+        }
+        if (pipeline_) {
+            gst_object_unref(pipeline_);
+        }
+    }
+
+    bool IsValid() const { return pipeline_ != nullptr; }
+
+    u32 StreamCount() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return streams_.size();
+    }
+
+    /**
+     * @brief Adds a branch for @p uri to the shared pipeline without waiting
+     * for it to become ready (see StreamHandler::WaitUntilReady).
+     * @returns The stream handler, or nullptr if the pipeline is invalid
+     */
+    up<StreamHandler> StartStream(i32 id, const std::string &uri,
+                                  const StreamOptions &options = {}) {
+        if (!IsValid()) {
+            return nullptr;
+        }
+        auto stream_handler =
+            std::make_unique<StreamHandler>(id, uri, options, pipeline_);
+        Attach(stream_handler.get());
+        return stream_handler;
+    }
+
+    /**
+     * @brief Adds a branch for @p uri to the shared pipeline and waits until
+     * it is ready, retrying up to @p retry_count times like
+     * StreamHandler::OpenStream.
+     * @returns The stream handler, or nullptr if the stream could not be
+     * opened
+     */
+    up<StreamHandler> OpenStream(i32 id, const std::string &uri,
+                                 u32 retry_count = DEFAULT_OPEN_RETRY_COUNT,
+                                 const StreamOptions &options = {}) {
+        for (u32 i = 0; i < retry_count; ++i) {
+            up<StreamHandler> stream_handler = StartStream(id, uri, options);
+            if (!stream_handler) {
+                return nullptr;
+            }
+            if (stream_handler->WaitUntilReady(
+                    std::chrono::seconds(INITIALIZATION_TIMEOUT_SECONDS))) {
+                return stream_handler;
+            }
+            stream_handler->LogStartupFailure();
+        }
+        return nullptr;
+    }
+
+  private:
+    GstElement *pipeline_;
+    GMainContext *context_;
+    GMainLoop *loop_;
+    std::thread bus_thread_;
+
+    /**
+     * @brief Guards streams_ and serializes bus handling against streams
+     * being torn down
+     */
+    mutable std::mutex mutex_;
+    vec<StreamHandler *> streams_;
+
+    void Attach(StreamHandler *stream) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        streams_.push_back(stream);
+        stream->on_detach_.push_back([this, stream]() { Detach(stream); });
+    }
+
+    void Detach(StreamHandler *stream) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        streams_.erase(std::remove(streams_.begin(), streams_.end(), stream),
+                       streams_.end());
+    }
+
+    /**
+     * @returns The stream whose branch contains @p object, nullptr if none.
+     * Caller must hold mutex_.
+     */
+    StreamHandler *FindOwner(GstObject *object) const {
+        for (StreamHandler *stream : streams_) {
+            if (object == GST_OBJECT(stream->pipeline_) ||
+                gst_object_has_as_ancestor(object,
+                                           GST_OBJECT(stream->pipeline_))) {
+                return stream;
+            }
+        }
+        return nullptr;
+    }
+
+    static GstBusSyncReply OnSyncMessage(GstBus *, GstMessage *message,
+                                         gpointer) {
+        stream_threads::OnStreamStatus(message);
+        return GST_BUS_PASS;
+    }
+
+    static gboolean OnBusMessage(GstBus *, GstMessage *message,
+                                 gpointer user_data) {
+        auto *self = static_cast<MultiStreamPipeline *>(user_data);
+
+        switch (GST_MESSAGE_TYPE(message)) {
+        case GST_MESSAGE_ERROR: {
+            GError *error = nullptr;
+            gchar *debug = nullptr;
+            gst_message_parse_error(message, &error, &debug);
+
+            std::lock_guard<std::mutex> lock(self->mutex_);
+            StreamHandler *stream = self->FindOwner(GST_MESSAGE_SRC(message));
+            if (stream) {
+                // Stop only the failing branch before reporting the error: a
+                // StreamWatchdog restarts it, otherwise the stream is closed,
+                // which also wakes up a consumer blocked in PullSample or
+                // WaitUntilReady.
+                gst_element_set_locked_state(stream->pipeline_, TRUE);
+                gst_element_set_state(stream->pipeline_, GST_STATE_NULL);
+                stream->OnError(error->message);
+            } else {
+                ERROR << "[MultiStreamPipeline] " << error->message;
+            }
+
+            g_clear_error(&error);
+            g_free(debug);
+            break;
+        }
+        case GST_MESSAGE_WARNING: {
+            GError *error = nullptr;
+            gchar *debug = nullptr;
+            gst_message_parse_warning(message, &error, &debug);
+            WARNING << "[MultiStreamPipeline] " << error->message;
+            g_clear_error(&error);
+            g_free(debug);
+            break;
+        }
+        default:
+            break;
+        }
+        return TRUE;
+    }
+};
@@ -0,0 +1,245 @@
+#pragma once
+
+#include "access_unit.hpp"
+#include "frame.hpp"
+#include "gst/app/gstappsink.h"
+#include "gst/app/gstappsrc.h"
+#include "gst/gst.h"
+#include "gst/gstbus.h"
+#include "gst/gstmessage.h"
+#include "gst/gstparse.h"
+#include "logging.hpp"
+#include "stream_handler.hpp"
+#include "stream_stats.hpp"
+#include "types.hpp"
+#include <chrono>
+#include <string>
+
+/**
+ * @brief Caps of the access units a CompressedStreamHandler hands out and an
+ * OnDemandDecoder accepts
+ */
+constexpr const char *H264_AU_CAPS =
+    "video/x-h264,stream-format=byte-stream,alignment=au";
+constexpr const char *ON_DEMAND_DECODER = "avdec_h264";
+/**
+ * @brief Compressed bytes an OnDemandDecoder queues in front of the decoder
+ * before Decode() blocks, several seconds of a typical 1080p stream
+ */
+constexpr u64 ON_DEMAND_MAX_QUEUED_BYTES = 2 * 1024 * 1024;
+
+/**
+ * @brief Decodes access units of one CompressedStreamHandler into Frames in a
+ * small pipeline of its own (appsrc ! decoder ! scale ! convert ! appsink),
+ * so decoding can be switched on and off while the stream keeps running.
+ *
+ * The decoder only starts at an IDR picture: units before the first one (or
+ * before the next one after Resync()) are skipped, so it never outputs
+ * pictures with missing references. Buffers are pushed by reference, the
+ * bitstream is not copied. Once ON_DEMAND_MAX_QUEUED_BYTES are waiting for
+ * the decoder, Decode() blocks until it catches up: units are never dropped
+ * here, as the ones that follow may reference them.
+ *
+ * Not thread-safe; Decode(), Resync() and TryPullFrame() must be called from
+ * the same consumer thread.
+ */
+class OnDemandDecoder {
+  public:
+    OnDemandDecoder() = delete;
+    OnDemandDecoder(const OnDemandDecoder &) = delete;
+
+    OnDemandDecoder(int id, const OutputSpec &output,
+                    const ThreadingOptions &threading = {})
+        : id_(id), is_open_(true) {
+        if (!StreamHandler::InitGStreamer()) {
+            is_open_ = false;
+            return;
+        }
+        CreatePipeline(output, threading);
+        if (!pipeline_) {
+            is_open_ = false;
+            return;
+        }
+        GstBus *bus = gst_element_get_bus(pipeline_);
+        gst_bus_set_sync_handler(bus, &OnDemandDecoder::OnBusMessage, this,
+                                 nullptr);
+        gst_object_unref(bus);
+        if (gst_element_set_state(pipeline_, GST_STATE_PLAYING) ==
+            GST_STATE_CHANGE_FAILURE) {
+            ERROR << "Stream [" << id_ << "]: Unable to start the decoder";
+            is_open_ = false;
+        }
+    }
+
+    ~OnDemandDecoder() {
+        if (pipeline_) {
+            gst_element_set_state(pipeline_, GST_STATE_NULL);
+            gst_element_get_state(pipeline_, NULL, NULL, GST_CLOCK_TIME_NONE);
+            gst_object_unref(pipeline_);
+            pipeline_ = nullptr;
+        }
+        if (appsrc_) {
+            gst_object_unref(appsrc_);
+            appsrc_ = nullptr;
+        }
+        if (appsink_) {
+            gst_object_unref(appsink_);
+            appsink_ = nullptr;
+        }
+    }
+
+    bool IsOpen() const { return is_open_; }
+
+    /**
+     * @brief Whether the decoder has started, i.e. got an IDR picture since
+     * it was created or last resynced
+     */
+    bool IsSynced() const { return synced_; }
+
+    /**
+     * @brief Call after units were lost upstream: everything up to the next
+     * IDR picture is skipped again, as later pictures may reference lost ones
+     */
+    void Resync() { synced_ = false; }
+
+    /**
+     * @brief Feeds @p unit to the decoder, or skips it while waiting for an
+     * IDR picture. Blocks while the decoder's input queue is full.
+     * @returns Whether the unit was passed on to the decoder
+     */
+    bool Decode(const AccessUnit &unit) {
+        if (!is_open_ || !unit) {
+            return false;
+        }
+        if (!synced_) {
+            if (!unit.IsIdr()) {
+                units_skipped_.Add();
+                return false;
+            }
+            synced_ = true;
+            DEBUG << "Stream [" << id_ << "]: Decoder starts at IDR, "
+                  << units_skipped_.Load() << " unit(s) skipped so far";
+        }
+        // push_buffer takes the reference
+        if (gst_app_src_push_buffer(GST_APP_SRC(appsrc_),
+                                    gst_buffer_ref(unit.Buffer())) !=
+            GST_FLOW_OK) {
+            is_open_ = false;
+            return false;
+        }
+        units_decoded_.Add();
+        return true;
+    }
+
+    /**
+     * @brief Waits up to @p timeout for the next decoded frame; invalid if
+     * none is ready
+     */
+    Frame TryPullFrame(
+        std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+        if (!appsink_) {
+            return Frame();
+        }
+        GstSample *sample = gst_app_sink_try_pull_sample(
+            GST_APP_SINK(appsink_),
+            std::chrono::duration_cast<std::chrono::nanoseconds>(timeout)
+                .count());
+        if (!sample) {
+            return Frame();
+        }
+        frames_decoded_.Add();
+        return Frame(sample);
+    }
+
+    /**
+     * @brief Units passed on to the decoder
+     */
+    u64 UnitsDecoded() const { return units_decoded_.Load(); }
+
+    /**
+     * @brief Units skipped while waiting for an IDR picture
+     */
+    u64 UnitsSkipped() const { return units_skipped_.Load(); }
+
+    /**
+     * @brief Frames pulled out of the decoder
+     */
+    u64 FramesDecoded() const { return frames_decoded_.Load(); }
+
+  private:
+    int id_;
+    atm<bool> is_open_;
+    bool synced_ = false;
+
+    GstElement *pipeline_ = nullptr;
+    GstElement *appsrc_ = nullptr;
+    GstElement *appsink_ = nullptr;
+
+    PaddedCounter units_decoded_;
+    PaddedCounter units_skipped_;
+    PaddedCounter frames_decoded_;
+
+    void CreatePipeline(const OutputSpec &output,
+                        const ThreadingOptions &threading) {
+        const std::string decoder_threads =
+            threading.decoder_threads == ThreadingOptions::ELEMENT_DEFAULT
+                ? ""
+                : " max-threads=" + std::to_string(threading.decoder_threads);
+        const std::string convert_threads =
+            threading.convert_threads == ThreadingOptions::ELEMENT_DEFAULT
+                ? ""
+                : " n-threads=" + std::to_string(threading.convert_threads);
+        // Frames not pulled in time are dropped at the appsink rather than
+        // stalling the decoder
+        const std::string pipeline_description =
+            std::string("appsrc name=src is-live=true format=time block=true "
+                        "max-bytes=") +
+            std::to_string(ON_DEMAND_MAX_QUEUED_BYTES) + " caps=\"" +
+            H264_AU_CAPS + "\" ! " + ON_DEMAND_DECODER + decoder_threads +
+            " ! videoscale add-borders=" +
+            (output.keep_aspect ? "true" : "false") + convert_threads +
+            " ! videoconvert" + convert_threads +
+            " ! appsink sync=false name=sink max-buffers=3 drop=true caps=\"" +
+            output.ToCaps() + "\"";
+
+        GError *error = nullptr;
+        pipeline_ = gst_parse_launch(pipeline_description.c_str(), &error);
+        if (error) {
+            ERROR << "Stream [" << id_ << "]: " << error->message;
+            g_clear_error(&error);
+        }
+        if (!pipeline_) {
+            ERROR << "Stream [" << id_ << "]: Unable to create the decoder";
+            return;
+        }
+        appsrc_ = gst_bin_get_by_name(GST_BIN(pipeline_), "src");
+        appsink_ = gst_bin_get_by_name(GST_BIN(pipeline_), "sink");
+        if (!appsrc_ || !appsink_) {
+            ERROR << "Stream [" << id_ << "]: Unable to get the decoder's "
+                  << "app source or sink";
+            g_clear_object(&appsrc_);
+            g_clear_object(&appsink_);
+            gst_object_unref(pipeline_);
+            pipeline_ = nullptr;
+        }
+    }
+
+    static GstBusSyncReply OnBusMessage(GstBus *, GstMessage *message,
+                                        gpointer user_data) {
+        auto *self = static_cast<OnDemandDecoder *>(user_data);
+        if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR) {
+            GError *error = nullptr;
+            gchar *debug = nullptr;
+            gst_message_parse_error(message, &error, &debug);
+            ERROR << "Stream [" << self->id_ << "]: Decoder: " << error->message
+                  << " -- Closing the decoder";
+            self->is_open_ = false;
+            // The decoder stopped consuming: unblock a Decode() waiting for
+            // room in the appsrc queue
+            gst_element_send_event(self->appsrc_, gst_event_new_flush_start());
+            g_clear_error(&error);
+            g_free(debug);
+        }
+        return GST_BUS_DROP;
+    }
+};
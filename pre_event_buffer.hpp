@@ -0,0 +1,253 @@
+#pragma once
+
+#include "clip_writer.hpp"
+#include "gst/gst.h"
+#include "gst/gstbuffer.h"
+#include "gst/gstcaps.h"
+#include "gst/gstevent.h"
+#include "gst/gstpad.h"
+#include "types.hpp"
+#include <algorithm>
+#include <deque>
+#include <mutex>
+
+/**
+ * @brief Keeps the most recent encoded video of a stream in memory, within
+ * a fixed byte budget, so the seconds before an event can be saved after it
+ * happened. Buffers are kept as references to the parser's output (nothing
+ * is copied) and grouped by GOP: only whole GOPs are evicted, so whatever is
+ * kept always starts at a keyframe and can be muxed without re-encoding.
+ *
+ * Installed as a probe on the video decoder's sink pad. Push() runs on the
+ * streaming thread and only holds the lock to append a reference.
+ */
+class PreEventBuffer {
+  public:
+    PreEventBuffer() = delete;
+    PreEventBuffer(const PreEventBuffer &) = delete;
+
+    explicit PreEventBuffer(u64 byte_budget) : byte_budget_(byte_budget) {}
+
+    ~PreEventBuffer() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Clear();
+        if (caps_) {
+            gst_caps_unref(caps_);
+        }
+    }
+
+    /**
+     * @brief Starts recording the input of @p decoder. A new decoder means a
+     * new stream (e.g. after a restart), so what was kept is dropped.
+     */
+    void Attach(GstElement *decoder) {
+        GstPad *pad = gst_element_get_static_pad(decoder, "sink");
+        if (!pad) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Clear();
+        }
+        gst_pad_add_probe(
+            pad,
+            static_cast<GstPadProbeType>(GST_PAD_PROBE_TYPE_BUFFER |
+                                         GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM),
+            &PreEventBuffer::OnProbe, this, nullptr);
+        gst_object_unref(pad);
+    }
+
+    /**
+     * @brief Sets the caps of the buffers that follow; kept GOPs in other
+     * caps cannot be muxed with them and are dropped
+     */
+    void SetCaps(GstCaps *caps) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (caps_ && caps && gst_caps_is_equal(caps_, caps)) {
+            return;
+        }
+        Clear();
+        if (caps_) {
+            gst_caps_unref(caps_);
+        }
+        caps_ = caps ? gst_caps_ref(caps) : nullptr;
+    }
+
+    /**
+     * @brief Appends one access unit, taking a reference to it
+     */
+    void Push(GstBuffer *buffer) {
+        const bool keyframe =
+            !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+        const u64 size = gst_buffer_get_size(buffer);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_HEADER)) {
+            // Out-of-band parameter sets: keep the latest run, every clip
+            // starts with them
+            if (!last_was_header_) {
+                ClearHeaders();
+            }
+            headers_.push_back(gst_buffer_ref(buffer));
+            last_was_header_ = true;
+            return;
+        }
+        last_was_header_ = false;
+        if (keyframe) {
+            gops_.emplace_back();
+        } else if (gops_.empty()) {
+            // Nothing before the first keyframe is decodable
+            return;
+        }
+        Gop &gop = gops_.back();
+        gop.buffers.push_back(gst_buffer_ref(buffer));
+        gop.bytes += size;
+        bytes_ += size;
+
+        // Evict whole GOPs from the front, but never the one being filled;
+        // if that alone exceeds the budget, drop it and wait for the next
+        // keyframe so memory stays bounded
+        while (bytes_ > byte_budget_ && !gops_.empty()) {
+            if (gops_.size() == 1) {
+                ++overflows_;
+            }
+            PopFront();
+        }
+    }
+
+    /**
+     * @brief References to everything kept, oldest GOP first; the buffer
+     * keeps recording
+     */
+    Clip Snapshot() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Clip clip;
+        clip.caps = caps_ ? gst_caps_ref(caps_) : nullptr;
+        if (gops_.empty()) {
+            return clip;
+        }
+        for (GstBuffer *buffer : headers_) {
+            clip.buffers.push_back(gst_buffer_ref(buffer));
+        }
+        for (const Gop &gop : gops_) {
+            for (GstBuffer *buffer : gop.buffers) {
+                clip.buffers.push_back(gst_buffer_ref(buffer));
+            }
+        }
+        return clip;
+    }
+
+    /**
+     * @brief Hands a Snapshot() to @p writer to be muxed into @p path
+     * @returns false if nothing is kept yet
+     */
+    bool Save(const std::string &path, ClipCallback on_done = nullptr,
+              ClipWriter &writer = ClipWriter::Instance()) const {
+        Clip clip = Snapshot();
+        if (clip.Empty()) {
+            return false;
+        }
+        writer.Submit(std::move(clip), path, std::move(on_done));
+        return true;
+    }
+
+    u64 ByteBudget() const { return byte_budget_; }
+
+    /**
+     * @brief Bytes of encoded video kept
+     */
+    u64 Bytes() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return bytes_;
+    }
+
+    /**
+     * @brief Stream time covered by what is kept, in milliseconds
+     */
+    double DurationMs() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (gops_.empty()) {
+            return 0;
+        }
+        const GstClockTime first =
+            GST_BUFFER_DTS_OR_PTS(gops_.front().buffers.front());
+        const GstClockTime last =
+            GST_BUFFER_DTS_OR_PTS(gops_.back().buffers.back());
+        if (!GST_CLOCK_TIME_IS_VALID(first) || !GST_CLOCK_TIME_IS_VALID(last) ||
+            last < first) {
+            return 0;
+        }
+        return (last - first) / 1e6;
+    }
+
+    u64 GopCount() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return gops_.size();
+    }
+
+    /**
+     * @brief Times a single GOP did not fit into the budget
+     */
+    u64 Overflows() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return overflows_;
+    }
+
+  private:
+    struct Gop {
+        vec<GstBuffer *> buffers;
+        u64 bytes = 0;
+    };
+
+    const u64 byte_budget_;
+    mutable std::mutex mutex_;
+    GstCaps *caps_ = nullptr;
+    std::deque<Gop> gops_;
+    vec<GstBuffer *> headers_;
+    bool last_was_header_ = false;
+    u64 bytes_ = 0;
+    u64 overflows_ = 0;
+
+    void PopFront() {
+        for (GstBuffer *buffer : gops_.front().buffers) {
+            gst_buffer_unref(buffer);
+        }
+        bytes_ -= gops_.front().bytes;
+        gops_.pop_front();
+    }
+
+    void Clear() {
+        while (!gops_.empty()) {
+            PopFront();
+        }
+        ClearHeaders();
+        last_was_header_ = false;
+    }
+
+    void ClearHeaders() {
+        for (GstBuffer *buffer : headers_) {
+            gst_buffer_unref(buffer);
+        }
+        headers_.clear();
+    }
+
+    static GstPadProbeReturn OnProbe(GstPad *, GstPadProbeInfo *info,
+                                     gpointer user_data) {
+        auto *self = static_cast<PreEventBuffer *>(user_data);
+        if (GST_PAD_PROBE_INFO_TYPE(info) &
+            GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+            GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+            if (GST_EVENT_TYPE(event) == GST_EVENT_CAPS) {
+                GstCaps *caps = nullptr;
+                gst_event_parse_caps(event, &caps);
+                self->SetCaps(caps);
+            }
+            return GST_PAD_PROBE_OK;
+        }
+        GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+        if (buffer) {
+            self->Push(buffer);
+        }
+        return GST_PAD_PROBE_OK;
+    }
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "types.hpp"
+#include <cerrno>
+#include <fcntl.h>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <utility>
+
+/**
+ * @brief A procfs file kept open and re-read from offset 0 with pread(), so
+ * sampling it costs one syscall and no allocation: procfs regenerates the
+ * content on every read at offset 0. The buffer only grows if the content
+ * no longer fits (e.g. CPUs coming online), which is rare.
+ */
+class ProcFile {
+  public:
+    ProcFile() = delete;
+    ProcFile(const ProcFile &) = delete;
+    ProcFile &operator=(const ProcFile &) = delete;
+
+    explicit ProcFile(const std::string &path, size_t capacity = 4096)
+        : path_(path), fd_(open(path.c_str(), O_RDONLY | O_CLOEXEC)),
+          buffer_(capacity) {}
+
+    ProcFile(ProcFile &&rhs) noexcept
+        : path_(std::move(rhs.path_)), fd_(rhs.fd_),
+          buffer_(std::move(rhs.buffer_)) {
+        rhs.fd_ = -1;
+    }
+
+    ~ProcFile() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    bool IsOpen() const { return fd_ >= 0; }
+
+    const std::string &Path() const { return path_; }
+
+    /**
+     * @returns The current content, valid until the next Read(); empty if
+     * the file could not be opened or read (e.g. the thread exited)
+     */
+    std::string_view Read() {
+        if (fd_ < 0) {
+            return {};
+        }
+        while (true) {
+            ssize_t n = pread(fd_, buffer_.data(), buffer_.size(), 0);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return {};
+            }
+            if (static_cast<size_t>(n) < buffer_.size()) {
+                return std::string_view(buffer_.data(), n);
+            }
+            // Possibly truncated: grow and read again
+            buffer_.resize(buffer_.size() * 2);
+        }
+    }
+
+  private:
+    std::string path_;
+    int fd_;
+    vec<char> buffer_;
+};
+
+/**
+ * @brief Non-allocating parsing helpers for procfs text
+ */
+namespace proc {
+
+inline void SkipSpaces(std::string_view &text) {
+    size_t i = 0;
+    while (i < text.size() && (text[i] == ' ' || text[i] == '\t')) {
+        ++i;
+    }
+    text.remove_prefix(i);
+}
+
+/**
+ * @brief Consumes the next whitespace-separated token
+ */
+inline std::string_view NextToken(std::string_view &text) {
+    SkipSpaces(text);
+    size_t i = 0;
+    while (i < text.size() && text[i] != ' ' && text[i] != '\t' &&
+           text[i] != '\n') {
+        ++i;
+    }
+    std::string_view token = text.substr(0, i);
+    text.remove_prefix(i);
+    return token;
+}
+
+/**
+ * @brief Consumes the next unsigned decimal number, 0 if there is none
+ */
+inline u64 NextU64(std::string_view &text) {
+    SkipSpaces(text);
+    u64 value = 0;
+    size_t i = 0;
+    while (i < text.size() && text[i] >= '0' && text[i] <= '9') {
+        value = value * 10 + (text[i] - '0');
+        ++i;
+    }
+    text.remove_prefix(i);
+    return value;
+}
+
+/**
+ * @brief Consumes the next line, without its newline
+ */
+inline std::string_view NextLine(std::string_view &text) {
+    size_t end = text.find('\n');
+    std::string_view line = text.substr(0, end);
+    text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+    return line;
+}
+
+/**
+ * @returns The number following "<key>:" on a line of a "Key: value" file
+ * (/proc/self/status, smaps_rollup, ...), 0 if the key is missing
+ */
+inline u64 FindU64(std::string_view text, std::string_view key) {
+    while (!text.empty()) {
+        std::string_view line = NextLine(text);
+        if (line.size() > key.size() && line.substr(0, key.size()) == key &&
+            line[key.size()] == ':') {
+            line.remove_prefix(key.size() + 1);
+            return NextU64(line);
+        }
+    }
+    return 0;
+}
+
+} // namespace proc
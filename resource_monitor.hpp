@@ -1,78 +1,414 @@
 #pragma once
 
-#include "cpu_ram_sampler.hpp"
+#include "cpu_sampler.hpp"
 #include "gpu_sampler.hpp"
+#include "histogram.hpp"
+#include "memory_sampler.hpp"
+#include "metrics_sink.hpp"
+#include "sampler.hpp"
+#include "stream_stats.hpp"
+#include "thread_cpu_sampler.hpp"
 #include "types.hpp"
+#include <algorithm>
 #include <chrono>
-#include <nvml.h>
-#include <sys/resource.h>
 #include <thread>
 
 class ResourceMonitor {
 
   public:
-    using CpuRamMetrics = vec<CpuRamSampler::Metrics>;
-    using GpuMetrics = vec<GpuSampler::Metrics>;
-    using Metrics = tup<CpuRamMetrics, GpuMetrics>;
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * @brief What one sampler cost the monitor thread
+     */
+    struct SamplerCost {
+        std::string name;
+        u64 samples = 0;
+        double cpu_ms = 0;
+        double max_us = 0;
+
+        double MeanUs() const { return samples ? 1e3 * cpu_ms / samples : 0; }
+    };
+
+    /**
+     * @brief Cost and timing accuracy of the monitor itself
+     */
+    struct SelfStats {
+        u64 samples = 0;
+        /**
+         * @brief Ticks skipped because sampling overran a whole period
+         */
+        u64 missed_deadlines = 0;
+        /**
+         * @brief CPU time of the monitor thread, sleeping included
+         */
+        double cpu_ms = 0;
+        double wall_ms = 0;
+        vec<SamplerCost> samplers;
+
+        /**
+         * @brief Monitor CPU time in percent of one core
+         */
+        double OverheadPercent() const {
+            return wall_ms > 0 ? 100.0 * cpu_ms / wall_ms : 0.0;
+        }
+
+        double SampleRate() const {
+            return wall_ms > 0 ? 1000.0 * samples / wall_ms : 0.0;
+        }
+    };
+
+    /**
+     * @brief The samplers that come with the monitor: cpu, memory, threads
+     * and gpu (only if NVML is installed)
+     */
+    static const SamplerRegistry &BuiltinSamplers() {
+        static const SamplerRegistry registry = []() {
+            SamplerRegistry builtin;
+            builtin.Register("cpu", []() -> up<Sampler> {
+                return std::make_unique<CpuSampler>();
+            });
+            builtin.Register("memory", []() -> up<Sampler> {
+                return std::make_unique<MemorySampler>();
+            });
+            builtin.Register("threads", []() -> up<Sampler> {
+                return std::make_unique<ThreadCpuSampler>();
+            });
+            builtin.Register(
+                "gpu", []() -> up<Sampler> { return GpuSampler::Create(); });
+            return builtin;
+        }();
+        return registry;
+    }
 
     ResourceMonitor() = delete;
     ResourceMonitor(const ResourceMonitor &) = delete;
+    ResourceMonitor(ResourceMonitor &&) = delete;
+
     /**
-     * @brief Moving an instance will not move the already taken measurements
-     * had that instance been already running
+     * @param samplers Names in @p registry to sample, in row order; names
+     * that are not registered are skipped with an error, unavailable
+     * samplers with a notice
      */
-    ResourceMonitor(ResourceMonitor &&rhs) {
-        refresh_rate_.store(rhs.refresh_rate_.load());
+    ResourceMonitor(
+        u32 refresh_rate,
+        const vec<std::string> &samplers = BuiltinSamplers().Names(),
+        const SamplerRegistry &registry = BuiltinSamplers())
+        : refresh_rate_(refresh_rate) {
+        for (const std::string &name : samplers) {
+            if (!registry.Has(name)) {
+                ERROR << "Unknown sampler " << name;
+                continue;
+            }
+            up<Sampler> sampler = registry.Create(name);
+            if (!sampler) {
+                INFO << "Sampler " << name << " is not available";
+                continue;
+            }
+            if (auto *threads =
+                    dynamic_cast<ThreadCpuSampler *>(sampler.get())) {
+                thread_sampler_ = threads;
+            }
+            samplers_.push_back({std::move(sampler), 0});
+        }
+        // One cost column per sampler, then the samplers' own columns
+        size_t offset = FIXED_COLUMNS + samplers_.size();
+        for (Entry &entry : samplers_) {
+            entry.offset = offset;
+            offset += entry.sampler->Columns().size();
+        }
+        row_.resize(offset);
     }
-    ResourceMonitor(u32 refresh_rate) : refresh_rate_(refresh_rate) {}
 
     void SetRefreshRate(u32 refresh_rate) { refresh_rate_.store(refresh_rate); }
 
-    Metrics Run(const atm<bool> &stop) const {
-        CpuRamMetrics cpu_ram_measurements;
-        GpuMetrics gpu_measurements;
-
-        auto InternalMemUsage = [&cpu_ram_measurements, &gpu_measurements]() {
-            u32 internal_mem_usage = sizeof(ResourceMonitor);
-            internal_mem_usage += cpu_ram_measurements.capacity() *
-                                  sizeof(CpuRamSampler::Metrics);
-            for (const auto &gpus : gpu_measurements) {
-                internal_mem_usage +=
-                    gpus.capacity() * sizeof(GpuSampler::Metric);
+    /**
+     * @brief Per-stream counters to sample on every tick. Must be set before
+     * Run() is started and must be callable from the monitor thread.
+     */
+    void SetStreamStatsProvider(StreamStatsProvider provider) {
+        stream_stats_provider_ = std::move(provider);
+    }
+
+    /**
+     * @brief Where to stream samples: one row per tick to @p usage (see
+     * UsageColumns()) and one row per stream per tick to @p streams (see
+     * StreamColumns()); either may be null. Must be set before Run() is
+     * started, and the sinks must outlive it.
+     */
+    void SetSinks(MetricsSink *usage, MetricsSink *streams) {
+        usage_sink_ = usage;
+        stream_sink_ = streams;
+    }
+
+    /**
+     * @brief Schema of the usage rows: the timestamp, the monitor's own
+     * cost in total and per sampler, then the columns of every sampler in
+     * use
+     */
+    vec<std::string> UsageColumns() const {
+        vec<std::string> columns = {"timestamp_ms", "monitor_cpu_us"};
+        for (const Entry &entry : samplers_) {
+            columns.push_back(std::string(entry.sampler->Name()) + "_cost_us");
+        }
+        for (const Entry &entry : samplers_) {
+            for (std::string &column : entry.sampler->Columns()) {
+                columns.push_back(std::move(column));
             }
-            return internal_mem_usage;
-        };
+        }
+        return columns;
+    }
 
+    /**
+     * @brief Schema of the per-stream rows
+     */
+    static vec<std::string> StreamColumns() {
+        return {"timestamp_ms",
+                "stream_id",
+                "access_units",
+                "frames_skipped_decode",
+                "frames_decoded",
+                "frames_dropped_queue",
+                "frames_dropped_videorate",
+                "frames_dropped_ring",
+                "frames_skipped_latest",
+                "frames_delivered",
+                "bytes_delivered",
+                "frames_invalid",
+                "short_reads",
+                "stalls",
+                "reconnects",
+                "restarts_failed",
+                "recoveries",
+                "recovery_ms_total",
+                "recovery_ms_max",
+                "subscribers",
+                "decodes_deduplicated",
+                "frames_dropped_fps",
+                "pre_event_bytes",
+                "pre_event_ms",
+                "queue_bytes",
+                "appsink_bytes",
+                "frames_held",
+                "frame_bytes_held",
+                "cpu_source_ms",
+                "cpu_depay_ms",
+                "cpu_decoder_ms",
+                "cpu_convert_ms",
+                "cpu_sink_ms",
+                "cpu_consumer_ms"};
+    }
+
+    /**
+     * @brief Samples until @p stop is set. Ticks are scheduled against
+     * absolute deadlines (start + k * period), so the time a sample takes
+     * does not accumulate as drift; if sampling overruns a whole period the
+     * missed ticks are skipped rather than taken in a burst. Samples are
+     * handed to the sinks as they are taken, so memory stays constant.
+     */
+    void Run(const atm<bool> &stop) {
+        self_stats_ = SelfStats();
+        for (const Entry &entry : samplers_) {
+            self_stats_.samplers.push_back({entry.sampler->Name()});
+        }
+        const Clock::time_point start = Clock::now();
+        const u64 cpu_start = ThreadCpuNs();
+        Clock::time_point deadline = start;
         while (!stop.load()) {
+            const Clock::duration period =
+                std::chrono::nanoseconds(1000000000) /
+                std::max<u32>(1, refresh_rate_);
             // Wait before the first measurement to warm the caches.
-            std::this_thread::sleep_for(
-                std::chrono::milliseconds(1000 / refresh_rate_));
+            deadline += period;
+            std::this_thread::sleep_until(deadline);
+            const Clock::time_point now = Clock::now();
+            if (now - deadline >= period) {
+                const auto missed = (now - deadline) / period;
+                self_stats_.missed_deadlines += missed;
+                deadline += missed * period;
+            }
+            lateness_us_.Record(
+                std::chrono::duration_cast<std::chrono::microseconds>(now -
+                                                                      deadline)
+                    .count());
+            const u64 tick_cpu_start = ThreadCpuNs();
 
-            CpuRamSampler::Metrics cpu_ram_sample = cpu_ram_sampler_.Sample();
-            // subtract the memory consumed by ResourceMonitor itself
-            cpu_ram_sample.usage_.ru_maxrss -= InternalMemUsage();
+            // Samplers run even if the sink is full, so the deltas they
+            // compute stay one tick wide
+            u64 sampler_cpu_start = tick_cpu_start;
+            for (size_t i = 0; i < samplers_.size(); ++i) {
+                const Entry &entry = samplers_[i];
+                entry.sampler->Sample(&row_[entry.offset]);
+                const u64 sampler_cpu_end = ThreadCpuNs();
+                const double cost_us =
+                    (sampler_cpu_end - sampler_cpu_start) / 1e3;
+                sampler_cpu_start = sampler_cpu_end;
+                row_[FIXED_COLUMNS + i] = cost_us;
+                SamplerCost &cost = self_stats_.samplers[i];
+                ++cost.samples;
+                cost.cpu_ms += cost_us / 1e3;
+                cost.max_us = std::max(cost.max_us, cost_us);
+            }
+            vec<StreamStats> streams;
+            if (stream_stats_provider_ && stream_sink_) {
+                streams = stream_stats_provider_();
+                for (StreamStats &stats : streams) {
+                    AttributeThreadCpu(stats);
+                }
+            }
+            const double timestamp_ms =
+                std::chrono::duration<double, std::milli>(now - start).count();
+            row_[0] = timestamp_ms;
+            row_[1] = (ThreadCpuNs() - tick_cpu_start) / 1e3;
+            ++self_stats_.samples;
 
-            cpu_ram_measurements.push_back(cpu_ram_sample);
-            gpu_measurements.push_back(gpu_sampler_.Sample());
+            if (usage_sink_) {
+                if (double *row = usage_sink_->BeginRow()) {
+                    std::copy(row_.begin(), row_.end(), row);
+                    usage_sink_->CommitRow();
+                }
+            }
+            for (const StreamStats &stats : streams) {
+                if (double *row = stream_sink_->BeginRow()) {
+                    FillStreamRow(row, timestamp_ms, stats);
+                    stream_sink_->CommitRow();
+                }
+            }
         }
 
-        return {cpu_ram_measurements, gpu_measurements};
+        self_stats_.cpu_ms = (ThreadCpuNs() - cpu_start) / 1e6;
+        self_stats_.wall_ms =
+            std::chrono::duration<double, std::milli>(Clock::now() - start)
+                .count();
     }
 
-    void LogCpuRamMetadata() const { cpu_ram_sampler_.LogMetadata(); }
+    /**
+     * @brief Cost of the last Run(); read once it returned
+     */
+    const SelfStats &GetSelfStats() const { return self_stats_; }
 
-    u32 GpuDeviceCount() const { return gpu_sampler_.DeviceCount(); }
+    /**
+     * @brief How late each tick woke up after its deadline, in microseconds
+     */
+    const LatencyHistogram &TickLatenessUs() const { return lateness_us_; }
 
-    const GpuSampler::Metadata &GetGpuMetadata(u32 index) const {
-        return gpu_sampler_.GetDeviceMetadataByIndex(index);
+    void LogMetadata() const {
+        for (const Entry &entry : samplers_) {
+            entry.sampler->LogMetadata();
+        }
     }
 
   private:
+    struct Entry {
+        up<Sampler> sampler;
+        /**
+         * @brief Where the sampler's columns start in the usage row
+         */
+        size_t offset;
+    };
+
+    /**
+     * @brief timestamp_ms and monitor_cpu_us
+     */
+    static constexpr size_t FIXED_COLUMNS = 2;
+
     /**
      * @brief number of measurements per second
      */
     atm<u32> refresh_rate_;
 
-    CpuRamSampler cpu_ram_sampler_;
-    GpuSampler gpu_sampler_;
+    vec<Entry> samplers_;
+    /**
+     * @brief The threads sampler if in use, for per-stream attribution
+     */
+    ThreadCpuSampler *thread_sampler_ = nullptr;
+    /**
+     * @brief The usage row being sampled
+     */
+    vec<double> row_;
+    StreamStatsProvider stream_stats_provider_;
+    MetricsSink *usage_sink_ = nullptr;
+    MetricsSink *stream_sink_ = nullptr;
+    SelfStats self_stats_;
+    LatencyHistogram lateness_us_;
+
+    static void FillStreamRow(double *row, double timestamp_ms,
+                              const StreamStats &s) {
+        *row++ = timestamp_ms;
+        *row++ = s.stream_id;
+        for (u64 value : {s.access_units,
+                          s.frames_skipped_decode,
+                          s.frames_decoded,
+                          s.frames_dropped_queue,
+                          s.frames_dropped_videorate,
+                          s.frames_dropped_ring,
+                          s.frames_skipped_latest,
+                          s.frames_delivered,
+                          s.bytes_delivered,
+                          s.frames_invalid,
+                          s.short_reads,
+                          s.stalls,
+                          s.reconnects,
+                          s.restarts_failed,
+                          s.recoveries,
+                          s.recovery_ms_total,
+                          s.recovery_ms_max,
+                          s.subscribers,
+                          s.decodes_deduplicated,
+                          s.frames_dropped_fps,
+                          s.pre_event_bytes}) {
+            *row++ = static_cast<double>(value);
+        }
+        *row++ = s.pre_event_ms;
+        for (u64 value : {s.queue_bytes, s.appsink_bytes, s.frames_held,
+                          s.frame_bytes_held}) {
+            *row++ = static_cast<double>(value);
+        }
+        for (double ms : {s.cpu_source_ms, s.cpu_depay_ms, s.cpu_decoder_ms,
+                          s.cpu_convert_ms, s.cpu_sink_ms, s.cpu_consumer_ms}) {
+            *row++ = ms;
+        }
+    }
+
+    /**
+     * @brief Fills the per-kind CPU time of @p s from its named threads.
+     * Conversion was measured on the thread hosting it and is taken out of
+     * that thread's kind, so no time is counted twice.
+     */
+    void AttributeThreadCpu(StreamStats &s) const {
+        const ThreadCpuSampler::KindCpuMs *cpu =
+            thread_sampler_ ? thread_sampler_->StreamCpuMs(s.stream_id)
+                            : nullptr;
+        if (!cpu) {
+            return;
+        }
+        auto ms = [cpu](ThreadKind kind) {
+            return (*cpu)[static_cast<u32>(kind)];
+        };
+        s.cpu_source_ms = ms(ThreadKind::Source);
+        s.cpu_depay_ms = ms(ThreadKind::Depay);
+        s.cpu_decoder_ms = ms(ThreadKind::Decoder);
+        s.cpu_sink_ms = ms(ThreadKind::Sink);
+        double *host = nullptr;
+        switch (s.convert_thread) {
+        case ThreadKind::Source:
+            host = &s.cpu_source_ms;
+            break;
+        case ThreadKind::Depay:
+            host = &s.cpu_depay_ms;
+            break;
+        case ThreadKind::Decoder:
+            host = &s.cpu_decoder_ms;
+            break;
+        case ThreadKind::Sink:
+            host = &s.cpu_sink_ms;
+            break;
+        default:
+            break;
+        }
+        if (host) {
+            // Thread times lag by up to ThreadCpuSampler::SAMPLE_INTERVAL
+            *host = std::max(0.0, *host - s.cpu_convert_ms);
+        }
+    }
 };
@@ -2,26 +2,70 @@
  * DISCLAIMER: Code shamelessly copied from https://github.com/GStreamer/gst-rtsp-server/blob/master/examples/test-mp4.c
  *
  * 2025-06-27
+ *
+ * Serves one MP4 file on --ports ports x --mounts mounts from a single
+ * process. The file is demuxed once, by a source pipeline paced in real time
+ * and played in a loop; every access unit is handed to the appsrc of each
+ * mount as a shallow copy, so all mounts share the demuxed packets. Each
+ * mount's media is shared by all of its clients.
  */
 
 #include <gst/gst.h>
 
+#include <gst/app/app.h>
 #include <gst/rtsp-server/rtsp-server.h>
 
-#define DEFAULT_RTSP_PORT "8554"
+#define DEFAULT_RTSP_PORT 8554
 #define DEFAULT_MOUNT_PATH ""
 
-static char *port = (char *)DEFAULT_RTSP_PORT;
+/* bytes an appsrc may hold, e.g. while its media is not playing, before
+ * access units are dropped until the next key frame */
+#define MAX_QUEUED_BYTES (4 * 1024 * 1024)
+
+static gint port = DEFAULT_RTSP_PORT;
+static gint port_count = 1;
+static gint mount_count = 1;
 static char *mount_path = (char *)DEFAULT_MOUNT_PATH;
+static gboolean print_stats = FALSE;
 
 static GOptionEntry entries[] = {
-    {"port", 'p', 0, G_OPTION_ARG_STRING, &port,
-     "Port to listen on (default: " DEFAULT_RTSP_PORT ")", "PORT"},
+    {"port", 'p', 0, G_OPTION_ARG_INT, &port,
+     "First port to listen on (default: 8554)", "PORT"},
+    {"ports", 'n', 0, G_OPTION_ARG_INT, &port_count,
+     "Number of consecutive ports to listen on (default: 1)", "N"},
     {"mount", 'm', 0, G_OPTION_ARG_STRING, &mount_path,
      "Path to mount the stream (default: " DEFAULT_MOUNT_PATH ")",
      "MOUNT_PATH"},
+    {"mounts", 'c', 0, G_OPTION_ARG_INT, &mount_count,
+     "Mounts per port, MOUNT_PATH0 to MOUNT_PATH<N-1> if more than one "
+     "(default: 1)",
+     "N"},
+    {"stats", 's', 0, G_OPTION_ARG_NONE, &print_stats,
+     "Print RTCP statistics of every client", NULL},
     {NULL}};
 
+/* a mount whose media is prepared, fed by the source pipeline */
+typedef struct {
+  GstElement *appsrc;
+  /* set until the first key frame is pushed, and again after a drop */
+  gboolean need_keyframe;
+  /* added to the source timestamps to get the appsrc's running time */
+  GstClockTimeDiff offset;
+} Mount;
+
+typedef struct {
+  GstElement *pipeline;
+  GMainLoop *loop;
+  GMutex lock;
+  /* Mount *, guarded by lock */
+  GPtrArray *mounts;
+  /* added to the timestamps of the current pass over the file, and the end
+   * of the current pass, guarded by lock */
+  GstClockTime loop_offset;
+  GstClockTime pass_end;
+  guint64 dropped;
+} Source;
+
 /* called when a stream has received an RTCP packet from the client */
 static void on_ssrc_active(GObject *session, GObject *source,
                            GstRTSPMedia *media) {
@@ -86,11 +130,159 @@ static void media_prepared_cb(GstRTSPMedia *media) {
   }
 }
 
+static void mount_free(gpointer data) {
+  Mount *mount = (Mount *)data;
+
+  gst_object_unref(mount->appsrc);
+  g_free(mount);
+}
+
+/* hands one access unit of the file to every mount, restamped to the
+ * mount's running time; the memory is shared, only the metadata is copied */
+static void push_to_mounts(Source *source, GstBuffer *buffer) {
+  GstClockTime pts = GST_BUFFER_PTS(buffer);
+  GstClockTime dts = GST_BUFFER_DTS(buffer);
+  GstClockTime start = GST_CLOCK_TIME_IS_VALID(dts) ? dts : pts;
+  gboolean keyframe =
+      !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  guint i;
+
+  if (!GST_CLOCK_TIME_IS_VALID(start))
+    return;
+
+  g_mutex_lock(&source->lock);
+  if (GST_CLOCK_TIME_IS_VALID(pts) && GST_BUFFER_DURATION_IS_VALID(buffer)) {
+    source->pass_end = MAX(source->pass_end, pts + GST_BUFFER_DURATION(buffer));
+  }
+  start += source->loop_offset;
+
+  for (i = 0; i < source->mounts->len; i++) {
+    Mount *mount = (Mount *)g_ptr_array_index(source->mounts, i);
+    GstAppSrc *appsrc = GST_APP_SRC(mount->appsrc);
+    GstBuffer *copy;
+
+    if (GST_STATE(mount->appsrc) != GST_STATE_PLAYING ||
+        gst_app_src_get_current_level_bytes(appsrc) > MAX_QUEUED_BYTES) {
+      /* the next access units depend on this one */
+      mount->need_keyframe = TRUE;
+      source->dropped++;
+      continue;
+    }
+    if (mount->need_keyframe) {
+      GstClock *clock;
+
+      if (!keyframe)
+        continue;
+      clock = gst_element_get_clock(mount->appsrc);
+      if (!clock)
+        continue;
+      mount->offset =
+          GST_CLOCK_DIFF(start, gst_clock_get_time(clock) -
+                                    gst_element_get_base_time(mount->appsrc));
+      gst_object_unref(clock);
+      mount->need_keyframe = FALSE;
+    }
+
+    copy = gst_buffer_copy(buffer);
+    if (GST_CLOCK_TIME_IS_VALID(pts))
+      GST_BUFFER_PTS(copy) = pts + source->loop_offset + mount->offset;
+    if (GST_CLOCK_TIME_IS_VALID(dts))
+      GST_BUFFER_DTS(copy) = dts + source->loop_offset + mount->offset;
+    gst_app_src_push_buffer(appsrc, copy);
+  }
+  g_mutex_unlock(&source->lock);
+}
+
+static GstFlowReturn on_new_sample(GstAppSink *appsink, gpointer user_data) {
+  GstSample *sample = gst_app_sink_pull_sample(appsink);
+
+  if (sample) {
+    push_to_mounts((Source *)user_data, gst_sample_get_buffer(sample));
+    gst_sample_unref(sample);
+  }
+  return GST_FLOW_OK;
+}
+
+/* restarts the file at the end; timestamps of the next pass continue where
+ * the previous pass ended */
+static gboolean on_source_message(GstBus *bus, GstMessage *message,
+                                  gpointer user_data) {
+  Source *source = (Source *)user_data;
+
+  switch (GST_MESSAGE_TYPE(message)) {
+  case GST_MESSAGE_EOS:
+    g_mutex_lock(&source->lock);
+    source->loop_offset += source->pass_end;
+    source->pass_end = 0;
+    g_mutex_unlock(&source->lock);
+    if (!gst_element_seek_simple(
+            source->pipeline, GST_FORMAT_TIME,
+            (GstSeekFlags)(GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT), 0)) {
+      g_printerr("Unable to loop the file\n");
+      g_main_loop_quit(source->loop);
+    }
+    break;
+  case GST_MESSAGE_ERROR: {
+    GError *error = NULL;
+
+    gst_message_parse_error(message, &error, NULL);
+    g_printerr("Source error: %s\n", error->message);
+    g_clear_error(&error);
+    g_main_loop_quit(source->loop);
+    break;
+  }
+  default:
+    break;
+  }
+  return TRUE;
+}
+
+typedef struct {
+  Source *source;
+  Mount *mount;
+} MountRef;
+
+static void mount_ref_free(gpointer data, GClosure *closure) { g_free(data); }
+
+static void media_unprepared_cb(GstRTSPMedia *media, gpointer user_data) {
+  MountRef *ref = (MountRef *)user_data;
+
+  g_mutex_lock(&ref->source->lock);
+  /* frees the mount */
+  g_ptr_array_remove_fast(ref->source->mounts, ref->mount);
+  g_mutex_unlock(&ref->source->lock);
+}
+
+/* registers the appsrc of a mount's (shared) media with the source */
 static void media_configure_cb(GstRTSPMediaFactory *factory,
-                               GstRTSPMedia *media) {
-  /* connect our prepared signal so that we can see when this media is
-   * prepared for streaming */
-  g_signal_connect(media, "prepared", (GCallback)media_prepared_cb, factory);
+                               GstRTSPMedia *media, gpointer user_data) {
+  Source *source = (Source *)user_data;
+  GstElement *element = gst_rtsp_media_get_element(media);
+  GstElement *appsrc = gst_bin_get_by_name(GST_BIN(element), "src");
+  MountRef *ref;
+
+  gst_object_unref(element);
+  if (!appsrc) {
+    g_printerr("Media without an appsrc named src\n");
+    return;
+  }
+
+  ref = g_new0(MountRef, 1);
+  ref->source = source;
+  ref->mount = g_new0(Mount, 1);
+  ref->mount->appsrc = appsrc;
+  ref->mount->need_keyframe = TRUE;
+  g_mutex_lock(&source->lock);
+  g_ptr_array_add(source->mounts, ref->mount);
+  g_mutex_unlock(&source->lock);
+  g_signal_connect_data(media, "unprepared", (GCallback)media_unprepared_cb,
+                        ref, mount_ref_free, (GConnectFlags)0);
+
+  if (print_stats) {
+    /* connect our prepared signal so that we can see when this media is
+     * prepared for streaming */
+    g_signal_connect(media, "prepared", (GCallback)media_prepared_cb, factory);
+  }
 }
 
 int main(int argc, char *argv[]) {
@@ -100,7 +292,12 @@ int main(int argc, char *argv[]) {
   GstRTSPMediaFactory *factory;
   GOptionContext *optctx;
   GError *error = NULL;
+  GstElement *appsink;
+  GstBus *bus;
+  GstAppSinkCallbacks callbacks = {};
+  Source source = {};
   gchar *str;
+  gint i, j;
 
   optctx = g_option_context_new("<filename.mp4> - Test RTSP Server, MP4");
   g_option_context_add_main_entries(optctx, entries, NULL);
@@ -120,47 +317,97 @@ int main(int argc, char *argv[]) {
     g_print("mount path must not be empty\n");
     return 1;
   }
+  if (port_count < 1 || mount_count < 1 || port < 1 ||
+      port + port_count - 1 > 65535) {
+    g_print("ports and mounts must be at least 1, ports at most 65535\n");
+    return 1;
+  }
   g_option_context_free(optctx);
 
   loop = g_main_loop_new(NULL, FALSE);
 
-  /* create a server instance */
-  server = gst_rtsp_server_new();
-  g_object_set(server, "service", port, NULL);
-
-  /* get the mount points for this server, every server has a default object
-   * that be used to map uri mount points to media factories */
-  mounts = gst_rtsp_server_get_mount_points(server);
-
-  str = g_strdup_printf("( "
-                        "filesrc location=\"%s\" ! qtdemux name=d "
-                        "d. ! queue ! rtph264pay pt=96 name=pay0 "
-                        "d. ! queue ! rtpmp4apay pt=97 name=pay1 "
-                        ")",
+  /* demux the file once for all mounts, paced in real time by the appsink;
+   * SPS/PPS go in band before every key frame so clients can join at any
+   * key frame */
+  str = g_strdup_printf("filesrc location=\"%s\" ! qtdemux ! "
+                        "h264parse config-interval=-1 ! "
+                        "video/x-h264,stream-format=byte-stream,alignment=au ! "
+                        "appsink name=sink sync=true max-buffers=8",
                         argv[1]);
-
-  /* make a media factory for a test stream. The default media factory can use
-   * gst-launch syntax to create pipelines.
-   * any launch line works as long as it contains elements named pay%d. Each
-   * element with pay%d names will be a stream */
-  factory = gst_rtsp_media_factory_new();
-  gst_rtsp_media_factory_set_launch(factory, str);
-  g_signal_connect(factory, "media-configure", (GCallback)media_configure_cb,
-                   factory);
+  source.pipeline = gst_parse_launch(str, &error);
   g_free(str);
+  if (error) {
+    g_printerr("Unable to create the source pipeline: %s\n", error->message);
+    g_clear_error(&error);
+    return 1;
+  }
+  source.loop = loop;
+  g_mutex_init(&source.lock);
+  source.mounts = g_ptr_array_new_with_free_func(mount_free);
+
+  appsink = gst_bin_get_by_name(GST_BIN(source.pipeline), "sink");
+  callbacks.new_sample = on_new_sample;
+  gst_app_sink_set_callbacks(GST_APP_SINK(appsink), &callbacks, &source, NULL);
+  gst_object_unref(appsink);
+
+  bus = gst_element_get_bus(source.pipeline);
+  gst_bus_add_watch(bus, on_source_message, &source);
+  gst_object_unref(bus);
+
+  for (i = 0; i < port_count; i++) {
+    gchar *service = g_strdup_printf("%d", port + i);
+
+    /* create a server instance */
+    server = gst_rtsp_server_new();
+    g_object_set(server, "service", service, NULL);
+    g_free(service);
+
+    /* get the mount points for this server, every server has a default
+     * object that be used to map uri mount points to media factories */
+    mounts = gst_rtsp_server_get_mount_points(server);
+
+    for (j = 0; j < mount_count; j++) {
+      gchar *path = mount_count == 1 ? g_strdup(mount_path)
+                                     : g_strdup_printf("%s%d", mount_path, j);
+
+      /* any launch line works as long as it contains elements named pay%d.
+       * Each element with pay%d names will be a stream */
+      factory = gst_rtsp_media_factory_new();
+      gst_rtsp_media_factory_set_launch(
+          factory, "( appsrc name=src is-live=true format=time "
+                   "caps=video/x-h264,stream-format=byte-stream,alignment=au "
+                   "! rtph264pay name=pay0 pt=96 config-interval=-1 )");
+      /* one media, and one payloader, for all clients of the mount */
+      gst_rtsp_media_factory_set_shared(factory, TRUE);
+      g_signal_connect(factory, "media-configure",
+                       (GCallback)media_configure_cb, &source);
+
+      gst_rtsp_mount_points_add_factory(mounts, path, factory);
+      g_free(path);
+    }
+
+    /* don't need the ref to the mapper anymore */
+    g_object_unref(mounts);
+
+    /* attach the server to the default maincontext */
+    if (gst_rtsp_server_attach(server, NULL) == 0) {
+      g_printerr("Unable to listen on port %d\n", port + i);
+      return 1;
+    }
+  }
 
-  /* attach the test factory to the /test url */
-  gst_rtsp_mount_points_add_factory(mounts, mount_path, factory);
-
-  /* don't need the ref to the mapper anymore */
-  g_object_unref(mounts);
-
-  /* attach the server to the default maincontext */
-  gst_rtsp_server_attach(server, NULL);
+  gst_element_set_state(source.pipeline, GST_STATE_PLAYING);
 
   /* start serving */
-  g_print("stream ready at rtsp://127.0.0.1:%s%s\n", port, mount_path);
+  g_print("%d streams ready at rtsp://127.0.0.1:%d-%d%s%s\n",
+          port_count * mount_count, port, port + port_count - 1, mount_path,
+          mount_count == 1 ? "" : "<N>");
   g_main_loop_run(loop);
 
+  gst_element_set_state(source.pipeline, GST_STATE_NULL);
+  gst_object_unref(source.pipeline);
+  g_print("%" G_GUINT64_FORMAT " access units dropped for mounts not "
+          "playing or behind\n",
+          source.dropped);
   return 0;
 }
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "types.hpp"
+#include <functional>
+#include <map>
+#include <string>
+
+/**
+ * @brief A source of resource usage columns sampled by the ResourceMonitor.
+ * The columns are fixed once the sampler is constructed, so a row layout
+ * can be built from the samplers in use.
+ */
+class Sampler {
+  public:
+    virtual ~Sampler() = default;
+
+    /**
+     * @brief Name the sampler is registered and selected by
+     */
+    virtual const char *Name() const = 0;
+
+    virtual vec<std::string> Columns() const = 0;
+
+    /**
+     * @brief Takes a sample and writes one value per column to @p row.
+     * Called from the monitor thread only.
+     */
+    virtual void Sample(double *row) = 0;
+
+    /**
+     * @brief Logs what is being sampled (hardware models, limits) once
+     * before sampling starts
+     */
+    virtual void LogMetadata() const {}
+};
+
+/**
+ * @brief Named sampler factories, so samplers can be selected by name
+ */
+class SamplerRegistry {
+  public:
+    /**
+     * @brief Returns nullptr if the sampler cannot run on this host (e.g.
+     * no NVML for the GPU sampler)
+     */
+    using Factory = std::function<up<Sampler>()>;
+
+    void Register(const std::string &name, Factory factory) {
+        if (factories_.emplace(name, std::move(factory)).second) {
+            names_.push_back(name);
+        }
+    }
+
+    bool Has(const std::string &name) const {
+        return factories_.count(name) != 0;
+    }
+
+    /**
+     * @returns The sampler, or nullptr if @p name is not registered or the
+     * sampler is unavailable
+     */
+    up<Sampler> Create(const std::string &name) const {
+        auto it = factories_.find(name);
+        return it == factories_.end() ? nullptr : it->second();
+    }
+
+    /**
+     * @brief Registered names, in registration order
+     */
+    const vec<std::string> &Names() const { return names_; }
+
+  private:
+    std::map<std::string, Factory> factories_;
+    vec<std::string> names_;
+};
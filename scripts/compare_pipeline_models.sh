@@ -0,0 +1,41 @@
+#!/usr/bin/env bash
+
+###############################################################################
+### Compare one-pipeline-per-stream against a single shared pipeline at 8, 24
+### and 64 streams (thread count, RSS and CPU per frame)
+###############################################################################
+
+if [ ! -f "$1" ]; then
+    if [ -z "$1" ]; then
+        echo "Usage: $0 <path_to_mp4> [frame_count]"
+    else
+        echo "$1 is not a file"
+    fi
+    exit 1
+fi
+
+frame_count=${2:-300}
+
+# Path to directory where this script is placed
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+BUILD_DIR="$SCRIPT_DIR/../build"
+
+# Kill all background jobs on Interrupt (Ctrl+C)
+trap 'echo "Stopping servers..."; kill 0; exit' INT
+
+for n in 8 24 64; do
+    for i in $(seq 1 "$n"); do
+        "$BUILD_DIR/rtsp_server" -m "/stream" -p $((8553 + i)) "$1" >/dev/null &
+    done
+    sleep 1
+
+    for mode in "" "--shared_pipeline"; do
+        log="./compare_${n}${mode:+_shared}.log"
+        "$BUILD_DIR/stream_handler" -s "$n" -f "$frame_count" $mode \
+            -l "$log" -m "./compare_${n}${mode:+_shared}.csv" 2>/dev/null
+        grep -h "Summary:" "$log"*
+    done
+
+    kill $(jobs -p) 2>/dev/null
+    wait 2>/dev/null
+done
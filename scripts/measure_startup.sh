@@ -0,0 +1,43 @@
+#!/usr/bin/env bash
+
+###############################################################################
+### Time until all streams are ready at 24 and 100 streams, with one pipeline
+### per stream and with a shared pipeline (per-stream breakdown in the
+### startup_*.csv files)
+###############################################################################
+
+if [ ! -f "$1" ]; then
+    if [ -z "$1" ]; then
+        echo "Usage: $0 <path_to_mp4> [frame_count]"
+    else
+        echo "$1 is not a file"
+    fi
+    exit 1
+fi
+
+frame_count=${2:-30}
+
+# Path to directory where this script is placed
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+BUILD_DIR="$SCRIPT_DIR/../build"
+
+# Kill all background jobs on Interrupt (Ctrl+C)
+trap 'echo "Stopping servers..."; kill 0; exit' INT
+
+for n in 24 100; do
+    for i in $(seq 1 "$n"); do
+        "$BUILD_DIR/rtsp_server" -m "/stream" -p $((8553 + i)) "$1" >/dev/null &
+    done
+    sleep 1
+
+    for mode in "" "--shared_pipeline"; do
+        name="startup_${n}${mode:+_shared}"
+        "$BUILD_DIR/stream_handler" -s "$n" -f "$frame_count" $mode \
+            -l "./$name.log" -m "./$name.metrics.csv" \
+            --startup_csv "./$name.csv" 2>/dev/null
+        grep -h "Startup:" "./$name.log"*
+    done
+
+    kill $(jobs -p) 2>/dev/null
+    wait 2>/dev/null
+done
@@ -0,0 +1,69 @@
+#!/usr/bin/env python
+
+"""Converts a metrics file written with --metrics_format binary to CSV.
+
+Layout (see MetricsFormat in metrics_sink.hpp):
+    char[8] "GSMETRIC", u32 version, u32 column_count,
+    column_count x (u16 name_length, char[name_length] name)
+    blocks: u32 row_count, column_count x f64[row_count]
+"""
+
+import struct
+import sys
+
+MAGIC = b'GSMETRIC'
+VERSION = 1
+
+
+def read_columns(path):
+    """Returns (column names, list of columns), ignoring a truncated last
+    block."""
+    with open(path, 'rb') as f:
+        data = f.read()
+    if data[:8] != MAGIC:
+        raise ValueError(f'{path} is not a binary metrics file')
+    version, column_count = struct.unpack_from('<II', data, 8)
+    if version != VERSION:
+        raise ValueError(f'{path}: unsupported version {version}')
+    offset = 16
+    names = []
+    for _ in range(column_count):
+        (length,) = struct.unpack_from('<H', data, offset)
+        offset += 2
+        names.append(data[offset:offset + length].decode())
+        offset += length
+
+    columns = [[] for _ in range(column_count)]
+    while offset + 4 <= len(data):
+        (rows,) = struct.unpack_from('<I', data, offset)
+        size = rows * column_count * 8
+        if offset + 4 + size > len(data):
+            break  # cut short by a crash
+        offset += 4
+        for c in range(column_count):
+            columns[c].extend(struct.unpack_from(f'<{rows}d', data, offset))
+            offset += rows * 8
+    return names, columns
+
+
+def format_value(value):
+    if value == int(value) and abs(value) < 9e15:
+        return str(int(value))
+    return f'{value:.10g}'
+
+
+def convert(binary_path, csv_path):
+    names, columns = read_columns(binary_path)
+    with open(csv_path, 'w') as out:
+        out.write(','.join(names) + '\n')
+        for row in zip(*columns):
+            out.write(','.join(format_value(v) for v in row) + '\n')
+    return len(columns[0]) if columns else 0
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3:
+        print(f'Usage: {sys.argv[0]} <metrics_binary_file> <csv_file>')
+        sys.exit(1)
+    rows = convert(sys.argv[1], sys.argv[2])
+    print(f'Wrote {rows} rows to {sys.argv[2]}')
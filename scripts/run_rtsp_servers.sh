@@ -1,8 +1,8 @@
 #!/usr/bin/env bash
 
-###########################################
-### Run N rtsp servers (separate processes)
-##########################################
+###############################################################
+### Serve N streams on ports 8554..8553+N from one rtsp_server
+###############################################################
 
 if [ ! -f "$1" ]; then
     if [ -z "$1" ]; then
@@ -13,15 +13,9 @@ if [ ! -f "$1" ]; then
     exit 1
 fi
 
-read -p "Enter number of servers: " n
-
-# Kill all background jobs on Interrupt (Ctrl+C)
-trap 'echo "Stopping servers..."; kill 0; exit' INT
+read -p "Enter number of streams: " n
 
 # Path to directory where this script is placed
 SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
-for i in $(seq 1 "$n"); do
-    "$SCRIPT_DIR/../build/rtsp_server" -m "/stream" -p $((8553 + i)) "$1" &
-done
-
-wait
+# The file is demuxed once and shared by all ports
+exec "$SCRIPT_DIR/../build/rtsp_server" -m "/stream" -p 8554 -n "$n" "$1"
@@ -1,5 +1,6 @@
 #!/usr/bin/env python
 
+import os
 import sys
 import pandas as pd
 import matplotlib.pyplot as plt
@@ -11,8 +12,16 @@ if len(sys.argv) < 2:
     sys.exit(1)
 csv_path = sys.argv[1]
 
-# === Load CSV ===
-df = pd.read_csv(csv_path)
+# === Load CSV (or a --metrics_format binary file) ===
+with open(csv_path, 'rb') as f:
+    is_binary = f.read(8) == b'GSMETRIC'
+if is_binary:
+    sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+    from metrics_to_csv import read_columns
+    names, columns = read_columns(csv_path)
+    df = pd.DataFrame(dict(zip(names, columns)))
+else:
+    df = pd.read_csv(csv_path)
 df['timestamp'] = df['timestamp_ms'] / 1000  # seconds
 
 # === Identify columns ===
@@ -37,10 +46,13 @@ with PdfPages('resource_metrics_report.pdf') as pdf:
 
     # — Memory usage —
     fig = plt.figure(figsize=(6, 3))
-    plt.plot(df['timestamp'], df['ram_kib'] / 1024)
+    for col in ['rss_kib', 'anon_kib', 'pss_kib', 'peak_rss_kib']:
+        if col in df.columns:
+            plt.plot(df['timestamp'], df[col] / 1024, label=col[:-4])
     plt.xlabel('Time (s)')
     plt.ylabel('RAM Usage (MiB)')
     plt.title('RAM Usage Over Time')
+    plt.legend(loc='upper left', fontsize='small')
     plt.tight_layout()
     pdf.savefig(fig)
     plt.close(fig)
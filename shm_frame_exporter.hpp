@@ -0,0 +1,81 @@
+#pragma once
+
+#include "frame.hpp"
+#include "gst/video/video-format.h"
+#include "logging.hpp"
+#include "shm_frame_ring.hpp"
+#include "types.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+constexpr u32 DEFAULT_SHM_SLOT_COUNT = 8;
+
+/**
+ * @brief Publishes the decoded frames of one stream to a shared-memory ring
+ * (see shm_frame_ring.hpp) for consumers in other processes. The ring is
+ * created on the first frame, with slots sized for it; frames that do not
+ * fit later (e.g. after a resolution change) are counted and skipped.
+ *
+ * Exporting costs one copy per frame on the producer side; every reader
+ * then reads the pixels in place.
+ */
+class ShmFrameExporter {
+  public:
+    ShmFrameExporter() = delete;
+    ShmFrameExporter(const ShmFrameExporter &) = delete;
+
+    ShmFrameExporter(const std::string &name,
+                     u32 slot_count = DEFAULT_SHM_SLOT_COUNT)
+        : name_(name), slot_count_(slot_count) {}
+
+    /**
+     * @returns false if the frame was not published
+     */
+    bool Export(const Frame &frame) {
+        if (!frame || failed_) {
+            return false;
+        }
+        shm::FrameDesc desc;
+        desc.width = frame.Width();
+        desc.height = frame.Height();
+        desc.format = gst_video_format_to_string(frame.Format());
+        desc.pts_ns = GST_CLOCK_TIME_IS_VALID(frame.Pts())
+                          ? static_cast<i64>(frame.Pts())
+                          : -1;
+        desc.plane_count = std::min(frame.PlaneCount(), shm::MAX_PLANES);
+        for (u32 p = 0; p < desc.plane_count; ++p) {
+            desc.data[p] = frame.PlaneData(p);
+            desc.stride[p] = frame.PlaneStride(p);
+            desc.rows[p] = frame.PlaneRows(p);
+        }
+
+        if (!writer_) {
+            writer_ = shm::Writer::Create(name_, slot_count_, desc.Size());
+            if (!writer_) {
+                ERROR << "Unable to create shared memory ring " << name_ << ": "
+                      << (errno == EEXIST ? "in use by another process"
+                                          : std::strerror(errno));
+                failed_ = true;
+                return false;
+            }
+            INFO << "Exporting " << desc.width << "x" << desc.height << " "
+                 << desc.format << " frames to " << name_ << ", " << slot_count_
+                 << " slots of " << desc.Size() << " bytes";
+        }
+        return writer_->Write(desc);
+    }
+
+    const std::string &Name() const { return name_; }
+
+    u64 Published() const { return writer_ ? writer_->Published() : 0; }
+
+    u64 Oversized() const { return writer_ ? writer_->Oversized() : 0; }
+
+  private:
+    std::string name_;
+    u32 slot_count_;
+    up<shm::Writer> writer_;
+    bool failed_ = false;
+};
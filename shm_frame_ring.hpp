@@ -0,0 +1,484 @@
+#pragma once
+
+#include "spsc_ring.hpp"
+#include "types.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief Ring of decoded frames in POSIX shared memory: one writer process
+ * publishes frames, any number of reader processes map the ring read-only
+ * and read the pixels in place. Readers never block the writer and never
+ * wait themselves; each slot is guarded by a seqlock, so a reader detects
+ * when the writer lapped it and reused a slot it was reading.
+ *
+ * This header only depends on POSIX, so analytics processes can use the
+ * reader without linking GStreamer.
+ */
+namespace shm {
+
+constexpr u64 RING_MAGIC = 0x474e495246525453; // "STRFRING"
+constexpr u32 RING_VERSION = 2;
+constexpr u32 MAX_PLANES = 4;
+constexpr u32 FORMAT_NAME_SIZE = 16;
+
+static_assert(atm<u64>::is_always_lock_free,
+              "shared-memory atomics must be lock-free to be address-free");
+
+/**
+ * @brief Monotonic clock in ns, comparable between processes on one host
+ */
+inline i64 MonotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<i64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Start of the shared memory object, followed by slot_count slots
+ */
+struct alignas(CACHE_LINE_SIZE) RingHeader {
+    u64 magic;
+    u32 version;
+    u32 slot_count;
+    /**
+     * @brief Bytes from one slot to the next (header and pixels)
+     */
+    u64 slot_stride;
+    /**
+     * @brief Pixel bytes a slot can hold
+     */
+    u64 data_capacity;
+    /**
+     * @brief Process that created the ring
+     */
+    i32 writer_pid;
+    /**
+     * @brief Frames published so far; frame n lives in slot n % slot_count
+     */
+    alignas(CACHE_LINE_SIZE) atm<u64> published;
+};
+
+/**
+ * @brief Per-slot header; the pixels follow it
+ */
+struct alignas(CACHE_LINE_SIZE) SlotHeader {
+    /**
+     * @brief Seqlock: 2n + 1 while frame n is being written, 2n + 2 once it
+     * is complete
+     */
+    atm<u64> sequence;
+    u64 frame_number;
+    /**
+     * @brief Presentation timestamp in ns, -1 if the frame had none
+     */
+    i64 pts_ns;
+    /**
+     * @brief MonotonicNs() when the writer started writing the frame
+     */
+    i64 publish_ns;
+    u32 width;
+    u32 height;
+    /**
+     * @brief GStreamer video format name, e.g. "RGB", "NV12"
+     */
+    char format[FORMAT_NAME_SIZE];
+    u32 plane_count;
+    u32 stride[MAX_PLANES];
+    /**
+     * @brief Offset of each plane from the start of the slot's pixels
+     */
+    u64 offset[MAX_PLANES];
+    u64 size;
+};
+
+inline u64 SlotStride(u64 data_capacity) {
+    const u64 bytes = sizeof(SlotHeader) + data_capacity;
+    return (bytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+/**
+ * @brief Shared memory object name of a stream's ring
+ */
+inline std::string RingName(i32 stream_id) {
+    return "/gst_stream_" + std::to_string(stream_id);
+}
+
+/**
+ * @brief One frame to publish; plane p is rows[p] rows of stride[p] bytes
+ */
+struct FrameDesc {
+    u32 width = 0;
+    u32 height = 0;
+    const char *format = "";
+    i64 pts_ns = -1;
+    u32 plane_count = 0;
+    const u8 *data[MAX_PLANES] = {};
+    u32 stride[MAX_PLANES] = {};
+    u32 rows[MAX_PLANES] = {};
+
+    u64 Size() const {
+        u64 size = 0;
+        for (u32 p = 0; p < plane_count; ++p) {
+            size += static_cast<u64>(stride[p]) * rows[p];
+        }
+        return size;
+    }
+};
+
+/**
+ * @brief Creates a ring and publishes frames into it; the ring is removed
+ * when the writer is destroyed (readers keep their mapping).
+ */
+class Writer {
+  public:
+    Writer(const Writer &) = delete;
+    Writer &operator=(const Writer &) = delete;
+
+    /**
+     * @brief Creates the ring @p name. A ring of that name left behind by a
+     * writer that is gone is replaced; one whose writer is still running is
+     * never touched.
+     * @returns The writer, or nullptr if the shared memory object could not
+     * be created; errno is EEXIST if another writer owns the name
+     */
+    static up<Writer> Create(const std::string &name, u32 slot_count,
+                             u64 data_capacity) {
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0 && errno == EEXIST) {
+            if (!IsOrphaned(name)) {
+                errno = EEXIST;
+                return nullptr;
+            }
+            shm_unlink(name.c_str());
+            fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        }
+        if (fd < 0) {
+            return nullptr;
+        }
+        const u64 slot_stride = SlotStride(data_capacity);
+        const u64 size = sizeof(RingHeader) + slot_count * slot_stride;
+        void *memory = MAP_FAILED;
+        if (ftruncate(fd, size) == 0) {
+            memory =
+                mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (memory == MAP_FAILED) {
+            shm_unlink(name.c_str());
+            return nullptr;
+        }
+
+        // ftruncate zero-fills: every slot starts with sequence 0
+        auto *header = static_cast<RingHeader *>(memory);
+        header->version = RING_VERSION;
+        header->slot_count = slot_count;
+        header->slot_stride = slot_stride;
+        header->data_capacity = data_capacity;
+        header->writer_pid = getpid();
+        header->published.store(0, std::memory_order_relaxed);
+        // Readers check the magic last
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = RING_MAGIC;
+        return up<Writer>(new Writer(name, memory, size));
+    }
+
+    /**
+     * @brief Whether the ring @p name was completely created by a process
+     * that no longer exists
+     */
+    static bool IsOrphaned(const std::string &name) {
+        const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        void *memory = MAP_FAILED;
+        if (fstat(fd, &st) == 0 &&
+            static_cast<u64>(st.st_size) >= sizeof(RingHeader)) {
+            memory =
+                mmap(nullptr, sizeof(RingHeader), PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (memory == MAP_FAILED) {
+            return false;
+        }
+        const auto *header = static_cast<const RingHeader *>(memory);
+        const bool ready = header->magic == RING_MAGIC;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // Rings of another version may be in use by a writer we cannot
+        // identify; leave them alone
+        const bool orphaned = ready && header->version == RING_VERSION &&
+                              header->writer_pid > 0 &&
+                              kill(header->writer_pid, 0) != 0 &&
+                              errno == ESRCH;
+        munmap(memory, sizeof(RingHeader));
+        return orphaned;
+    }
+
+    ~Writer() {
+        munmap(memory_, size_);
+        shm_unlink(name_.c_str());
+    }
+
+    const std::string &Name() const { return name_; }
+
+    u64 DataCapacity() const { return Header()->data_capacity; }
+
+    u64 Published() const { return next_; }
+
+    /**
+     * @brief Frames not published because they did not fit into a slot
+     */
+    u64 Oversized() const { return oversized_; }
+
+    /**
+     * @brief Copies @p frame into the next slot and publishes it. Never
+     * waits for readers: the oldest slot is overwritten.
+     * @returns false if the frame is larger than a slot
+     */
+    bool Write(const FrameDesc &frame) {
+        RingHeader *header = Header();
+        const u64 size = frame.Size();
+        if (size > header->data_capacity || frame.plane_count > MAX_PLANES) {
+            ++oversized_;
+            return false;
+        }
+        const u64 n = next_;
+        SlotHeader *slot = Slot(n % header->slot_count);
+
+        slot->sequence.store(2 * n + 1, std::memory_order_relaxed);
+        // Orders the odd sequence before any write to the slot
+        std::atomic_thread_fence(std::memory_order_release);
+
+        slot->frame_number = n;
+        slot->pts_ns = frame.pts_ns;
+        slot->publish_ns = MonotonicNs();
+        slot->width = frame.width;
+        slot->height = frame.height;
+        std::strncpy(slot->format, frame.format, FORMAT_NAME_SIZE - 1);
+        slot->format[FORMAT_NAME_SIZE - 1] = '\0';
+        slot->plane_count = frame.plane_count;
+        u8 *pixels = reinterpret_cast<u8 *>(slot + 1);
+        u64 offset = 0;
+        for (u32 p = 0; p < frame.plane_count; ++p) {
+            const u64 plane_size =
+                static_cast<u64>(frame.stride[p]) * frame.rows[p];
+            std::memcpy(pixels + offset, frame.data[p], plane_size);
+            slot->stride[p] = frame.stride[p];
+            slot->offset[p] = offset;
+            offset += plane_size;
+        }
+        slot->size = size;
+
+        slot->sequence.store(2 * n + 2, std::memory_order_release);
+        header->published.store(n + 1, std::memory_order_release);
+        next_ = n + 1;
+        return true;
+    }
+
+  private:
+    std::string name_;
+    void *memory_;
+    u64 size_;
+    u64 next_ = 0;
+    u64 oversized_ = 0;
+
+    Writer(const std::string &name, void *memory, u64 size)
+        : name_(name), memory_(memory), size_(size) {}
+
+    RingHeader *Header() const { return static_cast<RingHeader *>(memory_); }
+
+    SlotHeader *Slot(u64 index) const {
+        return reinterpret_cast<SlotHeader *>(static_cast<u8 *>(memory_) +
+                                              sizeof(RingHeader) +
+                                              index * Header()->slot_stride);
+    }
+};
+
+/**
+ * @brief A frame read from the ring. The plane pointers point into shared
+ * memory; once done with the pixels, check Reader::IsValid() to know the
+ * writer did not overwrite them meanwhile.
+ */
+struct FrameView {
+    u64 frame_number = 0;
+    i64 pts_ns = -1;
+    i64 publish_ns = 0;
+    u32 width = 0;
+    u32 height = 0;
+    char format[FORMAT_NAME_SIZE] = {};
+    u32 plane_count = 0;
+    const u8 *data[MAX_PLANES] = {};
+    u32 stride[MAX_PLANES] = {};
+    u64 size = 0;
+
+  private:
+    friend class Reader;
+    const SlotHeader *slot = nullptr;
+    u64 sequence = 0;
+};
+
+/**
+ * @brief Maps a ring read-only. All calls are wait-free: they never block
+ * and never loop on the writer. One Reader per consumer thread.
+ */
+class Reader {
+  public:
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+
+    /**
+     * @returns The reader, or nullptr if no ring of that name exists or it
+     * is not initialized yet
+     */
+    static up<Reader> Open(const std::string &name) {
+        const int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        void *memory = MAP_FAILED;
+        if (fstat(fd, &st) == 0 &&
+            static_cast<u64>(st.st_size) >= sizeof(RingHeader)) {
+            memory = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (memory == MAP_FAILED) {
+            return nullptr;
+        }
+        const auto *header = static_cast<const RingHeader *>(memory);
+        const bool ready = header->magic == RING_MAGIC;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (!ready || header->version != RING_VERSION ||
+            sizeof(RingHeader) + header->slot_count * header->slot_stride >
+                static_cast<u64>(st.st_size)) {
+            munmap(memory, st.st_size);
+            return nullptr;
+        }
+        up<Reader> reader(new Reader(memory, st.st_size));
+        // Start with the frames published from now on
+        reader->next_ = header->published.load(std::memory_order_acquire);
+        return reader;
+    }
+
+    ~Reader() { munmap(const_cast<void *>(memory_), size_); }
+
+    /**
+     * @brief Reads the frame after the last one read. A reader that fell
+     * more than a ring behind skips ahead to the oldest frame still kept.
+     * @returns false if there is no new frame, or the one due was just
+     * overwritten (counted in Lost(); the next call moves on)
+     */
+    bool TryNext(FrameView &view) {
+        const RingHeader *header = Header();
+        const u64 published = header->published.load(std::memory_order_acquire);
+        if (next_ >= published) {
+            return false;
+        }
+        if (published - next_ > header->slot_count) {
+            lost_ += published - header->slot_count - next_;
+            next_ = published - header->slot_count;
+        }
+        const u64 n = next_++;
+        if (!Read(n, view)) {
+            ++lost_;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Reads the newest complete frame, skipping any older ones not
+     * read yet
+     * @returns false if there is no new frame or it was just overwritten
+     */
+    bool TryLatest(FrameView &view) {
+        const u64 published =
+            Header()->published.load(std::memory_order_acquire);
+        if (next_ >= published) {
+            return false;
+        }
+        skipped_ += published - 1 - next_;
+        next_ = published - 1;
+        return TryNext(view);
+    }
+
+    /**
+     * @brief Whether the pixels of @p view were not overwritten since it was
+     * read; call after using them and drop the result if this fails
+     */
+    bool IsValid(const FrameView &view) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return view.slot && view.slot->sequence.load(
+                                std::memory_order_relaxed) == view.sequence;
+    }
+
+    /**
+     * @brief Frames overwritten before this reader got to them
+     */
+    u64 Lost() const { return lost_; }
+
+    /**
+     * @brief Frames passed over by TryLatest()
+     */
+    u64 Skipped() const { return skipped_; }
+
+    u32 SlotCount() const { return Header()->slot_count; }
+
+  private:
+    const void *memory_;
+    u64 size_;
+    u64 next_ = 0;
+    u64 lost_ = 0;
+    u64 skipped_ = 0;
+
+    Reader(const void *memory, u64 size) : memory_(memory), size_(size) {}
+
+    const RingHeader *Header() const {
+        return static_cast<const RingHeader *>(memory_);
+    }
+
+    const SlotHeader *Slot(u64 index) const {
+        return reinterpret_cast<const SlotHeader *>(
+            static_cast<const u8 *>(memory_) + sizeof(RingHeader) +
+            index * Header()->slot_stride);
+    }
+
+    bool Read(u64 n, FrameView &view) const {
+        const SlotHeader *slot = Slot(n % Header()->slot_count);
+        const u64 sequence = slot->sequence.load(std::memory_order_acquire);
+        if (sequence != 2 * n + 2) {
+            return false;
+        }
+        view.frame_number = slot->frame_number;
+        view.pts_ns = slot->pts_ns;
+        view.publish_ns = slot->publish_ns;
+        view.width = slot->width;
+        view.height = slot->height;
+        std::memcpy(view.format, slot->format, FORMAT_NAME_SIZE);
+        view.format[FORMAT_NAME_SIZE - 1] = '\0';
+        view.plane_count = std::min(slot->plane_count, MAX_PLANES);
+        view.size = std::min(slot->size, Header()->data_capacity);
+        const u8 *pixels = reinterpret_cast<const u8 *>(slot + 1);
+        for (u32 p = 0; p < view.plane_count; ++p) {
+            view.data[p] = pixels + std::min(slot->offset[p], view.size);
+            view.stride[p] = slot->stride[p];
+        }
+        view.slot = slot;
+        view.sequence = sequence;
+        // The header copy is only consistent if the slot was not reused
+        return IsValid(view);
+    }
+};
+
+} // namespace shm
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "types.hpp"
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+/**
+ * @brief Bounded lock-free ring buffer for exactly one producer thread and
+ * exactly one consumer thread. Capacity is rounded up to a power of two.
+ */
+template <typename T> class SpscRing {
+  public:
+    SpscRing() = delete;
+    SpscRing(const SpscRing &) = delete;
+    SpscRing &operator=(const SpscRing &) = delete;
+
+    explicit SpscRing(size_t capacity)
+        : mask_(RoundUpPowerOfTwo(capacity) - 1), slots_(mask_ + 1) {}
+
+    size_t Capacity() const { return mask_ + 1; }
+
+    /**
+     * @brief Producer side. Returns false, leaving @p value untouched, if the
+     * ring is full.
+     */
+    bool TryPush(T &value) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (head - cached_tail_ > mask_) {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if (head - cached_tail_ > mask_) {
+                return false;
+            }
+        }
+        slots_[head & mask_] = std::move(value);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Consumer side. Returns false if the ring is empty.
+     */
+    bool TryPop(T &out) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == cached_head_) {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail == cached_head_) {
+                return false;
+            }
+        }
+        out = std::move(slots_[tail & mask_]);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Consumer side. "Latest only": pops every queued item, hands
+     * each one but the newest to @p discard and returns the newest in
+     * @p out. Returns false if the ring is empty.
+     */
+    template <typename Discard> bool TryPopLatest(T &out, Discard &&discard) {
+        if (!TryPop(out)) {
+            return false;
+        }
+        T newer;
+        while (TryPop(newer)) {
+            discard(out);
+            out = std::move(newer);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Approximate number of queued items, exact only when called from
+     * the producer or consumer thread while the other side is idle.
+     */
+    size_t Size() const {
+        return head_.load(std::memory_order_acquire) -
+               tail_.load(std::memory_order_acquire);
+    }
+
+    bool Empty() const { return Size() == 0; }
+
+  private:
+    const size_t mask_;
+    vec<T> slots_;
+
+    // Producer-owned line
+    alignas(CACHE_LINE_SIZE) atm<size_t> head_{0};
+    size_t cached_tail_ = 0;
+
+    // Consumer-owned line
+    alignas(CACHE_LINE_SIZE) atm<size_t> tail_{0};
+    size_t cached_head_ = 0;
+
+    static size_t RoundUpPowerOfTwo(size_t n) {
+        size_t p = 1;
+        while (p < n) {
+            p <<= 1;
+        }
+        return p;
+    }
+};
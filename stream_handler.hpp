@@ -1,27 +1,197 @@
 #pragma once
 
+#include "decode_skipper.hpp"
+#include "frame.hpp"
 #include "glib.h"
 #include "gst/app/gstappsink.h"
 #include "gst/gst.h"
 #include "gst/gstbin.h"
 #include "gst/gstbuffer.h"
+#include "gst/gstbus.h"
 #include "gst/gstclock.h"
 #include "gst/gstelement.h"
 #include "gst/gstmemory.h"
+#include "gst/gstmessage.h"
 #include "gst/gstobject.h"
+#include "gst/gstpad.h"
 #include "gst/gstparse.h"
 #include "gst/gstsample.h"
 #include "gst/video/video-info.h"
+#include "histogram.hpp"
 #include "logging.hpp"
+#include "pre_event_buffer.hpp"
+#include "spsc_ring.hpp"
+#include "stream_stats.hpp"
+#include "stream_threads.hpp"
 #include "types.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 template <typename T> using vec = std::vector<T>;
 
 constexpr int INITIALIZATION_TIMEOUT_SECONDS = 5;
+constexpr u32 DEFAULT_OPEN_RETRY_COUNT = 3;
+constexpr std::chrono::milliseconds DEFAULT_PULL_TIMEOUT(1000);
+constexpr size_t DEFAULT_RING_CAPACITY = 4;
+/**
+ * @brief How long Restart() waits for the pipeline to reach READY; an RTSP
+ * source tearing down a dead session can otherwise block indefinitely
+ */
+constexpr std::chrono::seconds RESTART_STATE_TIMEOUT(5);
+/**
+ * @brief OutputSpec::format that hands out the decoder's NV12/I420 frames
+ * as-is; consumers convert with Frame::ToRgb only when they need RGB
+ */
+constexpr const char *NATIVE_OUTPUT_FORMAT = "native";
+
+/**
+ * @brief How decoded frames reach the consumer.
+ * - Pull: the consumer blocks in gst_app_sink_pull_sample (PullSample).
+ * - Push: the appsink new-sample callback pushes samples into a per-stream
+ *   SPSC ring and the consumer polls it without blocking (TryPop).
+ */
+enum class DeliveryMode { Pull, Push };
+
+/**
+ * @brief Raw video handed out by the appsink. A zero width or height keeps
+ * the source size in that dimension.
+ */
+struct OutputSpec {
+    /**
+     * @brief GStreamer video format name, e.g. RGB, GRAY8, NV12, I420, or
+     * NATIVE_OUTPUT_FORMAT
+     */
+    std::string format = "RGB";
+    u32 width = 0;
+    u32 height = 0;
+    /**
+     * @brief Pad with borders instead of stretching when the target aspect
+     * ratio differs from the source
+     */
+    bool keep_aspect = false;
+
+    bool IsNative() const { return format == NATIVE_OUTPUT_FORMAT; }
+
+    bool IsValid() const {
+        return IsNative() || gst_video_format_from_string(format.c_str()) !=
+                                 GST_VIDEO_FORMAT_UNKNOWN;
+    }
+
+    std::string ToCaps() const {
+        // Native: videoconvert stays in passthrough when the decoder already
+        // outputs NV12 or I420, which is what software H.264/H.265 decoders do
+        std::string caps =
+            "video/x-raw,format=" +
+            (IsNative() ? std::string("(string){ NV12, I420 }") : format) +
+            ",pixel-aspect-ratio=1/1";
+        if (width) {
+            caps += ",width=" + std::to_string(width);
+        }
+        if (height) {
+            caps += ",height=" + std::to_string(height);
+        }
+        return caps;
+    }
+};
+
+/**
+ * @brief Thread counts of the per-stream elements: the video decoder's
+ * max-threads and the n-threads of videoscale and videoconvert.
+ * ELEMENT_DEFAULT leaves a property untouched (libav decoders then use one
+ * thread per core, the converters a single thread).
+ */
+struct ThreadingOptions {
+    static constexpr i32 ELEMENT_DEFAULT = -1;
+    /**
+     * @brief Upper bound for Auto(): frame-threaded decoders add one frame of
+     * latency per thread and stop scaling well beyond this
+     */
+    static constexpr u32 MAX_AUTO_DECODER_THREADS = 8;
+
+    i32 decoder_threads = ELEMENT_DEFAULT;
+    i32 convert_threads = ELEMENT_DEFAULT;
+
+    /**
+     * @brief Splits the hardware threads evenly over @p stream_count streams.
+     * Decoding costs several times more than scaling and converting, so the
+     * decoder gets the whole per-stream share and the converters a quarter.
+     * With more streams than cores every element runs single-threaded.
+     */
+    static ThreadingOptions Auto(u32 stream_count) {
+        const u32 cores = std::max(1u, std::thread::hardware_concurrency());
+        const u32 share = std::max(1u, cores / std::max(1u, stream_count));
+        ThreadingOptions threading;
+        threading.decoder_threads = std::min(share, MAX_AUTO_DECODER_THREADS);
+        threading.convert_threads = std::max(1u, share / 4);
+        return threading;
+    }
+
+    /**
+     * @brief Parses a thread count option: "auto" takes @p auto_value,
+     * "default" keeps the element's own default, anything else must be a
+     * count
+     */
+    static bool ParseCount(const std::string &value, i32 auto_value,
+                           i32 &threads) {
+        if (value == "auto") {
+            threads = auto_value;
+            return true;
+        }
+        if (value == "default") {
+            threads = ELEMENT_DEFAULT;
+            return true;
+        }
+        char *end = nullptr;
+        long count = std::strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end != '\0' || count < 0) {
+            return false;
+        }
+        threads = static_cast<i32>(count);
+        return true;
+    }
+
+    static std::string DescribeCount(i32 threads) {
+        return threads == ELEMENT_DEFAULT ? "default" : std::to_string(threads);
+    }
+};
+
+/**
+ * @brief Per-stream configuration
+ */
+struct StreamOptions {
+    int fps_limit = 30;
+    OutputSpec output;
+    ThreadingOptions threading;
+    /**
+     * @brief How much decoding may be skipped to honour fps_limit
+     */
+    DecodeSkipMode decode_skip = DecodeSkipMode::Auto;
+    /**
+     * @brief Byte budget of the compressed video kept for SavePreEvent(), 0
+     * to keep none
+     */
+    u64 pre_event_bytes = 0;
+    DeliveryMode delivery_mode = DeliveryMode::Pull;
+    /**
+     * @brief Push mode: number of frames the SPSC ring can hold
+     */
+    size_t ring_capacity = DEFAULT_RING_CAPACITY;
+    /**
+     * @brief Push mode: invoked on the appsink streaming thread after a frame
+     * was queued, so consumers can be woken up instead of blocking in a pull
+     */
+    std::function<void()> on_frame_ready;
+};
 
 class StreamHandler {
   public:
@@ -29,22 +199,59 @@ class StreamHandler {
     StreamHandler(const StreamHandler &) = delete;
 
     StreamHandler(int id, const std::string &stream_uri, int fps_limit)
+        : StreamHandler(id, stream_uri, WithFpsLimit(fps_limit)) {}
+
+    /**
+     * @brief Starts the pipeline and returns without waiting for the stream
+     * to connect; see WaitUntilReady() and OpenStream().
+     *
+     * If @p host_pipeline is not null, the stream is built as a bin inside
+     * that (already playing) pipeline instead of a pipeline of its own. See
+     * MultiStreamPipeline.
+     */
+    StreamHandler(int id, const std::string &stream_uri,
+                  const StreamOptions &options,
+                  GstElement *host_pipeline = nullptr)
         : id_(id), stream_uri_(stream_uri), is_stream_open_(true),
-          fps_limit_(fps_limit), stream_width_(0), stream_height_(0),
-          pipeline_(nullptr) {
-        InitGStreamer();
+          fps_limit_(options.fps_limit), output_(options.output),
+          threading_(options.threading),
+          decode_skipper_(id, options.decode_skip, options.fps_limit),
+          pre_event_(options.pre_event_bytes ? std::make_unique<PreEventBuffer>(
+                                                   options.pre_event_bytes)
+                                             : nullptr),
+          stream_width_(0), stream_height_(0),
+          delivery_mode_(options.delivery_mode), ring_(options.ring_capacity),
+          on_frame_ready_(options.on_frame_ready),
+          host_pipeline_(host_pipeline), pipeline_(nullptr), appsink_(nullptr) {
+        if (!InitGStreamer()) {
+            is_stream_open_ = false;
+        }
         CreateNewPipeline();
         UpdateAppsink();
+        ConnectCounters();
+        ConnectStartupProbes();
+        if (delivery_mode_ == DeliveryMode::Push && appsink_) {
+            EnablePushDelivery();
+        }
         Play();
-        UpdateStreamResolution();
     }
 
     ~StreamHandler() {
+        for (const std::function<void()> &on_detach : on_detach_) {
+            on_detach();
+        }
         is_stream_open_ = false;
         if (pipeline_) {
+            if (host_pipeline_) {
+                // Keep the host from driving the branch back to PLAYING
+                gst_element_set_locked_state(pipeline_, TRUE);
+            }
             gst_element_set_state(pipeline_, GST_STATE_NULL);
             // Wait for state change to finish
             gst_element_get_state(pipeline_, NULL, NULL, GST_CLOCK_TIME_NONE);
+            if (host_pipeline_) {
+                gst_bin_remove(GST_BIN(host_pipeline_), pipeline_);
+            }
             gst_object_unref(pipeline_);
             pipeline_ = nullptr;
         }
@@ -52,68 +259,464 @@ class StreamHandler {
             gst_object_unref(appsink_);
             appsink_ = nullptr;
         }
+        if (videorate_) {
+            gst_object_unref(videorate_);
+            videorate_ = nullptr;
+        }
+        if (queue_) {
+            gst_object_unref(queue_);
+            queue_ = nullptr;
+        }
+        // The pipeline is stopped, so no producer is left; drain the ring.
+        QueuedSample queued;
+        while (ring_.TryPop(queued)) {
+            gst_sample_unref(queued.sample);
+        }
     }
 
     bool IsStreamOpen() const { return is_stream_open_; }
 
     int GetId() const { return id_; }
 
+    bool IsShared() const { return host_pipeline_ != nullptr; }
+
+    /**
+     * @brief Whether a StreamWatchdog found the stream stalled or failed and
+     * is restarting it
+     */
+    bool IsStalled() const { return stalled_; }
+
+    /**
+     * @brief Whether the appsink caps are negotiated, i.e. the stream size
+     * and frame size are known
+     */
+    bool IsReady() const { return caps_us_ >= 0; }
+
+    /**
+     * @brief Blocks until the stream is ready, has failed, or @p timeout
+     * passed.
+     * @returns Whether the stream is open and ready
+     */
+    bool WaitUntilReady(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(ready_mutex_);
+        ready_cv_.wait_for(lock, timeout,
+                           [this]() { return IsReady() || !is_stream_open_; });
+        return is_stream_open_ && IsReady();
+    }
+
+    StartupTimes GetStartupTimes() const {
+        auto ToMs = [](i64 us) { return us < 0 ? -1.0 : us / 1000.0; };
+        StartupTimes times;
+        times.stream_id = id_;
+        times.connect_ms = ToMs(connect_us_);
+        times.caps_ms = ToMs(caps_us_);
+        times.first_frame_ms = ToMs(first_frame_us_);
+        return times;
+    }
+
     size_t GetStreamWidth() const { return stream_width_; }
 
     size_t GetStreamHeight() const { return stream_height_; }
 
     int GetFPSLimit() const { return fps_limit_; }
 
-    vec<u8> PullSample() {
-        vec<u8> bytes;
+    /**
+     * @brief Changes the fps limit of the running stream: videorate's
+     * max-rate and the decode skipper follow from the next frame on
+     */
+    void SetFpsLimit(int fps_limit) {
+        if (fps_limit == fps_limit_.exchange(fps_limit)) {
+            return;
+        }
+        decode_skipper_.SetFpsLimit(fps_limit);
+        if (videorate_) {
+            g_object_set(videorate_, "max-rate", fps_limit, nullptr);
+        }
+        INFO << "Stream [" << id_ << "]: fps limit = " << fps_limit;
+    }
+
+    const OutputSpec &GetOutputSpec() const { return output_; }
+
+    const ThreadingOptions &GetThreading() const { return threading_; }
+
+    /**
+     * @brief The decode skipping in effect (what Auto resolved to)
+     */
+    DecodeSkipMode GetDecodeSkipMode() const {
+        return decode_skipper_.ActiveMode();
+    }
+
+    DeliveryMode GetDeliveryMode() const { return delivery_mode_; }
+
+    /**
+     * @brief The compressed video kept before now, null unless
+     * StreamOptions::pre_event_bytes is set
+     */
+    const PreEventBuffer *GetPreEventBuffer() const { return pre_event_.get(); }
+
+    /**
+     * @brief Saves the compressed video kept before now to an MP4 file at
+     * @p path without re-encoding. Returns right away; the file is written
+     * on the ClipWriter thread, which calls @p on_done when it is complete.
+     * @returns false if no pre-event buffer is kept or it is still empty
+     */
+    bool SavePreEvent(const std::string &path,
+                      ClipCallback on_done = nullptr) const {
+        return pre_event_ && pre_event_->Save(path, std::move(on_done));
+    }
+
+    /**
+     * @brief Waits up to @p timeout for the next frame. The returned frame
+     * references the decoder output in place; it is invalid if no frame came
+     * in time (the stream stays open, e.g. while a StreamWatchdog recovers
+     * it), the stream is closed, or the sample could not be mapped.
+     */
+    Frame PullSample(std::chrono::milliseconds timeout = DEFAULT_PULL_TIMEOUT) {
         if (!is_stream_open_) {
-            return bytes;
+            return Frame();
         }
 
-        GstSample *sample = gst_app_sink_pull_sample(GST_APP_SINK(appsink_));
+        GstSample *sample = gst_app_sink_try_pull_sample(
+            GST_APP_SINK(appsink_),
+            std::chrono::duration_cast<std::chrono::nanoseconds>(timeout)
+                .count());
         if (!sample) {
-            ERROR << "[StreamHandler][PullSample] Unable to read next "
-                     "frame -- Closing the stream";
-            is_stream_open_ = false;
-            return bytes;
+            if (gst_app_sink_is_eos(GST_APP_SINK(appsink_))) {
+                ERROR << "[StreamHandler][PullSample] End of stream -- "
+                         "Closing the stream";
+                is_stream_open_ = false;
+            }
+            return Frame();
         }
 
-        GstBuffer *buffer = gst_sample_get_buffer(sample);
-        GstMapInfo map;
-        if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
-            bytes.assign(map.data, map.data + map.size);
-            gst_buffer_unmap(buffer, &map);
-            gst_sample_unref(sample);
-            return bytes;
-        } else {
-            gst_sample_unref(sample);
-            return bytes;
+        // Appsink arrival is not observable here; the gap between pulls
+        // stands in for the inter-frame gap.
+        appsink_queued_.fetch_sub(1, std::memory_order_relaxed);
+        Frame::Clock::time_point now = Frame::Clock::now();
+        RecordGap(last_pull_, now);
+        last_pull_ = now;
+        return Deliver(Frame(sample));
+    }
+
+    /**
+     * @brief Push mode only. Returns the oldest queued frame without
+     * blocking, or an invalid frame if none is ready. Must only be called
+     * from a single consumer thread.
+     */
+    Frame TryPop() {
+        QueuedSample queued;
+        if (!ring_.TryPop(queued)) {
+            return Frame();
+        }
+        return Consume(queued);
+    }
+
+    /**
+     * @brief Push mode only. "Latest frame only" policy: discards every
+     * queued frame except the newest one and returns it, or an invalid frame
+     * if none is ready.
+     */
+    Frame TryPopLatest() {
+        QueuedSample latest;
+        if (!ring_.TryPopLatest(latest, [this](QueuedSample &skipped) {
+                gst_sample_unref(skipped.sample);
+                frames_skipped_latest_.Add();
+            })) {
+            return Frame();
+        }
+        return Consume(latest);
+    }
+
+    /**
+     * @brief Push mode only. Whether the ring holds frames not popped yet.
+     */
+    bool HasQueuedFrames() const { return !ring_.Empty(); }
+
+    /**
+     * @brief Cheap, lock-free copy of the stream's counters; safe to call
+     * from any thread, e.g. the ResourceMonitor
+     */
+    StreamStats Snapshot() const {
+        StreamStats stats;
+        stats.stream_id = id_;
+        if (videorate_) {
+            guint64 in = 0, drop = 0;
+            g_object_get(videorate_, "in", &in, "drop", &drop, NULL);
+            stats.frames_decoded = in;
+            stats.frames_dropped_videorate = drop;
+        }
+        stats.access_units = decode_skipper_.AccessUnits();
+        stats.frames_skipped_decode = decode_skipper_.Skipped();
+        if (pre_event_) {
+            stats.pre_event_bytes = pre_event_->Bytes();
+            stats.pre_event_ms = pre_event_->DurationMs();
+        }
+        stats.frames_dropped_queue = frames_dropped_queue_.Load();
+        stats.frames_dropped_ring = frames_dropped_ring_.Load();
+        stats.frames_skipped_latest = frames_skipped_latest_.Load();
+        stats.frames_delivered = frames_delivered_.Load();
+        stats.bytes_delivered = bytes_delivered_.Load();
+        stats.frames_invalid = frames_invalid_.Load();
+        stats.short_reads = short_reads_.Load();
+        if (queue_) {
+            guint queue_bytes = 0;
+            g_object_get(queue_, "current-level-bytes", &queue_bytes, NULL);
+            stats.queue_bytes = queue_bytes;
         }
+        // Size() is racy from this thread and may wrap; bound it
+        const u64 queued =
+            std::max<i64>(0, appsink_queued_.load(std::memory_order_relaxed)) +
+            std::min(ring_.Size(), ring_.Capacity());
+        stats.appsink_bytes = queued * frame_size_;
+        stats.frames_held = std::max<i64>(
+            0, frame_account_->frames.load(std::memory_order_relaxed));
+        stats.frame_bytes_held = std::max<i64>(
+            0, frame_account_->bytes.load(std::memory_order_relaxed));
+        stats.cpu_convert_ms = convert_cpu_ns_.Load() / 1e6;
+        stats.convert_thread = static_cast<ThreadKind>(
+            convert_thread_.load(std::memory_order_relaxed));
+        stats.stalls = stalls_.Load();
+        stats.reconnects = reconnects_.Load();
+        stats.restarts_failed = restarts_failed_.Load();
+        stats.recoveries = recoveries_.Load();
+        stats.recovery_ms_total = recovery_ms_total_.Load();
+        stats.recovery_ms_max =
+            recovery_ms_max_.load(std::memory_order_relaxed);
+        return stats;
     }
 
-    static up<StreamHandler> OpenStream(i32 id, const std::string &uri,
-                                        u32 retry_count = 3) {
+    /**
+     * @brief Size in bytes of a frame as negotiated on the appsink caps,
+     * including row padding
+     */
+    size_t GetFrameSize() const { return frame_size_; }
+
+    /**
+     * @brief Base time of the pipeline running the stream. PTS plus base
+     * time is the clock time a frame was due, comparable across streams as
+     * every pipeline runs on the system clock.
+     */
+    GstClockTime GetBaseTime() const {
+        GstElement *pipeline = host_pipeline_ ? host_pipeline_ : pipeline_;
+        return pipeline ? gst_element_get_base_time(pipeline) : 0;
+    }
+
+    /**
+     * @brief Time between consecutive frames reaching the appsink (push
+     * mode) or consecutive pulls (pull mode), in microseconds
+     */
+    const LatencyHistogram &InterFrameGapUs() const {
+        return inter_frame_gap_us_;
+    }
+
+    /**
+     * @brief Push mode only. Time a frame spent queued between reaching the
+     * appsink and being popped by the consumer, in microseconds
+     */
+    const LatencyHistogram &QueueResidencyUs() const {
+        return queue_residency_us_;
+    }
+
+    /**
+     * @brief Opens the stream and waits until it is ready, retrying up to
+     * @p retry_count times. To open many streams at once, construct the
+     * handlers first and wait for them afterwards instead.
+     * @returns The stream handler, or nullptr if the stream could not be
+     * opened
+     */
+    static up<StreamHandler>
+    OpenStream(i32 id, const std::string &uri,
+               u32 retry_count = DEFAULT_OPEN_RETRY_COUNT,
+               const StreamOptions &options = {}) {
         for (u32 i = 0; i < retry_count; ++i) {
             up<StreamHandler> stream_handler =
-                std::make_unique<StreamHandler>(id, uri, 30);
-            if (stream_handler->IsStreamOpen()) {
+                std::make_unique<StreamHandler>(id, uri, options);
+            if (stream_handler->WaitUntilReady(
+                    std::chrono::seconds(INITIALIZATION_TIMEOUT_SECONDS))) {
                 return stream_handler;
             }
+            stream_handler->LogStartupFailure();
         }
         return nullptr;
     }
 
+    /**
+     * @brief Logs the pipeline state of a stream that did not become ready
+     */
+    void LogStartupFailure() const {
+        if (!pipeline_) {
+            return;
+        }
+        GstState state;
+        GstState pending;
+        GstStateChangeReturn ret =
+            gst_element_get_state(pipeline_, &state, &pending, 0);
+        ERROR << "Stream [" << id_ << "]: Not ready after " << Elapsed() / 1000
+              << " ms, pipeline state: " << gst_element_state_get_name(state)
+              << ", pending: " << gst_element_state_get_name(pending)
+              << ", return: " << ret;
+    }
+
+    /**
+     * @returns The gst_parse_launch description of a stream's pipeline
+     */
+    static std::string PipelineDescription(const std::string &uri,
+                                           const OutputSpec &output,
+                                           int fps_limit,
+                                           const ThreadingOptions &threading) {
+        const std::string appsink_caps = output.ToCaps();
+        const std::string frame_rate_caps =
+            "max-rate=" + std::to_string(fps_limit) + " drop-only=true";
+        const std::string convert_threads =
+            threading.convert_threads == ThreadingOptions::ELEMENT_DEFAULT
+                ? ""
+                : " n-threads=" + std::to_string(threading.convert_threads);
+        // Rate-limit first so only kept frames are scaled and converted, and
+        // scale before converting so the conversion runs at output size
+        return "uridecodebin name=decode uri=" + uri +
+               " ! videorate name=rate " + frame_rate_caps +
+               " ! videoscale name=scale add-borders=" +
+               (output.keep_aspect ? "true" : "false") + convert_threads +
+               " ! videoconvert" + convert_threads +
+               " ! queue name=queue max-size-buffers=3 leaky=downstream ! " +
+               "appsink sync=false name=sink caps=\"" + appsink_caps + "\"";
+    }
+
+    /**
+     * @brief Initializes GStreamer once per process.
+     * @returns false if initialization failed
+     */
+    static bool InitGStreamer() {
+        static std::once_flag once;
+        static bool initialized = false;
+        std::call_once(once, []() {
+            GError *error = nullptr;
+            initialized = gst_init_check(nullptr, nullptr, &error);
+            if (error) {
+                ERROR << error->message;
+                g_clear_error(&error);
+            }
+        });
+        return initialized;
+    }
+
   private:
+    friend class MultiStreamPipeline;
+    friend class StreamWatchdog;
+
+    static StreamOptions WithFpsLimit(int fps_limit) {
+        StreamOptions options;
+        options.fps_limit = fps_limit;
+        return options;
+    }
+
     int id_;
     std::string stream_uri_;
-    bool is_stream_open_;
+    atm<bool> is_stream_open_;
+
+    atm<int> fps_limit_;
+    OutputSpec output_;
+    ThreadingOptions threading_;
+    DecodeSkipper decode_skipper_;
+    up<PreEventBuffer> pre_event_;
+    /**
+     * @brief Written by the streaming thread whenever the appsink caps are
+     * (re)negotiated
+     */
+    atm<int> stream_width_;
+    atm<int> stream_height_;
+    atm<size_t> frame_size_{0};
+
+    /**
+     * @brief Startup milestones in us since created_, -1 until reached
+     */
+    Frame::Clock::time_point created_ = Frame::Clock::now();
+    atm<i64> connect_us_{-1};
+    atm<i64> caps_us_{-1};
+    atm<i64> first_frame_us_{-1};
+    std::mutex ready_mutex_;
+    std::condition_variable ready_cv_;
+
+    struct QueuedSample {
+        GstSample *sample = nullptr;
+        Frame::Clock::time_point arrival;
+    };
 
-    int fps_limit_;
-    int stream_width_;
-    int stream_height_;
+    DeliveryMode delivery_mode_;
+    /**
+     * @brief Samples handed over by the appsink streaming thread in push mode
+     */
+    SpscRing<QueuedSample> ring_;
+    std::function<void()> on_frame_ready_;
 
+    LatencyHistogram inter_frame_gap_us_;
+    LatencyHistogram queue_residency_us_;
+    /**
+     * @brief Last appsink arrival, only touched by the streaming thread
+     */
+    Frame::Clock::time_point last_arrival_;
+    /**
+     * @brief Last pull, only touched by the consumer thread
+     */
+    Frame::Clock::time_point last_pull_;
+
+    /**
+     * @brief Pipeline hosting this stream's branch, null if the stream owns
+     * its own pipeline
+     */
+    GstElement *host_pipeline_;
+    /**
+     * @brief The stream's own pipeline, or its branch bin inside
+     * host_pipeline_
+     */
     GstElement *pipeline_;
     GstElement *appsink_;
+    GstElement *videorate_ = nullptr;
+    GstElement *queue_ = nullptr;
+
+    PaddedCounter frames_dropped_queue_;
+    PaddedCounter frames_dropped_ring_;
+    PaddedCounter frames_skipped_latest_;
+    PaddedCounter frames_delivered_;
+    PaddedCounter bytes_delivered_;
+    PaddedCounter frames_invalid_;
+    PaddedCounter short_reads_;
+    PaddedCounter convert_cpu_ns_;
+    /**
+     * @brief Samples that reached the appsink and were not pulled yet
+     */
+    atm<i64> appsink_queued_{0};
+    sp<FrameAccount> frame_account_ = std::make_shared<FrameAccount>();
+    /**
+     * @brief Thread CPU time when the frame being converted entered
+     * videoscale; only touched by that streaming thread
+     */
+    u64 convert_start_ns_ = 0;
+    atm<u8> convert_thread_{static_cast<u8>(ThreadKind::Other)};
+
+    /**
+     * @brief Set while a StreamWatchdog watches the stream; errors then
+     * leave the stream open for the watchdog to recover instead of closing it
+     */
+    atm<bool> watched_{false};
+    atm<bool> error_pending_{false};
+    atm<bool> stalled_{false};
+    /**
+     * @brief Last buffer reaching the appsink, in us since created_
+     */
+    atm<i64> last_frame_us_{-1};
+    PaddedCounter stalls_;
+    PaddedCounter reconnects_;
+    PaddedCounter restarts_failed_;
+    PaddedCounter recoveries_;
+    PaddedCounter recovery_ms_total_;
+    atm<u64> recovery_ms_max_{0};
+
+    /**
+     * @brief Set by the host pipeline and the watchdog to unregister the
+     * stream before it is torn down
+     */
+    vec<std::function<void()>> on_detach_;
 
     void CheckError(GError *&error) {
         if (error) {
@@ -123,28 +726,35 @@ class StreamHandler {
         }
     }
 
-    void InitGStreamer() {
-        GError *error = nullptr;
-        gst_init_check(nullptr, nullptr, &error);
-        CheckError(error);
-    }
-
     void CreateNewPipeline() {
         GError *error = nullptr;
 
-        const std::string kAppsinkCaps =
-            "video/x-raw,format=RGB,pixel-aspect-ratio=1/1";
-        const std::string frame_rate_caps =
-            "max-rate=" + std::to_string(fps_limit_) + " drop-only=true";
-        const std::string pipeline_description =
-            "uridecodebin uri=" + stream_uri_ +
-            " ! videoconvert ! videoscale !"
-            " videorate " +
-            frame_rate_caps +
-            " ! queue max-size-buffers=3 leaky=downstream ! " +
-            "appsink sync=false name=sink caps=\"" + kAppsinkCaps + "\"";
-        pipeline_ = gst_parse_launch(pipeline_description.c_str(), &error);
-        CheckError(error);
+        const std::string pipeline_description = PipelineDescription(
+            stream_uri_, output_, fps_limit_.load(), threading_);
+        // The name tells stream_threads which stream a thread works for
+        const std::string name = "stream" + std::to_string(id_);
+        if (!host_pipeline_) {
+            pipeline_ = gst_parse_launch(pipeline_description.c_str(), &error);
+            CheckError(error);
+            if (pipeline_) {
+                gst_object_set_name(GST_OBJECT(pipeline_), name.c_str());
+            }
+        } else {
+            pipeline_ = gst_parse_bin_from_description(
+                pipeline_description.c_str(), FALSE, &error);
+            CheckError(error);
+            if (pipeline_) {
+                gst_object_set_name(GST_OBJECT(pipeline_), name.c_str());
+                // Own a reference besides the one the host takes
+                gst_object_ref_sink(pipeline_);
+                if (!gst_bin_add(GST_BIN(host_pipeline_), pipeline_)) {
+                    ERROR << "Unable to add stream [" << id_
+                          << "] to the shared pipeline";
+                    gst_object_unref(pipeline_);
+                    pipeline_ = nullptr;
+                }
+            }
+        }
 
         if (!pipeline_) {
             ERROR << "Unable to create gstreamer pipeline";
@@ -153,6 +763,9 @@ class StreamHandler {
     }
 
     void UpdateAppsink() {
+        if (!pipeline_) {
+            return;
+        }
         appsink_ = gst_bin_get_by_name(GST_BIN(pipeline_), "sink");
         if (!appsink_) {
             ERROR << "Unable to get app sink";
@@ -160,7 +773,148 @@ class StreamHandler {
         }
     }
 
+    /**
+     * @brief Hooks up the drop counters: videorate keeps its own "in"/"drop"
+     * counts, the leaky queue reports each leaked buffer through "overrun".
+     */
+    void ConnectCounters() {
+        if (!pipeline_) {
+            return;
+        }
+        GstElement *decode = gst_bin_get_by_name(GST_BIN(pipeline_), "decode");
+        if (decode) {
+            // The decoder is created by a nested decodebin once the stream
+            // type is known, so it only shows up as a deep element
+            g_signal_connect(decode, "deep-element-added",
+                             G_CALLBACK(&StreamHandler::OnDecodeElementAdded),
+                             this);
+            gst_object_unref(decode);
+        }
+        if (threading_.convert_threads != ThreadingOptions::ELEMENT_DEFAULT) {
+            INFO << "Stream [" << id_
+                 << "]: videoscale/videoconvert n-threads = "
+                 << threading_.convert_threads;
+        }
+
+        videorate_ = gst_bin_get_by_name(GST_BIN(pipeline_), "rate");
+
+        queue_ = gst_bin_get_by_name(GST_BIN(pipeline_), "queue");
+        if (queue_) {
+            g_signal_connect(queue_, "overrun",
+                             G_CALLBACK(&StreamHandler::OnQueueOverrun), this);
+            AddBufferProbe(queue_, &StreamHandler::OnConvertExit);
+        }
+        GstElement *scale = gst_bin_get_by_name(GST_BIN(pipeline_), "scale");
+        if (scale) {
+            AddBufferProbe(scale, &StreamHandler::OnConvertEnter);
+            gst_object_unref(scale);
+        }
+    }
+
+    void AddBufferProbe(GstElement *element, GstPadProbeCallback callback) {
+        GstPad *pad = gst_element_get_static_pad(element, "sink");
+        if (pad) {
+            gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, callback, this,
+                              nullptr);
+            gst_object_unref(pad);
+        }
+    }
+
+    /**
+     * @brief videoscale and videoconvert run inline on the thread pushing
+     * frames out of videorate, so their CPU time is the thread's between
+     * a frame entering videoscale and reaching the queue
+     */
+    static GstPadProbeReturn OnConvertEnter(GstPad *, GstPadProbeInfo *,
+                                            gpointer user_data) {
+        auto *self = static_cast<StreamHandler *>(user_data);
+        self->convert_start_ns_ = ThreadCpuNs();
+        self->convert_thread_.store(
+            static_cast<u8>(stream_threads::CurrentKind()),
+            std::memory_order_relaxed);
+        return GST_PAD_PROBE_OK;
+    }
+
+    static GstPadProbeReturn OnConvertExit(GstPad *, GstPadProbeInfo *,
+                                           gpointer user_data) {
+        auto *self = static_cast<StreamHandler *>(user_data);
+        if (self->convert_start_ns_) {
+            self->convert_cpu_ns_.Add(ThreadCpuNs() - self->convert_start_ns_);
+            self->convert_start_ns_ = 0;
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    /**
+     * @brief Sets up video decoders as decodebin plugs them, before they see
+     * caps and start their threads: installs the pre-event buffer and the
+     * decode skipper and applies decoder_threads
+     */
+    static void OnDecodeElementAdded(GstBin *, GstBin *, GstElement *element,
+                                     gpointer user_data) {
+        auto *self = static_cast<StreamHandler *>(user_data);
+        GstElementFactory *factory = gst_element_get_factory(element);
+        if (!factory) {
+            return;
+        }
+        const gchar *klass = gst_element_factory_get_metadata(
+            factory, GST_ELEMENT_METADATA_KLASS);
+        if (!klass || !strstr(klass, "Decoder") || !strstr(klass, "Video")) {
+            return;
+        }
+
+        if (self->pre_event_) {
+            // Ahead of the skipper, so skipped units are kept as well
+            self->pre_event_->Attach(element);
+        }
+        self->decode_skipper_.Attach(element);
+
+        const i32 threads = self->threading_.decoder_threads;
+        if (threads == ThreadingOptions::ELEMENT_DEFAULT) {
+            return;
+        }
+
+        if (!g_object_class_find_property(G_OBJECT_GET_CLASS(element),
+                                          "max-threads")) {
+            WARNING << "Stream [" << self->id_ << "]: Decoder "
+                    << GST_OBJECT_NAME(factory)
+                    << " has no max-threads property, keeping its default";
+            return;
+        }
+        g_object_set(element, "max-threads", threads, nullptr);
+        INFO << "Stream [" << self->id_ << "]: Decoder "
+             << GST_OBJECT_NAME(factory) << " max-threads = " << threads;
+    }
+
+    static void OnQueueOverrun(GstElement *, gpointer user_data) {
+        static_cast<StreamHandler *>(user_data)->frames_dropped_queue_.Add();
+    }
+
+    Frame Deliver(Frame frame) {
+        if (!frame.IsValid()) {
+            frames_invalid_.Add();
+            return frame;
+        }
+        frame.Track(frame_account_);
+        frames_delivered_.Add();
+        bytes_delivered_.Add(frame.Size());
+        if (frame.Size() < frame_size_) {
+            short_reads_.Add();
+        }
+        return frame;
+    }
+
     void Play() {
+        if (!pipeline_) {
+            return;
+        }
+        if (host_pipeline_) {
+            if (!gst_element_sync_state_with_parent(pipeline_)) {
+                ERROR << "Unable to start playing";
+                is_stream_open_ = false;
+            }
+            return;
+        }
         GstStateChangeReturn ret =
             gst_element_set_state(pipeline_, GST_STATE_PLAYING);
         if (ret == GST_STATE_CHANGE_FAILURE) {
@@ -169,39 +923,276 @@ class StreamHandler {
         }
     }
 
-    void UpdateStreamResolution() {
-        GstSample *sample = gst_app_sink_try_pull_sample(
-            GST_APP_SINK(appsink_),
-            INITIALIZATION_TIMEOUT_SECONDS * GST_SECOND);
-        if (!sample) {
-            GstState state;
-            GstState pending;
-            GstClockTime timeout = 5 * GST_SECOND;
-            GstStateChangeReturn ret =
-                gst_element_get_state(pipeline_, &state, &pending, timeout);
-
-            ERROR << "Stream [" << id_
-                  << "]: Pipeline state: " << gst_element_state_get_name(state)
-                  << ", pending: " << gst_element_state_get_name(pending)
-                  << ", return: " << ret;
-            is_stream_open_ = false;
+    /**
+     * @brief Switches the appsink to callback delivery. The callbacks run on
+     * the appsink streaming thread, which is the sole producer of ring_.
+     */
+    void EnablePushDelivery() {
+        GstAppSinkCallbacks callbacks = {};
+        callbacks.new_sample = &StreamHandler::OnNewSample;
+        callbacks.eos = &StreamHandler::OnEos;
+        gst_app_sink_set_callbacks(GST_APP_SINK(appsink_), &callbacks, this,
+                                   nullptr);
+    }
+
+    static GstFlowReturn OnNewSample(GstAppSink *appsink, gpointer user_data) {
+        auto *self = static_cast<StreamHandler *>(user_data);
+        // Also drain whatever queued up in the appsink before the callbacks
+        // were installed.
+        GstSample *sample = nullptr;
+        bool queued = false;
+        while ((sample = gst_app_sink_try_pull_sample(appsink, 0))) {
+            self->appsink_queued_.fetch_sub(1, std::memory_order_relaxed);
+            QueuedSample item{sample, Frame::Clock::now()};
+            self->RecordGap(self->last_arrival_, item.arrival);
+            self->last_arrival_ = item.arrival;
+            if (self->ring_.TryPush(item)) {
+                queued = true;
+            } else {
+                // Ring full: the consumer is behind, drop the new frame.
+                gst_sample_unref(sample);
+                self->frames_dropped_ring_.Add();
+            }
+        }
+        if (queued && self->on_frame_ready_) {
+            self->on_frame_ready_();
+        }
+        return GST_FLOW_OK;
+    }
+
+    Frame Consume(const QueuedSample &queued) {
+        Frame frame(queued.sample, queued.arrival);
+        auto residency = Frame::Clock::now() - queued.arrival;
+        queue_residency_us_.Record(
+            std::chrono::duration_cast<std::chrono::microseconds>(residency)
+                .count());
+        return Deliver(std::move(frame));
+    }
+
+    void RecordGap(Frame::Clock::time_point previous,
+                   Frame::Clock::time_point now) {
+        if (previous != Frame::Clock::time_point()) {
+            inter_frame_gap_us_.Record(
+                std::chrono::duration_cast<std::chrono::microseconds>(now -
+                                                                      previous)
+                    .count());
+        }
+    }
+
+    static void OnEos(GstAppSink *, gpointer user_data) {
+        auto *self = static_cast<StreamHandler *>(user_data);
+        WARNING << "Stream [" << self->id_ << "]: End of stream";
+        // Wake the consumer so it notices the stream is closed
+        self->MarkClosed();
+    }
+
+    i64 Elapsed() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   Frame::Clock::now() - created_)
+            .count();
+    }
+
+    /**
+     * @brief Records @p milestone unless it was already reached
+     * @returns Whether this call recorded it
+     */
+    bool Mark(atm<i64> &milestone) {
+        i64 unset = -1;
+        return milestone.compare_exchange_strong(unset, Elapsed());
+    }
+
+    /**
+     * @brief Wakes up WaitUntilReady()
+     */
+    void NotifyReadyWaiters() {
+        // Taking the lock orders the notify after the waiter's predicate
+        // check, so the wakeup cannot be lost
+        { std::lock_guard<std::mutex> lock(ready_mutex_); }
+        ready_cv_.notify_all();
+    }
+
+    /**
+     * @brief Closes the stream from a bus or streaming thread
+     */
+    void MarkClosed() {
+        is_stream_open_ = false;
+        NotifyReadyWaiters();
+        if (on_frame_ready_) {
+            on_frame_ready_();
+        }
+    }
+
+    /**
+     * @brief Hooks that replace pulling a throwaway first sample: the stream
+     * size comes from the appsink pad caps, and the startup milestones are
+     * recorded as they happen
+     */
+    void ConnectStartupProbes() {
+        if (!pipeline_ || !appsink_) {
             return;
         }
+        GstElement *decode = gst_bin_get_by_name(GST_BIN(pipeline_), "decode");
+        if (decode) {
+            g_signal_connect(decode, "source-setup",
+                             G_CALLBACK(&StreamHandler::OnSourceSetup), this);
+            gst_object_unref(decode);
+        }
 
-        GstCaps *caps = gst_sample_get_caps(sample);
-        GstVideoInfo info;
+        GstPad *pad = gst_element_get_static_pad(appsink_, "sink");
+        g_signal_connect(pad, "notify::caps",
+                         G_CALLBACK(&StreamHandler::OnCapsChanged), this);
+        gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER,
+                          &StreamHandler::OnBuffer, this, nullptr);
+        gst_object_unref(pad);
+
+        if (!host_pipeline_) {
+            // Nothing pops the bus of an own pipeline; catch errors as they
+            // are posted so a failing stream does not wait for the timeout
+            GstBus *bus = gst_element_get_bus(pipeline_);
+            gst_bus_set_sync_handler(bus, &StreamHandler::OnBusMessage, this,
+                                     nullptr);
+            gst_object_unref(bus);
+        }
+    }
+
+    static void OnSourceSetup(GstElement *, GstElement *source,
+                              gpointer user_data) {
+        g_signal_connect(source, "pad-added",
+                         G_CALLBACK(&StreamHandler::OnSourcePadAdded),
+                         user_data);
+    }
+
+    static void OnSourcePadAdded(GstElement *, GstPad *, gpointer user_data) {
+        auto *self = static_cast<StreamHandler *>(user_data);
+        self->Mark(self->connect_us_);
+    }
+
+    static void OnCapsChanged(GstPad *pad, GParamSpec *, gpointer user_data) {
+        auto *self = static_cast<StreamHandler *>(user_data);
+        GstCaps *caps = gst_pad_get_current_caps(pad);
         if (!caps) {
-            ERROR << "Sample has no caps";
-            is_stream_open_ = false;
+            // Caps are cleared when the pad is deactivated
             return;
-        } else if (!gst_video_info_from_caps(&info, caps)) {
-            ERROR << "Failed to parse video info from caps";
-            is_stream_open_ = false;
+        }
+        GstVideoInfo info;
+        bool parsed = gst_video_info_from_caps(&info, caps);
+        gst_caps_unref(caps);
+        if (!parsed) {
+            ERROR << "Stream [" << self->id_
+                  << "]: Failed to parse video info from caps";
             return;
+        }
+
+        self->stream_width_ = info.width;
+        self->stream_height_ = info.height;
+        self->frame_size_ = GST_VIDEO_INFO_SIZE(&info);
+        self->Mark(self->connect_us_);
+        if (self->Mark(self->caps_us_)) {
+            INFO << "Stream [" << self->id_ << "]: Ready, " << info.width << "x"
+                 << info.height << ", connect = " << self->connect_us_ / 1000
+                 << " ms, caps = " << self->caps_us_ / 1000 << " ms";
+            self->NotifyReadyWaiters();
+        }
+    }
+
+    static GstPadProbeReturn OnBuffer(GstPad *, GstPadProbeInfo *,
+                                      gpointer user_data) {
+        auto *self = static_cast<StreamHandler *>(user_data);
+        self->appsink_queued_.fetch_add(1, std::memory_order_relaxed);
+        const i64 now_us = self->Elapsed();
+        self->last_frame_us_.store(now_us, std::memory_order_relaxed);
+        if (self->first_frame_us_ < 0 && self->Mark(self->first_frame_us_)) {
+            INFO << "Stream [" << self->id_ << "]: First frame after "
+                 << now_us / 1000 << " ms";
+        }
+        return GST_PAD_PROBE_OK;
+    }
+
+    /**
+     * @brief Handles an error posted by the stream's elements: watched
+     * streams are left to the watchdog, others are closed
+     */
+    void OnError(const gchar *message) {
+        if (watched_) {
+            WARNING << "Stream [" << id_ << "]: " << message
+                    << " -- Recovering the stream";
+            error_pending_ = true;
+        } else {
+            ERROR << "Stream [" << id_ << "]: " << message
+                  << " -- Closing the stream";
+            MarkClosed();
+        }
+    }
+
+    /**
+     * @brief Restarts the existing pipeline or branch by taking it through
+     * READY (which drops the RTSP session and flushes the elements) back to
+     * PLAYING. Must not be called from a streaming thread. Waits at most
+     * RESTART_STATE_TIMEOUT for READY.
+     * @returns false, after logging the error, if the pipeline failed to
+     * reach READY or to start playing again
+     */
+    bool Restart() {
+        if (!pipeline_) {
+            return false;
+        }
+        if (host_pipeline_) {
+            gst_element_set_locked_state(pipeline_, TRUE);
+        }
+        GstStateChangeReturn ret =
+            gst_element_set_state(pipeline_, GST_STATE_READY);
+        if (ret != GST_STATE_CHANGE_FAILURE) {
+            ret = gst_element_get_state(
+                pipeline_, nullptr, nullptr,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    RESTART_STATE_TIMEOUT)
+                    .count());
+        }
+        if (ret == GST_STATE_CHANGE_FAILURE) {
+            ERROR << "Stream [" << id_ << "]: Pipeline failed to go to READY";
+            if (host_pipeline_) {
+                gst_element_set_locked_state(pipeline_, FALSE);
+            }
+            return false;
+        }
+        if (ret == GST_STATE_CHANGE_ASYNC) {
+            WARNING << "Stream [" << id_ << "]: Pipeline did not reach READY "
+                    << "within " << RESTART_STATE_TIMEOUT.count() << " s";
+        }
+        error_pending_ = false;
+        // READY flushed the samples queued in the appsink
+        appsink_queued_ = 0;
+
+        bool playing;
+        if (host_pipeline_) {
+            gst_element_set_locked_state(pipeline_, FALSE);
+            playing = gst_element_sync_state_with_parent(pipeline_);
         } else {
-            stream_width_ = info.width;
-            stream_height_ = info.height;
+            playing = gst_element_set_state(pipeline_, GST_STATE_PLAYING) !=
+                      GST_STATE_CHANGE_FAILURE;
+        }
+        if (!playing) {
+            ERROR << "Stream [" << id_ << "]: Pipeline failed to go from "
+                  << "READY to PLAYING";
+        }
+        return playing;
+    }
+
+    static GstBusSyncReply OnBusMessage(GstBus *, GstMessage *message,
+                                        gpointer user_data) {
+        auto *self = static_cast<StreamHandler *>(user_data);
+        stream_threads::OnStreamStatus(message);
+        // Errors posted while the destructor tears the pipeline down find
+        // the stream already closed
+        if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR &&
+            self->is_stream_open_) {
+            GError *error = nullptr;
+            gchar *debug = nullptr;
+            gst_message_parse_error(message, &error, &debug);
+            self->OnError(error->message);
+            g_clear_error(&error);
+            g_free(debug);
         }
-        gst_sample_unref(sample);
+        return GST_BUS_DROP;
     }
 };
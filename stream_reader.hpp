@@ -0,0 +1,327 @@
+#pragma once
+
+#include "executor.hpp"
+#include "frame_batcher.hpp"
+#include "logging.hpp"
+#include "multi_stream_pipeline.hpp"
+#include "shm_frame_exporter.hpp"
+#include "stream_handler.hpp"
+#include "stream_registry.hpp"
+#include "stream_watchdog.hpp"
+#include "thread_cpu_sampler.hpp"
+#include "types.hpp"
+#include <chrono>
+#include <future>
+#include <string>
+
+/**
+ * @brief Reads a fixed number of frames from one stream without owning a
+ * thread. The stream runs in push mode and every new frame schedules a drain
+ * task on the shared executor; at most one drain task per stream is queued or
+ * running at any time.
+ *
+ * The stream is either a pipeline of the reader's own or, with ShareVia(), a
+ * subscription to a pipeline shared with every reader of the same URI.
+ */
+class StreamReader {
+  public:
+    StreamReader() = delete;
+    StreamReader(const StreamReader &) = delete;
+
+    /**
+     * @param uri Stream to read, opened with uridecodebin
+     * @param options Output and threading settings; delivery is always push
+     * @param shm_slots If not 0, every frame read is also exported to a
+     * shared-memory ring of this many slots named shm::RingName(id)
+     */
+    StreamReader(i32 id, const std::string &uri, u32 frame_count,
+                 const StreamOptions &options, WorkStealingExecutor &executor,
+                 u32 shm_slots = 0)
+        : id_(id), uri_(uri), frame_count_(frame_count), options_(options),
+          executor_(executor), read_count_(0), started_(false),
+          scheduled_(false), done_(false) {
+        if (shm_slots) {
+            exporter_ = std::make_unique<ShmFrameExporter>(shm::RingName(id),
+                                                           shm_slots);
+        }
+    }
+
+    ~StreamReader() {
+        // Stops the pipeline or unsubscribes, so no more frame callbacks
+        // reach this reader
+        stream_handler_.reset();
+        subscription_.reset();
+    }
+
+    /**
+     * @brief Hands the stream's frames to @p batcher instead of draining them
+     * on the executor. Must be called before Start(); the owner of the
+     * batcher reports the frames batched with AddBatchedFrame().
+     */
+    void BatchWith(FrameBatcher *batcher) { batcher_ = batcher; }
+
+    /**
+     * @brief Reads the stream through a subscription of @p registry instead
+     * of a pipeline of its own. Must be called before Start(). Shared
+     * streams are neither batched nor watched.
+     */
+    void ShareVia(StreamRegistry *registry) { registry_ = registry; }
+
+    /**
+     * @brief Starts opening the stream and returns immediately; Poll()
+     * completes the opening.
+     * @param shared_pipeline If not null, the stream is opened as a branch
+     * of this pipeline
+     * @param watchdog If not null, watches the stream once it is open
+     */
+    void Start(MultiStreamPipeline *shared_pipeline, StreamWatchdog *watchdog) {
+        shared_pipeline_ = shared_pipeline;
+        watchdog_ = watchdog;
+        StartAttempt();
+    }
+
+    /**
+     * @brief Advances opening: starts reading once the stream is ready,
+     * restarts it if it failed or timed out, up to DEFAULT_OPEN_RETRY_COUNT
+     * attempts in total.
+     * @returns true once the stream is open or given up on
+     */
+    bool Poll() {
+        if (started_ || done_) {
+            return true;
+        }
+        const StreamHandler *stream = Stream();
+        if (stream && stream->IsStreamOpen() && stream->IsReady()) {
+            INFO << "Stream [" << id_ << "]: Opened stream, stream size = "
+                 << stream->GetStreamWidth() << "x" << stream->GetStreamHeight()
+                 << " " << stream->GetOutputSpec().format
+                 << ", attempts = " << attempts_;
+            if (watchdog_ && stream_handler_) {
+                watchdog_->Watch(stream_handler_.get());
+            }
+            start_ = std::chrono::steady_clock::now();
+            started_ = true;
+            if (batcher_ && stream_handler_) {
+                batcher_->AddStream(stream_handler_.get());
+                return true;
+            }
+            // Frames may have been queued while the stream was opening
+            Schedule();
+            return true;
+        }
+
+        bool timed_out = std::chrono::steady_clock::now() - attempt_start_ >=
+                         std::chrono::seconds(INITIALIZATION_TIMEOUT_SECONDS);
+        if (stream && stream->IsStreamOpen() && !timed_out) {
+            return false;
+        }
+
+        if (stream) {
+            stream->LogStartupFailure();
+        }
+        if (stream && attempts_ < DEFAULT_OPEN_RETRY_COUNT) {
+            WARNING << "Stream [" << id_ << "]: Retrying to open the stream";
+            StartAttempt();
+            return false;
+        }
+        ERROR << "Stream [" << id_ << "]: Failed to open stream";
+        done_ = true;
+        result_.set_value(0);
+        return true;
+    }
+
+    /**
+     * @brief Counts a frame of this stream that went into a batch; reading is
+     * done after frame_count of them. Called from the batching thread only.
+     */
+    void AddBatchedFrame() {
+        if (started_ && !done_ && ++read_count_ >= frame_count_) {
+            Finish();
+        }
+    }
+
+    /**
+     * @brief Ends batched reading short of frame_count, once the batcher has
+     * no more frames
+     */
+    void StopBatching() {
+        if (started_ && !done_) {
+            Finish();
+        }
+    }
+
+    bool IsDone() const { return done_; }
+
+    /**
+     * @returns Startup milestones of the last opening attempt. Must be called
+     * from the thread that calls Poll().
+     */
+    StartupTimes GetStartupTimes() const {
+        if (const StreamHandler *stream = Stream()) {
+            return stream->GetStartupTimes();
+        }
+        StartupTimes times;
+        times.stream_id = id_;
+        return times;
+    }
+
+    /**
+     * @returns The number of frames read, available once reading is done
+     */
+    fut<u32> Result() { return result_.get_future(); }
+
+    /**
+     * @returns The opened stream, nullptr while opening or if it failed. A
+     * shared stream is the same for every reader subscribed to it.
+     */
+    const StreamHandler *Handler() const {
+        return started_ ? Stream() : nullptr;
+    }
+
+    /**
+     * @brief Counters of the frames this reader received: the stream's, or
+     * this subscriber's deliveries for a shared stream. Only valid once
+     * Handler() is not null.
+     */
+    StreamStats Snapshot() const {
+        StreamStats stats = subscription_ ? subscription_->Snapshot()
+                                          : stream_handler_->Snapshot();
+        stats.cpu_consumer_ms = ConsumerCpuMs();
+        return stats;
+    }
+
+    /**
+     * @brief CPU time the executor spent processing this stream's frames.
+     * Workers are shared by all streams, so it is measured per drain rather
+     * than attributed by thread.
+     */
+    double ConsumerCpuMs() const {
+        return consumer_cpu_ns_.load(std::memory_order_relaxed) / 1e6;
+    }
+
+  private:
+    i32 id_;
+    std::string uri_;
+    u32 frame_count_;
+    StreamOptions options_;
+    WorkStealingExecutor &executor_;
+    MultiStreamPipeline *shared_pipeline_ = nullptr;
+    StreamWatchdog *watchdog_ = nullptr;
+    FrameBatcher *batcher_ = nullptr;
+    StreamRegistry *registry_ = nullptr;
+    up<StreamHandler> stream_handler_;
+    up<StreamSubscription> subscription_;
+    up<ShmFrameExporter> exporter_;
+    u32 attempts_ = 0;
+    std::chrono::steady_clock::time_point attempt_start_;
+
+    u32 read_count_;
+    std::chrono::steady_clock::time_point start_;
+    std::promise<u32> result_;
+
+    atm<bool> started_;
+    atm<bool> scheduled_;
+    atm<bool> done_;
+    atm<u64> consumer_cpu_ns_{0};
+
+    /**
+     * @returns The stream read from, nullptr before the first attempt
+     */
+    const StreamHandler *Stream() const {
+        return subscription_ ? &subscription_->Stream().Handler()
+                             : stream_handler_.get();
+    }
+
+    void StartAttempt() {
+        StreamOptions options = options_;
+        options.delivery_mode = DeliveryMode::Push;
+        if (batcher_ && !registry_) {
+            options.on_frame_ready = batcher_->FrameReadyCallback();
+        } else {
+            options.on_frame_ready = [this]() { Schedule(); };
+        }
+
+        // Stop the previous attempt before starting the next one
+        stream_handler_.reset();
+        subscription_.reset();
+        ++attempts_;
+        attempt_start_ = std::chrono::steady_clock::now();
+        if (registry_) {
+            SubscriberOptions subscriber;
+            subscriber.fps_limit = options.fps_limit;
+            subscriber.ring_capacity = options.ring_capacity;
+            subscriber.on_frame_ready = options.on_frame_ready;
+            subscription_ =
+                registry_->Subscribe(id_, uri_, options, subscriber);
+            return;
+        }
+        stream_handler_ =
+            shared_pipeline_
+                ? shared_pipeline_->StartStream(id_, uri_, options)
+                : std::make_unique<StreamHandler>(id_, uri_, options);
+    }
+
+    /**
+     * @brief Called on the appsink streaming thread for every new frame
+     */
+    void Schedule() {
+        if (!started_ || done_) {
+            return;
+        }
+        if (!scheduled_.exchange(true)) {
+            executor_.Submit([this]() { Drain(); });
+        }
+    }
+
+    void Drain() {
+        const u64 cpu_start = ThreadCpuNs();
+        const StreamHandler *stream = Stream();
+        size_t frame_size = stream->GetFrameSize();
+
+        while (read_count_ < frame_count_) {
+            Frame frame = subscription_ ? subscription_->TryPop()
+                                        : stream_handler_->TryPop();
+            if (!frame) {
+                break;
+            }
+            if (frame.Size() == frame_size) {
+                ++read_count_;
+                if (exporter_) {
+                    exporter_->Export(frame);
+                }
+            } else {
+                INFO << "Stream [" << id_ << "]: Read " << frame.Size() << "/"
+                     << frame_size << " bytes";
+            }
+        }
+        consumer_cpu_ns_.fetch_add(ThreadCpuNs() - cpu_start,
+                                   std::memory_order_relaxed);
+
+        if (read_count_ >= frame_count_ || !stream->IsStreamOpen()) {
+            return Finish();
+        }
+
+        scheduled_ = false;
+        // A frame queued while draining found scheduled_ set; pick it up
+        if (subscription_ ? subscription_->HasQueuedFrames()
+                          : stream_handler_->HasQueuedFrames()) {
+            Schedule();
+        }
+    }
+
+    void Finish() {
+        done_ = true;
+        double elapsed = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start_)
+                             .count();
+        double fps = read_count_ / elapsed;
+        INFO << "Stream [" << id_ << "]: Read " << read_count_ << "/"
+             << frame_count_ << " in " << elapsed << "s, FPS = " << fps;
+        if (exporter_) {
+            INFO << "Stream [" << id_ << "]: Exported "
+                 << exporter_->Published() << " frames to " << exporter_->Name()
+                 << ", " << exporter_->Oversized() << " too large for a slot";
+        }
+        result_.set_value(read_count_);
+    }
+};
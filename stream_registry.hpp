@@ -0,0 +1,541 @@
+#pragma once
+
+#include "frame.hpp"
+#include "gst/gst.h"
+#include "gst/gstsample.h"
+#include "logging.hpp"
+#include "spsc_ring.hpp"
+#include "stream_handler.hpp"
+#include "stream_stats.hpp"
+#include "types.hpp"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * @brief fps limit of a shared stream while one of its subscribers takes
+ * every frame; far above any camera rate, so videorate and the decode
+ * skipper let everything through
+ */
+constexpr int UNCAPPED_FPS_LIMIT = 1000;
+
+/**
+ * @brief What a subscriber gets when it falls behind.
+ * - DropNewest: frames queue up to the ring capacity, then new frames are
+ *   dropped (like DeliveryMode::Push).
+ * - LatestOnly: only the newest frame is kept, each new frame replaces the
+ *   one not popped yet.
+ */
+enum class SubscriberDropPolicy { DropNewest, LatestOnly };
+
+/**
+ * @brief Per-subscriber delivery settings of a shared stream
+ */
+struct SubscriberOptions {
+    /**
+     * @brief Frames per second this subscriber wants at most, 0 for every
+     * frame. Applied on top of the shared stream, which runs at the highest
+     * cap among its subscribers.
+     */
+    int fps_limit = 0;
+    SubscriberDropPolicy drop_policy = SubscriberDropPolicy::DropNewest;
+    /**
+     * @brief DropNewest: number of frames the subscriber's ring can hold
+     */
+    size_t ring_capacity = DEFAULT_RING_CAPACITY;
+    /**
+     * @brief Invoked on the streaming thread after a frame was queued for
+     * this subscriber, and when the stream closes. Must not subscribe to or
+     * unsubscribe from the stream.
+     */
+    std::function<void()> on_frame_ready;
+};
+
+class StreamSubscription;
+
+/**
+ * @brief One decoding StreamHandler whose frames are fanned out to any
+ * number of subscribers. The handler runs in push mode; its frame callback
+ * hands every frame to each subscriber as a new reference to the same
+ * sample, so the frame is decoded and converted once however many
+ * subscribers receive it.
+ *
+ * Owned jointly by the subscriptions (see StreamRegistry); the pipeline stops
+ * when the last one goes away.
+ */
+class SharedStream {
+  public:
+    SharedStream() = delete;
+    SharedStream(const SharedStream &) = delete;
+
+    SharedStream(i32 id, const std::string &uri, const StreamOptions &options,
+                 int fps_limit)
+        : uri_(uri) {
+        StreamOptions shared = options;
+        shared.fps_limit = fps_limit;
+        shared.delivery_mode = DeliveryMode::Push;
+        shared.on_frame_ready = [this]() { FanOut(); };
+        handler_ = std::make_unique<StreamHandler>(id, uri, shared);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            started_ = true;
+        }
+        // Frames may have been queued before handler_ was set
+        FanOut();
+    }
+
+    ~SharedStream() {
+        {
+            // Keep late frame callbacks away from the handler going down
+            std::lock_guard<std::mutex> lock(mutex_);
+            started_ = false;
+        }
+        handler_.reset();
+    }
+
+    const std::string &Uri() const { return uri_; }
+
+    const StreamHandler &Handler() const { return *handler_; }
+
+    u32 SubscriberCount() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return subscribers_.size();
+    }
+
+    /**
+     * @brief The handler's counters plus the subscriber count and the
+     * deliveries served by a shared decode
+     */
+    StreamStats Snapshot() const {
+        StreamStats stats = handler_->Snapshot();
+        stats.decodes_deduplicated = decodes_deduplicated_.Load();
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats.subscribers = subscribers_.size();
+        // Subscribers hold the frames; the handler's are released in FanOut
+        for (const Subscriber *subscriber : subscribers_) {
+            stats.frames_held += subscriber->FramesHeld();
+            stats.frame_bytes_held += subscriber->FrameBytesHeld();
+        }
+        return stats;
+    }
+
+    /**
+     * @brief fps limit the shared pipeline runs at for subscribers wanting
+     * at most @p subscriber_limits (0 for every frame): the highest of them,
+     * so every subscriber gets at least its rate
+     */
+    static int SharedFpsLimit(const vec<int> &subscriber_limits) {
+        int fps_limit = 0;
+        for (int wanted : subscriber_limits) {
+            fps_limit =
+                std::max(fps_limit, wanted > 0 ? wanted : UNCAPPED_FPS_LIMIT);
+        }
+        return fps_limit;
+    }
+
+  private:
+    friend class StreamSubscription;
+
+    struct QueuedSample {
+        GstSample *sample = nullptr;
+        Frame::Clock::time_point arrival;
+    };
+
+    /**
+     * @brief Delivery state of one subscription. Offer() runs on the
+     * streaming thread with SharedStream::mutex_ held, Pop() on the
+     * subscriber's consumer thread.
+     */
+    struct Subscriber {
+        SubscriberOptions options;
+        SpscRing<QueuedSample> ring;
+        /**
+         * @brief LatestOnly: the newest frame not popped yet
+         */
+        std::mutex latest_mutex;
+        QueuedSample latest;
+        /**
+         * @brief Earliest PTS the fps cap admits next, streaming thread only
+         */
+        GstClockTime next_pts = GST_CLOCK_TIME_NONE;
+        bool queued = false;
+        /**
+         * @brief Frames popped by the subscriber and not released yet
+         */
+        sp<FrameAccount> account = std::make_shared<FrameAccount>();
+
+        PaddedCounter frames_dropped_fps;
+        PaddedCounter frames_dropped_ring;
+        PaddedCounter frames_skipped_latest;
+        PaddedCounter frames_delivered;
+        PaddedCounter bytes_delivered;
+        PaddedCounter frames_invalid;
+
+        explicit Subscriber(const SubscriberOptions &subscriber_options)
+            : options(subscriber_options),
+              ring(subscriber_options.drop_policy ==
+                           SubscriberDropPolicy::DropNewest
+                       ? subscriber_options.ring_capacity
+                       : 1) {}
+
+        ~Subscriber() {
+            QueuedSample queued;
+            while (Pop(queued)) {
+                gst_sample_unref(queued.sample);
+            }
+        }
+
+        /**
+         * @returns Whether the frame was queued for the subscriber
+         */
+        bool Offer(const Frame &frame) {
+            if (!AdmitByRate(frame.Pts())) {
+                frames_dropped_fps.Add();
+                return false;
+            }
+            QueuedSample item{gst_sample_ref(frame.Sample()),
+                              frame.ArrivalTime()};
+            if (options.drop_policy == SubscriberDropPolicy::LatestOnly) {
+                std::lock_guard<std::mutex> lock(latest_mutex);
+                if (latest.sample) {
+                    gst_sample_unref(latest.sample);
+                    frames_skipped_latest.Add();
+                }
+                latest = item;
+            } else if (!ring.TryPush(item)) {
+                gst_sample_unref(item.sample);
+                frames_dropped_ring.Add();
+                return false;
+            }
+            queued = true;
+            return true;
+        }
+
+        bool Pop(QueuedSample &out) {
+            if (options.drop_policy == SubscriberDropPolicy::LatestOnly) {
+                std::lock_guard<std::mutex> lock(latest_mutex);
+                out = std::exchange(latest, QueuedSample());
+                return out.sample != nullptr;
+            }
+            return ring.TryPop(out);
+        }
+
+        u64 FramesHeld() const {
+            return std::max<i64>(
+                0, account->frames.load(std::memory_order_relaxed));
+        }
+
+        u64 FrameBytesHeld() const {
+            return std::max<i64>(
+                0, account->bytes.load(std::memory_order_relaxed));
+        }
+
+        bool HasQueuedFrames() {
+            if (options.drop_policy == SubscriberDropPolicy::LatestOnly) {
+                std::lock_guard<std::mutex> lock(latest_mutex);
+                return latest.sample != nullptr;
+            }
+            return !ring.Empty();
+        }
+
+        /**
+         * @brief Drop-only rate limiting on the PTS grid of the cap, so the
+         * delivered rate does not drift below it. A PTS far behind the grid
+         * (e.g. after a pipeline restart) starts a new grid.
+         */
+        bool AdmitByRate(GstClockTime pts) {
+            if (options.fps_limit <= 0 || !GST_CLOCK_TIME_IS_VALID(pts)) {
+                return true;
+            }
+            const GstClockTime interval = GST_SECOND / options.fps_limit;
+            if (GST_CLOCK_TIME_IS_VALID(next_pts) && pts < next_pts &&
+                next_pts - pts <= interval) {
+                return false;
+            }
+            next_pts = GST_CLOCK_TIME_IS_VALID(next_pts) && pts >= next_pts &&
+                               pts - next_pts < interval
+                           ? next_pts + interval
+                           : pts + interval;
+            return true;
+        }
+    };
+
+    std::string uri_;
+    up<StreamHandler> handler_;
+
+    /**
+     * @brief Guards subscribers_ and serializes FanOut(), which is the only
+     * consumer of the handler's ring
+     */
+    mutable std::mutex mutex_;
+    bool started_ = false;
+    vec<Subscriber *> subscribers_;
+    PaddedCounter decodes_deduplicated_;
+
+    void Add(Subscriber *subscriber) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        subscribers_.push_back(subscriber);
+        UpdateFpsLimit();
+    }
+
+    void Remove(Subscriber *subscriber) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        subscribers_.erase(
+            std::remove(subscribers_.begin(), subscribers_.end(), subscriber),
+            subscribers_.end());
+        UpdateFpsLimit();
+    }
+
+    /**
+     * @brief Runs the pipeline at the highest rate any subscriber wants
+     */
+    void UpdateFpsLimit() {
+        if (!started_ || subscribers_.empty()) {
+            return;
+        }
+        vec<int> limits;
+        for (const Subscriber *subscriber : subscribers_) {
+            limits.push_back(subscriber->options.fps_limit);
+        }
+        // Decode skipping follows at the next keyframe
+        handler_->SetFpsLimit(SharedFpsLimit(limits));
+    }
+
+    /**
+     * @brief Frame callback of the handler: runs on the appsink streaming
+     * thread, or on a bus thread when the stream closes
+     */
+    void FanOut() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!started_) {
+            return;
+        }
+        for (Frame frame = handler_->TryPop(); frame;
+             frame = handler_->TryPop()) {
+            u64 receivers = 0;
+            for (Subscriber *subscriber : subscribers_) {
+                receivers += subscriber->Offer(frame);
+            }
+            if (receivers > 1) {
+                decodes_deduplicated_.Add(receivers - 1);
+            }
+        }
+        const bool closed = !handler_->IsStreamOpen();
+        for (Subscriber *subscriber : subscribers_) {
+            if ((subscriber->queued || closed) &&
+                subscriber->options.on_frame_ready) {
+                subscriber->options.on_frame_ready();
+            }
+            subscriber->queued = false;
+        }
+    }
+};
+
+/**
+ * @brief A consumer's handle on a shared stream, from
+ * StreamRegistry::Subscribe. Frames are popped without blocking like in push
+ * mode; TryPop() must only be called from a single consumer thread.
+ * Unsubscribes when destroyed.
+ */
+class StreamSubscription {
+  public:
+    StreamSubscription() = delete;
+    StreamSubscription(const StreamSubscription &) = delete;
+
+    StreamSubscription(i32 id, sp<SharedStream> stream,
+                       const SubscriberOptions &options)
+        : id_(id), stream_(std::move(stream)),
+          subscriber_(std::make_unique<SharedStream::Subscriber>(options)) {
+        stream_->Add(subscriber_.get());
+    }
+
+    ~StreamSubscription() { stream_->Remove(subscriber_.get()); }
+
+    i32 GetId() const { return id_; }
+
+    bool IsStreamOpen() const { return stream_->Handler().IsStreamOpen(); }
+
+    bool IsReady() const { return stream_->Handler().IsReady(); }
+
+    size_t GetStreamWidth() const {
+        return stream_->Handler().GetStreamWidth();
+    }
+
+    size_t GetStreamHeight() const {
+        return stream_->Handler().GetStreamHeight();
+    }
+
+    size_t GetFrameSize() const { return stream_->Handler().GetFrameSize(); }
+
+    /**
+     * @brief The shared stream behind this subscription
+     */
+    const SharedStream &Stream() const { return *stream_; }
+
+    /**
+     * @brief Returns the next frame for this subscriber without blocking
+     * (the newest one with SubscriberDropPolicy::LatestOnly), or an invalid
+     * frame if none is ready. The frame may be shared with other
+     * subscribers and must only be read; it counts as held by this
+     * subscriber until released.
+     */
+    Frame TryPop() {
+        SharedStream::QueuedSample queued;
+        if (!subscriber_->Pop(queued)) {
+            return Frame();
+        }
+        Frame frame(queued.sample, queued.arrival);
+        if (!frame.IsValid()) {
+            subscriber_->frames_invalid.Add();
+            return frame;
+        }
+        frame.Track(subscriber_->account);
+        subscriber_->frames_delivered.Add();
+        subscriber_->bytes_delivered.Add(frame.Size());
+        return frame;
+    }
+
+    bool HasQueuedFrames() const { return subscriber_->HasQueuedFrames(); }
+
+    /**
+     * @brief This subscriber's delivery counters, plus the subscriber count
+     * and deduplicated decodes of the shared stream
+     */
+    StreamStats Snapshot() const {
+        StreamStats stats;
+        stats.stream_id = id_;
+        stats.frames_dropped_fps = subscriber_->frames_dropped_fps.Load();
+        stats.frames_dropped_ring = subscriber_->frames_dropped_ring.Load();
+        stats.frames_skipped_latest = subscriber_->frames_skipped_latest.Load();
+        stats.frames_delivered = subscriber_->frames_delivered.Load();
+        stats.bytes_delivered = subscriber_->bytes_delivered.Load();
+        stats.frames_invalid = subscriber_->frames_invalid.Load();
+        stats.frames_held = subscriber_->FramesHeld();
+        stats.frame_bytes_held = subscriber_->FrameBytesHeld();
+        stats.subscribers = stream_->SubscriberCount();
+        stats.decodes_deduplicated = stream_->decodes_deduplicated_.Load();
+        return stats;
+    }
+
+  private:
+    i32 id_;
+    sp<SharedStream> stream_;
+    up<SharedStream::Subscriber> subscriber_;
+};
+
+/**
+ * @brief Process-wide registry of shared streams keyed by URI and output
+ * spec. Subscribing to a URI that is already open with the same output
+ * reuses its pipeline (one RTSP session, one decode) instead of building a
+ * second StreamHandler; the pipeline is reference counted by its
+ * subscriptions and stops with the last one.
+ */
+class StreamRegistry {
+  public:
+    struct Stats {
+        /**
+         * @brief Shared streams currently open
+         */
+        u64 streams = 0;
+        u64 subscribers = 0;
+        /**
+         * @brief Subscribe() calls served by a stream that was already open
+         */
+        u64 opens_deduplicated = 0;
+        u64 subscribe_calls = 0;
+    };
+
+    StreamRegistry() = default;
+    StreamRegistry(const StreamRegistry &) = delete;
+
+    static StreamRegistry &Instance() {
+        static StreamRegistry registry;
+        return registry;
+    }
+
+    /**
+     * @brief Subscribes to @p uri, opening the stream if no subscriber has
+     * it open with the same output spec yet. Returns immediately; see
+     * StreamSubscription::IsReady(). The other @p options (threading,
+     * decode skipping) are taken from the subscriber that opens the stream.
+     * @param id Names the subscription, and the stream if this opens it
+     */
+    up<StreamSubscription> Subscribe(i32 id, const std::string &uri,
+                                     const StreamOptions &options = {},
+                                     const SubscriberOptions &subscriber = {}) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++subscribe_calls_;
+        RemoveClosed();
+
+        const std::string key = Key(uri, options.output);
+        sp<SharedStream> stream = streams_[key].lock();
+        // A closed stream stays with its subscribers; newcomers get a new one
+        if (stream && stream->Handler().IsStreamOpen()) {
+            ++opens_deduplicated_;
+            INFO << "Stream [" << id << "]: Sharing the open stream of " << uri
+                 << " (" << stream->SubscriberCount() << " subscriber(s))";
+        } else {
+            stream = std::make_shared<SharedStream>(id, uri, options,
+                                                    subscriber.fps_limit > 0
+                                                        ? subscriber.fps_limit
+                                                        : UNCAPPED_FPS_LIMIT);
+            streams_[key] = stream;
+        }
+        return std::make_unique<StreamSubscription>(id, std::move(stream),
+                                                    subscriber);
+    }
+
+    Stats GetStats() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        RemoveClosed();
+        Stats stats;
+        stats.opens_deduplicated = opens_deduplicated_;
+        stats.subscribe_calls = subscribe_calls_;
+        for (const auto &entry : streams_) {
+            if (sp<SharedStream> stream = entry.second.lock()) {
+                ++stats.streams;
+                stats.subscribers += stream->SubscriberCount();
+            }
+        }
+        return stats;
+    }
+
+    /**
+     * @brief Counters of every open shared stream
+     */
+    vec<StreamStats> Snapshot() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        vec<StreamStats> stats;
+        for (const auto &entry : streams_) {
+            if (sp<SharedStream> stream = entry.second.lock()) {
+                stats.push_back(stream->Snapshot());
+            }
+        }
+        return stats;
+    }
+
+  private:
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::weak_ptr<SharedStream>> streams_;
+    u64 opens_deduplicated_ = 0;
+    u64 subscribe_calls_ = 0;
+
+    static std::string Key(const std::string &uri, const OutputSpec &output) {
+        return uri + "|" + output.ToCaps() +
+               (output.keep_aspect ? "|keep_aspect" : "");
+    }
+
+    /**
+     * @brief Forgets streams whose last subscription is gone
+     */
+    void RemoveClosed() {
+        for (auto it = streams_.begin(); it != streams_.end();) {
+            it = it->second.expired() ? streams_.erase(it) : std::next(it);
+        }
+    }
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "spsc_ring.hpp"
+#include "thread_cpu_sampler.hpp"
+#include "types.hpp"
+#include <atomic>
+#include <functional>
+
+/**
+ * @brief Counter on its own cache line, so counters bumped by different
+ * threads (streaming thread, consumer thread) never share a line
+ */
+struct alignas(CACHE_LINE_SIZE) PaddedCounter {
+    atm<u64> value{0};
+
+    void Add(u64 n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+
+    u64 Load() const { return value.load(std::memory_order_relaxed); }
+};
+
+/**
+ * @brief Point-in-time copy of one stream's counters
+ */
+struct StreamStats {
+    i32 stream_id = -1;
+    /**
+     * @brief Encoded access units that reached the decoder's input, only
+     * counted while decode skipping is enabled
+     */
+    u64 access_units = 0;
+    /**
+     * @brief Access units dropped before decoding (see DecodeSkipper)
+     */
+    u64 frames_skipped_decode = 0;
+    /**
+     * @brief Frames that came out of the decoder (videorate input)
+     */
+    u64 frames_decoded = 0;
+    /**
+     * @brief Frames leaked by the leaky queue in front of the appsink
+     */
+    u64 frames_dropped_queue = 0;
+    /**
+     * @brief Frames dropped by videorate to honour the fps limit
+     */
+    u64 frames_dropped_videorate = 0;
+    /**
+     * @brief Push mode: frames dropped because the SPSC ring was full
+     */
+    u64 frames_dropped_ring = 0;
+    /**
+     * @brief Push mode: frames discarded by the "latest frame only" policy
+     */
+    u64 frames_skipped_latest = 0;
+    u64 frames_delivered = 0;
+    u64 bytes_delivered = 0;
+    /**
+     * @brief Frames pulled that could not be mapped; they are handed out
+     * invalid and not counted as delivered
+     */
+    u64 frames_invalid = 0;
+    /**
+     * @brief Delivered frames smaller than the negotiated frame size
+     */
+    u64 short_reads = 0;
+    /**
+     * @brief Times the StreamWatchdog found the stream stalled or failed
+     */
+    u64 stalls = 0;
+    /**
+     * @brief READY -> PLAYING restarts that succeeded, including ones that
+     * did not bring frames back
+     */
+    u64 reconnects = 0;
+    /**
+     * @brief Restarts whose state changes failed; not counted as reconnects
+     */
+    u64 restarts_failed = 0;
+    /**
+     * @brief Stalls that ended with frames flowing again
+     */
+    u64 recoveries = 0;
+    /**
+     * @brief Time from detecting a stall to the first frame after it, summed
+     * over and maximum of all recoveries
+     */
+    u64 recovery_ms_total = 0;
+    u64 recovery_ms_max = 0;
+    /**
+     * @brief Streams shared through the StreamRegistry: current subscribers,
+     * and deliveries served by a decode another subscriber also received
+     */
+    u64 subscribers = 0;
+    u64 decodes_deduplicated = 0;
+    /**
+     * @brief Subscriptions only: frames dropped to honour the subscriber's
+     * own fps cap
+     */
+    u64 frames_dropped_fps = 0;
+    /**
+     * @brief Compressed video held by the pre-event buffer: bytes and the
+     * stream time they cover
+     */
+    u64 pre_event_bytes = 0;
+    double pre_event_ms = 0;
+    /**
+     * @brief Decoded video held for the stream: in the queue in front of
+     * the appsink, queued in the appsink (and the push-mode ring), and in
+     * frame handles consumers have not released yet
+     */
+    u64 queue_bytes = 0;
+    u64 appsink_bytes = 0;
+    u64 frames_held = 0;
+    u64 frame_bytes_held = 0;
+    /**
+     * @brief CPU time spent on the stream since it started, per ThreadKind.
+     * Streaming threads are attributed by name (see ThreadCpuSampler);
+     * conversion and consumer time are measured where they run, since they
+     * share threads with other work.
+     */
+    double cpu_source_ms = 0;
+    double cpu_depay_ms = 0;
+    double cpu_decoder_ms = 0;
+    double cpu_convert_ms = 0;
+    double cpu_sink_ms = 0;
+    double cpu_consumer_ms = 0;
+    /**
+     * @brief Kind of the thread videoscale and videoconvert run on, whose
+     * time already includes cpu_convert_ms
+     */
+    ThreadKind convert_thread = ThreadKind::Other;
+};
+
+/**
+ * @brief Startup milestones of one stream in ms since its handler was
+ * created, negative until reached
+ */
+struct StartupTimes {
+    i32 stream_id = -1;
+    /**
+     * @brief The source produced its first pad, i.e. the RTSP session is set
+     * up (sources with static pads count as connected once caps are known)
+     */
+    double connect_ms = -1;
+    /**
+     * @brief Caps negotiated on the appsink pad; width, height and frame size
+     * are known from here on
+     */
+    double caps_ms = -1;
+    double first_frame_ms = -1;
+};
+
+using StreamStatsProvider = std::function<vec<StreamStats>()>;
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "gst/gst.h"
+#include "gst/gstelement.h"
+#include "gst/gstelementfactory.h"
+#include "gst/gstmessage.h"
+#include "gst/gstobject.h"
+#include "thread_cpu_sampler.hpp"
+#include "types.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <string>
+
+/**
+ * @brief Names GStreamer streaming threads after their stream and the kind
+ * of element driving them ("s3:decoder"), so ThreadCpuSampler can attribute
+ * their CPU time. Threads announce themselves with a stream-status ENTER
+ * message, posted synchronously from the new thread: handling it in a bus
+ * sync handler runs on the thread to name.
+ */
+namespace stream_threads {
+
+/**
+ * @brief Kind the calling thread was named with, Other if it was not
+ */
+inline ThreadKind &CurrentKind() {
+    static thread_local ThreadKind kind = ThreadKind::Other;
+    return kind;
+}
+
+inline void NameCurrentThread(const std::string &name, ThreadKind kind) {
+    // Linux keeps 15 characters and rejects longer names
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+    CurrentKind() = kind;
+}
+
+inline bool HasFactory(GstElement *element, const char *name) {
+    GstElementFactory *factory = gst_element_get_factory(element);
+    return factory && strcmp(gst_plugin_feature_get_name(factory), name) == 0;
+}
+
+/**
+ * @brief The kind of work a thread started by @p element does: the element
+ * itself and whatever it pushes into downstream on the same thread
+ */
+inline ThreadKind Classify(GstElement *element) {
+    GstElementFactory *factory = gst_element_get_factory(element);
+    const gchar *klass = factory ? gst_element_factory_get_metadata(
+                                       factory, GST_ELEMENT_METADATA_KLASS)
+                                 : nullptr;
+    if (HasFactory(element, "rtpjitterbuffer") ||
+        (klass && (strstr(klass, "Depayloader") || strstr(klass, "Parser")))) {
+        return ThreadKind::Depay;
+    }
+    if (klass && strstr(klass, "Source")) {
+        return ThreadKind::Source;
+    }
+    if (klass && strstr(klass, "Decoder")) {
+        return ThreadKind::Decoder;
+    }
+    if (klass && (strstr(klass, "Converter") || strstr(klass, "Scaler"))) {
+        return ThreadKind::Convert;
+    }
+    // Queues inside decodebin feed the decoder; the stream's own queue feeds
+    // the appsink
+    for (GstObject *parent = GST_OBJECT_PARENT(element); parent;
+         parent = GST_OBJECT_PARENT(parent)) {
+        if (GST_IS_ELEMENT(parent) &&
+            (HasFactory(GST_ELEMENT(parent), "decodebin") ||
+             HasFactory(GST_ELEMENT(parent), "decodebin3"))) {
+            return ThreadKind::Decoder;
+        }
+    }
+    if (HasFactory(element, "queue")) {
+        return ThreadKind::Sink;
+    }
+    return ThreadKind::Other;
+}
+
+/**
+ * @returns N of the closest ancestor of @p object named "stream<N>" (the
+ * name StreamHandler gives its pipeline or branch), -1 if there is none
+ */
+inline i32 StreamIdOf(GstObject *object) {
+    for (; object; object = GST_OBJECT_PARENT(object)) {
+        const char *name = GST_OBJECT_NAME(object);
+        if (name && strncmp(name, "stream", 6) == 0 && name[6] >= '0' &&
+            name[6] <= '9') {
+            return std::atoi(name + 6);
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Names the calling thread if @p message announces it entering a
+ * stream's element; call from a bus sync handler
+ */
+inline void OnStreamStatus(GstMessage *message) {
+    if (GST_MESSAGE_TYPE(message) != GST_MESSAGE_STREAM_STATUS) {
+        return;
+    }
+    GstStreamStatusType type;
+    GstElement *owner = nullptr;
+    gst_message_parse_stream_status(message, &type, &owner);
+    if (type != GST_STREAM_STATUS_TYPE_ENTER || !owner) {
+        return;
+    }
+    const i32 stream_id = StreamIdOf(GST_OBJECT(owner));
+    if (stream_id < 0) {
+        return;
+    }
+    const ThreadKind kind = Classify(owner);
+    NameCurrentThread(StreamThreadName(stream_id, kind), kind);
+}
+
+} // namespace stream_threads
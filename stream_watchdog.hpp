@@ -0,0 +1,287 @@
+#pragma once
+
+#include "logging.hpp"
+#include "stream_handler.hpp"
+#include "types.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+struct WatchdogOptions {
+    /**
+     * @brief A stream without a new frame for this long counts as stalled
+     */
+    std::chrono::milliseconds stall_timeout{3000};
+    /**
+     * @brief How long frames get to come back after the first restart; doubles
+     * with every further restart of the same stall, up to max_backoff
+     */
+    std::chrono::milliseconds initial_backoff{500};
+    std::chrono::milliseconds max_backoff{8000};
+    /**
+     * @brief Restarts per stall before the stream is closed, 0 for no limit
+     */
+    u32 max_reconnects = 5;
+};
+
+/**
+ * @brief Watches streams from a single thread and recovers those that stop
+ * delivering frames or report an error, by restarting their existing
+ * pipeline (READY -> PLAYING) with exponential backoff instead of building a
+ * new StreamHandler. Stalls, restarts and recovery times are counted in the
+ * stream's StreamStats.
+ *
+ * The watchdog must outlive every StreamHandler it watches.
+ */
+class StreamWatchdog {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    StreamWatchdog() = delete;
+    StreamWatchdog(const StreamWatchdog &) = delete;
+
+    explicit StreamWatchdog(const WatchdogOptions &options)
+        : options_(options), stop_(false) {
+        // Check often enough to notice a stall within a quarter timeout
+        check_interval_ = std::clamp(options_.stall_timeout / 4,
+                                     std::chrono::milliseconds(10),
+                                     std::chrono::milliseconds(100));
+        thread_ = std::thread([this]() { Run(); });
+    }
+
+    ~StreamWatchdog() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        stop_cv_.notify_all();
+        thread_.join();
+    }
+
+    /**
+     * @brief Starts watching a stream that is ready. From now on errors of
+     * the stream are recovered instead of closing it.
+     */
+    void Watch(StreamHandler *stream) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Entry entry;
+        entry.stream = stream;
+        entry.watched_us = stream->Elapsed();
+        entries_.push_back(entry);
+        stream->watched_ = true;
+        stream->on_detach_.push_back([this, stream]() { Unwatch(stream); });
+    }
+
+    u32 StreamCount() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return entries_.size();
+    }
+
+  private:
+    struct Entry {
+        StreamHandler *stream = nullptr;
+        /**
+         * @brief Stream time (StreamHandler::Elapsed) when watching started
+         */
+        i64 watched_us = 0;
+        bool recovering = false;
+        Clock::time_point stall_start;
+        Clock::time_point next_attempt;
+        u32 attempts = 0;
+        /**
+         * @brief Stream time of the last successful restart, -1 if none yet
+         */
+        i64 restart_us = -1;
+    };
+
+    WatchdogOptions options_;
+    std::chrono::milliseconds check_interval_;
+
+    /**
+     * @brief Guards entries_ and restarting_; not held while restarting, so
+     * watching and unwatching other streams never waits for a pipeline
+     */
+    mutable std::mutex mutex_;
+    std::condition_variable stop_cv_;
+    bool stop_;
+    vec<Entry> entries_;
+    /**
+     * @brief A restart run outside the lock
+     */
+    struct Restarting {
+        StreamHandler *stream;
+        /**
+         * @brief Stream time when the restart began
+         */
+        i64 start_us = -1;
+        bool succeeded = false;
+    };
+
+    /**
+     * @brief Streams being restarted outside the lock
+     */
+    vec<Restarting> restarting_;
+    std::condition_variable restarted_cv_;
+    std::thread thread_;
+
+    void Unwatch(StreamHandler *stream) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        // Called while the stream is destroyed: let a restart of it finish
+        restarted_cv_.wait(lock, [this, stream]() {
+            return std::none_of(restarting_.begin(), restarting_.end(),
+                                [stream](const Restarting &restarting) {
+                                    return restarting.stream == stream;
+                                });
+        });
+        entries_.erase(std::remove_if(entries_.begin(), entries_.end(),
+                                      [stream](const Entry &entry) {
+                                          return entry.stream == stream;
+                                      }),
+                       entries_.end());
+    }
+
+    void Run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stop_cv_.wait_for(lock, check_interval_,
+                                  [this]() { return stop_; })) {
+            const Clock::time_point now = Clock::now();
+            entries_.erase(std::remove_if(entries_.begin(), entries_.end(),
+                                          [this, now](Entry &entry) {
+                                              return !Check(entry, now);
+                                          }),
+                           entries_.end());
+            if (restarting_.empty()) {
+                continue;
+            }
+
+            // Restarting blocks until the pipeline reaches READY; Unwatch()
+            // keeps the streams in restarting_ alive meanwhile
+            lock.unlock();
+            for (Restarting &restarting : restarting_) {
+                restarting.start_us = restarting.stream->Elapsed();
+                restarting.succeeded = restarting.stream->Restart();
+            }
+            lock.lock();
+            for (const Restarting &restarting : restarting_) {
+                OnRestarted(restarting);
+            }
+            restarting_.clear();
+            restarted_cv_.notify_all();
+        }
+    }
+
+    std::chrono::milliseconds Backoff(u32 attempt) const {
+        auto backoff = options_.initial_backoff;
+        for (u32 i = 1; i < attempt && backoff < options_.max_backoff; ++i) {
+            backoff *= 2;
+        }
+        return std::min(backoff, options_.max_backoff);
+    }
+
+    /**
+     * @returns false once the stream no longer needs watching
+     */
+    bool Check(Entry &entry, Clock::time_point now) {
+        StreamHandler *stream = entry.stream;
+        if (!stream->IsStreamOpen()) {
+            return false;
+        }
+        const i64 last_frame_us =
+            stream->last_frame_us_.load(std::memory_order_relaxed);
+
+        if (!entry.recovering) {
+            const i64 idle_us =
+                stream->Elapsed() - std::max(last_frame_us, entry.watched_us);
+            const bool failed = stream->error_pending_;
+            if (!failed &&
+                idle_us < std::chrono::duration_cast<std::chrono::microseconds>(
+                              options_.stall_timeout)
+                              .count()) {
+                return true;
+            }
+
+            WARNING << "Stream [" << stream->GetId() << "]: "
+                    << (failed ? "Failed"
+                               : "Stalled, no frame for " +
+                                     std::to_string(idle_us / 1000) + " ms")
+                    << " -- Restarting the pipeline";
+            stream->stalls_.Add();
+            stream->stalled_ = true;
+            entry.recovering = true;
+            entry.stall_start = now;
+            entry.next_attempt = now;
+            entry.attempts = 0;
+            entry.restart_us = -1;
+        }
+
+        if (entry.restart_us >= 0 && last_frame_us > entry.restart_us &&
+            !stream->error_pending_) {
+            RecordRecovery(entry, now);
+            return true;
+        }
+        if (now < entry.next_attempt) {
+            return true;
+        }
+        if (options_.max_reconnects &&
+            entry.attempts >= options_.max_reconnects) {
+            ERROR << "Stream [" << stream->GetId() << "]: No frames after "
+                  << entry.attempts << " restart attempts -- Closing the "
+                  << "stream";
+            stream->MarkClosed();
+            return false;
+        }
+
+        // Failed restarts count as attempts too, so they back off and
+        // eventually close the stream
+        ++entry.attempts;
+        restarting_.push_back({stream});
+        entry.next_attempt = now + Backoff(entry.attempts);
+        return true;
+    }
+
+    /**
+     * @brief Records the outcome of a restart: only one that succeeded
+     * counts as a reconnect and is waited on for frames
+     */
+    void OnRestarted(const Restarting &restarting) {
+        StreamHandler *stream = restarting.stream;
+        auto entry = std::find_if(
+            entries_.begin(), entries_.end(),
+            [stream](const Entry &entry) { return entry.stream == stream; });
+        if (entry == entries_.end()) {
+            return;
+        }
+        if (!restarting.succeeded) {
+            stream->restarts_failed_.Add();
+            entry->restart_us = -1;
+            WARNING << "Stream [" << stream->GetId() << "]: Restart attempt "
+                    << entry->attempts << " failed";
+            return;
+        }
+        stream->reconnects_.Add();
+        entry->restart_us = restarting.start_us;
+    }
+
+    void RecordRecovery(Entry &entry, Clock::time_point now) {
+        StreamHandler *stream = entry.stream;
+        const u64 recovery_ms =
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                now - entry.stall_start)
+                .count();
+        stream->recoveries_.Add();
+        stream->recovery_ms_total_.Add(recovery_ms);
+        u64 max = stream->recovery_ms_max_.load(std::memory_order_relaxed);
+        while (recovery_ms > max &&
+               !stream->recovery_ms_max_.compare_exchange_weak(
+                   max, recovery_ms, std::memory_order_relaxed)) {
+        }
+        stream->stalled_ = false;
+
+        INFO << "Stream [" << stream->GetId() << "]: Recovered after "
+             << recovery_ms << " ms and " << entry.attempts << " restart(s)";
+        entry.recovering = false;
+        entry.restart_us = -1;
+    }
+};
@@ -0,0 +1,261 @@
+#pragma once
+
+#include "proc_file.hpp"
+#include "sampler.hpp"
+#include "types.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <dirent.h>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <unordered_map>
+
+/**
+ * @brief What a thread of the process works on, from its name
+ */
+enum class ThreadKind : u8 {
+    /**
+     * @brief Network sources (rtspsrc, udpsrc, ...)
+     */
+    Source,
+    /**
+     * @brief Jitter buffer output: depayloading and parsing
+     */
+    Depay,
+    /**
+     * @brief Decoder input queues and the decoder's own worker threads
+     */
+    Decoder,
+    /**
+     * @brief Scaling and pixel format conversion; runs inline on another
+     * thread, so it is measured with probes rather than by thread
+     */
+    Convert,
+    /**
+     * @brief The queue feeding the appsink
+     */
+    Sink,
+    /**
+     * @brief Threads processing delivered frames
+     */
+    Consumer,
+    Other,
+};
+
+constexpr u32 THREAD_KIND_COUNT = static_cast<u32>(ThreadKind::Other) + 1;
+
+constexpr const char *THREAD_KIND_NAMES[THREAD_KIND_COUNT] = {
+    "source", "depay", "decoder", "convert", "sink", "consumer", "other"};
+
+inline const char *ThreadKindName(ThreadKind kind) {
+    return THREAD_KIND_NAMES[static_cast<u32>(kind)];
+}
+
+/**
+ * @brief CPU time used by the calling thread, in nanoseconds
+ */
+inline u64 ThreadCpuNs() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<u64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Thread name carrying the stream and the kind, e.g. "s12:decoder"
+ * (Linux keeps 15 characters)
+ */
+inline std::string StreamThreadName(i32 stream_id, ThreadKind kind) {
+    return "s" + std::to_string(stream_id) + ":" + ThreadKindName(kind);
+}
+
+/**
+ * @brief Parses a name made by StreamThreadName(), or a bare kind name
+ * prefix (e.g. "consumer3") for threads shared by all streams
+ * @param stream_id Set to -1 if the thread is not tied to a stream
+ */
+inline void ParseThreadName(std::string_view name, i32 &stream_id,
+                            ThreadKind &kind) {
+    stream_id = -1;
+    kind = ThreadKind::Other;
+    if (name.size() > 2 && name[0] == 's' && name[1] >= '0' && name[1] <= '9') {
+        size_t colon = name.find(':');
+        if (colon == std::string_view::npos) {
+            return;
+        }
+        std::string_view digits = name.substr(1, colon - 1);
+        stream_id = static_cast<i32>(proc::NextU64(digits));
+        name.remove_prefix(colon + 1);
+    }
+    for (u32 k = 0; k < THREAD_KIND_COUNT; ++k) {
+        const std::string_view kind_name = THREAD_KIND_NAMES[k];
+        if (name.substr(0, kind_name.size()) == kind_name) {
+            kind = static_cast<ThreadKind>(k);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief CPU time of every thread of the process, read from
+ * /proc/self/task/<tid>/stat and rolled up by stream and ThreadKind from the
+ * thread names. Each thread's stat file is kept open while the thread
+ * lives. Time is attributed to the name a thread has when sampled.
+ */
+class ThreadCpuSampler : public Sampler {
+  public:
+    using Clock = std::chrono::steady_clock;
+    using KindCpuMs = arr<double, THREAD_KIND_COUNT>;
+
+    /**
+     * @brief Shortest time between two reads when sampled as part of the
+     * monitor: reading every thread's stat file costs a few microseconds
+     * per thread, which would dominate at high refresh rates
+     */
+    static constexpr std::chrono::milliseconds SAMPLE_INTERVAL{100};
+
+    ThreadCpuSampler(const ThreadCpuSampler &) = delete;
+    ThreadCpuSampler()
+        : ms_per_tick_(1000.0 / sysconf(_SC_CLK_TCK)),
+          task_dir_(opendir("/proc/self/task")) {}
+
+    ~ThreadCpuSampler() override {
+        if (task_dir_) {
+            closedir(task_dir_);
+        }
+    }
+
+    const char *Name() const override { return "threads"; }
+
+    vec<std::string> Columns() const override {
+        vec<std::string> columns = {"threads"};
+        for (const char *kind : THREAD_KIND_NAMES) {
+            columns.push_back(std::string("cpu_") + kind + "_ms");
+        }
+        return columns;
+    }
+
+    /**
+     * @brief Updates at most once per SAMPLE_INTERVAL and writes the thread
+     * count and TotalCpuMs()
+     */
+    void Sample(double *row) override {
+        const Clock::time_point now = Clock::now();
+        if (now - last_update_ >= SAMPLE_INTERVAL) {
+            Update();
+            last_update_ = now;
+        }
+        *row++ = ThreadCount();
+        for (double ms : total_ms_) {
+            *row++ = ms;
+        }
+    }
+
+    /**
+     * @brief Reads every thread's CPU time and adds what was used since the
+     * previous call to its stream and kind
+     */
+    void Update() {
+        if (!task_dir_) {
+            return;
+        }
+        ++generation_;
+        rewinddir(task_dir_);
+        while (dirent *entry = readdir(task_dir_)) {
+            if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+                continue;
+            }
+            const i32 tid = std::atoi(entry->d_name);
+            auto it = threads_.find(tid);
+            if (it == threads_.end()) {
+                it = threads_
+                         .emplace(tid,
+                                  Thread("/proc/self/task/" +
+                                         std::string(entry->d_name) + "/stat"))
+                         .first;
+            }
+            Account(it->second);
+        }
+        // Threads that exited: their time up to the last sample is kept
+        for (auto it = threads_.begin(); it != threads_.end();) {
+            if (it->second.generation != generation_) {
+                it = threads_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    u32 ThreadCount() const { return threads_.size(); }
+
+    /**
+     * @brief CPU time used by all threads, per kind, since the sampler was
+     * created (threads that are not named count as Other)
+     */
+    const KindCpuMs &TotalCpuMs() const { return total_ms_; }
+
+    /**
+     * @returns CPU time of the threads of @p stream_id per kind, nullptr if
+     * none was seen yet
+     */
+    const KindCpuMs *StreamCpuMs(i32 stream_id) const {
+        auto it = streams_.find(stream_id);
+        return it == streams_.end() ? nullptr : &it->second;
+    }
+
+  private:
+    struct Thread {
+        ProcFile stat;
+        u64 ticks = 0;
+        u64 generation = 0;
+
+        explicit Thread(const std::string &path) : stat(path, 1024) {}
+    };
+
+    double ms_per_tick_;
+    DIR *task_dir_;
+    u64 generation_ = 0;
+    Clock::time_point last_update_{};
+    std::unordered_map<i32, Thread> threads_;
+    std::map<i32, KindCpuMs> streams_;
+    KindCpuMs total_ms_{};
+
+    void Account(Thread &thread) {
+        std::string_view text = thread.stat.Read();
+        // pid (comm) state ppid ... utime stime: comm may hold spaces and
+        // parentheses, so it ends at the last ')'
+        const size_t open = text.find('(');
+        const size_t close = text.rfind(')');
+        if (open == std::string_view::npos || close == std::string_view::npos ||
+            close < open) {
+            return;
+        }
+        thread.generation = generation_;
+        const std::string_view name = text.substr(open + 1, close - open - 1);
+        text.remove_prefix(close + 1);
+        // Fields 3 to 13, then utime (14) and stime (15)
+        for (u32 field = 3; field <= 13; ++field) {
+            proc::NextToken(text);
+        }
+        const u64 utime = proc::NextU64(text);
+        const u64 ticks = utime + proc::NextU64(text);
+        // Time before the sampler first saw a thread counts as well
+        const u64 delta = ticks - std::min(thread.ticks, ticks);
+        thread.ticks = ticks;
+        if (delta == 0) {
+            return;
+        }
+
+        i32 stream_id;
+        ThreadKind kind;
+        ParseThreadName(name, stream_id, kind);
+        const double ms = delta * ms_per_tick_;
+        total_ms_[static_cast<u32>(kind)] += ms;
+        if (stream_id >= 0) {
+            streams_[stream_id][static_cast<u32>(kind)] += ms;
+        }
+    }
+};
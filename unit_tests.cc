@@ -0,0 +1,953 @@
+#include "decode_skipper.hpp"
+#include "executor.hpp"
+#include "frame_batcher.hpp"
+#include "histogram.hpp"
+#include "metrics_sink.hpp"
+#include "pre_event_buffer.hpp"
+#include "shm_frame_ring.hpp"
+#include "spsc_ring.hpp"
+#include "stream_registry.hpp"
+#include "types.hpp"
+#include "video_reference.hpp"
+#include "yuv_to_rgb.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+namespace {
+
+constexpr GstClockTime TOLERANCE = 15 * GST_MSECOND;
+
+GstClockTime Ms(u64 ms) { return ms * GST_MSECOND; }
+
+/**
+ * @brief Timestamps of a stream's pending frames, every @p step ms from
+ * @p first to @p last
+ */
+vec<GstClockTime> Frames(u64 first, u64 last, u64 step) {
+    vec<GstClockTime> times;
+    for (u64 ms = first; ms <= last; ms += step) {
+        times.push_back(Ms(ms));
+    }
+    return times;
+}
+
+} // namespace
+
+TEST(FrameBatcherAlign, MatchesEveryStreamAtTheCommonTime) {
+    // Stream 1 runs 40 ms ahead: its frame at the newest time stream 0
+    // reached is picked, not its newest one
+    GstClockTime target;
+    vec<i32> chosen = FrameBatcher::AlignByPts(
+        {Frames(0, 200, 40), Frames(40, 240, 40)}, TOLERANCE, target);
+    EXPECT_EQ(target, Ms(200));
+    EXPECT_EQ(chosen, (vec<i32>{5, 4}));
+}
+
+TEST(FrameBatcherAlign, PicksTheClosestFrameWithinTolerance) {
+    GstClockTime target;
+    vec<i32> chosen = FrameBatcher::AlignByPts(
+        {{Ms(100)}, {Ms(80), Ms(95), Ms(108)}, {Ms(114)}}, TOLERANCE, target);
+    EXPECT_EQ(target, Ms(100));
+    EXPECT_EQ(chosen, (vec<i32>{0, 1, 0}));
+}
+
+TEST(FrameBatcherAlign, LeavesStreamsOutsideToleranceEmpty) {
+    GstClockTime target;
+    vec<i32> chosen = FrameBatcher::AlignByPts({{Ms(100)}, {Ms(50), Ms(116)}},
+                                               TOLERANCE, target);
+    EXPECT_EQ(target, Ms(100));
+    EXPECT_EQ(chosen, (vec<i32>{0, -1}));
+}
+
+TEST(FrameBatcherAlign, LeavesStreamsWithoutFramesEmpty) {
+    GstClockTime target;
+    vec<i32> chosen =
+        FrameBatcher::AlignByPts({{Ms(100)}, {}, {Ms(105)}}, TOLERANCE, target);
+    EXPECT_EQ(target, Ms(100));
+    EXPECT_EQ(chosen, (vec<i32>{0, -1, 0}));
+}
+
+TEST(FrameBatcherAlign, TakesTheNewestFrameWithoutPts) {
+    GstClockTime target;
+    vec<i32> chosen = FrameBatcher::AlignByPts(
+        {{Ms(100)}, {Ms(20), GST_CLOCK_TIME_NONE}}, TOLERANCE, target);
+    EXPECT_EQ(target, Ms(100));
+    EXPECT_EQ(chosen, (vec<i32>{0, 1}));
+
+    chosen = FrameBatcher::AlignByPts(
+        {{GST_CLOCK_TIME_NONE}, {GST_CLOCK_TIME_NONE, GST_CLOCK_TIME_NONE}},
+        TOLERANCE, target);
+    EXPECT_FALSE(GST_CLOCK_TIME_IS_VALID(target));
+    EXPECT_EQ(chosen, (vec<i32>{0, 1}));
+}
+
+TEST(FrameBatcherAlign, HandlesNoFramesAtAll) {
+    GstClockTime target = 0;
+    vec<i32> chosen = FrameBatcher::AlignByPts({{}, {}}, TOLERANCE, target);
+    EXPECT_FALSE(GST_CLOCK_TIME_IS_VALID(target));
+    EXPECT_EQ(chosen, (vec<i32>{-1, -1}));
+}
+
+namespace {
+
+/**
+ * @brief Limited-range YCbCr -> RGB in double precision, the conversion the
+ * Q16 kernels approximate
+ */
+arr<double, 3> ReferenceRgb(double kr, double kb, u8 y, u8 u, u8 v) {
+    const double kg = 1.0 - kr - kb;
+    const double yy = (y - 16) * 255.0 / 219.0;
+    const double uu = (u - 128) * 255.0 / 224.0;
+    const double vv = (v - 128) * 255.0 / 224.0;
+    arr<double, 3> rgb = {yy + 2.0 * (1.0 - kr) * vv,
+                          yy - 2.0 * kb * (1.0 - kb) / kg * uu -
+                              2.0 * kr * (1.0 - kr) / kg * vv,
+                          yy + 2.0 * (1.0 - kb) * uu};
+    for (double &c : rgb) {
+        c = std::min(255.0, std::max(0.0, c));
+    }
+    return rgb;
+}
+
+/**
+ * @brief Random 4:2:0 planes of one frame, padded rows like decoder output
+ */
+struct YuvPlanes {
+    u32 width, height, y_stride, c_stride;
+    vec<u8> y, u, v, uv;
+
+    YuvPlanes(u32 width, u32 height, u32 seed)
+        : width(width), height(height), y_stride(width + 13),
+          c_stride(width + 7) {
+        std::mt19937 rng(seed);
+        std::uniform_int_distribution<u32> byte(0, 255);
+        const u32 chroma_rows = (height + 1) / 2;
+        y.resize(y_stride * height);
+        u.resize(c_stride * chroma_rows);
+        v.resize(c_stride * chroma_rows);
+        uv.resize(2 * c_stride * chroma_rows);
+        for (u8 &b : y) {
+            b = byte(rng);
+        }
+        for (u32 i = 0; i < u.size(); ++i) {
+            u[i] = byte(rng);
+            v[i] = byte(rng);
+        }
+        // Same chroma interleaved, so both layouts give the same image
+        for (u32 row = 0; row < chroma_rows; ++row) {
+            for (u32 x = 0; x < c_stride; ++x) {
+                uv[2 * c_stride * row + 2 * x] = u[c_stride * row + x];
+                uv[2 * c_stride * row + 2 * x + 1] = v[c_stride * row + x];
+            }
+        }
+    }
+
+    yuv::Image I420() const {
+        return yuv::Image::I420(y.data(), y_stride, u.data(), c_stride,
+                                v.data(), c_stride, width, height);
+    }
+
+    yuv::Image Nv12() const {
+        return yuv::Image::Nv12(y.data(), y_stride, uv.data(), 2 * c_stride,
+                                width, height);
+    }
+};
+
+/**
+ * @brief Widths around the 16-pixel SIMD blocks, so every kernel runs its
+ * scalar tail, plus sizes with no full block at all
+ */
+constexpr u32 YUV_WIDTHS[] = {1, 2, 3, 15, 16, 17, 31, 33, 47, 63, 65, 127};
+constexpr u32 YUV_HEIGHTS[] = {1, 2, 5};
+
+constexpr yuv::Kernel YUV_KERNELS[] = {yuv::Kernel::Scalar, yuv::Kernel::Sse41,
+                                       yuv::Kernel::Avx2};
+
+/**
+ * @brief Bytes after each RGB row, filled with RGB_CANARY to catch kernels
+ * writing past the row
+ */
+constexpr u32 RGB_PADDING = 11;
+constexpr u8 RGB_CANARY = 0xA5;
+
+/**
+ * @brief Converts @p image with @p kernel into rows with trailing padding
+ * @returns The RGB rows, 3 * width + RGB_PADDING bytes each
+ */
+vec<u8> Convert(const yuv::Image &image, const yuv::Coefficients &c,
+                yuv::Kernel kernel) {
+    const u32 stride = 3 * image.width + RGB_PADDING;
+    vec<u8> rgb(stride * image.height, RGB_CANARY);
+    yuv::ToRgb(image, c, rgb.data(), stride, kernel);
+    return rgb;
+}
+
+} // namespace
+
+TEST(YuvToRgb, StaysWithinOneOfTheExactConversion) {
+    const struct {
+        double kr, kb;
+        yuv::Coefficients coefficients;
+    } matrices[] = {{0.299, 0.114, yuv::Coefficients::Bt601()},
+                    {0.2126, 0.0722, yuv::Coefficients::Bt709()}};
+
+    for (const auto &matrix : matrices) {
+        for (u32 width : YUV_WIDTHS) {
+            for (u32 height : YUV_HEIGHTS) {
+                const YuvPlanes planes(width, height, width * 31 + height);
+                const vec<u8> rgb = Convert(planes.I420(), matrix.coefficients,
+                                            yuv::Kernel::Scalar);
+                const u32 stride = 3 * width + RGB_PADDING;
+                for (u32 row = 0; row < height; ++row) {
+                    for (u32 x = 0; x < width; ++x) {
+                        const u32 c = (row / 2) * planes.c_stride + x / 2;
+                        const arr<double, 3> expected =
+                            ReferenceRgb(matrix.kr, matrix.kb,
+                                         planes.y[row * planes.y_stride + x],
+                                         planes.u[c], planes.v[c]);
+                        for (u32 ch = 0; ch < 3; ++ch) {
+                            ASSERT_LE(std::abs(rgb[row * stride + 3 * x + ch] -
+                                               expected[ch]),
+                                      1.0)
+                                << width << "x" << height << " at (" << x
+                                << ", " << row << ") channel " << ch;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST(YuvToRgb, SimdKernelsMatchScalarExactly) {
+    const yuv::Coefficients c = yuv::Coefficients::Bt709();
+    for (yuv::Kernel kernel : YUV_KERNELS) {
+        if (!yuv::IsSupported(kernel)) {
+            continue;
+        }
+        for (u32 width : YUV_WIDTHS) {
+            for (u32 height : YUV_HEIGHTS) {
+                const YuvPlanes planes(width, height, width + height);
+                const vec<u8> expected =
+                    Convert(planes.I420(), c, yuv::Kernel::Scalar);
+                EXPECT_EQ(Convert(planes.I420(), c, kernel), expected)
+                    << yuv::KernelName(kernel) << " I420 " << width << "x"
+                    << height;
+                EXPECT_EQ(Convert(planes.Nv12(), c, kernel), expected)
+                    << yuv::KernelName(kernel) << " NV12 " << width << "x"
+                    << height;
+            }
+        }
+    }
+}
+
+TEST(YuvToRgb, WritesNothingPastTheRow) {
+    const yuv::Coefficients c = yuv::Coefficients::Bt601();
+    for (yuv::Kernel kernel : YUV_KERNELS) {
+        if (!yuv::IsSupported(kernel)) {
+            continue;
+        }
+        for (u32 width : YUV_WIDTHS) {
+            const YuvPlanes planes(width, 2, width);
+            const vec<u8> rgb = Convert(planes.Nv12(), c, kernel);
+            const u32 stride = 3 * width + RGB_PADDING;
+            for (u32 row = 0; row < 2; ++row) {
+                EXPECT_TRUE(std::all_of(rgb.begin() + row * stride + 3 * width,
+                                        rgb.begin() + (row + 1) * stride,
+                                        [](u8 b) { return b == RGB_CANARY; }))
+                    << yuv::KernelName(kernel) << " width " << width;
+            }
+        }
+    }
+}
+
+TEST(YuvToRgb, MatchesVideoconvertWithinOne) {
+    gst_init(nullptr, nullptr);
+    const struct {
+        i32 width, height;
+    } sizes[] = {{1280, 720}, {1920, 1080}, {3840, 2160}, {641, 361}};
+
+    for (const char *format : {"NV12", "I420"}) {
+        for (const auto &size : sizes) {
+            const Frame frame(MakeSample(format, size.width, size.height));
+            ASSERT_TRUE(frame.IsValid());
+            for (yuv::Kernel kernel : YUV_KERNELS) {
+                if (!yuv::IsSupported(kernel)) {
+                    continue;
+                }
+                const i32 max_diff = MaxAbsDiffToVideoconvert(frame, kernel);
+                EXPECT_GE(max_diff, 0);
+                EXPECT_LE(max_diff, 1)
+                    << yuv::KernelName(kernel) << " " << format << " "
+                    << size.width << "x" << size.height;
+            }
+        }
+    }
+}
+
+namespace {
+
+constexpr u32 SOURCE_FPS = 30;
+/**
+ * @brief Access units from one keyframe to the next: one keyframe a second
+ */
+constexpr u32 GOP_SIZE = 30;
+
+/**
+ * @brief Feeds access unit @p index of a 30 fps stream with a keyframe every
+ * GOP_SIZE units
+ */
+DecodeSkipMode Feed(DecodeSkipper &skipper, u32 index) {
+    return skipper.ModeFor(index % GOP_SIZE == 0,
+                           index * GST_SECOND / SOURCE_FPS);
+}
+
+} // namespace
+
+TEST(DecodeSkipper, FixedModeAppliesFromTheStart) {
+    DecodeSkipper skipper(0, DecodeSkipMode::KeyframeOnly, 1);
+    EXPECT_EQ(Feed(skipper, 5), DecodeSkipMode::KeyframeOnly);
+    EXPECT_EQ(skipper.ActiveMode(), DecodeSkipMode::KeyframeOnly);
+}
+
+TEST(DecodeSkipper, AutoSwitchesModesOnKeyframesOnly) {
+    DecodeSkipper skipper(0, DecodeSkipMode::Auto, 1);
+    // Frame rate and keyframe interval are known from the second keyframe
+    // on, where a 1 fps limit switches to keyframes only
+    u32 index = 0;
+    for (; index < GOP_SIZE; ++index) {
+        ASSERT_EQ(Feed(skipper, index), DecodeSkipMode::None) << index;
+    }
+    EXPECT_EQ(Feed(skipper, index++), DecodeSkipMode::KeyframeOnly);
+
+    // Raising the limit mid-GOP keeps dropping delta units up to the next
+    // keyframe: decoding them without the ones dropped before is corrupt
+    for (; index < GOP_SIZE + GOP_SIZE / 2; ++index) {
+        ASSERT_EQ(Feed(skipper, index), DecodeSkipMode::KeyframeOnly) << index;
+    }
+    skipper.SetFpsLimit(SOURCE_FPS);
+    for (; index < 2 * GOP_SIZE; ++index) {
+        ASSERT_EQ(Feed(skipper, index), DecodeSkipMode::KeyframeOnly) << index;
+    }
+    EXPECT_EQ(Feed(skipper, index++), DecodeSkipMode::None);
+    EXPECT_EQ(skipper.ActiveMode(), DecodeSkipMode::None);
+
+    // Lowering it again mid-GOP waits for the next keyframe too
+    for (; index < 2 * GOP_SIZE + GOP_SIZE / 2; ++index) {
+        ASSERT_EQ(Feed(skipper, index), DecodeSkipMode::None) << index;
+    }
+    skipper.SetFpsLimit(1);
+    for (; index < 3 * GOP_SIZE; ++index) {
+        ASSERT_EQ(Feed(skipper, index), DecodeSkipMode::None) << index;
+    }
+    EXPECT_EQ(Feed(skipper, index++), DecodeSkipMode::KeyframeOnly);
+    EXPECT_EQ(Feed(skipper, index++), DecodeSkipMode::KeyframeOnly);
+}
+
+namespace {
+
+/**
+ * @brief Listens on a loopback port and never answers: a stream opened on
+ * Uri() stays open, waiting for the RTSP server, for the whole test
+ */
+class SilentRtspServer {
+  public:
+    SilentRtspServer() : fd_(socket(AF_INET, SOCK_STREAM, 0)) {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(addr);
+        if (fd_ < 0 ||
+            bind(fd_, reinterpret_cast<sockaddr *>(&addr), length) != 0 ||
+            listen(fd_, 16) != 0 ||
+            getsockname(fd_, reinterpret_cast<sockaddr *>(&addr), &length) !=
+                0) {
+            return;
+        }
+        uri_ = "rtsp://127.0.0.1:" + std::to_string(ntohs(addr.sin_port)) +
+               "/stream";
+    }
+
+    ~SilentRtspServer() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    const std::string &Uri() const { return uri_; }
+
+  private:
+    int fd_;
+    std::string uri_;
+};
+
+SubscriberOptions WithFpsLimit(int fps_limit) {
+    SubscriberOptions options;
+    options.fps_limit = fps_limit;
+    return options;
+}
+
+} // namespace
+
+TEST(StreamRegistry, RunsSharedStreamsAtTheHighestSubscriberLimit) {
+    EXPECT_EQ(SharedStream::SharedFpsLimit({5}), 5);
+    EXPECT_EQ(SharedStream::SharedFpsLimit({5, 15, 10}), 15);
+    // 0 takes every frame
+    EXPECT_EQ(SharedStream::SharedFpsLimit({5, 0}), UNCAPPED_FPS_LIMIT);
+}
+
+TEST(StreamRegistry, SubscribersOfAUriShareOneStream) {
+    SilentRtspServer server;
+    ASSERT_FALSE(server.Uri().empty());
+    StreamRegistry registry;
+
+    up<StreamSubscription> slow =
+        registry.Subscribe(0, server.Uri(), {}, WithFpsLimit(5));
+    up<StreamSubscription> fast =
+        registry.Subscribe(1, server.Uri(), {}, WithFpsLimit(15));
+    ASSERT_TRUE(slow->IsStreamOpen());
+    EXPECT_EQ(&slow->Stream(), &fast->Stream());
+    EXPECT_EQ(slow->Stream().SubscriberCount(), 2u);
+    EXPECT_EQ(slow->Stream().Handler().GetFPSLimit(), 15);
+
+    StreamRegistry::Stats stats = registry.GetStats();
+    EXPECT_EQ(stats.streams, 1u);
+    EXPECT_EQ(stats.subscribers, 2u);
+    EXPECT_EQ(stats.subscribe_calls, 2u);
+    EXPECT_EQ(stats.opens_deduplicated, 1u);
+
+    // The remaining subscriber's limit applies again
+    fast.reset();
+    EXPECT_EQ(slow->Stream().SubscriberCount(), 1u);
+    EXPECT_EQ(slow->Stream().Handler().GetFPSLimit(), 5);
+    EXPECT_EQ(registry.GetStats().subscribers, 1u);
+
+    // The last subscription stops the stream
+    slow.reset();
+    stats = registry.GetStats();
+    EXPECT_EQ(stats.streams, 0u);
+    EXPECT_EQ(stats.subscribers, 0u);
+}
+
+TEST(StreamRegistry, OpensAStreamPerOutputSpec) {
+    SilentRtspServer server;
+    ASSERT_FALSE(server.Uri().empty());
+    StreamRegistry registry;
+    StreamOptions gray;
+    gray.output.format = "GRAY8";
+
+    up<StreamSubscription> rgb = registry.Subscribe(0, server.Uri());
+    up<StreamSubscription> mono = registry.Subscribe(1, server.Uri(), gray);
+    EXPECT_NE(&rgb->Stream(), &mono->Stream());
+    EXPECT_EQ(registry.GetStats().streams, 2u);
+    EXPECT_EQ(registry.GetStats().opens_deduplicated, 0u);
+
+    // A new subscriber of an open stream joins it
+    up<StreamSubscription> mono2 = registry.Subscribe(2, server.Uri(), gray);
+    EXPECT_EQ(&mono->Stream(), &mono2->Stream());
+    EXPECT_EQ(mono->Stream().SubscriberCount(), 2u);
+    EXPECT_EQ(rgb->Stream().SubscriberCount(), 1u);
+}
+
+TEST(MetricsPath, GivesBinaryFilesABinExtension) {
+    EXPECT_EQ(MetricsPath("./metrics.csv", MetricsFormat::Csv),
+              "./metrics.csv");
+    EXPECT_EQ(MetricsPath("./metrics.csv", MetricsFormat::Binary),
+              "./metrics.bin");
+    EXPECT_EQ(MetricsPath("./metrics", MetricsFormat::Binary), "./metrics.bin");
+    EXPECT_EQ(MetricsPath("csv", MetricsFormat::Binary), "csv.bin");
+}
+
+namespace {
+
+/**
+ * @brief Columns and values read back from a MetricsFormat::Binary file
+ */
+struct BinaryMetrics {
+    vec<std::string> columns;
+    vec<vec<double>> rows;
+};
+
+/**
+ * @brief Parses @p path as the layout documented on MetricsFormat::Binary
+ * @returns false if the header does not match
+ */
+bool ReadBinaryMetrics(const std::string &path, BinaryMetrics &metrics) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof(METRICS_BINARY_MAGIC)];
+    u32 version = 0, column_count = 0;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char *>(&version), sizeof(version));
+    in.read(reinterpret_cast<char *>(&column_count), sizeof(column_count));
+    if (!in || std::memcmp(magic, METRICS_BINARY_MAGIC, sizeof(magic)) != 0 ||
+        version != METRICS_BINARY_VERSION) {
+        return false;
+    }
+    for (u32 c = 0; c < column_count; ++c) {
+        u16 length = 0;
+        in.read(reinterpret_cast<char *>(&length), sizeof(length));
+        std::string name(length, '\0');
+        in.read(name.data(), length);
+        metrics.columns.push_back(name);
+    }
+    u32 row_count = 0;
+    while (in.read(reinterpret_cast<char *>(&row_count), sizeof(row_count))) {
+        // Column-major block
+        vec<double> block(static_cast<size_t>(row_count) * column_count);
+        in.read(reinterpret_cast<char *>(block.data()),
+                block.size() * sizeof(double));
+        if (!in) {
+            break;
+        }
+        for (u32 r = 0; r < row_count; ++r) {
+            vec<double> row(column_count);
+            for (u32 c = 0; c < column_count; ++c) {
+                row[c] = block[c * row_count + r];
+            }
+            metrics.rows.push_back(row);
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+TEST(MetricsSink, BinaryFileReadsBackTheCommittedRows) {
+    const std::string path =
+        "/tmp/unit_tests_metrics_" + std::to_string(getpid()) + ".bin";
+    const vec<std::string> columns = {"timestamp_ms", "cpu_usage", "rss_kib"};
+    const vec<vec<double>> rows = {
+        {0, 12.5, 1024}, {1000, 0.1234567891, 2048}, {2000, 99.75, 4096}};
+    {
+        // A ring smaller than the rows, drained as they are committed
+        MetricsSink sink(path, columns, MetricsFormat::Binary, 2,
+                         std::chrono::milliseconds(1));
+        ASSERT_TRUE(sink.IsOpen());
+        for (const vec<double> &row : rows) {
+            double *slot = nullptr;
+            while (!(slot = sink.BeginRow())) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            std::copy(row.begin(), row.end(), slot);
+            sink.CommitRow();
+        }
+        sink.Close();
+        EXPECT_EQ(sink.RowsWritten(), rows.size());
+    }
+
+    BinaryMetrics metrics;
+    ASSERT_TRUE(ReadBinaryMetrics(path, metrics));
+    std::remove(path.c_str());
+    EXPECT_EQ(metrics.columns, columns);
+    EXPECT_EQ(metrics.rows, rows);
+}
+
+TEST(ShmRing, LeavesTheRingOfARunningWriterAlone) {
+    const std::string name = shm::RingName(-1000 - getpid());
+    up<shm::Writer> writer = shm::Writer::Create(name, 4, 1024);
+    ASSERT_TRUE(writer);
+
+    errno = 0;
+    EXPECT_FALSE(shm::Writer::Create(name, 4, 1024));
+    EXPECT_EQ(errno, EEXIST);
+    // Still the first writer's ring
+    up<shm::Reader> reader = shm::Reader::Open(name);
+    ASSERT_TRUE(reader);
+}
+
+TEST(ShmRing, ReplacesTheRingOfAWriterThatIsGone) {
+    const std::string name = shm::RingName(-2000 - getpid());
+    const pid_t child = fork();
+    ASSERT_GE(child, 0);
+    if (child == 0) {
+        // Exit without the destructor removing the ring, like a crash
+        _exit(shm::Writer::Create(name, 4, 1024).release() ? 0 : 1);
+    }
+    int status = 0;
+    ASSERT_EQ(waitpid(child, &status, 0), child);
+    ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    up<shm::Writer> writer = shm::Writer::Create(name, 4, 1024);
+    EXPECT_TRUE(writer);
+    if (!writer) {
+        shm_unlink(name.c_str());
+    }
+}
+
+TEST(SpscRing, RoundsCapacityUpToAPowerOfTwo) {
+    EXPECT_EQ(SpscRing<u64>(1).Capacity(), 1u);
+    EXPECT_EQ(SpscRing<u64>(5).Capacity(), 8u);
+    EXPECT_EQ(SpscRing<u64>(64).Capacity(), 64u);
+}
+
+TEST(SpscRing, RejectsPushesWhenFullAndPopsWhenEmpty) {
+    SpscRing<u64> ring(4);
+    u64 value = 0;
+    EXPECT_TRUE(ring.Empty());
+    EXPECT_FALSE(ring.TryPop(value));
+
+    for (u64 i = 0; i < 4; ++i) {
+        value = i;
+        ASSERT_TRUE(ring.TryPush(value));
+    }
+    value = 4;
+    EXPECT_FALSE(ring.TryPush(value));
+    EXPECT_EQ(value, 4u);
+    EXPECT_EQ(ring.Size(), 4u);
+
+    for (u64 i = 0; i < 4; ++i) {
+        ASSERT_TRUE(ring.TryPop(value));
+        EXPECT_EQ(value, i);
+    }
+    EXPECT_FALSE(ring.TryPop(value));
+    EXPECT_TRUE(ring.Empty());
+}
+
+TEST(SpscRing, KeepsOrderAcrossWrapArounds) {
+    SpscRing<u64> ring(4);
+    u64 next_push = 0, next_pop = 0;
+    // 3 in, 3 out: the indices wrap every few rounds at different offsets
+    for (u32 round = 0; round < 100; ++round) {
+        for (u32 i = 0; i < 3; ++i) {
+            u64 value = next_push++;
+            ASSERT_TRUE(ring.TryPush(value));
+        }
+        EXPECT_EQ(ring.Size(), 3u);
+        for (u32 i = 0; i < 3; ++i) {
+            u64 value;
+            ASSERT_TRUE(ring.TryPop(value));
+            ASSERT_EQ(value, next_pop++);
+        }
+    }
+    EXPECT_TRUE(ring.Empty());
+}
+
+TEST(SpscRing, PopsTheLatestAndDiscardsTheRest) {
+    SpscRing<u64> ring(8);
+    vec<u64> discarded;
+    auto discard = [&discarded](u64 &value) { discarded.push_back(value); };
+    u64 value = 0;
+    EXPECT_FALSE(ring.TryPopLatest(value, discard));
+
+    for (u64 i = 1; i <= 3; ++i) {
+        value = i;
+        ASSERT_TRUE(ring.TryPush(value));
+    }
+    ASSERT_TRUE(ring.TryPopLatest(value, discard));
+    EXPECT_EQ(value, 3u);
+    EXPECT_EQ(discarded, (vec<u64>{1, 2}));
+    EXPECT_TRUE(ring.Empty());
+
+    // A single queued item is returned without discarding anything
+    value = 4;
+    ASSERT_TRUE(ring.TryPush(value));
+    ASSERT_TRUE(ring.TryPopLatest(value, discard));
+    EXPECT_EQ(value, 4u);
+    EXPECT_EQ(discarded.size(), 2u);
+}
+
+TEST(SpscRing, TwoThreadsSeeEveryItemInOrder) {
+    constexpr u64 ITEMS = 1000000;
+    SpscRing<u64> ring(64);
+    std::thread producer([&ring]() {
+        for (u64 i = 0; i < ITEMS; ++i) {
+            u64 value = i;
+            while (!ring.TryPush(value)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    u64 expected = 0;
+    bool in_order = true;
+    while (expected < ITEMS) {
+        u64 value;
+        if (!ring.TryPop(value)) {
+            std::this_thread::yield();
+            continue;
+        }
+        in_order = in_order && value == expected;
+        ++expected;
+    }
+    producer.join();
+    EXPECT_TRUE(in_order);
+    EXPECT_TRUE(ring.Empty());
+}
+
+TEST(WorkStealingExecutor, RunsEveryTaskExactlyOnce) {
+    constexpr u32 TASKS = 20000;
+    for (u32 workers : {1u, 2u, 4u, 8u}) {
+        vec<atm<u32>> runs(TASKS);
+        {
+            WorkStealingExecutor executor(workers);
+            ASSERT_EQ(executor.ThreadCount(), workers);
+            // Half from outside, half from the workers into their own deques
+            for (u32 i = 0; i < TASKS; i += 2) {
+                executor.Submit([&executor, &runs, i]() {
+                    runs[i].fetch_add(1);
+                    executor.Submit([&runs, i]() { runs[i + 1].fetch_add(1); });
+                });
+            }
+        }
+        for (u32 i = 0; i < TASKS; ++i) {
+            ASSERT_EQ(runs[i].load(), 1u)
+                << "task " << i << " with " << workers << " workers";
+        }
+    }
+}
+
+TEST(WorkStealingExecutor, IdleWorkersStealFromABusyOne) {
+    constexpr u32 SUBTASKS = 64;
+    atm<u32> done{0};
+    atm<bool> stolen{false};
+    bool finished = false;
+    {
+        WorkStealingExecutor executor(4);
+        executor.Submit([&]() {
+            const std::thread::id owner = std::this_thread::get_id();
+            // Queued on this worker's own deque, which it cannot pop while
+            // this task runs: only the other workers can run them
+            for (u32 i = 0; i < SUBTASKS; ++i) {
+                executor.Submit([&, owner]() {
+                    if (std::this_thread::get_id() != owner) {
+                        stolen = true;
+                    }
+                    done.fetch_add(1);
+                });
+            }
+            const auto deadline =
+                std::chrono::steady_clock::now() + std::chrono::seconds(10);
+            while (done.load() < SUBTASKS &&
+                   std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::yield();
+            }
+            finished = done.load() == SUBTASKS;
+        });
+    }
+    EXPECT_TRUE(finished);
+    EXPECT_TRUE(stolen);
+}
+
+TEST(WorkStealingExecutor, RunsQueuedTasksOnShutdown) {
+    constexpr u32 TASKS = 100;
+    atm<bool> release{false};
+    atm<u32> runs{0};
+    std::thread releaser;
+    {
+        WorkStealingExecutor executor(1);
+        // Keeps the only worker busy until the destructor has started
+        executor.Submit([&release]() {
+            while (!release) {
+                std::this_thread::yield();
+            }
+        });
+        for (u32 i = 0; i < TASKS; ++i) {
+            executor.Submit([&runs]() { runs.fetch_add(1); });
+        }
+        releaser = std::thread([&release]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            release = true;
+        });
+    }
+    releaser.join();
+    EXPECT_EQ(runs.load(), TASKS);
+}
+
+TEST(LatencyHistogram, PlacesEveryValueInItsBucket) {
+    using H = LatencyHistogram;
+    // Exact below SUB_BUCKETS
+    for (u64 value = 0; value < H::SUB_BUCKETS; ++value) {
+        H histogram;
+        histogram.Record(value);
+        EXPECT_EQ(histogram.Percentile(0.5), value);
+    }
+    // Both ends of every other bucket: a value reported outside
+    // [lower, upper] was counted in a neighbouring bucket
+    u32 buckets = H::SUB_BUCKETS;
+    for (u32 exponent = H::SUB_BUCKET_BITS; exponent <= H::MAX_EXPONENT;
+         ++exponent) {
+        const u64 width = 1ull << (exponent - H::SUB_BUCKET_BITS);
+        for (u64 sub_bucket = 0; sub_bucket < H::SUB_BUCKETS; ++sub_bucket) {
+            const u64 lower = (H::SUB_BUCKETS + sub_bucket) * width;
+            const u64 upper = lower + width - 1;
+            for (u64 value : {lower, upper}) {
+                H histogram;
+                histogram.Record(value);
+                const u64 reported = histogram.Percentile(0.5);
+                ASSERT_GE(reported, lower) << value;
+                ASSERT_LE(reported, upper) << value;
+                ASSERT_LE(value - reported, width / 2) << value;
+            }
+            ++buckets;
+        }
+    }
+    EXPECT_EQ(buckets, H::BUCKET_COUNT);
+}
+
+TEST(LatencyHistogram, PercentilesStayWithinTheBucketWidth) {
+    // Log-normal latencies spread over most of the buckets
+    std::mt19937 rng(7);
+    std::lognormal_distribution<double> latency_us(8.0, 2.5);
+    vec<u64> values(200000);
+    LatencyHistogram histogram;
+    for (u64 &value : values) {
+        value = std::min(latency_us(rng), 1e9);
+        histogram.Record(value);
+    }
+    std::sort(values.begin(), values.end());
+    EXPECT_EQ(histogram.Count(), values.size());
+    EXPECT_EQ(histogram.Max(), values.back());
+
+    for (double quantile : {0.5, 0.99, 0.999}) {
+        const u64 exact =
+            values[static_cast<size_t>(std::ceil(quantile * values.size())) -
+                   1];
+        const double error =
+            std::fabs(static_cast<double>(histogram.Percentile(quantile)) -
+                      static_cast<double>(exact));
+        // A bucket is at most 1/SUB_BUCKETS of its lower bound wide
+        EXPECT_LE(error, std::max(1.0, static_cast<double>(exact) /
+                                           LatencyHistogram::SUB_BUCKETS))
+            << "p" << quantile * 100 << " exact " << exact;
+    }
+}
+
+TEST(LatencyHistogram, CountsEveryRecordFromConcurrentThreads) {
+    constexpr u32 THREADS = 4;
+    constexpr u64 RECORDS = 100000;
+    LatencyHistogram histogram;
+    vec<std::thread> threads;
+    for (u32 t = 0; t < THREADS; ++t) {
+        threads.emplace_back([&histogram, t]() {
+            for (u64 i = 0; i < RECORDS; ++i) {
+                histogram.Record(t * RECORDS + i);
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(histogram.Count(), THREADS * RECORDS);
+    EXPECT_EQ(histogram.Max(), THREADS * RECORDS - 1);
+    EXPECT_LE(histogram.Max() - histogram.Percentile(1.0),
+              histogram.Max() / LatencyHistogram::SUB_BUCKETS);
+}
+
+namespace {
+
+constexpr u64 HEADER_BYTES = 20;
+constexpr u64 KEYFRAME_BYTES = 1000;
+constexpr u64 DELTA_BYTES = 200;
+constexpr u32 DELTAS_PER_GOP = 9;
+constexpr u64 GOP_BYTES = KEYFRAME_BYTES + DELTAS_PER_GOP * DELTA_BYTES;
+
+/**
+ * @brief Pushes an access unit of @p size bytes flagged like the parser's
+ * output: deltas with DELTA_UNIT, parameter sets with HEADER
+ */
+void PushUnit(PreEventBuffer &pre_event, u64 size, bool keyframe,
+              bool header = false) {
+    GstBuffer *buffer = gst_buffer_new_allocate(nullptr, size, nullptr);
+    if (!keyframe) {
+        GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    }
+    if (header) {
+        GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_HEADER);
+    }
+    pre_event.Push(buffer);
+    gst_buffer_unref(buffer);
+}
+
+void PushHeaders(PreEventBuffer &pre_event) {
+    PushUnit(pre_event, HEADER_BYTES, true, true);
+    PushUnit(pre_event, HEADER_BYTES, true, true);
+}
+
+/**
+ * @brief Checks that a saved clip could be muxed: the two headers, then a
+ * keyframe
+ */
+void ExpectClipStartsAtKeyframe(const PreEventBuffer &pre_event) {
+    const Clip clip = pre_event.Snapshot();
+    if (clip.Empty()) {
+        return;
+    }
+    ASSERT_GE(clip.buffers.size(), 3u);
+    for (u32 i = 0; i < 2; ++i) {
+        EXPECT_TRUE(
+            GST_BUFFER_FLAG_IS_SET(clip.buffers[i], GST_BUFFER_FLAG_HEADER));
+    }
+    EXPECT_FALSE(
+        GST_BUFFER_FLAG_IS_SET(clip.buffers[2], GST_BUFFER_FLAG_HEADER));
+    EXPECT_FALSE(
+        GST_BUFFER_FLAG_IS_SET(clip.buffers[2], GST_BUFFER_FLAG_DELTA_UNIT));
+}
+
+} // namespace
+
+TEST(PreEventBuffer, EvictsWholeGopsWithinTheBudget) {
+    gst_init(nullptr, nullptr);
+    constexpr u64 BUDGET = 10000;
+    PreEventBuffer pre_event(BUDGET);
+    PushHeaders(pre_event);
+    for (u32 gop = 0; gop < 10; ++gop) {
+        PushUnit(pre_event, KEYFRAME_BYTES, true);
+        ExpectClipStartsAtKeyframe(pre_event);
+        for (u32 i = 0; i < DELTAS_PER_GOP; ++i) {
+            PushUnit(pre_event, DELTA_BYTES, false);
+            ASSERT_LE(pre_event.Bytes(), BUDGET);
+            ExpectClipStartsAtKeyframe(pre_event);
+        }
+    }
+    // As many whole GOPs as fit
+    EXPECT_EQ(pre_event.GopCount(), BUDGET / GOP_BYTES);
+    EXPECT_EQ(pre_event.Bytes(), BUDGET / GOP_BYTES * GOP_BYTES);
+    EXPECT_EQ(pre_event.Overflows(), 0u);
+}
+
+TEST(PreEventBuffer, DropsAGopLargerThanTheBudgetUntilTheNextKeyframe) {
+    gst_init(nullptr, nullptr);
+    constexpr u64 BUDGET = 3000;
+    PreEventBuffer pre_event(BUDGET);
+    PushHeaders(pre_event);
+    PushUnit(pre_event, KEYFRAME_BYTES, true);
+    for (u32 i = 0; i < DELTAS_PER_GOP; ++i) {
+        PushUnit(pre_event, DELTA_BYTES, false);
+    }
+    EXPECT_EQ(pre_event.Bytes(), GOP_BYTES);
+
+    // Outgrows the budget on its own at the sixth delta: dropped, and the
+    // deltas after it are discarded too
+    PushUnit(pre_event, KEYFRAME_BYTES, true);
+    for (u32 i = 0; i < 8; ++i) {
+        PushUnit(pre_event, 2 * DELTA_BYTES, false);
+        ASSERT_LE(pre_event.Bytes(), BUDGET);
+        ExpectClipStartsAtKeyframe(pre_event);
+    }
+    EXPECT_EQ(pre_event.Overflows(), 1u);
+    EXPECT_EQ(pre_event.Bytes(), 0u);
+    EXPECT_TRUE(pre_event.Snapshot().Empty());
+
+    // Recording resumes at the next keyframe
+    PushUnit(pre_event, KEYFRAME_BYTES, true);
+    PushUnit(pre_event, DELTA_BYTES, false);
+    EXPECT_EQ(pre_event.Bytes(), KEYFRAME_BYTES + DELTA_BYTES);
+    EXPECT_EQ(pre_event.Overflows(), 1u);
+    ExpectClipStartsAtKeyframe(pre_event);
+    EXPECT_EQ(pre_event.Snapshot().buffers.size(), 4u);
+}
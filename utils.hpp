@@ -1,17 +1,25 @@
 #pragma once
 
 #include "cstdlib"
-#include "gpu_sampler.hpp"
+#include "decode_skipper.hpp"
+#include "frame_batcher.hpp"
+#include "histogram.hpp"
 #include "logging.hpp"
+#include "metrics_sink.hpp"
 #include "resource_monitor.hpp"
+#include "stream_registry.hpp"
+#include "stream_stats.hpp"
 #include "sys/resource.h"
 #include "types.hpp"
 #include <algorithm>
 #include <chrono>
 #include <cstdio>
 #include <cxxopts.hpp>
+#include <fstream>
 #include <glog/logging.h>
 #include <iostream>
+#include <sstream>
+#include <string>
 #include <type_traits>
 #include <utility>
 
@@ -64,89 +72,222 @@ static inline void IncreaseFileDescriptorLimit() {
     }
 }
 
-static inline void LogGpuMetadata(u32 id, const GpuSampler::Metadata &meta) {
-    INFO << "GPU " << id << ": " << meta.name_
-         << ", Memory: " << meta.memory_total_ << " MB"
-         << ", Power Limit: " << meta.power_limit_ << " mW"
-         << ", Max GPU Clock: " << meta.graphics_max_clock_ << " MHz"
-         << ", Max SM Clock: " << meta.sm_max_clock_ << " MHz"
-         << ", Max Video Clock: " << meta.vid_max_clock_ << " MHz"
-         << ", Max Mem Clock: " << meta.mem_max_clock_ << " MHz";
+/**
+ * @brief Reads a numeric field of /proc/self/status, e.g. "Threads" or "VmRSS"
+ * (in KiB).
+ * @returns 0 if the field is missing
+ */
+static inline u64 ReadProcSelfStatus(const std::string &field) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    const std::string prefix = field + ":";
+    while (std::getline(status, line)) {
+        if (line.rfind(prefix, 0) == 0) {
+            return std::stoull(line.substr(prefix.size()));
+        }
+    }
+    return 0;
+}
+
+/**
+ * @returns URI of stream @p index as rtsp_server lays out its streams:
+ * @p mounts_per_port mounts on each of the consecutive ports from @p port,
+ * named @p path when a port has one mount and @p path followed by the mount
+ * number when it has several
+ */
+static inline std::string
+StreamUri(u32 index, u32 port, const std::string &path, u32 mounts_per_port) {
+    std::string uri =
+        "rtsp://127.0.0.1:" + std::to_string(port + index / mounts_per_port) +
+        path;
+    if (mounts_per_port > 1) {
+        uri += std::to_string(index % mounts_per_port);
+    }
+    return uri;
+}
+
+/**
+ * @brief Latency histograms of one stream, in microseconds
+ */
+struct StreamLatency {
+    i32 stream_id;
+    const LatencyHistogram *inter_frame_gap_us;
+    const LatencyHistogram *queue_residency_us;
+};
+
+constexpr arr<double, 4> LATENCY_QUANTILES = {0.5, 0.9, 0.99, 0.999};
+
+static inline void LogLatencyPercentiles(const StreamLatency &latency) {
+    auto Format = [](const LatencyHistogram &h) {
+        std::ostringstream out;
+        for (double quantile : LATENCY_QUANTILES) {
+            out << (quantile == LATENCY_QUANTILES.front() ? "" : ", ") << "p"
+                << quantile * 100 << " = " << h.Percentile(quantile) << "us";
+        }
+        return out.str();
+    };
+    INFO << "Stream [" << latency.stream_id << "]: inter-frame gap "
+         << Format(*latency.inter_frame_gap_us) << "; queue residency "
+         << Format(*latency.queue_residency_us);
 }
 
 static inline void
-SaveResourceUsageMetricsCsv(const cxxopts::ParseResult &args,
-                            const ResourceMonitor &resource_monitor,
-                            const ResourceMonitor::Metrics &metrics) {
-    const std::string &filepath = args["metrics_csv"].as<std::string>();
-    LOG(INFO) << "Writing usage metrics to " << filepath;
-
-    auto [cpu_ram_metrics, gpu_metrics] = metrics;
-    u32 refresh_rate = args["refresh_rate"].as<u32>();
+SaveLatencyPercentilesCsv(const cxxopts::ParseResult &args,
+                          const vec<StreamLatency> &latencies) {
+    const std::string &filepath = args["latency_csv"].as<std::string>();
+    LOG(INFO) << "Writing latency percentiles to " << filepath;
+
     std::ofstream out(filepath);
+    out << "stream_id,metric,count,p50_us,p90_us,p99_us,p999_us,max_us\n";
 
-    // ===== Header =====
-    out << "timestamp_ms,cpu_user_ms,cpu_sys_ms";
-    if (!cpu_ram_metrics.empty()) {
-        const auto &first = cpu_ram_metrics[0];
-        for (u32 c = 0; c < first.hardware_threads_.size(); ++c) {
-            out << ",cpu" << c << "_usage";
+    auto WriteRow = [&out](i32 id, const char *metric,
+                           const LatencyHistogram &h) {
+        out << id << "," << metric << "," << h.Count();
+        for (double quantile : LATENCY_QUANTILES) {
+            out << "," << h.Percentile(quantile);
         }
+        out << "," << h.Max() << "\n";
+    };
+    for (const StreamLatency &latency : latencies) {
+        WriteRow(latency.stream_id, "inter_frame_gap",
+                 *latency.inter_frame_gap_us);
+        WriteRow(latency.stream_id, "queue_residency",
+                 *latency.queue_residency_us);
     }
-    out << ",ram_kib";
-    for (u32 g = 0; g < resource_monitor.GpuDeviceCount(); ++g) {
-        out << ",gpu" << g << "_util"
-            << ",gpu" << g << "_mem"
-            << ",gpu" << g << "_enc_util"
-            << ",gpu" << g << "_dec_util"
-            << ",gpu" << g << "_temp"
-            << ",gpu" << g << "_power"
-            << ",gpu" << g << "_gpu_clock"
-            << ",gpu" << g << "_mem_clock"
-            << ",gpu" << g << "_sm_clock"
-            << ",gpu" << g << "_vid_clock"
-            << ",gpu" << g << "_gpu_clock_util"
-            << ",gpu" << g << "_mem_clock_util"
-            << ",gpu" << g << "_sm_clock_util"
-            << ",gpu" << g << "_vid_clock_util";
-    }
-    out << "\n";
 
-    // ===== Rows =====
-    u32 count = std::min(cpu_ram_metrics.size(), gpu_metrics.size());
-    for (u32 i = 0; i < count; ++i) {
-        const auto &cr = cpu_ram_metrics[i];
-        const auto &gpu_metric = gpu_metrics[i];
+    out.close();
+}
 
-        u64 timestamp_ms = static_cast<u64>(1000.0 * i / refresh_rate);
-        u64 cpu_user_ms = cr.usage_.ru_utime.tv_sec * 1000 +
-                          cr.usage_.ru_utime.tv_usec / 1000;
-        u64 cpu_sys_ms = cr.usage_.ru_stime.tv_sec * 1000 +
-                         cr.usage_.ru_stime.tv_usec / 1000;
+/**
+ * @brief Logs how much of a stream was decoded compared to delivered
+ */
+static inline void LogDecodeStats(const StreamStats &stats,
+                                  DecodeSkipMode mode) {
+    INFO << "Stream [" << stats.stream_id
+         << "]: decode skip = " << DecodeSkipModeName(mode)
+         << ", access units = " << stats.access_units
+         << ", skipped before decode = " << stats.frames_skipped_decode
+         << ", decoded = " << stats.frames_decoded
+         << ", delivered = " << stats.frames_delivered;
+}
 
-        out << timestamp_ms << "," << cpu_user_ms << "," << cpu_sys_ms;
+/**
+ * @brief Logs the watchdog counters of a stream that stalled at least once
+ */
+static inline void LogRecoveryStats(const StreamStats &stats) {
+    if (stats.stalls == 0) {
+        return;
+    }
+    INFO << "Stream [" << stats.stream_id << "]: stalls = " << stats.stalls
+         << ", reconnects = " << stats.reconnects
+         << ", failed restarts = " << stats.restarts_failed
+         << ", recoveries = " << stats.recoveries << ", mean recovery = "
+         << (stats.recoveries ? stats.recovery_ms_total / stats.recoveries : 0)
+         << " ms, max recovery = " << stats.recovery_ms_max << " ms";
+}
 
-        for (const auto &core : cr.hardware_threads_) {
-            out << "," << core.usage;
-        }
+/**
+ * @brief Logs the memory held by a stream's pre-event buffer
+ */
+static inline void LogPreEventStats(const StreamStats &stats) {
+    if (stats.pre_event_bytes == 0) {
+        return;
+    }
+    INFO << "Stream [" << stats.stream_id
+         << "]: pre-event buffer = " << stats.pre_event_bytes / 1024
+         << " KiB for " << stats.pre_event_ms << " ms of video";
+}
 
-        u64 ram_kb = cr.usage_.ru_maxrss;
-        out << "," << ram_kb;
-
-        for (const auto &g : gpu_metric) {
-            out << "," << g.gpu_ << "," << g.memory_ << ","
-                << g.encoder_utilization_ << "," << g.decoder_utilization_
-                << "," << g.temperature_ << "," << g.power_ << ","
-                << g.graphics_clocks_ << "," << g.mem_clocks_ << ","
-                << g.sm_clocks_ << "," << g.vid_clocks_ << ","
-                << g.graphics_clock_util_ << "," << g.mem_clock_util_ << ","
-                << g.sm_clock_util_ << "," << g.vid_clock_util_;
-        }
+/**
+ * @brief Logs how long it took until all streams were ready and the slowest
+ * stream per startup milestone
+ */
+static inline void LogStartupSummary(const vec<StartupTimes> &times,
+                                     double all_ready_ms) {
+    u32 ready = 0;
+    StartupTimes slowest;
+    for (const StartupTimes &t : times) {
+        ready += t.caps_ms >= 0;
+        slowest.connect_ms = std::max(slowest.connect_ms, t.connect_ms);
+        slowest.caps_ms = std::max(slowest.caps_ms, t.caps_ms);
+        slowest.first_frame_ms =
+            std::max(slowest.first_frame_ms, t.first_frame_ms);
+    }
+    INFO << "Startup: streams = " << times.size() << ", ready = " << ready
+         << ", all_ready_ms = " << all_ready_ms
+         << ", max_connect_ms = " << slowest.connect_ms
+         << ", max_caps_ms = " << slowest.caps_ms
+         << ", max_first_frame_ms = " << slowest.first_frame_ms;
+}
+
+/**
+ * @brief Writes the startup milestones of every stream, -1 where a milestone
+ * was never reached
+ */
+static inline void SaveStartupTimesCsv(const cxxopts::ParseResult &args,
+                                       const vec<StartupTimes> &times) {
+    const std::string &filepath = args["startup_csv"].as<std::string>();
+    LOG(INFO) << "Writing stream startup times to " << filepath;
 
-        out << "\n";
+    std::ofstream out(filepath);
+    out << "stream_id,connect_ms,caps_ms,first_frame_ms\n";
+    for (const StartupTimes &t : times) {
+        out << t.stream_id << "," << t.connect_ms << "," << t.caps_ms << ","
+            << t.first_frame_ms << "\n";
     }
 
     out.close();
 }
 
+/**
+ * @brief Logs what the resource monitor itself cost and how closely it kept
+ * to its schedule
+ */
+static inline void LogMonitorStats(const ResourceMonitor &resource_monitor) {
+    const ResourceMonitor::SelfStats &stats = resource_monitor.GetSelfStats();
+    const LatencyHistogram &lateness = resource_monitor.TickLatenessUs();
+    INFO << "Resource monitor: samples = " << stats.samples
+         << ", rate = " << stats.SampleRate()
+         << " Hz, missed deadlines = " << stats.missed_deadlines
+         << ", tick lateness p50 = " << lateness.Percentile(0.5)
+         << "us, p99 = " << lateness.Percentile(0.99)
+         << "us, self overhead = " << stats.OverheadPercent()
+         << "% of one core";
+    for (const ResourceMonitor::SamplerCost &cost : stats.samplers) {
+        INFO << "Sampler " << cost.name << ": mean = " << cost.MeanUs()
+             << "us, max = " << cost.max_us
+             << "us per tick, total = " << cost.cpu_ms << " ms";
+    }
+}
+
+/**
+ * @brief Logs how many rows a metrics sink wrote and dropped
+ */
+static inline void LogMetricsSink(const MetricsSink &sink) {
+    INFO << "Wrote " << sink.RowsWritten() << " rows to " << sink.Path()
+         << ", dropped " << sink.RowsDropped() << " rows";
+}
+
+/**
+ * @brief Logs how many subscriptions the shared streams served
+ */
+static inline void LogRegistryStats(const StreamRegistry::Stats &stats) {
+    INFO << "Stream registry: subscribe calls = " << stats.subscribe_calls
+         << ", served by an open stream = " << stats.opens_deduplicated
+         << ", streams open = " << stats.streams
+         << ", subscribers = " << stats.subscribers;
+}
+
+/**
+ * @brief Logs how full the batches were and the latency batching added
+ */
+static inline void LogBatchStats(const FrameBatcher::Stats &stats) {
+    INFO << "Batches: " << stats.batches << ", frames = " << stats.frames
+         << ", dropped = " << stats.frames_dropped
+         << ", mean fill ratio = " << stats.MeanFillRatio()
+         << ", mean added latency = " << stats.MeanAddedLatencyMs()
+         << " ms, max added latency = " << stats.added_latency_ms_max
+         << " ms, max pts skew = " << stats.pts_skew_ms_max << " ms";
+}
+
 } // namespace utils
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "frame.hpp"
+#include "gst/gst.h"
+#include "gst/video/video-converter.h"
+#include "types.hpp"
+#include "yuv_to_rgb.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+
+/**
+ * @brief Builds a sample of the given format and size, filled like a decoder
+ * would leave it in the appsink.
+ */
+inline GstSample *MakeSample(const std::string &format, i32 width, i32 height) {
+    const std::string caps_description =
+        "video/x-raw,format=" + format +
+        ",colorimetry=bt709,framerate=30/1,pixel-aspect-ratio=1/1,width=" +
+        std::to_string(width) + ",height=" + std::to_string(height);
+    GstCaps *caps = gst_caps_from_string(caps_description.c_str());
+
+    GstVideoInfo info;
+    gst_video_info_from_caps(&info, caps);
+    GstBuffer *buffer = gst_buffer_new_allocate(nullptr, info.size, nullptr);
+
+    GstMapInfo map;
+    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+    for (gsize i = 0; i < map.size; ++i) {
+        map.data[i] = static_cast<u8>(i ^ (i >> 9));
+    }
+    gst_buffer_unmap(buffer, &map);
+
+    GstSample *sample = gst_sample_new(buffer, caps, nullptr, nullptr);
+    gst_buffer_unref(buffer);
+    gst_caps_unref(caps);
+    return sample;
+}
+
+/**
+ * @brief videoconvert's converter from the sample's format to packed RGB.
+ * Chroma resampling and dithering are off so the output is comparable with
+ * the kernels, which replicate chroma.
+ */
+struct RgbConverter {
+    GstVideoInfo out_info;
+    GstVideoConverter *converter = nullptr;
+    GstBuffer *out_buffer = nullptr;
+
+    explicit RgbConverter(const GstVideoInfo &in_info) {
+        gst_video_info_set_format(&out_info, GST_VIDEO_FORMAT_RGB,
+                                  GST_VIDEO_INFO_WIDTH(&in_info),
+                                  GST_VIDEO_INFO_HEIGHT(&in_info));
+        GstStructure *config = gst_structure_new(
+            "GstVideoConverter", GST_VIDEO_CONVERTER_OPT_CHROMA_MODE,
+            GST_TYPE_VIDEO_CHROMA_MODE, GST_VIDEO_CHROMA_MODE_NONE,
+            GST_VIDEO_CONVERTER_OPT_DITHER_METHOD, GST_TYPE_VIDEO_DITHER_METHOD,
+            GST_VIDEO_DITHER_NONE, nullptr);
+        converter = gst_video_converter_new(
+            const_cast<GstVideoInfo *>(&in_info), &out_info, config);
+        out_buffer = gst_buffer_new_allocate(nullptr, out_info.size, nullptr);
+    }
+
+    RgbConverter(const RgbConverter &) = delete;
+    RgbConverter &operator=(const RgbConverter &) = delete;
+
+    ~RgbConverter() {
+        gst_buffer_unref(out_buffer);
+        gst_video_converter_free(converter);
+    }
+
+    /**
+     * @brief Converts @p frame into out_buffer
+     */
+    void Convert(const Frame &frame) {
+        GstVideoFrame src, dst;
+        gst_video_frame_map(&src, const_cast<GstVideoInfo *>(&frame.Info()),
+                            gst_sample_get_buffer(frame.Sample()),
+                            GST_MAP_READ);
+        gst_video_frame_map(&dst, &out_info, out_buffer, GST_MAP_WRITE);
+        gst_video_converter_frame(converter, &src, &dst);
+        gst_video_frame_unmap(&dst);
+        gst_video_frame_unmap(&src);
+    }
+};
+
+/**
+ * @returns Largest per-channel difference between the kernel output and
+ * videoconvert's for @p frame, -1 if the kernel cannot convert it
+ */
+inline i32 MaxAbsDiffToVideoconvert(const Frame &frame, yuv::Kernel kernel) {
+    const u32 stride = 3 * frame.Width();
+    vec<u8> rgb(static_cast<size_t>(stride) * frame.Height());
+    if (!frame.ToRgb(rgb.data(), stride, kernel)) {
+        return -1;
+    }
+
+    RgbConverter reference(frame.Info());
+    reference.Convert(frame);
+
+    GstMapInfo map;
+    gst_buffer_map(reference.out_buffer, &map, GST_MAP_READ);
+    const u32 reference_stride =
+        GST_VIDEO_INFO_PLANE_STRIDE(&reference.out_info, 0);
+    i32 max_diff = 0;
+    for (u32 row = 0; row < frame.Height(); ++row) {
+        for (u32 i = 0; i < stride; ++i) {
+            max_diff = std::max(max_diff,
+                                std::abs(rgb[row * stride + i] -
+                                         map.data[row * reference_stride + i]));
+        }
+    }
+    gst_buffer_unmap(reference.out_buffer, &map);
+    return max_diff;
+}
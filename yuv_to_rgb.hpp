@@ -0,0 +1,353 @@
+#pragma once
+
+#include "types.hpp"
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define YUV_TO_RGB_X86 1
+#endif
+
+/**
+ * @brief NV12/I420 -> packed RGB conversion, used to convert decoder output
+ * lazily (only for the frames a consumer actually looks at) instead of running
+ * videoconvert on every frame.
+ *
+ * All kernels use the same Q16 fixed-point arithmetic, so the SIMD variants
+ * produce exactly the scalar result. The best kernel is picked at runtime
+ * from the CPU features.
+ */
+namespace yuv {
+
+/**
+ * @brief Q16 fixed-point YCbCr -> RGB matrix
+ */
+struct Coefficients {
+    i32 y_offset;
+    i32 cy;
+    i32 crv;
+    i32 cgu;
+    i32 cgv;
+    i32 cbu;
+
+    /**
+     * @param kr Red luma weight (BT.601: 0.299, BT.709: 0.2126)
+     * @param kb Blue luma weight (BT.601: 0.114, BT.709: 0.0722)
+     * @param full_range Whether Y/Cb/Cr use 0-255 instead of 16-235/16-240
+     */
+    static Coefficients Make(double kr, double kb, bool full_range) {
+        const double kg = 1.0 - kr - kb;
+        const double y_scale = full_range ? 1.0 : 255.0 / 219.0;
+        const double c_scale = full_range ? 1.0 : 255.0 / 224.0;
+        auto Q16 = [](double v) {
+            return static_cast<i32>(std::lround(v * 65536));
+        };
+        return {full_range ? 0 : 16,
+                Q16(y_scale),
+                Q16(2.0 * (1.0 - kr) * c_scale),
+                Q16(2.0 * kb * (1.0 - kb) / kg * c_scale),
+                Q16(2.0 * kr * (1.0 - kr) / kg * c_scale),
+                Q16(2.0 * (1.0 - kb) * c_scale)};
+    }
+
+    static Coefficients Bt601() { return Make(0.299, 0.114, false); }
+
+    static Coefficients Bt709() { return Make(0.2126, 0.0722, false); }
+};
+
+/**
+ * @brief Planes of a 4:2:0 frame. For NV12 the chroma is interleaved
+ * (u points at the UV plane, v at u + 1, chroma_step is 2); for I420 u and v
+ * are separate planes and chroma_step is 1.
+ */
+struct Image {
+    const u8 *y;
+    u32 y_stride;
+    const u8 *u;
+    u32 u_stride;
+    const u8 *v;
+    u32 v_stride;
+    u32 chroma_step;
+    u32 width;
+    u32 height;
+
+    static Image Nv12(const u8 *y, u32 y_stride, const u8 *uv, u32 uv_stride,
+                      u32 width, u32 height) {
+        return {y,         y_stride, uv,    uv_stride, uv + 1,
+                uv_stride, 2,        width, height};
+    }
+
+    static Image I420(const u8 *y, u32 y_stride, const u8 *u, u32 u_stride,
+                      const u8 *v, u32 v_stride, u32 width, u32 height) {
+        return {y, y_stride, u, u_stride, v, v_stride, 1, width, height};
+    }
+};
+
+enum class Kernel { Scalar, Sse41, Avx2 };
+
+inline const char *KernelName(Kernel kernel) {
+    switch (kernel) {
+    case Kernel::Avx2:
+        return "avx2";
+    case Kernel::Sse41:
+        return "sse4.1";
+    default:
+        return "scalar";
+    }
+}
+
+inline bool IsSupported(Kernel kernel) {
+#ifdef YUV_TO_RGB_X86
+    switch (kernel) {
+    case Kernel::Avx2:
+        return __builtin_cpu_supports("avx2");
+    case Kernel::Sse41:
+        return __builtin_cpu_supports("sse4.1");
+    default:
+        return true;
+    }
+#else
+    return kernel == Kernel::Scalar;
+#endif
+}
+
+inline Kernel BestKernel() {
+    static const Kernel best = IsSupported(Kernel::Avx2)    ? Kernel::Avx2
+                               : IsSupported(Kernel::Sse41) ? Kernel::Sse41
+                                                            : Kernel::Scalar;
+    return best;
+}
+
+namespace detail {
+
+inline u8 Clamp(i32 v) { return v < 0 ? 0 : v > 255 ? 255 : v; }
+
+/**
+ * @brief Converts pixels [begin, end) of one row
+ */
+inline void ScalarRow(const Coefficients &c, const u8 *y, const u8 *u,
+                      const u8 *v, u32 chroma_step, u8 *rgb, u32 begin,
+                      u32 end) {
+    for (u32 x = begin; x < end; ++x) {
+        const i32 yy = c.cy * (y[x] - c.y_offset) + (1 << 15);
+        const i32 uu = u[(x / 2) * chroma_step] - 128;
+        const i32 vv = v[(x / 2) * chroma_step] - 128;
+        rgb[3 * x + 0] = Clamp((yy + c.crv * vv) >> 16);
+        rgb[3 * x + 1] = Clamp((yy - c.cgu * uu - c.cgv * vv) >> 16);
+        rgb[3 * x + 2] = Clamp((yy + c.cbu * uu) >> 16);
+    }
+}
+
+#ifdef YUV_TO_RGB_X86
+
+/**
+ * @brief pshufb masks scattering 16 R, 16 G and 16 B bytes into 48 bytes of
+ * packed RGB: kMasks[out][channel] builds output vector `out` from `channel`
+ */
+struct InterleaveMasks {
+    alignas(16) u8 masks[3][3][16];
+
+    constexpr InterleaveMasks() : masks() {
+        for (u32 out = 0; out < 3; ++out) {
+            for (u32 channel = 0; channel < 3; ++channel) {
+                for (u32 i = 0; i < 16; ++i) {
+                    const u32 j = 16 * out + i;
+                    masks[out][channel][i] = j % 3 == channel ? j / 3 : 0x80;
+                }
+            }
+        }
+    }
+};
+
+inline constexpr InterleaveMasks kInterleave{};
+
+__attribute__((target("sse4.1"))) inline __m128i Mask(u32 out, u32 channel) {
+    return _mm_load_si128(
+        reinterpret_cast<const __m128i *>(kInterleave.masks[out][channel]));
+}
+
+__attribute__((target("sse4.1"))) inline void StoreRgb(u8 *dst, __m128i r,
+                                                       __m128i g, __m128i b) {
+    for (u32 out = 0; out < 3; ++out) {
+        __m128i v =
+            _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, Mask(out, 0)),
+                                      _mm_shuffle_epi8(g, Mask(out, 1))),
+                         _mm_shuffle_epi8(b, Mask(out, 2)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 16 * out), v);
+    }
+}
+
+/**
+ * @brief Loads the chroma of 16 pixels starting at pixel x and duplicates
+ * every sample horizontally (4:2:0 -> 4:4:4 for one row)
+ */
+__attribute__((target("sse4.1"))) inline void
+LoadChroma16(const u8 *u, const u8 *v, u32 chroma_step, u32 x, __m128i &u16,
+             __m128i &v16) {
+    __m128i u8, v8;
+    if (chroma_step == 2) {
+        // NV12: 16 bytes U0 V0 U1 V1 ... U7 V7
+        const __m128i uv =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(u + x));
+        u8 = _mm_shuffle_epi8(uv, _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, -1,
+                                                -1, -1, -1, -1, -1, -1, -1));
+        v8 = _mm_shuffle_epi8(uv, _mm_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, -1,
+                                                -1, -1, -1, -1, -1, -1, -1));
+    } else {
+        u8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(u + x / 2));
+        v8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(v + x / 2));
+    }
+    u16 = _mm_unpacklo_epi8(u8, u8);
+    v16 = _mm_unpacklo_epi8(v8, v8);
+}
+
+__attribute__((target("sse4.1"))) inline void
+Sse41Row(const Coefficients &c, const u8 *y, const u8 *u, const u8 *v,
+         u32 chroma_step, u8 *rgb, u32 width) {
+    const __m128i y_offset = _mm_set1_epi32(c.y_offset);
+    const __m128i c128 = _mm_set1_epi32(128);
+    const __m128i round = _mm_set1_epi32(1 << 15);
+    const __m128i cy = _mm_set1_epi32(c.cy), crv = _mm_set1_epi32(c.crv),
+                  cgu = _mm_set1_epi32(c.cgu), cgv = _mm_set1_epi32(c.cgv),
+                  cbu = _mm_set1_epi32(c.cbu);
+
+    u32 x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m128i y16 =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(y + x));
+        __m128i u16, v16;
+        LoadChroma16(u, v, chroma_step, x, u16, v16);
+
+        // Widened 4 pixels at a time; _mm_srli_si128 needs an immediate
+        const __m128i ys[4] = {_mm_cvtepu8_epi32(y16),
+                               _mm_cvtepu8_epi32(_mm_srli_si128(y16, 4)),
+                               _mm_cvtepu8_epi32(_mm_srli_si128(y16, 8)),
+                               _mm_cvtepu8_epi32(_mm_srli_si128(y16, 12))};
+        const __m128i us[4] = {_mm_cvtepu8_epi32(u16),
+                               _mm_cvtepu8_epi32(_mm_srli_si128(u16, 4)),
+                               _mm_cvtepu8_epi32(_mm_srli_si128(u16, 8)),
+                               _mm_cvtepu8_epi32(_mm_srli_si128(u16, 12))};
+        const __m128i vs[4] = {_mm_cvtepu8_epi32(v16),
+                               _mm_cvtepu8_epi32(_mm_srli_si128(v16, 4)),
+                               _mm_cvtepu8_epi32(_mm_srli_si128(v16, 8)),
+                               _mm_cvtepu8_epi32(_mm_srli_si128(v16, 12))};
+        __m128i r[4], g[4], b[4];
+        for (u32 k = 0; k < 4; ++k) {
+            const __m128i yy = _mm_add_epi32(
+                _mm_mullo_epi32(_mm_sub_epi32(ys[k], y_offset), cy), round);
+            const __m128i uu = _mm_sub_epi32(us[k], c128);
+            const __m128i vv = _mm_sub_epi32(vs[k], c128);
+            r[k] =
+                _mm_srai_epi32(_mm_add_epi32(yy, _mm_mullo_epi32(vv, crv)), 16);
+            g[k] = _mm_srai_epi32(
+                _mm_sub_epi32(_mm_sub_epi32(yy, _mm_mullo_epi32(uu, cgu)),
+                              _mm_mullo_epi32(vv, cgv)),
+                16);
+            b[k] =
+                _mm_srai_epi32(_mm_add_epi32(yy, _mm_mullo_epi32(uu, cbu)), 16);
+        }
+
+        // Saturating packs clamp to [0, 255]
+        const __m128i r8 = _mm_packus_epi16(_mm_packs_epi32(r[0], r[1]),
+                                            _mm_packs_epi32(r[2], r[3]));
+        const __m128i g8 = _mm_packus_epi16(_mm_packs_epi32(g[0], g[1]),
+                                            _mm_packs_epi32(g[2], g[3]));
+        const __m128i b8 = _mm_packus_epi16(_mm_packs_epi32(b[0], b[1]),
+                                            _mm_packs_epi32(b[2], b[3]));
+        StoreRgb(rgb + 3 * x, r8, g8, b8);
+    }
+    ScalarRow(c, y, u, v, chroma_step, rgb, x, width);
+}
+
+__attribute__((target("avx2"))) inline __m128i PackU8(__m256i lo, __m256i hi) {
+    // packs works per 128-bit lane; restore pixel order before narrowing
+    const __m256i packed =
+        _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+    return _mm_packus_epi16(_mm256_castsi256_si128(packed),
+                            _mm256_extracti128_si256(packed, 1));
+}
+
+__attribute__((target("avx2"))) inline void
+Avx2Row(const Coefficients &c, const u8 *y, const u8 *u, const u8 *v,
+        u32 chroma_step, u8 *rgb, u32 width) {
+    const __m256i y_offset = _mm256_set1_epi32(c.y_offset);
+    const __m256i c128 = _mm256_set1_epi32(128);
+    const __m256i round = _mm256_set1_epi32(1 << 15);
+    const __m256i cy = _mm256_set1_epi32(c.cy), crv = _mm256_set1_epi32(c.crv),
+                  cgu = _mm256_set1_epi32(c.cgu),
+                  cgv = _mm256_set1_epi32(c.cgv),
+                  cbu = _mm256_set1_epi32(c.cbu);
+
+    u32 x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m128i y16 =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(y + x));
+        __m128i u16, v16;
+        LoadChroma16(u, v, chroma_step, x, u16, v16);
+
+        const __m256i ys[2] = {_mm256_cvtepu8_epi32(y16),
+                               _mm256_cvtepu8_epi32(_mm_srli_si128(y16, 8))};
+        const __m256i us[2] = {_mm256_cvtepu8_epi32(u16),
+                               _mm256_cvtepu8_epi32(_mm_srli_si128(u16, 8))};
+        const __m256i vs[2] = {_mm256_cvtepu8_epi32(v16),
+                               _mm256_cvtepu8_epi32(_mm_srli_si128(v16, 8))};
+        __m256i r[2], g[2], b[2];
+        for (u32 k = 0; k < 2; ++k) {
+            const __m256i yy = _mm256_add_epi32(
+                _mm256_mullo_epi32(_mm256_sub_epi32(ys[k], y_offset), cy),
+                round);
+            const __m256i uu = _mm256_sub_epi32(us[k], c128);
+            const __m256i vv = _mm256_sub_epi32(vs[k], c128);
+            r[k] = _mm256_srai_epi32(
+                _mm256_add_epi32(yy, _mm256_mullo_epi32(vv, crv)), 16);
+            g[k] = _mm256_srai_epi32(
+                _mm256_sub_epi32(
+                    _mm256_sub_epi32(yy, _mm256_mullo_epi32(uu, cgu)),
+                    _mm256_mullo_epi32(vv, cgv)),
+                16);
+            b[k] = _mm256_srai_epi32(
+                _mm256_add_epi32(yy, _mm256_mullo_epi32(uu, cbu)), 16);
+        }
+
+        StoreRgb(rgb + 3 * x, PackU8(r[0], r[1]), PackU8(g[0], g[1]),
+                 PackU8(b[0], b[1]));
+    }
+    ScalarRow(c, y, u, v, chroma_step, rgb, x, width);
+}
+
+#endif // YUV_TO_RGB_X86
+
+} // namespace detail
+
+/**
+ * @brief Converts a 4:2:0 image to packed RGB (3 bytes per pixel)
+ * @param rgb_stride Bytes per output row, at least 3 * width
+ */
+inline void ToRgb(const Image &image, const Coefficients &coefficients, u8 *rgb,
+                  u32 rgb_stride, Kernel kernel = BestKernel()) {
+    for (u32 row = 0; row < image.height; ++row) {
+        const u8 *y = image.y + row * image.y_stride;
+        const u8 *u = image.u + (row / 2) * image.u_stride;
+        const u8 *v = image.v + (row / 2) * image.v_stride;
+        u8 *out = rgb + row * rgb_stride;
+
+        switch (kernel) {
+#ifdef YUV_TO_RGB_X86
+        case Kernel::Avx2:
+            detail::Avx2Row(coefficients, y, u, v, image.chroma_step, out,
+                            image.width);
+            break;
+        case Kernel::Sse41:
+            detail::Sse41Row(coefficients, y, u, v, image.chroma_step, out,
+                             image.width);
+            break;
+#endif
+        default:
+            detail::ScalarRow(coefficients, y, u, v, image.chroma_step, out, 0,
+                              image.width);
+            break;
+        }
+    }
+}
+
+} // namespace yuv